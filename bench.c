@@ -0,0 +1,1258 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "rudp.h"
+
+#define MAX_PROFILES 32
+#define MAX_SIZES 16
+#define NAME_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-"
+#define MAX_FLOWS (MAX_STREAMS + 1)
+#define PROXY_DATAGRAM_SIZE 65536
+#define PROXY_POLL_US 10000         // Longest wait of the proxy, so it sees a stop in time.
+#define PROXY_REORDER_US 1000       // Extra delay of a reordered datagram.
+#define PROXY_QUEUE_US 50000        // Datagrams which would wait longer than this for the link are dropped.
+#define PROXY_SOCKET_BUFFER 8388608 // Socket buffers of the proxy, so bursts are only dropped by the profile.
+#define EDIT_MAX_LENGTH 1024        // Most bytes an edit of the copy of the receiver changes.
+#define LATENCY_WARMUP 100          // Round trips of the latency benchmark which are not timed.
+
+
+
+// Impairments of the proxy, applied to the datagrams of both directions.
+typedef struct Profile
+{
+    char name[32];
+    double loss;            // Probability that a datagram is dropped.
+    double duplicate;       // Probability that a datagram is sent twice.
+    double reorder;         // Probability that a datagram is held back PROXY_REORDER_US.
+    uint64_t delay;         // One way delay in microseconds.
+    uint64_t jitter;        // Delay varies by up to this much either way, in microseconds.
+    double rate;            // Link rate in bits per second, 0 for no limit.
+} Profile;
+
+
+// Datagram held by the proxy until its release time.
+typedef struct Datagram
+{
+    uint64_t release;
+    uint64_t order;         // Datagrams released at the same time keep their order.
+    int fd;                 // Socket it is sent from.
+    struct sockaddr_in to;
+    size_t length;
+    char *data;
+} Datagram;
+
+
+// Socket of the proxy for one socket of the sender, so the receiver sees every stream
+// at an address of its own and its replies go back to the right socket.
+typedef struct Flow
+{
+    struct sockaddr_in client;
+    int fd;
+} Flow;
+
+
+typedef struct Proxy
+{
+    const Profile *profile;
+    int fd;                         // Socket the sender sends to.
+    struct sockaddr_in addr;        // Address of fd.
+    struct sockaddr_in server;
+    Flow flows[MAX_FLOWS];
+    int flow_count;
+    Datagram *queue;                // Min heap by release time.
+    size_t queue_size;
+    size_t queue_capacity;
+    uint64_t order;
+    uint64_t link_free[2];          // Time each direction of the link is free, sender to receiver first.
+    uint64_t random;
+    pthread_t tid;
+    atomic_bool stop;
+    // Counts of datagrams, and the CPU time of the proxy thread.
+    uint64_t forwarded;
+    uint64_t dropped;
+    uint64_t overflowed;
+    uint64_t duplicated;
+    uint64_t reordered;
+    uint64_t cpu_us;
+} Proxy;
+
+
+// Receiver of a run, a listener which writes the file into memory. For a delta it is an RUDP
+// which receives the file with ReceiveFileFrom over an edited copy of it instead.
+typedef struct Receiver
+{
+    RUDP_Listener listener;
+    RUDP rudp;
+    bool delta;
+    struct sockaddr_in addr;
+    int fd;                     // File the streams are written to.
+    uint64_t expected;          // Size of the file.
+    uint64_t bytes;             // Bytes of the ranges received.
+    bool failed;
+    pthread_t tid;
+    uint64_t cpu_us;
+} Receiver;
+
+
+// Range of one stream of the file, kept in the user field of its connection.
+typedef struct Range
+{
+    RUDP_FileHeader header;
+    bool done;
+} Range;
+
+
+// Options of the sender, the same as those of the client.
+typedef struct Options
+{
+    int window;
+    int segment_size;
+    bool offload;
+    int streams;
+    int fec_data;
+    int fec_parity;
+    bool compress;
+    bool checksums;
+    bool delta;
+    int edits;              // Edits of the copy of the receiver a delta is made against.
+    const char *congestion;
+    int messages;           // Round trips of the latency benchmark, 0 to send files instead.
+} Options;
+
+
+// Side of the latency benchmark which sends every message back to its sender.
+typedef struct Echo
+{
+    RUDP rudp;
+    struct sockaddr_in addr;    // Address of the sender.
+    char *buffer;
+    size_t size;
+    int messages;
+    bool failed;
+    pthread_t tid;
+} Echo;
+
+
+const Profile default_profiles[] = {
+    { .name = "clean" },
+    { .name = "loss1", .loss = 0.01 },
+    { .name = "loss5", .loss = 0.05 },
+    { .name = "delay10", .delay = 10000 },
+    { .name = "reorder", .reorder = 0.02, .duplicate = 0.01 },
+    { .name = "rate100", .rate = 100e6 },
+};
+const uint64_t default_sizes[] = { 65536, 1048576, 16777216 };
+const uint64_t default_message_sizes[] = { 64, 1024, 16384 };
+// Receiver of the run in progress, runs are done one at a time.
+Receiver *receiver;
+// Runs which did not deliver the file, or timed out on a link which loses nothing.
+int failed_runs;
+
+
+
+void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-z sizes] [-i name:impairments]... [-r runs] [-S seed] [-w window] "
+            "[-c reno|cubic|vegas|none] [-s segment_size] [-g] [-p streams] [-f data:parity] [-l] [-k] [-d edits] "
+            "[-m round_trips]\n", name);
+    exit(1);
+}
+
+
+uint64_t bench_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+uint64_t cpu_time_us(int who)
+{
+    struct rusage usage;
+
+    getrusage(who, &usage);
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+        + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+
+
+// ==================== Option Functions ====================
+
+// Parses a size with an optional K, M or G suffix.
+// On success 0 is returned. On error -1 is returned.
+int parse_size(const char *text, uint64_t *size)
+{
+    char *end;
+    double value = strtod(text, &end);
+
+    switch (*end) {
+    case 'K': case 'k':
+        value *= 1024;
+        end++;
+        break;
+    case 'M': case 'm':
+        value *= 1048576;
+        end++;
+        break;
+    case 'G': case 'g':
+        value *= 1073741824;
+        end++;
+        break;
+    }
+    if (end == text || *end != '\0' || value < 1) {
+        return -1;
+    }
+    *size = (uint64_t)value;
+    return 0;
+}
+
+
+// Parses a profile of the form name:key=value,... with the keys loss, dup and reorder
+// (probabilities), delay and jitter (milliseconds) and rate (Mbit/s).
+// On success 0 is returned. On error -1 is returned.
+int parse_profile(char *text, Profile *profile)
+{
+    char *colon = strchr(text, ':');
+    char *item, *value, *end, *saveptr;
+    double number;
+
+    memset(profile, 0, sizeof(*profile));
+    if (colon != NULL) {
+        *colon = '\0';
+    }
+    // Names are printed in JSON as they are.
+    if (*text == '\0' || strlen(text) >= sizeof(profile->name) || strspn(text, NAME_CHARS) != strlen(text)) {
+        return -1;
+    }
+    strcpy(profile->name, text);
+    if (colon == NULL) {
+        return 0;
+    }
+
+    for (item = strtok_r(colon + 1, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+        value = strchr(item, '=');
+        if (value == NULL) {
+            return -1;
+        }
+        *value++ = '\0';
+        number = strtod(value, &end);
+        if (end == value || *end != '\0' || number < 0) {
+            return -1;
+        }
+        if (strcmp(item, "loss") == 0 && number <= 1) {
+            profile->loss = number;
+        }
+        else if (strcmp(item, "dup") == 0 && number <= 1) {
+            profile->duplicate = number;
+        }
+        else if (strcmp(item, "reorder") == 0 && number <= 1) {
+            profile->reorder = number;
+        }
+        else if (strcmp(item, "delay") == 0) {
+            profile->delay = (uint64_t)(number * 1000);
+        }
+        else if (strcmp(item, "jitter") == 0) {
+            profile->jitter = (uint64_t)(number * 1000);
+        }
+        else if (strcmp(item, "rate") == 0) {
+            profile->rate = number * 1e6;
+        }
+        else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+
+// ==================== Proxy Functions ====================
+
+// xorshift64*, seeded per run so that a run can be repeated.
+double proxy_random(Proxy *self)
+{
+    self->random ^= self->random >> 12;
+    self->random ^= self->random << 25;
+    self->random ^= self->random >> 27;
+    return (self->random * 0x2545F4914F6CDD1DULL >> 11) * (1.0 / 9007199254740992.0);
+}
+
+bool datagram_before(const Datagram *a, const Datagram *b)
+{
+    return a->release < b->release || (a->release == b->release && a->order < b->order);
+}
+
+// On success 0 is returned. On error -1 is returned.
+int proxy_push(Proxy *self, Datagram *datagram)
+{
+    Datagram *queue, swap;
+    size_t i, parent;
+
+    if (self->queue_size == self->queue_capacity) {
+        self->queue_capacity = self->queue_capacity == 0 ? 1024 : self->queue_capacity * 2;
+        queue = realloc(self->queue, self->queue_capacity * sizeof(Datagram));
+        if (queue == NULL) {
+            return -1;
+        }
+        self->queue = queue;
+    }
+    datagram->order = self->order++;
+    i = self->queue_size++;
+    self->queue[i] = *datagram;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!datagram_before(&self->queue[i], &self->queue[parent])) {
+            break;
+        }
+        swap = self->queue[i];
+        self->queue[i] = self->queue[parent];
+        self->queue[parent] = swap;
+        i = parent;
+    }
+    return 0;
+}
+
+void proxy_pop(Proxy *self)
+{
+    Datagram swap;
+    size_t i = 0, child;
+
+    self->queue[0] = self->queue[--self->queue_size];
+    while ((child = 2 * i + 1) < self->queue_size) {
+        if (child + 1 < self->queue_size && datagram_before(&self->queue[child + 1], &self->queue[child])) {
+            child++;
+        }
+        if (!datagram_before(&self->queue[child], &self->queue[i])) {
+            break;
+        }
+        swap = self->queue[i];
+        self->queue[i] = self->queue[child];
+        self->queue[child] = swap;
+        i = child;
+    }
+}
+
+// Makes a socket of the proxy on loopback. Its buffers hold a window which the link releases at once,
+// the kernel limits them to net.core.rmem_max and wmem_max.
+// On success the socket is returned. On error -1 is returned.
+int proxy_socket(struct sockaddr_in *addr)
+{
+    int fd, socket_buffer = PROXY_SOCKET_BUFFER;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &socket_buffer, sizeof(socket_buffer));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &socket_buffer, sizeof(socket_buffer));
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*)addr, sizeof(*addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Returns the flow of a socket of the sender, a socket is made for a new one.
+Flow* proxy_flow(Proxy *self, const struct sockaddr_in *client)
+{
+    struct sockaddr_in addr;
+    Flow *flow;
+
+    for (int i = 0; i < self->flow_count; i++) {
+        flow = &self->flows[i];
+        if (flow->client.sin_port == client->sin_port && flow->client.sin_addr.s_addr == client->sin_addr.s_addr) {
+            return flow;
+        }
+    }
+    if (self->flow_count == MAX_FLOWS) {
+        return NULL;
+    }
+    flow = &self->flows[self->flow_count];
+    flow->fd = proxy_socket(&addr);
+    if (flow->fd == -1) {
+        return NULL;
+    }
+    flow->client = *client;
+    self->flow_count++;
+    return flow;
+}
+
+// Queues a datagram after the impairments of the profile, direction 0 is from the sender.
+// On success 0 is returned. On error -1 is returned.
+int proxy_impair(Proxy *self, int direction, int fd, const struct sockaddr_in *to, const char *data,
+                    size_t length, uint64_t now)
+{
+    const Profile *profile = self->profile;
+    Datagram datagram;
+    uint64_t start;
+    int copies = 1;
+
+    if (proxy_random(self) < profile->loss) {
+        self->dropped++;
+        return 0;
+    }
+    // The link sends datagrams one after another at its rate, those which would
+    // wait too long in its queue are dropped.
+    start = now;
+    if (profile->rate > 0) {
+        if (self->link_free[direction] > now + PROXY_QUEUE_US) {
+            self->overflowed++;
+            return 0;
+        }
+        if (self->link_free[direction] > start) {
+            start = self->link_free[direction];
+        }
+        start += (uint64_t)(length * 8 * 1e6 / profile->rate);
+        self->link_free[direction] = start;
+    }
+    if (proxy_random(self) < profile->duplicate) {
+        self->duplicated++;
+        copies = 2;
+    }
+    for (int i = 0; i < copies; i++) {
+        datagram.release = start + profile->delay;
+        if (profile->jitter > 0) {
+            datagram.release += (uint64_t)(proxy_random(self) * 2 * profile->jitter);
+            datagram.release = datagram.release > profile->jitter ? datagram.release - profile->jitter : 0;
+        }
+        if (proxy_random(self) < profile->reorder) {
+            self->reordered++;
+            datagram.release += PROXY_REORDER_US;
+        }
+        datagram.fd = fd;
+        datagram.to = *to;
+        datagram.length = length;
+        datagram.data = malloc(length);
+        if (datagram.data == NULL) {
+            return -1;
+        }
+        memcpy(datagram.data, data, length);
+        if (proxy_push(self, &datagram) == -1) {
+            free(datagram.data);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Receives what is waiting on a socket of the proxy, without blocking.
+// On success 0 is returned. On error -1 is returned.
+int proxy_receive(Proxy *self, int fd, char *data, uint64_t now)
+{
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    ssize_t length;
+    Flow *flow;
+
+    for (;;) {
+        fromlen = sizeof(from);
+        length = recvfrom(fd, data, PROXY_DATAGRAM_SIZE, MSG_DONTWAIT, (struct sockaddr*)&from, &fromlen);
+        if (length == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNREFUSED ? 0 : -1;
+        }
+        if (fd != self->fd) {
+            for (flow = self->flows; flow->fd != fd; flow++) {
+            }
+            if (proxy_impair(self, 1, self->fd, &flow->client, data, length, now) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        flow = proxy_flow(self, &from);
+        if (flow == NULL || proxy_impair(self, 0, flow->fd, &self->server, data, length, now) == -1) {
+            return -1;
+        }
+    }
+}
+
+void* proxy_run(void *arg)
+{
+    Proxy *self = arg;
+    struct pollfd fds[MAX_FLOWS + 1];
+    struct timespec timeout;
+    uint64_t now, wait, cpu_start = cpu_time_us(RUSAGE_THREAD);
+    Datagram *datagram;
+    char *data = malloc(PROXY_DATAGRAM_SIZE);
+    int count;
+
+    if (data == NULL) {
+        perror("Proxy failed");
+        return NULL;
+    }
+    while (!self->stop) {
+        now = bench_now_us();
+        wait = PROXY_POLL_US;
+        if (self->queue_size > 0) {
+            wait = self->queue[0].release > now ? self->queue[0].release - now : 0;
+            if (wait > PROXY_POLL_US) {
+                wait = PROXY_POLL_US;
+            }
+        }
+        fds[0].fd = self->fd;
+        fds[0].events = POLLIN;
+        for (int i = 0; i < self->flow_count; i++) {
+            fds[i + 1].fd = self->flows[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+        count = self->flow_count + 1;
+        timeout.tv_sec = wait / 1000000;
+        timeout.tv_nsec = wait % 1000000 * 1000;
+        if (ppoll(fds, count, &timeout, NULL) == -1 && errno != EINTR) {
+            perror("Proxy failed");
+            break;
+        }
+
+        now = bench_now_us();
+        for (int i = 0; i < count; i++) {
+            if ((fds[i].revents & (POLLIN | POLLERR)) && proxy_receive(self, fds[i].fd, data, now) == -1) {
+                perror("Proxy failed");
+                self->stop = true;
+            }
+        }
+        while (self->queue_size > 0 && self->queue[0].release <= now) {
+            datagram = &self->queue[0];
+            sendto(datagram->fd, datagram->data, datagram->length, 0, (struct sockaddr*)&datagram->to,
+                    sizeof(datagram->to));
+            self->forwarded++;
+            free(datagram->data);
+            proxy_pop(self);
+        }
+    }
+    free(data);
+    self->cpu_us = cpu_time_us(RUSAGE_THREAD) - cpu_start;
+    return NULL;
+}
+
+// Starts a proxy between the sender and server with the impairments of profile.
+// On success 0 is returned. On error -1 is returned.
+int proxy_start(Proxy *self, const Profile *profile, const struct sockaddr_in *server, uint64_t seed)
+{
+    socklen_t addrlen = sizeof(self->addr);
+
+    memset(self, 0, sizeof(*self));
+    self->profile = profile;
+    self->server = *server;
+    self->random = seed * 0x9E3779B97F4A7C15ULL + 1;
+    self->fd = proxy_socket(&self->addr);
+    if (self->fd == -1) {
+        return -1;
+    }
+    if (getsockname(self->fd, (struct sockaddr*)&self->addr, &addrlen) == -1) {
+        close(self->fd);
+        return -1;
+    }
+    if (pthread_create(&self->tid, NULL, proxy_run, self) != 0) {
+        close(self->fd);
+        return -1;
+    }
+    return 0;
+}
+
+void proxy_stop(Proxy *self)
+{
+    self->stop = true;
+    pthread_join(self->tid, NULL);
+    for (size_t i = 0; i < self->queue_size; i++) {
+        free(self->queue[i].data);
+    }
+    free(self->queue);
+    for (int i = 0; i < self->flow_count; i++) {
+        close(self->flows[i].fd);
+    }
+    close(self->fd);
+}
+
+
+
+
+
+
+// ==================== Receiver Functions ====================
+
+// Every stream starts with its file header, the range it gives is written to the file
+// and checked against its checksum.
+void on_data(RUDP *conn, const char *data, size_t length, bool last)
+{
+    Range *range = conn->user;
+
+    if (range == NULL) {
+        range = calloc(1, sizeof(Range));
+        if (range == NULL || !last || rudp_unpack_file_header(&range->header, data, length) == -1) {
+            free(range);
+            receiver->failed = true;
+            rudp_conn_close(conn);
+            return;
+        }
+        conn->user = range;
+        rudp_conn_set_file(conn, receiver->fd, range->header.offset);
+        if (range->header.flags & RUDP_FILE_COMPRESSED) {
+            rudp_conn_set_compressed(conn);
+        }
+        return;
+    }
+
+    // The listener keeps acking the connection after it is closed, so it is not stopped
+    // before the sender is done.
+    range->done = true;
+    if (data != NULL || length != range->header.length
+        || rudp_check_file_range(receiver->fd, 0, &range->header) == -1)
+    {
+        receiver->failed = true;
+    }
+    receiver->bytes += length;
+    rudp_conn_close(conn);
+}
+
+
+void on_close(RUDP *conn)
+{
+    Range *range = conn->user;
+
+    if (range != NULL && !range->done) {
+        receiver->failed = true;
+    }
+    free(range);
+}
+
+
+void* receiver_run(void *arg)
+{
+    Receiver *self = arg;
+    uint64_t cpu_start = cpu_time_us(RUSAGE_THREAD);
+
+    if (rudp_listener_run(&self->listener) == -1) {
+        perror("Error in receiving");
+        self->failed = true;
+    }
+    self->cpu_us = cpu_time_us(RUSAGE_THREAD) - cpu_start;
+    return NULL;
+}
+
+
+// Receives the file as a delta of the edited copy in the file of the receiver.
+void* delta_receiver_run(void *arg)
+{
+    Receiver *self = arg;
+    uint64_t cpu_start = cpu_time_us(RUSAGE_THREAD);
+    struct sockaddr_in from;
+    socklen_t fromlen = sizeof(from);
+    FILE *fp = fdopen(dup(self->fd), "r+");
+    ssize_t bytes = -1;
+
+    if (fp != NULL) {
+        bytes = ReceiveFileFrom(&self->rudp, fp, (struct sockaddr*)&from, &fromlen);
+        fclose(fp);
+    }
+    if (bytes == -1) {
+        self->failed = true;
+    }
+    else {
+        self->bytes = bytes;
+    }
+    self->cpu_us = cpu_time_us(RUSAGE_THREAD) - cpu_start;
+    return NULL;
+}
+
+
+// Writes the file fp of size bytes to fd with edits spread over it, each of which replaces,
+// inserts or deletes up to EDIT_MAX_LENGTH bytes.
+// On success 0 is returned. On error -1 is returned.
+int write_edited(int fd, FILE *fp, uint64_t size, int edits, uint64_t seed)
+{
+    char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    char noise[EDIT_MAX_LENGTH];
+    uint64_t x = seed * 0x9E3779B97F4A7C15ULL + 1, at = 0, next, length;
+    int result = 0;
+
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+    for (int i = 0; i <= edits && result == 0; i++) {
+        next = i < edits ? size / edits * i + x % (size / edits + 1) : size;
+        if (next < at) {
+            next = at;
+        }
+        if (write(fd, data + at, next - at) != (ssize_t)(next - at)) {
+            result = -1;
+        }
+        at = next;
+        if (i == edits) {
+            break;
+        }
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        length = 1 + (x >> 8) % EDIT_MAX_LENGTH;
+        for (size_t j = 0; j < length; j++) {
+            noise[j] = (char)(x >> (j % 8 * 8)) ^ (char)j;
+        }
+        // Replaced and deleted bytes are skipped in the file, inserted ones are not.
+        if (x % 3 != 2 && write(fd, noise, length) != (ssize_t)length) {
+            result = -1;
+        }
+        if (x % 3 != 1) {
+            at = at + length < size ? at + length : size;
+        }
+    }
+    munmap(data, size);
+    return result;
+}
+
+// Starts an RUDP on a port of the loopback address which receives the file as a delta of an
+// edited copy of it in memory.
+// On success 0 is returned. On error -1 is returned.
+int delta_receiver_start(Receiver *self, const Options *options, FILE *fp, uint64_t size, uint64_t seed)
+{
+    socklen_t addrlen = sizeof(self->addr);
+
+    memset(self, 0, sizeof(*self));
+    self->delta = true;
+    self->expected = size;
+    self->fd = memfd_create("bench", 0);
+    if (self->fd == -1) {
+        return -1;
+    }
+    if (write_edited(self->fd, fp, size, options->edits, seed) == -1 || lseek(self->fd, 0, SEEK_SET) == -1
+        || rudp_socket(&self->rudp) == -1)
+    {
+        close(self->fd);
+        return -1;
+    }
+    rudp_set_window(&self->rudp, options->window);
+    rudp_set_segment_size(&self->rudp, options->segment_size);
+    if (options->offload) {
+        rudp_set_offload(&self->rudp, true);
+    }
+    rudp_set_checksums(&self->rudp, options->checksums);
+
+    self->addr.sin_family = AF_INET;
+    self->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (rudp_bind(&self->rudp, (struct sockaddr*)&self->addr, sizeof(self->addr)) == -1
+        || getsockname(self->rudp.sockfd, (struct sockaddr*)&self->addr, &addrlen) == -1
+        || pthread_create(&self->tid, NULL, delta_receiver_run, self) != 0)
+    {
+        rudp_close(&self->rudp);
+        close(self->fd);
+        return -1;
+    }
+    receiver = self;
+    return 0;
+}
+
+// Starts a listener on a port of the loopback address which writes into memory.
+// On success 0 is returned. On error -1 is returned.
+int receiver_start(Receiver *self, const Options *options, uint64_t size)
+{
+    RUDP_Listener *listener = &self->listener;
+    socklen_t addrlen = sizeof(self->addr);
+
+    memset(self, 0, sizeof(*self));
+    self->expected = size;
+    self->fd = memfd_create("bench", 0);
+    if (self->fd == -1) {
+        return -1;
+    }
+    if (rudp_listener_socket(listener) == -1) {
+        close(self->fd);
+        return -1;
+    }
+    rudp_set_window(&listener->rudp, options->window);
+    rudp_set_segment_size(&listener->rudp, options->segment_size);
+    if (options->offload) {
+        rudp_set_offload(&listener->rudp, true);
+    }
+    rudp_set_checksums(&listener->rudp, options->checksums);
+    listener->rudp.features = RUDP_FEATURE_FILE_HEADER | RUDP_FEATURE_STREAMS | RUDP_FEATURE_FEC
+                                | RUDP_FEATURE_COMPRESS | RUDP_FEATURE_CHECKSUM;
+    listener->on_data = on_data;
+    listener->on_close = on_close;
+
+    self->addr.sin_family = AF_INET;
+    self->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (rudp_bind(&listener->rudp, (struct sockaddr*)&self->addr, sizeof(self->addr)) == -1
+        || getsockname(listener->rudp.sockfd, (struct sockaddr*)&self->addr, &addrlen) == -1
+        || pthread_create(&self->tid, NULL, receiver_run, self) != 0)
+    {
+        rudp_listener_close(listener);
+        close(self->fd);
+        return -1;
+    }
+    receiver = self;
+    return 0;
+}
+
+void receiver_stop(Receiver *self)
+{
+    // A delta receiver stops once it has the file.
+    if (self->delta) {
+        pthread_join(self->tid, NULL);
+        rudp_close(&self->rudp);
+    }
+    else {
+        self->listener.stop = true;
+        pthread_join(self->tid, NULL);
+        rudp_listener_close(&self->listener);
+    }
+    close(self->fd);
+    receiver = NULL;
+}
+
+
+
+// ==================== Benchmark Functions ====================
+
+// Makes a file of size bytes of random data, which the sender maps.
+FILE* make_file(uint64_t size, uint64_t seed)
+{
+    FILE *fp = tmpfile();
+    uint64_t x = seed * 0x9E3779B97F4A7C15ULL + 1;
+    uint64_t block[512];
+
+    if (fp == NULL) {
+        return NULL;
+    }
+    for (uint64_t written = 0; written < size; written += sizeof(block)) {
+        for (size_t i = 0; i < 512; i++) {
+            x ^= x >> 12;
+            x ^= x << 25;
+            x ^= x >> 27;
+            block[i] = x * 0x2545F4914F6CDD1DULL;
+        }
+        if (fwrite(block, 1, size - written < sizeof(block) ? size - written : sizeof(block), fp) == 0) {
+            fclose(fp);
+            return NULL;
+        }
+    }
+    fflush(fp);
+    return fp;
+}
+
+// Sends the file fp of size bytes through a proxy with the impairments of profile and
+// prints the results as one line of JSON.
+// On success 0 is returned. If the run could not be set up -1 is returned.
+int run_once(const Profile *profile, FILE *fp, uint64_t size, int run, uint64_t seed, const Options *options)
+{
+    Receiver receiver_state;
+    Proxy proxy;
+    RUDP rudp;
+    RUDP_Stats sender_stats, receiver_stats;
+    ssize_t bytes;
+    uint64_t start, end, cpu_start, cpu_total, cpu_sender;
+    bool ok;
+
+    if (rudp_socket(&rudp) == -1) {
+        return -1;
+    }
+    rudp_set_window(&rudp, options->window);
+    rudp_set_segment_size(&rudp, options->segment_size);
+    if (options->offload) {
+        rudp_set_offload(&rudp, true);
+    }
+    rudp_set_streams(&rudp, options->streams);
+    rudp_set_fec(&rudp, options->fec_data, options->fec_parity);
+    rudp_set_compression(&rudp, options->compress);
+    rudp_set_checksums(&rudp, options->checksums);
+    rudp_set_delta(&rudp, options->delta);
+    rudp_set_congestion(&rudp, options->congestion);
+
+    cpu_start = cpu_time_us(RUSAGE_SELF);
+    if ((options->delta ? delta_receiver_start(&receiver_state, options, fp, size, seed)
+                        : receiver_start(&receiver_state, options, size)) == -1)
+    {
+        rudp_close(&rudp);
+        return -1;
+    }
+    if (proxy_start(&proxy, profile, &receiver_state.addr, seed) == -1) {
+        receiver_stop(&receiver_state);
+        rudp_close(&rudp);
+        return -1;
+    }
+
+    rewind(fp);
+    start = bench_now_us();
+    bytes = SendFileTo(&rudp, fp, (struct sockaddr*)&proxy.addr, sizeof(proxy.addr));
+    end = bench_now_us();
+    // A delta receiver which never got the file cannot be stopped, so the run is given up.
+    if (bytes == -1 && options->delta) {
+        return -1;
+    }
+
+    receiver_stop(&receiver_state);
+    proxy_stop(&proxy);
+    cpu_total = cpu_time_us(RUSAGE_SELF) - cpu_start;
+    cpu_sender = cpu_total - receiver_state.cpu_us - proxy.cpu_us;
+    ok = bytes == (ssize_t)size && receiver_state.bytes == size && !receiver_state.failed;
+    rudp_get_stats(&rudp, &sender_stats);
+    rudp_get_stats(options->delta ? &receiver_state.rudp : &receiver_state.listener.rudp, &receiver_stats);
+
+    printf("{\"size\":%" PRIu64 ",\"profile\":\"%s\",\"loss\":%g,\"duplicate\":%g,\"reorder\":%g,"
+            "\"delay_ms\":%g,\"jitter_ms\":%g,\"rate_mbps\":%g,",
+            size, profile->name, profile->loss, profile->duplicate, profile->reorder,
+            profile->delay / 1e3, profile->jitter / 1e3, profile->rate / 1e6);
+    printf("\"congestion\":\"%s\",\"window\":%d,\"streams\":%d,\"fec_data\":%d,\"fec_parity\":%d,"
+            "\"compress\":%s,\"checksums\":%s,\"crc\":\"%s\",\"run\":%d,", options->congestion, options->window,
+            options->streams, options->fec_data, options->fec_parity, options->compress ? "true" : "false",
+            options->checksums ? "true" : "false", crc32c_name(), run);
+    printf("\"ok\":%s,\"time_ms\":%.3f,\"goodput_mbps\":%.3f,", ok ? "true" : "false",
+            (end - start) / 1e3, ok ? size * 8.0 / (end - start) : 0.0);
+    printf("\"segments_sent\":%" PRIu64 ",\"segments_resent\":%" PRIu64 ",\"timeouts\":%" PRIu64
+            ",\"segments_duplicate\":%" PRIu64 ",\"acks_sent\":%" PRIu64 ",\"acks_received\":%" PRIu64 ",",
+            sender_stats.segments_sent, sender_stats.segments_resent, sender_stats.timeouts,
+            receiver_stats.segments_duplicate, receiver_stats.acks_sent, sender_stats.acks_received);
+    printf("\"datagrams_corrupt\":%" PRIu64 ",", receiver_stats.datagrams_corrupt + sender_stats.datagrams_corrupt);
+    printf("\"parity_sent\":%" PRIu64 ",\"segments_rebuilt\":%" PRIu64 ",", sender_stats.parity_sent,
+            receiver_stats.segments_rebuilt);
+    printf("\"rtt_p50_us\":%" PRIu64 ",\"rtt_p99_us\":%" PRIu64 ",\"delivery_p50_us\":%" PRIu64
+            ",\"delivery_p99_us\":%" PRIu64 ",",
+            rudp_histogram_percentile(sender_stats.rtt_histogram, 0.5),
+            rudp_histogram_percentile(sender_stats.rtt_histogram, 0.99),
+            rudp_histogram_percentile(sender_stats.delivery_histogram, 0.5),
+            rudp_histogram_percentile(sender_stats.delivery_histogram, 0.99));
+    printf("\"compress_input\":%" PRIu64 ",\"compress_output\":%" PRIu64 ",", sender_stats.compress_input,
+            sender_stats.compress_output);
+    printf("\"delta\":%s,\"edits\":%d,\"delta_matched\":%" PRIu64 ",\"delta_literal\":%" PRIu64 ","
+            "\"signature_segments\":%" PRIu64 ",", options->delta ? "true" : "false", options->delta ? options->edits : 0,
+            sender_stats.delta_matched, sender_stats.delta_literal, receiver_stats.segments_sent);
+    printf("\"memory_peak_sender\":%" PRIu64 ",\"memory_peak_receiver\":%" PRIu64 ",", sender_stats.memory_peak,
+            receiver_stats.memory_peak);
+    printf("\"datagrams_forwarded\":%" PRIu64 ",\"datagrams_dropped\":%" PRIu64 ",\"datagrams_overflowed\":%" PRIu64
+            ",\"datagrams_duplicated\":%" PRIu64 ",\"datagrams_reordered\":%" PRIu64 ",",
+            proxy.forwarded, proxy.dropped, proxy.overflowed, proxy.duplicated, proxy.reordered);
+    printf("\"cpu_sender_ms\":%.3f,\"cpu_receiver_ms\":%.3f,\"cpu_proxy_ms\":%.3f,\"cpu_percent\":%.1f}\n",
+            cpu_sender / 1e3, receiver_state.cpu_us / 1e3, proxy.cpu_us / 1e3,
+            (cpu_sender + receiver_state.cpu_us) * 100.0 / (end - start));
+    fflush(stdout);
+
+    // Without losses every timeout is spurious, the timeout is too short for the path.
+    if (!ok) {
+        fprintf(stderr, "Run %d of %" PRIu64 " bytes over %s failed\n", run, size, profile->name);
+        failed_runs++;
+    }
+    else if (sender_stats.timeouts > 0 && profile->loss == 0 && profile->duplicate == 0
+        && profile->reorder == 0 && profile->jitter == 0 && proxy.overflowed == 0)
+    {
+        fprintf(stderr, "Run %d of %" PRIu64 " bytes over %s had %" PRIu64 " spurious timeouts\n", run, size,
+                profile->name, sender_stats.timeouts);
+        failed_runs++;
+    }
+
+    rudp_close(&rudp);
+    return 0;
+}
+
+
+
+
+// ==================== Latency Functions ====================
+
+void* echo_run(void *arg)
+{
+    Echo *self = arg;
+
+    for (int i = 0; i < self->messages; i++) {
+        if (rudp_recvfrom(&self->rudp, self->buffer, self->size, NULL, NULL) != (ssize_t)self->size
+            || rudp_sendto(&self->rudp, self->buffer, self->size, (struct sockaddr*)&self->addr,
+                            sizeof(self->addr)) != (ssize_t)self->size)
+        {
+            self->failed = true;
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Makes a socket on a port of the loopback address with the options of the sender.
+// On success 0 is returned. On error -1 is returned.
+int latency_socket(RUDP *rudp, struct sockaddr_in *addr, bool message_mode, const Options *options)
+{
+    socklen_t addrlen = sizeof(*addr);
+
+    if (rudp_socket(rudp) == -1) {
+        return -1;
+    }
+    rudp_set_window(rudp, options->window);
+    rudp_set_segment_size(rudp, options->segment_size);
+    if (options->offload) {
+        rudp_set_offload(rudp, true);
+    }
+    rudp_set_checksums(rudp, options->checksums);
+    rudp_set_congestion(rudp, options->congestion);
+    rudp_set_messages(rudp, message_mode);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (rudp_bind(rudp, (struct sockaddr*)addr, sizeof(*addr)) == -1
+        || getsockname(rudp->sockfd, (struct sockaddr*)addr, &addrlen) == -1)
+    {
+        rudp_close(rudp);
+        return -1;
+    }
+    return 0;
+}
+
+int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Sends messages of size bytes over loopback to a thread which sends each one back, one at a
+// time, and prints percentiles of the round trip times as one line of JSON. The first
+// LATENCY_WARMUP round trips, which negotiate the session, are not timed.
+// On success 0 is returned. If the run could not be set up -1 is returned.
+int run_latency(uint64_t size, bool message_mode, int run, const Options *options)
+{
+    Echo echo;
+    RUDP rudp;
+    RUDP_Stats sender_stats, echo_stats;
+    struct sockaddr_in addr;
+    char *message, *reply;
+    uint64_t *samples, start, total = 0, cpu_start, cpu_total;
+    int done = 0, count = options->messages;
+    bool ok = true;
+
+    memset(&echo, 0, sizeof(echo));
+    message = malloc(size);
+    reply = malloc(size);
+    echo.buffer = malloc(size);
+    samples = malloc(count * sizeof(uint64_t));
+    if (message == NULL || reply == NULL || echo.buffer == NULL || samples == NULL) {
+        free(message);
+        free(reply);
+        free(echo.buffer);
+        free(samples);
+        return -1;
+    }
+    memset(message, 'm', size);
+    echo.size = size;
+    echo.messages = LATENCY_WARMUP + count;
+    if (latency_socket(&rudp, &echo.addr, message_mode, options) == -1) {
+        return -1;
+    }
+    if (latency_socket(&echo.rudp, &addr, message_mode, options) == -1
+        || pthread_create(&echo.tid, NULL, echo_run, &echo) != 0)
+    {
+        rudp_close(&rudp);
+        return -1;
+    }
+
+    cpu_start = cpu_time_us(RUSAGE_SELF);
+    for (int i = 0; i < LATENCY_WARMUP + count && ok; i++) {
+        start = bench_now_ns();
+        ok = rudp_sendto(&rudp, message, size, (struct sockaddr*)&addr, sizeof(addr)) == (ssize_t)size
+            && rudp_recvfrom(&rudp, reply, size, NULL, NULL) == (ssize_t)size;
+        if (ok && i >= LATENCY_WARMUP) {
+            samples[done] = bench_now_ns() - start;
+            total += samples[done++];
+        }
+    }
+    cpu_total = cpu_time_us(RUSAGE_SELF) - cpu_start;
+    // An echo which never got its message cannot be stopped, so the run is given up.
+    if (!ok) {
+        return -1;
+    }
+    pthread_join(echo.tid, NULL);
+    ok = !echo.failed && memcmp(message, reply, size) == 0;
+    qsort(samples, done, sizeof(uint64_t), compare_u64);
+    rudp_get_stats(&rudp, &sender_stats);
+    rudp_get_stats(&echo.rudp, &echo_stats);
+
+    printf("{\"latency\":true,\"size\":%" PRIu64 ",\"message_mode\":%s,\"round_trips\":%d,\"window\":%d,"
+            "\"checksums\":%s,\"run\":%d,\"ok\":%s,", size, message_mode ? "true" : "false", done, options->window,
+            options->checksums ? "true" : "false", run, ok ? "true" : "false");
+    printf("\"rtt_p50_us\":%.1f,\"rtt_p99_us\":%.1f,\"rtt_max_us\":%.1f,\"rtt_mean_us\":%.1f,",
+            samples[done / 2] / 1e3, samples[(uint64_t)done * 99 / 100] / 1e3, samples[done - 1] / 1e3,
+            total / 1e3 / done);
+    printf("\"timeouts\":%" PRIu64 ",\"fast_retransmits\":%" PRIu64 ",", sender_stats.timeouts + echo_stats.timeouts,
+            sender_stats.fast_retransmits + echo_stats.fast_retransmits);
+    printf("\"cpu_us_per_round_trip\":%.1f}\n", (double)cpu_total / (LATENCY_WARMUP + count));
+    fflush(stdout);
+
+    rudp_close(&echo.rudp);
+    rudp_close(&rudp);
+    free(message);
+    free(reply);
+    free(echo.buffer);
+    free(samples);
+    return 0;
+}
+
+
+int main(int argc, char* argv[])
+{
+    Profile profiles[MAX_PROFILES];
+    uint64_t sizes[MAX_SIZES];
+    int profile_count = 0, size_count = 0;
+    int runs = 1;
+    uint64_t seed = 1;
+    Options options = {
+        .window = DEFAULT_WINDOW_SIZE,
+        .segment_size = DEFAULT_SEGMENT_SIZE,
+        .streams = 1,
+        .fec_data = FEC_MAX_DATA / 4,
+        .congestion = CC_DEFAULT,
+    };
+    char *item, *saveptr;
+    RUDP check;
+    FILE *fp;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "z:i:r:S:w:c:s:gp:f:lkd:m:")) != -1) {
+        switch (opt) {
+        case 'z':
+            for (item = strtok_r(optarg, ",", &saveptr); item != NULL; item = strtok_r(NULL, ",", &saveptr)) {
+                if (size_count == MAX_SIZES || parse_size(item, &sizes[size_count++]) == -1) {
+                    usage(argv[0]);
+                }
+            }
+            break;
+        case 'i':
+            if (profile_count == MAX_PROFILES || parse_profile(optarg, &profiles[profile_count++]) == -1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'r':
+            runs = atoi(optarg);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            options.window = atoi(optarg);
+            break;
+        case 's':
+            options.segment_size = atoi(optarg);
+            break;
+        case 'g':
+            options.offload = true;
+            break;
+        case 'p':
+            options.streams = atoi(optarg);
+            break;
+        case 'f':
+            if (sscanf(optarg, "%d:%d", &options.fec_data, &options.fec_parity) != 2) {
+                usage(argv[0]);
+            }
+            break;
+        case 'l':
+            options.compress = true;
+            break;
+        case 'k':
+            options.checksums = true;
+            break;
+        case 'd':
+            options.delta = true;
+            options.edits = atoi(optarg);
+            break;
+        case 'c':
+            options.congestion = optarg;
+            break;
+        case 'm':
+            options.messages = atoi(optarg);
+            if (options.messages < 1) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc != optind || runs < 1 || options.edits < 0) {
+        usage(argv[0]);
+    }
+    if (profile_count == 0) {
+        profile_count = sizeof(default_profiles) / sizeof(default_profiles[0]);
+        memcpy(profiles, default_profiles, sizeof(default_profiles));
+    }
+    if (size_count == 0 && options.messages > 0) {
+        size_count = sizeof(default_message_sizes) / sizeof(default_message_sizes[0]);
+        memcpy(sizes, default_message_sizes, sizeof(default_message_sizes));
+    }
+    else if (size_count == 0) {
+        size_count = sizeof(default_sizes) / sizeof(default_sizes[0]);
+        memcpy(sizes, default_sizes, sizeof(default_sizes));
+    }
+
+    // Options are checked once on a socket which is not used.
+    rudp_init(&check);
+    if (rudp_set_window(&check, options.window) == -1) {
+        fprintf(stderr, "Window must be in [1, %d]\n", MAX_WINDOW_SIZE);
+        exit(1);
+    }
+    if (rudp_set_segment_size(&check, options.segment_size) == -1) {
+        fprintf(stderr, "Segment size must be in [%d, %d]\n", MAX_PAYLOAD_SIZE, MAX_SEGMENT_SIZE);
+        exit(1);
+    }
+    if (rudp_set_streams(&check, options.streams) == -1) {
+        fprintf(stderr, "Streams must be in [1, %d]\n", MAX_STREAMS);
+        exit(1);
+    }
+    if (rudp_set_fec(&check, options.fec_data, options.fec_parity) == -1) {
+        fprintf(stderr, "FEC blocks must have [1, %d] data and [0, %d] parity segments\n", FEC_MAX_DATA, FEC_MAX_PARITY);
+        exit(1);
+    }
+    if (rudp_set_congestion(&check, options.congestion) == -1) {
+        fprintf(stderr, "Unknown congestion control: %s\n", options.congestion);
+        exit(1);
+    }
+    rudp_close(&check);
+
+    // Messages of every size go back and forth with message mode off and on, without the proxy.
+    if (options.messages > 0) {
+        for (int s = 0; s < size_count; s++) {
+            for (int m = 0; m < 2; m++) {
+                for (int r = 0; r < runs; r++) {
+                    if (run_latency(sizes[s], m == 1, r, &options) == -1) {
+                        perror("Failed to set up run");
+                        exit(1);
+                    }
+                }
+            }
+        }
+        return 0;
+    }
+
+    // Every size is sent through every profile, each run with a seed of its own.
+    for (int s = 0; s < size_count; s++) {
+        fp = make_file(sizes[s], seed + s);
+        if (fp == NULL) {
+            perror("Failed to make file");
+            exit(1);
+        }
+        for (int p = 0; p < profile_count; p++) {
+            for (int r = 0; r < runs; r++) {
+                if (run_once(&profiles[p], fp, sizes[s], r, seed++, &options) == -1) {
+                    perror("Failed to set up run");
+                    exit(1);
+                }
+            }
+        }
+        fclose(fp);
+    }
+
+    return failed_runs > 0;
+}
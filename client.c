@@ -1,75 +1,166 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include "rudp.h"
-
-#define MAX_FILENAME_LEN 100
-
-
-
-int main(int argc, char* argv[1])
-{
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <server_ip> <port>\n", argv[0]);
-        exit(1);
-    }
-    const char *server_ip = argv[1];
-    const int port = atoi(argv[2]);
-
-    struct sockaddr_in serv_adr, from_adr;
-    socklen_t adr_sz;
-
-    ssize_t bytes;
-    char filename[MAX_FILENAME_LEN];
-    unsigned short int str_len;
-    FILE* fp;
-
-    RUDP rudp;
-
-    if (rudp_socket(&rudp) == -1) {
-        perror("Failed to create socket");
-        exit(1);
-    }
-
-    memset(&serv_adr, 0, sizeof(serv_adr));
-    serv_adr.sin_family = AF_INET;
-    serv_adr.sin_addr.s_addr = inet_addr(server_ip);
-    serv_adr.sin_port = htons(port);
-
-    rudp.logs = true;
-
-    fputs("Enter filename: ", stdout);
-    fgets(filename, MAX_FILENAME_LEN, stdin);
-    str_len = strlen(filename);
-    filename[--str_len] = '\0';
-
-    bytes = rudp_sendto(&rudp, filename, str_len, (struct sockaddr*)&serv_adr, sizeof(serv_adr));
-    if (bytes == -1) {
-        perror("Error in sending filename");
-        goto END;
-    }
-
-    fp = fopen(filename, "r");
-    if (fp == NULL) {
-        perror("Error in opening file");
-        goto END;
-    }
-    
-    bytes = SendFileTo(&rudp, fp, (struct sockaddr*)&serv_adr, sizeof(serv_adr));
-    if (bytes == -1) {
-        perror("Error in sending file");
-        goto END;
-    }
-
-    printf("\n\nSent File Size: %ld\n", bytes);
-    
-
-    END:
-
-    fclose(fp);
-    rudp_close(&rudp);
-
-    return 0;
-}
-
-
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "rudp.h"
+
+#define MAX_FILENAME_LEN 100
+
+
+
+void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-w window] [-v version] [-c reno|cubic|vegas|none] [-s segment_size] [-g] [-p streams] [-f data:parity] [-l] [-k] [-r] <server_ip> <port>\n", name);
+    exit(1);
+}
+
+
+int main(int argc, char* argv[])
+{
+    int window = DEFAULT_WINDOW_SIZE;
+    int version = RUDP_VERSION_AUTO;
+    int segment_size = DEFAULT_SEGMENT_SIZE;
+    bool offload = false;
+    int streams = 1;
+    int fec_data = FEC_MAX_DATA / 4, fec_parity = 0;
+    bool compress = false;
+    bool checksums = false;
+    bool resume = false;
+    const char *congestion = CC_DEFAULT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:v:c:s:gp:f:lkr")) != -1) {
+        switch (opt) {
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 'v':
+            version = atoi(optarg);
+            break;
+        case 's':
+            segment_size = atoi(optarg);
+            break;
+        case 'g':
+            offload = true;
+            break;
+        case 'p':
+            streams = atoi(optarg);
+            break;
+        case 'f':
+            if (sscanf(optarg, "%d:%d", &fec_data, &fec_parity) != 2) {
+                usage(argv[0]);
+            }
+            break;
+        case 'l':
+            compress = true;
+            break;
+        case 'k':
+            checksums = true;
+            break;
+        case 'r':
+            resume = true;
+            break;
+        case 'c':
+            congestion = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+    }
+    const char *server_ip = argv[optind];
+    const int port = atoi(argv[optind + 1]);
+
+    struct sockaddr_in serv_adr, from_adr;
+    socklen_t adr_sz;
+
+    ssize_t bytes;
+    char filename[MAX_FILENAME_LEN];
+    unsigned short int str_len;
+    FILE* fp;
+
+    RUDP rudp;
+
+    if (rudp_socket(&rudp) == -1) {
+        perror("Failed to create socket");
+        exit(1);
+    }
+    if (rudp_set_window(&rudp, window) == -1) {
+        fprintf(stderr, "Window must be in [1, %d]\n", MAX_WINDOW_SIZE);
+        exit(1);
+    }
+    if (rudp_set_segment_size(&rudp, segment_size) == -1) {
+        fprintf(stderr, "Segment size must be in [%d, %d]\n", MAX_PAYLOAD_SIZE, MAX_SEGMENT_SIZE);
+        exit(1);
+    }
+    if (offload && rudp_set_offload(&rudp, true) == -1) {
+        perror("Failed to turn on segmentation offload");
+        exit(1);
+    }
+    if (rudp_set_streams(&rudp, streams) == -1) {
+        fprintf(stderr, "Streams must be in [1, %d]\n", MAX_STREAMS);
+        exit(1);
+    }
+    if (rudp_set_fec(&rudp, fec_data, fec_parity) == -1) {
+        fprintf(stderr, "FEC blocks must have [1, %d] data and [0, %d] parity segments\n", FEC_MAX_DATA, FEC_MAX_PARITY);
+        exit(1);
+    }
+    rudp_set_compression(&rudp, compress);
+    rudp_set_checksums(&rudp, checksums);
+    rudp_set_resume(&rudp, resume);
+    rudp.version = version;
+    if (rudp_set_congestion(&rudp, congestion) == -1) {
+        fprintf(stderr, "Unknown congestion control: %s\n", congestion);
+        exit(1);
+    }
+
+    memset(&serv_adr, 0, sizeof(serv_adr));
+    serv_adr.sin_family = AF_INET;
+    serv_adr.sin_addr.s_addr = inet_addr(server_ip);
+    serv_adr.sin_port = htons(port);
+
+    rudp.logs = true;
+
+    fputs("Enter filename: ", stdout);
+    fgets(filename, MAX_FILENAME_LEN, stdin);
+    str_len = strlen(filename);
+    filename[--str_len] = '\0';
+
+    // The filename is a small message, sent in message mode and the file without it.
+    rudp_set_messages(&rudp, true);
+    bytes = rudp_sendto(&rudp, filename, str_len, (struct sockaddr*)&serv_adr, sizeof(serv_adr));
+    rudp_set_messages(&rudp, false);
+    if (bytes == -1) {
+        perror("Error in sending filename");
+        goto END;
+    }
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        perror("Error in opening file");
+        goto END;
+    }
+    
+    bytes = SendFileTo(&rudp, fp, (struct sockaddr*)&serv_adr, sizeof(serv_adr));
+    if (bytes == -1) {
+        perror("Error in sending file");
+        goto END;
+    }
+
+    printf("\n\nSent File Size: %ld\n", bytes);
+    rudp_print_batch_stats(&rudp);
+    rudp_print_loss_stats(&rudp);
+    rudp_print_stats(&rudp);
+    
+
+    END:
+
+    fclose(fp);
+    rudp_close(&rudp);
+
+    return 0;
+}
+
+
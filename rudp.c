@@ -1,479 +1,6172 @@
-#include <unistd.h>
-#include <string.h>
-#include <stdio.h>
-#include "rudp.h"
-
-
-
-// ==================== Timer Functions ====================
-
-void start_timer(Timer *self)
-{
-    self->active = true;
-    time(&self->start_time);
-}
-
-void update_time(Timer *self)
-{
-    if (self->active) {
-        time(&self->current_time);
-        self->elapsed_time = difftime(self->current_time, self->start_time);
-    }
-}
-
-void reset_timer(Timer *self)
-{
-    time(&self->start_time);
-}
-
-void stop_timer(Timer *self)
-{
-    self->active = false;
-}
-
-bool timeout(Timer *self)
-{
-    return self->active && self->elapsed_time >= TIMEOUT;
-}
-
-
-
-// ==================== RUDP_Segment Functions ====================
-
-void make_segment(RUDP_Segment *self, char *data, uint16_t data_length, uint8_t seqno)
-{
-    self->header.ack = 0;
-    self->header.last = 0;
-    self->header.seqno = seqno;
-    memcpy(self->data, data, data_length);
-}
-
-void make_ack_segment(RUDP_Segment *self, uint8_t seqno)
-{
-    self->header.ack = 1;
-    self->header.last = 0;
-    self->header.seqno = seqno;
-}
-
-
-
-// ==================== RUDP_Window Functions ====================
-
-void window_init(RUDP_Window *self, RUDP *rudp)
-{
-    self->rudp = rudp;
-    self->base = 0;
-    self->next = 0;
-}
-
-// Returns index of segment with seqno within window range.
-uint8_t get_index(RUDP_Window *self, uint8_t seqno)
-{
-    uint8_t index = self->base;
-    while (self->rudp->buffer[index].header.seqno != seqno 
-            && index - self->base + 1 < WINDOW_SIZE) 
-    {
-        index++;
-    }
-    return index;
-}
-
-
-
-// ==================== ReceiverThread Functions ====================
-
-void rt_init(ReceiverThread *self, RUDP *rudp)
-{
-    self->rudp = rudp;
-    self->bytes_received = 0;
-    self->stop = false;
-}
-
-void* receive(void* arg)
-{
-    ReceiverThread *self = (ReceiverThread*)arg;
-    RUDP_Window *window = &self->rudp->window;
-    RUDP_Segment *buffer = self->rudp->buffer;
-    Timer *timers = self->rudp->timers;
-    RUDP_Segment segment, ack;
-    ssize_t bytes;
-    uint8_t index, timer_index;
-
-    struct sockaddr_in host_addr;
-    socklen_t host_addr_size;
-
-    while (1) {
-        host_addr_size = sizeof(host_addr);
-        bytes = recvfrom(self->rudp->sockfd, &segment, sizeof(RUDP_Segment), 0, 
-                            (struct sockaddr*)&host_addr, &host_addr_size);
-        if (bytes == -1) {
-            self->bytes_received = -1;
-            self->stop = true;
-            break;
-        }
-        index = get_index(window, segment.header.seqno);
-        // For Sender.
-        // If an ack is received.
-        if (segment.header.ack) {
-            if (self->rudp->logs) {
-                printf("Ack Received: %d", segment.header.seqno);
-                if (segment.header.last) {
-                    printf(" --> Last Ack");
-                }
-                printf("\n");
-            }
-            // If ack is in [sendBase, sendBase + WINDOW_SIZE - 1].
-            if (index >= window->base && index <= window->base + WINDOW_SIZE - 1) {
-                // Find and stop the timer for the segment for which the ack is received.
-                for (timer_index = 0; timer_index < WINDOW_SIZE; timer_index++) {
-                    if (timers[timer_index].index == index) {
-                        break;
-                    }
-                }
-                stop_timer(&timers[timer_index]);
-
-                // Mark the segment as received using ack field.
-                buffer[index].header.ack = 1;
-
-                // If earliest ack is received than advance window base to the next unacked segment.
-                while (buffer[window->base].header.ack) {
-                    window->base++;
-                }
-            }
-        }
-        // For Receiver.
-        // If a data segment is received.
-        else {
-            if (self->rudp->logs) {
-                printf("Segment Received: %d", segment.header.seqno);
-                if (segment.header.last) {
-                    printf(" --> Last Segment");
-                }
-                printf("\n");
-            }
-
-            // If segment is in [rcvBase, rcvBase + WINDOW_SIZE - 1].
-            if (index >= window->base && index <= window->base + WINDOW_SIZE - 1) {
-                // Store segment in buffer.
-                buffer[index] = segment;
-
-                // Mark the segment as received using ack field.
-                buffer[index].header.ack = 1;
-
-                self->bytes_received += bytes - sizeof(RUDP_Header);
-                // Send ack for received segment.
-                make_ack_segment(&ack, segment.header.seqno);
-                if (buffer[index].header.last) {
-                    ack.header.last = 1;
-                }
-                
-                bytes = sendto(self->rudp->sockfd, &ack, sizeof(RUDP_Header), 0, 
-                                    (struct sockaddr*)&host_addr, host_addr_size);
-                if (bytes == -1) {
-                    self->bytes_received = -1;
-                    self->stop = true;
-                    break;
-                }
-                if (self->rudp->logs) {
-                    printf("Sent ACK: %d", ack.header.seqno);
-                    if (ack.header.last) {
-                        printf(" --> Last ACK");
-                    }
-                    printf("\n");
-                }
-
-                // If in order segemnt is received then advance window base to next not yet received segment.
-                while (buffer[window->base].header.ack) {
-                    window->base++;
-                }
-            }
-            // If segment is in [rcvBase - WINDOW_SIZE, rcvBase - 1].
-            else if (index >= window->base - WINDOW_SIZE && index <= window->base - 1) {
-                // Send ack for received segment.
-                make_ack_segment(&ack, segment.header.seqno);
-                if (buffer[index].header.last) {
-                    ack.header.last = 1;
-                }
-                bytes = sendto(self->rudp->sockfd, &ack, sizeof(RUDP_Header), 0, 
-                                    (struct sockaddr*)&host_addr, host_addr_size);
-                if (bytes == -1) {
-                    self->bytes_received = -1;
-                    self->stop = true;
-                    break;
-                }
-                if (self->rudp->logs) {
-                    printf("Resent ACK: %d", ack.header.seqno);
-                    if (ack.header.last) {
-                        printf(" --> Last ACK");
-                    }
-                    printf("\n");
-                }
-            }
-        }
-        // If all segments or acks received.
-        if (buffer[window->base - 1].header.last) {
-            self->stop = true;
-            break;
-        }
-        usleep(1);
-    }
-    pthread_exit(NULL);
-}
-
-
-
-// ==================== RUDP Functions ====================
-
-int rudp_socket(RUDP *self)
-{
-    self->logs = false;
-    self->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    return self->sockfd;
-}
-
-int rudp_close(RUDP *self)
-{
-    return close(self->sockfd);
-}
-
-int rudp_bind(RUDP *self, const struct sockaddr *addr, socklen_t addrlen)
-{
-    return bind(self->sockfd, addr, addrlen);
-}
-
-
-// Used to make sements from buffer argument and insert in RUDP buffer before sending.
-void insert_segments(RUDP *self)
-{
-    uint8_t seqno = 0;
-    uint8_t i;
-    // Make no_of_segments - 1 segments with data of MAX_PAYLOAD_SIZE bytes.
-    for (i = 0; i < self->no_of_segments - 1; i++) {
-        make_segment(&self->buffer[i], self->buffer_arg, MAX_PAYLOAD_SIZE, seqno);
-        seqno = (seqno + 1) % SEQUENCE_NUMBERS;
-        self->buffer_arg += MAX_PAYLOAD_SIZE;
-    }
-    // For last segment length is calculated separately because it may not be
-    // a multiple of MAX_PAYLOAD_SIZE and the last bit is set in the header.
-    make_segment(&self->buffer[i], self->buffer_arg, self->buffer_arg_len - (i * MAX_PAYLOAD_SIZE), seqno);
-    self->buffer[i].header.last = 1;
-}
-
-ssize_t rudp_sendto(RUDP *self, const void *buffer, size_t length, 
-                        const struct sockaddr *dest_addr, socklen_t addrlen)
-{
-    if (self->logs) {
-        printf("------------------------------\n");
-    }
-    if (length > BUFFER_SIZE * MAX_PAYLOAD_SIZE) {
-        fprintf(stderr, "Cannot send more than %d bytes\n", BUFFER_SIZE * MAX_PAYLOAD_SIZE);
-        return -1;
-    }
-    uint8_t i;
-    ssize_t bytes_sent = 0;
-    ssize_t bytes;
-
-    // Initialize RUDP_Window and ReceiverThread struct variables.
-    window_init(&self->window, self);
-    rt_init(&self->receiver, self);
-
-    // Disable all timers.
-    for (i = 0; i < WINDOW_SIZE; i++) {
-        self->timers[i].active = false;
-    }
-    self->next_timer = 0;
-
-    self->buffer_arg = (char*)buffer;
-    self->buffer_arg_len = length;
-    self->no_of_segments = length / MAX_PAYLOAD_SIZE;
-    if (length % MAX_PAYLOAD_SIZE != 0) {
-        self->no_of_segments++;
-    }
-
-    insert_segments(self);
-
-    // Start receiver thread.
-    pthread_create(&self->receiver.tid, NULL, receive, (void*)&self->receiver);
-    
-    while (!self->receiver.stop) {
-        // Send more segments if segments sent are less than window size 
-        // and all segments are not sent.
-        if (self->window.next - self->window.base + 1 < WINDOW_SIZE 
-            && self->window.next < self->no_of_segments)
-        {
-            if (self->window.next != self->no_of_segments - 1) {
-                bytes = sendto(self->sockfd, &self->buffer[self->window.next], sizeof(RUDP_Segment), 0, 
-                                    dest_addr, addrlen);
-            }
-            else {
-                bytes = sendto(self->sockfd, &self->buffer[self->window.next], sizeof(RUDP_Header) + length - ((self->no_of_segments - 1) * MAX_PAYLOAD_SIZE), 0, 
-                                    dest_addr, addrlen);
-
-            }
-
-            if (self->logs) {
-                printf("Sent Segment: %d", self->buffer[self->window.next].header.seqno);
-                if (self->buffer[self->window.next].header.last) {
-                    printf(" --> Last Segment");
-                }
-                printf("\n");
-            }
-
-            bytes_sent += bytes - sizeof(RUDP_Header);
-
-            // Increment the next_timer index to the index of the next available timer.
-            while (self->timers[self->next_timer].active)
-            {
-                self->next_timer = (self->next_timer + 1) % WINDOW_SIZE;
-            }
-            // Start timer.
-            self->timers[self->next_timer].index = self->window.next;
-            start_timer(&self->timers[self->next_timer]);
-            self->window.next++;
-        }
-        // Check for timeouts.
-        for (i = 0; i < WINDOW_SIZE; i++) {
-            update_time(&self->timers[i]);
-            if (timeout(&self->timers[i])) {
-                self->buffer[self->timers[i].index].header.ack = 0;
-                if (self->timers[i].index != self->no_of_segments - 1) {
-                    bytes = sendto(self->sockfd, &self->buffer[self->timers[i].index], sizeof(RUDP_Segment), 0, 
-                                        dest_addr, addrlen);
-                }
-                else {
-                    bytes = sendto(self->sockfd, &self->buffer[self->timers[i].index], sizeof(RUDP_Header) + length - ((self->no_of_segments - 1) * MAX_PAYLOAD_SIZE), 0, 
-                                        dest_addr, addrlen);
-                }
-
-                if (self->logs) {
-                    printf("Timeout. Resent Segment: %d", self->buffer[self->timers[i].index].header.seqno);
-                    if (self->buffer[self->timers[i].index].header.last) {
-                        printf(" --> Last Segment");
-                    }
-                    printf("\n");
-                }
-
-                reset_timer(&self->timers[i]);
-            }
-        }
-    }
-    
-    pthread_join(self->receiver.tid, NULL);
-    if (self->receiver.bytes_received == -1) {
-        return -1;
-    }
-    return bytes_sent;
-}
-
-
-// Sets sequence numbers of the whole buffer 
-// and sets acks to 0. 
-void initialize_buffer(RUDP *self)
-{
-    uint8_t seqno = 0;
-    for (uint8_t i = 0; i < BUFFER_SIZE - 1; i++) {
-        self->buffer[i].header.ack = 0;
-        self->buffer[i].header.seqno = seqno;
-        seqno = (seqno + 1) % SEQUENCE_NUMBERS;
-    }
-}
-
-// Used to copy data from all received segments in to the buffer argument.
-void copy_to_buffer(RUDP *self)
-{
-    uint8_t i;
-    for (i = 0; i < self->no_of_segments - 1; i++) {
-        memcpy(self->buffer_arg, self->buffer[i].data, MAX_PAYLOAD_SIZE);
-        self->buffer_arg += MAX_PAYLOAD_SIZE;
-    }
-    memcpy(self->buffer_arg, self->buffer[i].data, self->receiver.bytes_received - i * MAX_PAYLOAD_SIZE);
-}
-
-ssize_t rudp_recvfrom(RUDP *self, void *buffer, size_t length, 
-                        struct sockaddr *src_addr, socklen_t *addrlen)
-{
-    if (self->logs) {
-        printf("------------------------------\n");
-    }
-    // Initialize RUDP_Window and ReceiverThread struct variables.
-    window_init(&self->window, self);
-    rt_init(&self->receiver, self);
-
-    // Setting sequence numbers is required for get_index function 
-    // and setting acks to 0 is required for receive function because
-    // ack 1 indicates that the segment has been received.
-    initialize_buffer(self);
-
-    self->buffer_arg = (char*)buffer;
-    self->buffer_arg_len = length;
-
-    // Start receiver thread.
-    pthread_create(&self->receiver.tid, NULL, receive, (void*)&self->receiver);
-    pthread_join(self->receiver.tid, NULL);
-
-    // If no error occured.
-    if (self->receiver.bytes_received != -1) {
-        self->no_of_segments = self->receiver.bytes_received / MAX_PAYLOAD_SIZE;
-        if (self->receiver.bytes_received % MAX_PAYLOAD_SIZE != 0) {
-            self->no_of_segments++;
-        }
-        copy_to_buffer(self);
-    }
-
-    return self->receiver.bytes_received;
-}
-
-
-
-
-ssize_t SendFileTo(RUDP *rudp, FILE* fp, const struct sockaddr *dest_addr, socklen_t addrlen)
-{
-    char buffer[FILE_BUFFER_SIZE];
-    const char* eof = "EOF";
-    short unsigned int eofLen = strlen(eof);
-    size_t bytesRead;
-    ssize_t bytesSent, totalBytesSent = 0;
-    
-    while (!feof(fp)) {
-        bytesRead = fread(buffer, 1, FILE_BUFFER_SIZE, fp);
-        bytesSent = rudp_sendto(rudp, buffer, bytesRead, dest_addr, addrlen);
-        if (bytesSent == -1) {
-            return -1;
-        }
-        totalBytesSent += bytesSent;
-    }
-    // Sending end-of-file indicator.
-    bytesSent = rudp_sendto(rudp, eof, eofLen, dest_addr, addrlen);
-    if (bytesSent == -1) {
-        return -1;
-    }
-
-    return totalBytesSent;
-}
-
-
-ssize_t ReceiveFileFrom(RUDP *rudp, FILE* fp, struct sockaddr *src_addr, socklen_t *addrlen)
-{
-    char buffer[FILE_BUFFER_SIZE];
-    const char* eof = "EOF";
-    short unsigned int eofLen = strlen(eof);
-    ssize_t bytesReceived, totalBytesReceived = 0;
-
-    // Continue receiving data until an end-of-file indicator is encountered.
-    while (1) {
-        bytesReceived = rudp_recvfrom(rudp, buffer, FILE_BUFFER_SIZE, src_addr, addrlen);
-        if (bytesReceived == -1) {
-            return -1;
-        }
-        // Checking for end-of-file indicator.
-        if (strncmp(buffer, eof, eofLen) == 0) {
-            break;
-        }
-        fwrite(buffer, 1, bytesReceived, fp);
-        totalBytesReceived += bytesReceived;
-    }
-
-    return totalBytesReceived;
-}
-
-
+
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include "rudp.h"
+
+
+// Datagrams are sent and received in batches with sendmmsg and recvmmsg where they exist.
+// Build with -DRUDP_NO_MMSG to use one system call per datagram.
+#if defined(__linux__) && !defined(RUDP_NO_MMSG)
+#define HAVE_MMSG
+#endif
+
+#ifndef __linux__
+struct mmsghdr
+{
+    struct msghdr msg_hdr;
+    unsigned int msg_len;
+};
+#endif
+
+// Segmentation offload options of Linux 4.18 and 5.0, for C libraries which do not define them.
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define BATCH_SIZE 64   // Max datagrams sent or received with one system call.
+
+// Datagrams waiting to be sent. Data is not copied, it must stay in place until the batch is flushed.
+// With UDP_SEGMENT datagrams of the same size to the same peer are joined in one message,
+// which the kernel splits into datagrams of gso_size bytes. Only the last may be shorter.
+typedef struct SendBatch
+{
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iov[BATCH_SIZE][2];        // Header and data of each datagram, in the order of the messages.
+    char headers[BATCH_SIZE][sizeof(RUDP_Header_v2) + RUDP_CHECKSUM_SIZE];
+    char control[BATCH_SIZE][CMSG_SPACE(sizeof(uint16_t))];
+    uint16_t gso_size[BATCH_SIZE];          // Size of the datagrams of each message.
+    uint32_t msg_bytes[BATCH_SIZE];
+    unsigned int msg_datagrams[BATCH_SIZE];
+    unsigned int count;                     // Number of messages.
+    unsigned int datagrams;
+} SendBatch;
+
+// Datagrams received with one system call. With UDP_GRO a buffer may hold datagrams
+// of one peer joined by the kernel, all of them gro_size bytes but the last.
+typedef struct RecvBatch
+{
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iov[BATCH_SIZE];
+    struct sockaddr_in addrs[BATCH_SIZE];
+    char control[BATCH_SIZE][CMSG_SPACE(sizeof(int))];
+    uint32_t gro_size[BATCH_SIZE];
+    char *buffers;          // BATCH_SIZE buffers of buffer_size bytes.
+    size_t buffer_size;
+} RecvBatch;
+
+// Data of segments written to a file with one system call. Data is not copied,
+// it must stay in place until the batch is flushed.
+typedef struct WriteBatch
+{
+    RUDP *rudp;             // Connection whose file is written.
+    off_t offset;           // Offset in the file of the first byte.
+    size_t length;
+    struct iovec iov[BATCH_SIZE];
+    int count;
+} WriteBatch;
+
+// Rest of a regular file mapped into memory, segments point into it so that
+// file data is not copied before the kernel copies it into datagrams.
+typedef struct FileMap
+{
+    void *map;              // Start of the mapping, on a page boundary.
+    size_t map_length;
+    const char *data;       // Data from the position of the file.
+    size_t length;
+    long position;          // Position of the file when it was mapped.
+} FileMap;
+
+// Copy of a file which is received as a delta, taken before the file is written.
+typedef struct DeltaBasis
+{
+    int fd;                 // Unnamed file of the copy, -1 if there is none.
+    const uint8_t *map;     // Mapping of the copy, NULL if it is empty.
+    uint64_t length;
+} DeltaBasis;
+
+// Range of a file, which a stream sends.
+typedef struct FileRange
+{
+    uint64_t offset;
+    uint64_t length;
+} FileRange;
+
+// Message which a file header may follow, taken by a data function so that a resume request
+// is answered before it is acked.
+typedef struct FileMessage
+{
+    char *data;             // RUDP_RESUME_MAX bytes.
+    size_t length;
+    const char *path;       // Path of the file which is received, NULL if it is not a regular file.
+    off_t base;             // Offset in the file of the data.
+    Manifest *manifest;     // Manifest of the file, opened when a resume request is answered.
+    bool resumed;
+} FileMessage;
+
+struct StreamGroup;
+
+// Range of a mapped file sent over a stream in a thread of its own.
+typedef struct FileStream
+{
+    struct StreamGroup *group;
+    RUDP *rudp;             // RUDP of the caller for the first stream, otherwise own.
+    RUDP own;
+    RUDP_FileHeader header;
+    const char *data;       // Data of the range in the mapping.
+    pthread_t tid;
+    ssize_t bytes_sent;
+    uint64_t start_time;
+    uint64_t end_time;
+    uint64_t acked_before;  // Bytes acked in the session before the range.
+    bool sending;           // Set when the range is being sent.
+    bool done;
+} FileStream;
+
+// Streams of one file. The other streams send their headers once the peer has the header
+// of the first stream, so the transfer they join is known to the peer.
+typedef struct StreamGroup
+{
+    FileStream streams[MAX_STREAMS];
+    int count;
+    const struct sockaddr *dest_addr;
+    socklen_t addrlen;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // Signaled when the first header is acked or a stream is done.
+    int registered;             // 1 when the first header is acked, -1 if it failed, 0 before.
+    int finished;               // Number of streams which are done.
+} StreamGroup;
+
+
+
+// ==================== Timer Functions ====================
+
+// Returns time of the monotonic clock in microseconds.
+uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void start_timer(Timer *self, uint64_t rto)
+{
+    self->active = true;
+    self->retransmissions = 0;
+    self->sent_time = now_us();
+    self->first_sent_time = self->sent_time;
+    self->expiry_time = self->sent_time + rto;
+}
+
+void restart_timer(Timer *self, uint64_t rto)
+{
+    self->retransmissions++;
+    self->sent_time = now_us();
+    self->expiry_time = self->sent_time + rto;
+}
+
+void stop_timer(Timer *self)
+{
+    self->active = false;
+}
+
+
+
+// ==================== TimerHeap Functions ====================
+
+void heap_init(TimerHeap *self)
+{
+    self->entries = NULL;
+    self->size = 0;
+    self->capacity = 0;
+}
+
+void heap_free(TimerHeap *self)
+{
+    free(self->entries);
+    heap_init(self);
+}
+
+// On success 0 is returned. On error -1 is returned.
+int heap_push(TimerHeap *self, uint64_t expiry_time, uint32_t index)
+{
+    TimerEntry *entries;
+    uint32_t i, parent;
+
+    if (self->size == self->capacity) {
+        entries = realloc(self->entries, (self->capacity ? 2 * self->capacity : 64) * sizeof(TimerEntry));
+        if (entries == NULL) {
+            return -1;
+        }
+        self->entries = entries;
+        self->capacity = self->capacity ? 2 * self->capacity : 64;
+    }
+    // Move the new entry up while it expires before its parent.
+    i = self->size++;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (self->entries[parent].expiry_time <= expiry_time) {
+            break;
+        }
+        self->entries[i] = self->entries[parent];
+        i = parent;
+    }
+    self->entries[i].expiry_time = expiry_time;
+    self->entries[i].index = index;
+    return 0;
+}
+
+// Entry which expires first. Heap must not be empty.
+TimerEntry *heap_top(TimerHeap *self)
+{
+    return &self->entries[0];
+}
+
+void heap_pop(TimerHeap *self)
+{
+    TimerEntry last = self->entries[--self->size];
+    uint32_t i = 0, child;
+
+    // Move the last entry down from the top while a child expires before it.
+    while ((child = 2 * i + 1) < self->size) {
+        if (child + 1 < self->size && self->entries[child + 1].expiry_time < self->entries[child].expiry_time) {
+            child++;
+        }
+        if (last.expiry_time <= self->entries[child].expiry_time) {
+            break;
+        }
+        self->entries[i] = self->entries[child];
+        i = child;
+    }
+    self->entries[i] = last;
+}
+
+
+
+// ==================== RTTEstimator Functions ====================
+
+void rtt_init(RTTEstimator *self)
+{
+    self->srtt = 0;
+    self->rttvar = 0;
+    self->rto = INITIAL_RTO;
+    self->has_sample = false;
+}
+
+// Sets the timeout from the estimate, undoing the backoff of earlier timeouts.
+// It is called when an ack of new data shows that the peer is reachable again,
+// acks of resent segments give no samples and would leave the timeout backed off.
+void rtt_reset_backoff(RTTEstimator *self)
+{
+    uint64_t variation;
+
+    if (!self->has_sample) {
+        self->rto = INITIAL_RTO;
+        return;
+    }
+    // The variation term is at least the granularity G of RFC 6298, which covers timers fired late
+    // and an ack delayed by the peer, as a steady RTT drives the variation to zero.
+    // The peer's ack delay is then added as in RFC 9002, samples of the acks not delayed miss it.
+    variation = 4 * self->rttvar;
+    if (variation < RTO_GRANULARITY + ACK_DELAY) {
+        variation = RTO_GRANULARITY + ACK_DELAY;
+    }
+    self->rto = self->srtt + variation + ACK_DELAY;
+    if (self->rto < MIN_RTO) {
+        self->rto = MIN_RTO;
+    }
+    if (self->rto > MAX_RTO) {
+        self->rto = MAX_RTO;
+    }
+}
+
+// Updates the estimate with a round trip time sample as in RFC 6298.
+void rtt_sample(RTTEstimator *self, uint64_t rtt)
+{
+    uint64_t deviation;
+
+    if (!self->has_sample) {
+        self->srtt = rtt;
+        self->rttvar = rtt / 2;
+        self->has_sample = true;
+    }
+    else {
+        deviation = self->srtt > rtt ? self->srtt - rtt : rtt - self->srtt;
+        self->rttvar = (3 * self->rttvar + deviation) / 4;
+        self->srtt = (7 * self->srtt + rtt) / 8;
+    }
+    rtt_reset_backoff(self);
+}
+
+// Doubles the retransmission timeout after a timeout.
+void rtt_backoff(RTTEstimator *self)
+{
+    self->rto *= 2;
+    if (self->rto > MAX_RTO) {
+        self->rto = MAX_RTO;
+    }
+}
+
+// Returns the retransmission timeout to use with the peer.
+uint64_t get_rto(struct RUDP *rudp)
+{
+    return rudp->peer_version == RUDP_VERSION_1 ? LEGACY_RTO : rudp->rtt.rto;
+}
+
+
+
+// ==================== Stats Functions ====================
+
+// Counters are only added to, so no order with other memory is needed.
+void stat_add(atomic_uint_least64_t *counter, uint64_t n)
+{
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+void stat_sub(atomic_uint_least64_t *counter, uint64_t n)
+{
+    atomic_fetch_sub_explicit(counter, n, memory_order_relaxed);
+}
+
+uint64_t stat_get(atomic_uint_least64_t *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Counts time in the bucket of its highest bit.
+void stat_record(atomic_uint_least64_t *histogram, uint64_t time)
+{
+    int bucket = time < 2 ? 0 : 63 - __builtin_clzll(time);
+
+    if (bucket >= RUDP_HISTOGRAM_BUCKETS) {
+        bucket = RUDP_HISTOGRAM_BUCKETS - 1;
+    }
+    stat_add(&histogram[bucket], 1);
+}
+
+// Adds the counters of a session which has ended, a stream or a connection, to another.
+void stats_merge(RUDP *self, RUDP *from)
+{
+    stat_add(&self->loss_stats.segments_resent, stat_get(&from->loss_stats.segments_resent));
+    stat_add(&self->loss_stats.parity_sent, stat_get(&from->loss_stats.parity_sent));
+    stat_add(&self->loss_stats.parity_received, stat_get(&from->loss_stats.parity_received));
+    stat_add(&self->loss_stats.segments_rebuilt, stat_get(&from->loss_stats.segments_rebuilt));
+    stat_add(&self->batch_stats.send_calls, stat_get(&from->batch_stats.send_calls));
+    stat_add(&self->batch_stats.datagrams_sent, stat_get(&from->batch_stats.datagrams_sent));
+    stat_add(&self->batch_stats.recv_calls, stat_get(&from->batch_stats.recv_calls));
+    stat_add(&self->batch_stats.datagrams_received, stat_get(&from->batch_stats.datagrams_received));
+    stat_add(&self->stats.segments_sent, stat_get(&from->stats.segments_sent));
+    stat_add(&self->stats.timeouts, stat_get(&from->stats.timeouts));
+    stat_add(&self->stats.fast_retransmits, stat_get(&from->stats.fast_retransmits));
+    stat_add(&self->stats.acks_received, stat_get(&from->stats.acks_received));
+    stat_add(&self->stats.segments_received, stat_get(&from->stats.segments_received));
+    stat_add(&self->stats.segments_duplicate, stat_get(&from->stats.segments_duplicate));
+    stat_add(&self->stats.datagrams_corrupt, stat_get(&from->stats.datagrams_corrupt));
+    stat_add(&self->stats.acks_sent, stat_get(&from->stats.acks_sent));
+    stat_add(&self->stats.bytes_acked, stat_get(&from->stats.bytes_acked));
+    stat_add(&self->stats.compress_input, stat_get(&from->stats.compress_input));
+    stat_add(&self->stats.compress_output, stat_get(&from->stats.compress_output));
+    stat_add(&self->stats.compress_raw_blocks, stat_get(&from->stats.compress_raw_blocks));
+    stat_add(&self->stats.delta_matched, stat_get(&from->stats.delta_matched));
+    stat_add(&self->stats.delta_literal, stat_get(&from->stats.delta_literal));
+    stat_add(&self->stats.resumed, stat_get(&from->stats.resumed));
+    if (stat_get(&from->stats.memory_peak) > stat_get(&self->stats.memory_peak)) {
+        atomic_store_explicit(&self->stats.memory_peak, stat_get(&from->stats.memory_peak), memory_order_relaxed);
+    }
+    for (int i = 0; i < RUDP_HISTOGRAM_BUCKETS; i++) {
+        stat_add(&self->stats.rtt[i], stat_get(&from->stats.rtt[i]));
+        stat_add(&self->stats.delivery[i], stat_get(&from->stats.delivery[i]));
+    }
+}
+
+
+
+// ==================== RUDP_Segment Functions ====================
+
+// Makes a segment whose data is not copied, it must stay in place until the segment is acked.
+void make_segment_ref(RUDP_Segment *self, const char *data, uint16_t data_length, uint32_t seqno)
+{
+    self->header.ack = 0;
+    self->header.last = 0;
+    self->header.hello = 0;
+    self->header.sack = 0;
+    self->header.ack_now = 0;
+    self->header.probe = 0;
+    self->header.parity = 0;
+    self->header.reply = 0;
+    self->header.window = 0;
+    self->header.seqno = seqno;
+    self->header.conn_id = 0;
+    self->length = data_length;
+    self->payload = data;
+}
+
+// Makes a segment with a copy of data, which may already have been read in place.
+void make_segment(RUDP_Segment *self, char *data, uint16_t data_length, uint32_t seqno)
+{
+    if (data != self->data) {
+        memcpy(self->data, data, data_length);
+    }
+    make_segment_ref(self, self->data, data_length, seqno);
+}
+
+void make_ack_segment(RUDP_Segment *self, uint32_t seqno)
+{
+    self->header.ack = 1;
+    self->header.last = 0;
+    self->header.hello = 0;
+    self->header.sack = 0;
+    self->header.ack_now = 0;
+    self->header.probe = 0;
+    self->header.parity = 0;
+    self->header.reply = 0;
+    self->header.window = 0;
+    self->header.seqno = seqno;
+    self->header.conn_id = 0;
+    self->length = 0;
+}
+
+// Packs header into the wire format of version.
+// Returns the number of header bytes written to packed.
+size_t pack_header(const RUDP_Header *header, uint8_t version, char *packed)
+{
+    if (version == RUDP_VERSION_1) {
+        RUDP_Header_v1 v1;
+        v1.seqno = header->seqno % SEQUENCE_NUMBERS;
+        v1.ack = header->ack;
+        v1.last = header->last;
+        memcpy(packed, &v1, sizeof(v1));
+        return sizeof(v1);
+    }
+    RUDP_Header_v2 v2;
+    v2.version = RUDP_V2_MARK | RUDP_VERSION_2;
+    v2.flags = (header->ack ? RUDP_FLAG_ACK : 0)
+                | (header->last ? RUDP_FLAG_LAST : 0)
+                | (header->hello ? RUDP_FLAG_HELLO : 0)
+                | (header->sack ? RUDP_FLAG_SACK : 0)
+                | (header->ack_now ? RUDP_FLAG_ACK_NOW : 0)
+                | (header->probe ? RUDP_FLAG_PROBE : 0)
+                | (header->parity ? RUDP_FLAG_PARITY : 0)
+                | (header->reply ? RUDP_FLAG_REPLY : 0);
+    v2.window = htons(header->window);
+    v2.seqno = htonl(header->seqno);
+    v2.conn_id = htonl(header->conn_id);
+    memcpy(packed, &v2, sizeof(v2));
+    return sizeof(v2);
+}
+
+// Returns true if the checksum after the header of a version 2 datagram matches it.
+bool checksum_matches(const char *datagram, ssize_t bytes)
+{
+    uint32_t expected, crc;
+
+    if (bytes < (ssize_t)(sizeof(RUDP_Header_v2) + RUDP_CHECKSUM_SIZE)) {
+        return false;
+    }
+    memcpy(&expected, datagram + sizeof(RUDP_Header_v2), sizeof(expected));
+    crc = crc32c(0, datagram, sizeof(RUDP_Header_v2));
+    crc = crc32c(crc, datagram + sizeof(RUDP_Header_v2) + RUDP_CHECKSUM_SIZE,
+                    bytes - sizeof(RUDP_Header_v2) - RUDP_CHECKSUM_SIZE);
+    return crc == ntohl(expected);
+}
+
+// Unpacks the header of a received datagram of either version.
+// A version 2 datagram is recognized by its first byte and length, version 1 acks are 1 byte long
+// and version 1 data segments never have the ack bit set.
+// Returns the number of header bytes, with the checksum, and sets version. Returns -1 if the
+// datagram is empty or its checksum does not match.
+ssize_t unpack_header(RUDP_Header *header, const char *datagram, ssize_t bytes, uint8_t *version)
+{
+    if (bytes >= (ssize_t)sizeof(RUDP_Header_v2)
+        && (uint8_t)datagram[0] == (RUDP_V2_MARK | RUDP_VERSION_2))
+    {
+        RUDP_Header_v2 v2;
+        memcpy(&v2, datagram, sizeof(v2));
+        if ((v2.flags & RUDP_FLAG_CHECKSUM) && !checksum_matches(datagram, bytes)) {
+            return -1;
+        }
+        header->seqno = ntohl(v2.seqno);
+        header->conn_id = ntohl(v2.conn_id);
+        header->window = ntohs(v2.window);
+        header->ack = (v2.flags & RUDP_FLAG_ACK) != 0;
+        header->last = (v2.flags & RUDP_FLAG_LAST) != 0;
+        header->hello = (v2.flags & RUDP_FLAG_HELLO) != 0;
+        header->sack = (v2.flags & RUDP_FLAG_SACK) != 0;
+        header->ack_now = (v2.flags & RUDP_FLAG_ACK_NOW) != 0;
+        header->probe = (v2.flags & RUDP_FLAG_PROBE) != 0;
+        // The same flag means a parity segment or an ack with a reply.
+        header->parity = !header->ack && (v2.flags & RUDP_FLAG_PARITY) != 0;
+        header->reply = header->ack && (v2.flags & RUDP_FLAG_REPLY) != 0;
+        *version = RUDP_VERSION_2;
+        return v2.flags & RUDP_FLAG_CHECKSUM ? sizeof(v2) + RUDP_CHECKSUM_SIZE : sizeof(v2);
+    }
+    if (bytes >= (ssize_t)sizeof(RUDP_Header_v1)) {
+        RUDP_Header_v1 v1;
+        memcpy(&v1, datagram, sizeof(v1));
+        header->seqno = v1.seqno;
+        header->conn_id = 0;
+        header->window = 0;
+        header->ack = v1.ack;
+        header->last = v1.last;
+        header->hello = 0;
+        header->sack = 0;
+        header->ack_now = 0;
+        header->probe = 0;
+        header->parity = 0;
+        header->reply = 0;
+        *version = RUDP_VERSION_1;
+        return sizeof(v1);
+    }
+    return -1;
+}
+
+// Sends the header packed in version followed by length bytes of data.
+ssize_t send_packet(int sockfd, const RUDP_Header *header, uint8_t version, const char *data, uint16_t length,
+                        const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    char packed[sizeof(RUDP_Header_v2)];
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    iov[0].iov_base = packed;
+    iov[0].iov_len = pack_header(header, version, packed);
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = length;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void*)dest_addr;
+    msg.msg_namelen = addrlen;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    return sendmsg(sockfd, &msg, 0);
+}
+
+
+
+// ==================== Batch Functions ====================
+
+void send_batch_init(SendBatch *self)
+{
+    self->count = 0;
+    self->datagrams = 0;
+}
+
+// Sends up to count datagrams with one system call.
+// Returns the number of datagrams sent. On error -1 is returned.
+int send_datagrams(RUDP *rudp, struct mmsghdr *msgs, unsigned int count)
+{
+#ifdef HAVE_MMSG
+    if (rudp->batching) {
+        int sent = sendmmsg(rudp->sockfd, msgs, count, 0);
+        if (sent != -1 || errno != ENOSYS) {
+            return sent;
+        }
+        // Kernel has no sendmmsg, one datagram is sent per call from now on.
+        rudp->batching = false;
+    }
+#endif
+    return sendmsg(rudp->sockfd, &msgs->msg_hdr, 0) == -1 ? -1 : 1;
+}
+
+// Sends all datagrams of the batch and empties it.
+// On success 0 is returned. On error -1 is returned, datagrams which were not sent are dropped.
+int send_batch_flush(RUDP *rudp, SendBatch *self)
+{
+    unsigned int done = 0;
+    int sent, result = 0;
+
+    while (done < self->count) {
+        sent = send_datagrams(rudp, &self->msgs[done], self->count - done);
+        if (sent == -1) {
+            // Device cannot split the buffer, datagrams are sent separately from now on.
+            // Those of the batch are lost and resent when their timers expire.
+            if (rudp->gso && errno == EIO) {
+                rudp->gso = false;
+            }
+            else {
+                result = -1;
+            }
+            break;
+        }
+        stat_add(&rudp->batch_stats.send_calls, 1);
+        for (int i = 0; i < sent; i++) {
+            stat_add(&rudp->batch_stats.datagrams_sent, self->msg_datagrams[done + i]);
+        }
+        done += sent;
+    }
+    self->count = 0;
+    self->datagrams = 0;
+    return result;
+}
+
+// Returns true if a datagram of size bytes to dest_addr can be joined to the last message
+// of the batch. Datagrams are joined while they are all full, up to the size of a UDP datagram.
+bool can_join(SendBatch *self, size_t size, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    unsigned int i = self->count - 1;
+    struct msghdr *msg = &self->msgs[i].msg_hdr;
+
+    return self->msg_bytes[i] == (uint32_t)self->gso_size[i] * self->msg_datagrams[i]
+        && size <= self->gso_size[i] && self->msg_datagrams[i] < GSO_MAX_SEGMENTS
+        && self->msg_bytes[i] + size <= sizeof(RUDP_Header_v2) + MAX_SEGMENT_SIZE
+        && msg->msg_namelen == addrlen && memcmp(msg->msg_name, dest_addr, addrlen) == 0;
+}
+
+// Returns true if the datagrams sent to the peer of rudp after the hello carry a checksum.
+bool sends_checksums(RUDP *rudp)
+{
+    return rudp->checksums && rudp->peer_version == RUDP_VERSION_2 && (rudp->peer_features & RUDP_FEATURE_CHECKSUM);
+}
+
+// Adds the header packed in version followed by length bytes of data to the batch.
+// A full batch is flushed first.
+// On success 0 is returned. On error -1 is returned.
+int send_batch_add(RUDP *rudp, SendBatch *self, const RUDP_Header *header, uint8_t version,
+                    const char *data, uint16_t length, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    struct msghdr *msg;
+    struct cmsghdr *cmsg;
+    struct iovec *iov;
+    char *packed;
+    uint32_t crc;
+    size_t size;
+    unsigned int i;
+    int result = 0;
+
+    if (self->datagrams == BATCH_SIZE) {
+        result = send_batch_flush(rudp, self);
+    }
+    iov = self->iov[self->datagrams];
+    packed = self->headers[self->datagrams];
+    iov[0].iov_base = packed;
+    iov[0].iov_len = pack_header(header, version, packed);
+    if (version == RUDP_VERSION_2 && !header->hello && !header->probe && sends_checksums(rudp)) {
+        packed[1] |= RUDP_FLAG_CHECKSUM;
+        crc = crc32c(crc32c(0, packed, iov[0].iov_len), data, length);
+        crc = htonl(crc);
+        memcpy(packed + iov[0].iov_len, &crc, sizeof(crc));
+        iov[0].iov_len += RUDP_CHECKSUM_SIZE;
+    }
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len = length;
+    size = iov[0].iov_len + length;
+    self->datagrams++;
+
+    if (rudp->gso && self->count > 0 && can_join(self, size, dest_addr, addrlen)) {
+        i = self->count - 1;
+        msg = &self->msgs[i].msg_hdr;
+        msg->msg_iovlen += 2;
+        self->msg_bytes[i] += size;
+        // Kernel is told the size to split the message at once it holds more than one datagram.
+        if (++self->msg_datagrams[i] == 2) {
+            msg->msg_control = self->control[i];
+            msg->msg_controllen = sizeof(self->control[i]);
+            cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            memcpy(CMSG_DATA(cmsg), &self->gso_size[i], sizeof(uint16_t));
+        }
+        return result;
+    }
+
+    i = self->count;
+    msg = &self->msgs[i].msg_hdr;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = (void*)dest_addr;
+    msg->msg_namelen = addrlen;
+    msg->msg_iov = iov;
+    msg->msg_iovlen = 2;
+    self->gso_size[i] = size;
+    self->msg_bytes[i] = size;
+    self->msg_datagrams[i] = 1;
+    self->count++;
+    return result;
+}
+
+// Returns the buffer of the datagrams received in message i.
+char* recv_batch_buffer(RecvBatch *self, int i)
+{
+    return self->buffers + i * self->buffer_size;
+}
+
+// Allocates buffers for the largest datagrams of rudp, or for datagrams joined by the kernel.
+// On success 0 is returned. On error -1 is returned.
+int recv_batch_init(RecvBatch *self, RUDP *rudp)
+{
+    self->buffer_size = rudp->gro ? GRO_BUFFER_SIZE : sizeof(RUDP_Header_v2) + rudp->segment_size;
+    self->buffers = malloc(BATCH_SIZE * self->buffer_size);
+    if (self->buffers == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        self->iov[i].iov_base = recv_batch_buffer(self, i);
+        self->iov[i].iov_len = self->buffer_size;
+        memset(&self->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        self->msgs[i].msg_hdr.msg_name = &self->addrs[i];
+        self->msgs[i].msg_hdr.msg_iov = &self->iov[i];
+        self->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    return 0;
+}
+
+void recv_batch_free(RecvBatch *self)
+{
+    free(self->buffers);
+    self->buffers = NULL;
+}
+
+// Sets the size of the datagrams in each message from the UDP_GRO control message
+// of the kernel. A message without one holds a single datagram.
+// Returns the number of datagrams in the first count messages.
+int split_joined(RUDP *rudp, RecvBatch *self, int count)
+{
+    struct cmsghdr *cmsg;
+    int datagrams = 0, size;
+
+    for (int i = 0; i < count; i++) {
+        self->gro_size[i] = self->msgs[i].msg_len;
+        if (rudp->gro) {
+            for (cmsg = CMSG_FIRSTHDR(&self->msgs[i].msg_hdr); cmsg != NULL;
+                    cmsg = CMSG_NXTHDR(&self->msgs[i].msg_hdr, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+                    memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+                    if (size > 0) {
+                        self->gro_size[i] = size;
+                    }
+                }
+            }
+        }
+        datagrams += self->gro_size[i] == 0 ? 1 : (self->msgs[i].msg_len + self->gro_size[i] - 1) / self->gro_size[i];
+    }
+    return datagrams;
+}
+
+// Waits for at least one datagram and receives all datagrams which are queued, up to BATCH_SIZE.
+// Returns the number of datagrams received. On error -1 is returned.
+int recv_batch(RUDP *rudp, RecvBatch *self)
+{
+    ssize_t bytes;
+    int received;
+
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        self->msgs[i].msg_hdr.msg_namelen = sizeof(self->addrs[i]);
+        self->msgs[i].msg_hdr.msg_control = rudp->gro ? self->control[i] : NULL;
+        self->msgs[i].msg_hdr.msg_controllen = rudp->gro ? sizeof(self->control[i]) : 0;
+    }
+#ifdef HAVE_MMSG
+    if (rudp->recv_batching) {
+        received = recvmmsg(rudp->sockfd, self->msgs, BATCH_SIZE, MSG_WAITFORONE, NULL);
+        if (received != -1 || errno != ENOSYS) {
+            if (received > 0) {
+                stat_add(&rudp->batch_stats.recv_calls, 1);
+                stat_add(&rudp->batch_stats.datagrams_received, split_joined(rudp, self, received));
+            }
+            return received;
+        }
+        // Kernel has no recvmmsg, one datagram is received per call from now on.
+        rudp->recv_batching = false;
+    }
+#endif
+    bytes = recvmsg(rudp->sockfd, &self->msgs[0].msg_hdr, 0);
+    if (bytes == -1) {
+        return -1;
+    }
+    self->msgs[0].msg_len = bytes;
+    received = 1;
+    stat_add(&rudp->batch_stats.recv_calls, 1);
+    stat_add(&rudp->batch_stats.datagrams_received, split_joined(rudp, self, received));
+    return received;
+}
+
+
+
+// ==================== File Functions ====================
+
+// Sets the file which the next message is written to from offset.
+void set_file(RUDP *self, int fd, off_t offset)
+{
+    self->file_fd = fd;
+    self->file_offset = offset;
+    self->file_allocated = offset;
+}
+
+void write_batch_init(WriteBatch *self)
+{
+    self->rudp = NULL;
+    self->length = 0;
+    self->count = 0;
+}
+
+// Gives up writing a message to the file after an error. A connection of a listener
+// is closed, otherwise the function call which receives the file fails.
+void file_failed(RUDP *self)
+{
+    self->file_fd = -1;
+    self->manifest = NULL;
+    if (self->on_data != NULL) {
+        self->closed = true;
+    }
+    else {
+        self->receiver.bytes_received = -1;
+        self->receiver.done = true;
+    }
+}
+
+// Writes the data of the batch to the file of its connection with one system call.
+void write_batch_flush(WriteBatch *self)
+{
+    if (self->count == 0) {
+        return;
+    }
+    // Connection may have given up the file since the data was added.
+    if (self->rudp->file_fd != -1
+        && pwritev(self->rudp->file_fd, self->iov, self->count, self->offset) != (ssize_t)self->length)
+    {
+        file_failed(self->rudp);
+    }
+    self->count = 0;
+    self->length = 0;
+}
+
+// Allocates space for the file up to FILE_PREALLOCATE bytes past end, so that segments
+// out of order do not fragment it and a full disk is found early. The size of the file
+// is not changed. File systems without fallocate are written without it, other errors
+// are retried with the next segment.
+void allocate_file(RUDP *self, off_t end)
+{
+    if (end <= self->file_allocated) {
+        return;
+    }
+    if (fallocate(self->file_fd, FALLOC_FL_KEEP_SIZE, self->file_allocated,
+                    end + FILE_PREALLOCATE - self->file_allocated) == -1)
+    {
+        if (errno == ENOSPC || errno == EFBIG) {
+            file_failed(self);
+            return;
+        }
+        if (errno != EOPNOTSUPP && errno != ENOSYS) {
+            return;
+        }
+    }
+    self->file_allocated = end + FILE_PREALLOCATE;
+}
+
+// Returns the offset in the file of the segment with index.
+off_t file_position(RUDP *self, uint32_t index)
+{
+    return self->file_offset + (off_t)(index - self->window.message_start) * self->window.message_segment_size;
+}
+
+// Adds the data of the segment with index to the batch. Data which continues the
+// data of the batch in the same file is written with it.
+void write_segment(RUDP *self, WriteBatch *writes, uint32_t index, const char *data, uint16_t length)
+{
+    off_t offset = file_position(self, index);
+
+    allocate_file(self, offset + length);
+    if (self->file_fd == -1) {
+        return;
+    }
+    if (writes->count == BATCH_SIZE || (writes->count > 0
+        && (writes->rudp != self || writes->offset + (off_t)writes->length != offset)))
+    {
+        write_batch_flush(writes);
+    }
+    if (writes->count == 0) {
+        writes->rudp = self;
+        writes->offset = offset;
+    }
+    writes->iov[writes->count].iov_base = (void*)data;
+    writes->iov[writes->count].iov_len = length;
+    writes->count++;
+    writes->length += length;
+}
+
+// Ends a message written to the file at end. The space allocated past the end is freed,
+// unless the file goes on after the message, and on_data is told that the message is complete.
+void finish_file(RUDP *self, off_t end)
+{
+    struct stat st;
+
+    // Data past the message, as other ranges of the file, is kept.
+    if ((fstat(self->file_fd, &st) == -1 || st.st_size <= end) && ftruncate(self->file_fd, end) == -1) {
+        file_failed(self);
+        return;
+    }
+    self->file_fd = -1;
+    self->manifest = NULL;
+    if (self->on_data != NULL && !self->closed) {
+        self->on_data(self, NULL, end - self->file_offset, true);
+    }
+}
+
+// Marks the blocks of the manifest which the data from start to end of the file ends. Blocks
+// are only marked once their data has been written, so a manifest left by a process which
+// stops never has a block which is not in the file.
+void mark_manifest(RUDP *self, off_t start, off_t end, WriteBatch *writes)
+{
+    if (self->manifest == NULL || !manifest_completes(self->manifest, start, end)) {
+        return;
+    }
+    if (writes != NULL) {
+        write_batch_flush(writes);
+    }
+    if (self->file_fd != -1) {
+        manifest_mark(self->manifest, self->file_offset, start, end);
+    }
+}
+
+// Finishes an in order segment of a message which goes to the file. Segments which arrived
+// before the file was set are still in the buffer and are written now.
+void deliver_to_file(RUDP *self, RUDP_Segment *segment, WriteBatch *writes)
+{
+    off_t offset = file_position(self, segment->header.seqno);
+
+    if (segment->payload != NULL
+        && pwrite(self->file_fd, segment->payload, segment->length, offset) != segment->length)
+    {
+        file_failed(self);
+        return;
+    }
+    self->receiver.bytes_received += segment->length;
+    mark_manifest(self, offset, offset + segment->length, writes);
+    if (!segment->header.last) {
+        return;
+    }
+    write_batch_flush(writes);
+    if (self->file_fd != -1) {
+        finish_file(self, offset + segment->length);
+    }
+}
+
+
+
+// ==================== Event Functions ====================
+
+// The sender sleeps in epoll until the receiver thread writes to the eventfd, because it
+// queued acks, or until the timerfd expires at the time of the first retransmission timer.
+// The receiver thread sleeps in ppoll until acks arrive or the sender writes to the stopfd.
+// On success 0 is returned. On error -1 is returned.
+int events_init(RUDP *self)
+{
+    struct epoll_event event;
+
+    self->epfd = epoll_create1(EPOLL_CLOEXEC);
+    self->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    self->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    self->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    self->timer_armed = 0;
+    if (self->epfd == -1 || self->eventfd == -1 || self->stopfd == -1 || self->timerfd == -1) {
+        return -1;
+    }
+    event.events = EPOLLIN;
+    event.data.fd = self->eventfd;
+    if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, self->eventfd, &event) == -1) {
+        return -1;
+    }
+    event.data.fd = self->timerfd;
+    return epoll_ctl(self->epfd, EPOLL_CTL_ADD, self->timerfd, &event);
+}
+
+void events_free(RUDP *self)
+{
+    if (self->epfd != -1) {
+        close(self->epfd);
+    }
+    if (self->eventfd != -1) {
+        close(self->eventfd);
+    }
+    if (self->stopfd != -1) {
+        close(self->stopfd);
+    }
+    if (self->timerfd != -1) {
+        close(self->timerfd);
+    }
+    self->epfd = self->eventfd = self->stopfd = self->timerfd = -1;
+}
+
+// Used by the receiver thread to wake the sender.
+void wake_sender(RUDP *self)
+{
+    uint64_t one = 1;
+    write(self->eventfd, &one, sizeof(one));
+}
+
+// Waits until the sender is woken or the time expiry_time, 0 if no timer is running, is reached.
+// On success 0 is returned. On error -1 is returned.
+int wait_events(RUDP *self, uint64_t expiry_time)
+{
+    struct epoll_event events[2];
+    struct itimerspec spec;
+    uint64_t value;
+    int count, i;
+
+    // The timerfd is set again only when the first timer changes.
+    if (expiry_time != self->timer_armed) {
+        memset(&spec, 0, sizeof(spec));
+        spec.it_value.tv_sec = expiry_time / 1000000;
+        spec.it_value.tv_nsec = expiry_time % 1000000 * 1000;
+        if (timerfd_settime(self->timerfd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+            return -1;
+        }
+        self->timer_armed = expiry_time;
+    }
+
+    count = epoll_wait(self->epfd, events, 2, -1);
+    if (count == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (i = 0; i < count; i++) {
+        read(events[i].data.fd, &value, sizeof(value));
+        if (events[i].data.fd == self->timerfd) {
+            self->timer_armed = 0;
+        }
+    }
+    return 0;
+}
+
+
+
+// ==================== Async Functions ====================
+
+// Wakes the caller of async transfers.
+void async_notify(AsyncWorker *self)
+{
+    uint64_t one = 1;
+    write(self->eventfd, &one, sizeof(one));
+}
+
+// Counts bytes acked or delivered of an async transfer, the caller is woken each time
+// another ASYNC_PROGRESS_BYTES have been.
+void async_progress(RUDP *self, size_t bytes)
+{
+    AsyncWorker *worker = self->async;
+    uint64_t before;
+
+    if (worker == NULL) {
+        return;
+    }
+    before = atomic_fetch_add_explicit(&worker->progress, bytes, memory_order_relaxed);
+    if ((before + bytes) / ASYNC_PROGRESS_BYTES != before / ASYNC_PROGRESS_BYTES) {
+        async_notify(worker);
+    }
+}
+
+void free_requests(AsyncRequest *request)
+{
+    AsyncRequest *next;
+
+    for (; request != NULL; request = next) {
+        next = request->next;
+        free(request);
+    }
+}
+
+// Stops the thread of async transfers and drops the transfers not yet taken. A running transfer
+// is ended as its receiver thread ends it on an error: a sender is woken through the stopfd,
+// also while it negotiates the version, and a receiver blocked in the socket by shutting its
+// reading down. Each of them stays set, and the thread starts no transfer once it is stopped,
+// so this is done once under the lock.
+void async_stop(RUDP *self)
+{
+    AsyncWorker *worker = self->async;
+    uint64_t value = 1;
+
+    if (worker == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&worker->lock);
+    worker->stop = true;
+    pthread_cond_broadcast(&worker->changed);
+    if (worker->running != NULL) {
+        atomic_store_explicit(&self->receiver.stop, true, memory_order_relaxed);
+        write(self->stopfd, &value, sizeof(value));
+        if (!worker->running->sending) {
+            shutdown(self->sockfd, SHUT_RD);
+        }
+    }
+    while (worker->running != NULL) {
+        pthread_cond_wait(&worker->changed, &worker->lock);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    pthread_join(worker->tid, NULL);
+
+    free_requests(worker->pending);
+    free_requests(worker->completed);
+    close(worker->eventfd);
+    pthread_mutex_destroy(&worker->lock);
+    pthread_cond_destroy(&worker->changed);
+    free(worker);
+    self->async = NULL;
+}
+
+
+// ==================== RUDP_Window Functions ====================
+
+// Window of a version 1 peer always starts at 0. Window of a version 2 peer
+// continues from the sequence number where the last function call stopped.
+void window_init(RUDP_Window *self, RUDP *rudp, uint32_t base, uint32_t size)
+{
+    self->rudp = rudp;
+    self->base = base;
+    self->next = base;
+    self->message_start = base;
+    self->message_segment_size = 0;
+    self->size = size;
+    self->mask = rudp->peer_version == RUDP_VERSION_1 ? SEQUENCE_NUMBERS - 1 : UINT32_MAX;
+    self->released = base;
+}
+
+// Returns how far seqno is ahead of the window base in sequence number space.
+// Offsets in [0, size - 1] are in [base, base + size - 1] and
+// offsets in (mask - size, mask] are in [base - size, base - 1].
+uint32_t get_offset(RUDP_Window *self, uint32_t seqno)
+{
+    return (seqno - self->base) & self->mask;
+}
+
+// Returns slot of buffer which holds the segment with index.
+uint32_t get_slot(RUDP *self, uint32_t index)
+{
+    return index & (self->buffer_size - 1);
+}
+
+// Counts bytes taken for the session and keeps its peak.
+void memory_taken(RUDP *self, uint64_t bytes)
+{
+    uint64_t used = atomic_fetch_add_explicit(&self->stats.memory, bytes, memory_order_relaxed) + bytes;
+
+    if (used > stat_get(&self->stats.memory_peak)) {
+        atomic_store_explicit(&self->stats.memory_peak, used, memory_order_relaxed);
+    }
+}
+
+// Returns the delivered segments of a receiver whose data is kept. A peer which sends parity
+// gets FEC_MAX_DATA, so the data of the block of a lost segment is still there.
+uint32_t data_reserve(RUDP *self)
+{
+    return self->peer_features & RUDP_FEATURE_PARITY ? FEC_MAX_DATA : 0;
+}
+
+// Returns the data of the slot of the segment with index, which takes a block of the pool
+// if it has none. Segments sent from memory of the caller or written to a file at once
+// never take one.
+// On error NULL is returned.
+char* slot_data(RUDP *self, uint32_t index)
+{
+    RUDP_Segment *segment = &self->buffer[get_slot(self, index)];
+
+    if (segment->data == NULL) {
+        segment->data = pool_alloc(self->segment_size);
+        if (segment->data != NULL) {
+            memory_taken(self, pool_block_size(self->segment_size));
+        }
+    }
+    return segment->data;
+}
+
+// Gives the data of the slot of the segment with index back to the pool.
+void release_data(RUDP *self, uint32_t index)
+{
+    RUDP_Segment *segment = &self->buffer[get_slot(self, index)];
+
+    if (segment->data != NULL) {
+        pool_free(segment->data, self->segment_size);
+        stat_sub(&self->stats.memory, pool_block_size(self->segment_size));
+        segment->data = NULL;
+    }
+}
+
+// Gives the data of every slot back, when the buffer is freed or a session ends.
+void release_buffer_data(RUDP *self)
+{
+    for (uint32_t i = 0; i < self->buffer_size; i++) {
+        release_data(self, i);
+    }
+}
+
+// Gives back the data of delivered segments which are no longer kept. Called once the data
+// written to files has been written, so no write still points into it.
+void release_delivered(RUDP *self)
+{
+    RUDP_Window *window = &self->window;
+    uint32_t end = window->base - data_reserve(self);
+
+    while ((int32_t)(end - window->released) > 0) {
+        release_data(self, window->released++);
+    }
+}
+
+// Allocates the ring buffer and timers for window_size segments of segment_size bytes.
+// Slots take data from the pool only while they hold a segment, so memory follows the
+// window in use. Slots of the delivered segments a receiver keeps are not reused by the window.
+// On success 0 is returned. On error -1 is returned.
+int alloc_buffer(RUDP *self, uint32_t window_size, uint16_t segment_size)
+{
+    uint32_t buffer_size = SEQUENCE_NUMBERS;
+    uint32_t reserve = data_reserve(self);
+    RUDP_Segment *buffer;
+    Timer *timers;
+
+    if (pool_block_size(segment_size) == 0) {
+        return -1;
+    }
+    while (buffer_size < 2 * window_size || buffer_size <= window_size + reserve) {
+        buffer_size *= 2;
+    }
+    buffer = calloc(buffer_size, sizeof(RUDP_Segment));
+    timers = calloc(buffer_size, sizeof(Timer));
+    if (buffer == NULL || timers == NULL) {
+        free(buffer);
+        free(timers);
+        return -1;
+    }
+    release_buffer_data(self);
+    free(self->buffer);
+    free(self->timers);
+    stat_sub(&self->stats.memory, (uint64_t)self->buffer_size * (sizeof(RUDP_Segment) + sizeof(Timer)));
+    memory_taken(self, (uint64_t)buffer_size * (sizeof(RUDP_Segment) + sizeof(Timer)));
+    self->buffer = buffer;
+    self->timers = timers;
+    self->buffer_size = buffer_size;
+    self->slots_clear = true;
+    self->window_size = window_size;
+    self->segment_size = segment_size;
+    return 0;
+}
+
+
+
+// ==================== FileRing Functions ====================
+
+// Reads the file into the ring a chunk at a time, waiting while it is full, until the file ends.
+// Only this thread writes to the ring, so chunks are read without the lock. The thread can only
+// be cancelled in fread, which waits for a pipe as long as it has no data.
+void* run_file_reader(void *arg)
+{
+    FileRing *self = arg;
+    size_t at, n, length;
+    bool stop;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    do {
+        pthread_mutex_lock(&self->lock);
+        while (!self->stop && self->head - self->tail == FILE_RING_SIZE) {
+            pthread_cond_wait(&self->changed, &self->lock);
+        }
+        n = FILE_RING_SIZE - (self->head - self->tail);
+        stop = self->stop;
+        pthread_mutex_unlock(&self->lock);
+        if (stop) {
+            break;
+        }
+        at = self->head & (FILE_RING_SIZE - 1);
+        if (n > FILE_RING_SIZE - at) {
+            n = FILE_RING_SIZE - at;
+        }
+        if (n > FILE_CHUNK_SIZE) {
+            n = FILE_CHUNK_SIZE;
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        length = fread(self->data + at, 1, n, self->fp);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_mutex_lock(&self->lock);
+        self->head += length;
+        self->done = length < n;
+        self->failed = self->done && ferror(self->fp);
+        stop = self->done;
+        pthread_cond_broadcast(&self->changed);
+        pthread_mutex_unlock(&self->lock);
+        wake_sender(self->rudp);
+    } while (!stop);
+    return NULL;
+}
+
+// Writes the ring to the file a chunk at a time, waiting while it is empty, until the receiver
+// has put in its last bytes. Only this thread takes bytes, so chunks are written without the lock.
+void* run_file_writer(void *arg)
+{
+    FileRing *self = arg;
+    size_t at, n;
+    bool failed;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    do {
+        pthread_mutex_lock(&self->lock);
+        while (!self->stop && !self->done && self->head == self->tail) {
+            pthread_cond_wait(&self->changed, &self->lock);
+        }
+        n = self->stop ? 0 : self->head - self->tail;
+        pthread_mutex_unlock(&self->lock);
+        if (n == 0) {
+            break;
+        }
+        at = self->tail & (FILE_RING_SIZE - 1);
+        if (n > FILE_RING_SIZE - at) {
+            n = FILE_RING_SIZE - at;
+        }
+        if (n > FILE_CHUNK_SIZE) {
+            n = FILE_CHUNK_SIZE;
+        }
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        failed = fwrite(self->data + at, 1, n, self->fp) != n;
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_mutex_lock(&self->lock);
+        self->tail += n;
+        self->failed = failed;
+        pthread_cond_broadcast(&self->changed);
+        pthread_mutex_unlock(&self->lock);
+    } while (!failed);
+    return NULL;
+}
+
+// Starts the I/O thread of a file which is not regular, which reads it ahead of the sender,
+// or writes the bytes the receiver puts in the ring if writing is set.
+// Returns the ring. On error NULL is returned.
+FileRing* file_ring_start(RUDP *rudp, FILE *fp, bool writing)
+{
+    FileRing *self = calloc(1, sizeof(FileRing));
+
+    if (self == NULL) {
+        return NULL;
+    }
+    self->rudp = rudp;
+    self->fp = fp;
+    self->writing = writing;
+    self->data = malloc(FILE_RING_SIZE);
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->changed, NULL);
+    if (self->data == NULL
+        || pthread_create(&self->tid, NULL, writing ? run_file_writer : run_file_reader, self) != 0)
+    {
+        pthread_cond_destroy(&self->changed);
+        pthread_mutex_destroy(&self->lock);
+        free(self->data);
+        free(self);
+        return NULL;
+    }
+    memory_taken(rudp, FILE_RING_SIZE);
+    return self;
+}
+
+// Stops the I/O thread and frees the ring. A writer first writes the rest of the ring if drain
+// is set, and the file is flushed. A reader which waits for the file is cancelled.
+// On success 0 is returned. If the file could not be read or written -1 is returned.
+int file_ring_stop(FileRing *self, bool drain)
+{
+    bool cancel;
+    int result;
+
+    pthread_mutex_lock(&self->lock);
+    if (self->writing && drain) {
+        self->done = true;
+        pthread_cond_broadcast(&self->changed);
+        while (!self->failed && self->tail != self->head) {
+            pthread_cond_wait(&self->changed, &self->lock);
+        }
+    }
+    self->stop = true;
+    cancel = !self->writing && !self->done;
+    pthread_cond_broadcast(&self->changed);
+    pthread_mutex_unlock(&self->lock);
+    if (cancel) {
+        pthread_cancel(self->tid);
+    }
+    pthread_join(self->tid, NULL);
+    result = self->failed || (self->writing && fflush(self->fp) == EOF) ? -1 : 0;
+    pthread_cond_destroy(&self->changed);
+    pthread_mutex_destroy(&self->lock);
+    stat_sub(&self->rudp->stats.memory, FILE_RING_SIZE);
+    free(self->data);
+    free(self);
+    return result;
+}
+
+// Returns true if the ring has more than size bytes, or the rest of the file, so that the
+// bytes taken are known to end the file or not.
+bool file_ring_ready(FileRing *self, size_t size)
+{
+    bool ready;
+
+    pthread_mutex_lock(&self->lock);
+    ready = self->head - self->tail > size || self->done;
+    pthread_mutex_unlock(&self->lock);
+    return ready;
+}
+
+// Takes up to size bytes from the ring once it is ready, last is set if they end the file.
+// Only the sender takes bytes, so they are copied without the lock.
+// Returns the number of bytes taken. If the file could not be read -1 is returned.
+ssize_t file_ring_read(FileRing *self, char *data, size_t size, bool *last)
+{
+    size_t n, at, first;
+    bool failed;
+
+    pthread_mutex_lock(&self->lock);
+    while (self->head - self->tail <= size && !self->done) {
+        pthread_cond_wait(&self->changed, &self->lock);
+    }
+    n = self->head - self->tail < size ? self->head - self->tail : size;
+    failed = self->failed;
+    pthread_mutex_unlock(&self->lock);
+    if (failed) {
+        return -1;
+    }
+    at = self->tail & (FILE_RING_SIZE - 1);
+    first = n < FILE_RING_SIZE - at ? n : FILE_RING_SIZE - at;
+    memcpy(data, self->data + at, first);
+    memcpy(data + first, self->data, n - first);
+    pthread_mutex_lock(&self->lock);
+    self->tail += n;
+    *last = self->done && self->tail == self->head;
+    pthread_cond_broadcast(&self->changed);
+    pthread_mutex_unlock(&self->lock);
+    return n;
+}
+
+// Puts length bytes in the ring of a writer, waiting while it is full. Only the receiver puts
+// bytes in, so they are copied without the lock.
+// On success 0 is returned. If the file could not be written -1 is returned.
+int file_ring_write(FileRing *self, const char *data, size_t length)
+{
+    size_t at, n;
+    bool failed;
+
+    while (length > 0) {
+        pthread_mutex_lock(&self->lock);
+        while (!self->failed && self->head - self->tail == FILE_RING_SIZE) {
+            pthread_cond_wait(&self->changed, &self->lock);
+        }
+        n = FILE_RING_SIZE - (self->head - self->tail);
+        failed = self->failed;
+        pthread_mutex_unlock(&self->lock);
+        if (failed) {
+            return -1;
+        }
+        at = self->head & (FILE_RING_SIZE - 1);
+        if (n > FILE_RING_SIZE - at) {
+            n = FILE_RING_SIZE - at;
+        }
+        if (n > length) {
+            n = length;
+        }
+        memcpy(self->data + at, data, n);
+        data += n;
+        length -= n;
+        pthread_mutex_lock(&self->lock);
+        self->head += n;
+        pthread_cond_broadcast(&self->changed);
+        pthread_mutex_unlock(&self->lock);
+    }
+    return 0;
+}
+
+
+
+// ==================== Prefetcher Functions ====================
+
+// Faults the range in a chunk at a time, computing its checksum, and waits while it is
+// FILE_READAHEAD bytes ahead of the sender. Reads of the pages up to there are started at
+// once, so the disk has them queued while the thread waits for the first.
+void* run_prefetcher(void *arg)
+{
+    Prefetcher *self = arg;
+    uintptr_t page_size = sysconf(_SC_PAGESIZE), start;
+    size_t fetched = 0, advised = 0, limit, n;
+    uint32_t crc = 0;
+    bool stop = false;
+
+    while (fetched < self->length) {
+        pthread_mutex_lock(&self->lock);
+        while (!self->stop && fetched >= self->taken + FILE_READAHEAD) {
+            pthread_cond_wait(&self->taken_changed, &self->lock);
+        }
+        limit = self->taken + FILE_READAHEAD < self->length ? self->taken + FILE_READAHEAD : self->length;
+        stop = self->stop;
+        pthread_mutex_unlock(&self->lock);
+        if (stop) {
+            break;
+        }
+        if (advised < limit) {
+            start = (uintptr_t)(self->data + advised) & ~(page_size - 1);
+            madvise((void*)start, (uintptr_t)(self->data + limit) - start, MADV_WILLNEED);
+            advised = limit;
+        }
+        n = self->length - fetched < FILE_CHUNK_SIZE ? self->length - fetched : FILE_CHUNK_SIZE;
+        crc = crc32c(crc, self->data + fetched, n);
+        fetched += n;
+    }
+    self->crc = crc;
+    return NULL;
+}
+
+// Starts faulting in the mapped range which the sender is about to send from its buffer argument.
+// On success 0 is returned. On error -1 is returned.
+int prefetcher_start(RUDP *rudp, const char *data, size_t length)
+{
+    Prefetcher *self = calloc(1, sizeof(Prefetcher));
+
+    if (self == NULL) {
+        return -1;
+    }
+    self->data = data;
+    self->length = length;
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->taken_changed, NULL);
+    if (pthread_create(&self->tid, NULL, run_prefetcher, self) != 0) {
+        pthread_cond_destroy(&self->taken_changed);
+        pthread_mutex_destroy(&self->lock);
+        free(self);
+        return -1;
+    }
+    rudp->prefetcher = self;
+    return 0;
+}
+
+// Tells the thread that the sender has taken the range up to taken, once a chunk.
+void prefetcher_take(Prefetcher *self, size_t taken)
+{
+    if (taken < self->told + FILE_CHUNK_SIZE && taken != self->length) {
+        return;
+    }
+    self->told = taken;
+    pthread_mutex_lock(&self->lock);
+    self->taken = taken;
+    pthread_cond_signal(&self->taken_changed);
+    pthread_mutex_unlock(&self->lock);
+}
+
+// Stops the prefetcher, once it has gone through the whole range if finish is set.
+// Returns the CRC32C of the range, which is only known if finish is set.
+uint32_t prefetcher_stop(RUDP *rudp, bool finish)
+{
+    Prefetcher *self = rudp->prefetcher;
+    uint32_t crc;
+
+    pthread_mutex_lock(&self->lock);
+    if (finish) {
+        self->taken = self->length;
+    }
+    else {
+        self->stop = true;
+    }
+    pthread_cond_signal(&self->taken_changed);
+    pthread_mutex_unlock(&self->lock);
+    pthread_join(self->tid, NULL);
+    crc = self->crc;
+    pthread_cond_destroy(&self->taken_changed);
+    pthread_mutex_destroy(&self->lock);
+    free(self);
+    rudp->prefetcher = NULL;
+    return crc;
+}
+
+
+
+// ==================== Compression Functions ====================
+
+void pack_u64(char *packed, uint64_t value)
+{
+    uint32_t high = htonl(value >> 32), low = htonl((uint32_t)value);
+
+    memcpy(packed, &high, sizeof(high));
+    memcpy(packed + 4, &low, sizeof(low));
+}
+
+uint64_t unpack_u64(const char *packed)
+{
+    uint32_t high, low;
+
+    memcpy(&high, packed, sizeof(high));
+    memcpy(&low, packed + 4, sizeof(low));
+    return (uint64_t)ntohl(high) << 32 | ntohl(low);
+}
+
+// Writes length bytes to the queue of the compressor, waiting while it is full. Only the
+// compressor thread writes, so bytes are copied without the lock.
+// On success 0 is returned. If the sender stopped the compressor -1 is returned.
+int compressor_write(Compressor *self, const uint8_t *data, size_t length)
+{
+    size_t at, n;
+    bool stop;
+
+    while (length > 0) {
+        pthread_mutex_lock(&self->lock);
+        while (!self->stop && self->head - self->tail == COMPRESS_QUEUE_SIZE) {
+            pthread_cond_wait(&self->space, &self->lock);
+        }
+        n = COMPRESS_QUEUE_SIZE - (self->head - self->tail);
+        stop = self->stop;
+        pthread_mutex_unlock(&self->lock);
+        if (stop) {
+            return -1;
+        }
+        at = self->head & (COMPRESS_QUEUE_SIZE - 1);
+        if (n > COMPRESS_QUEUE_SIZE - at) {
+            n = COMPRESS_QUEUE_SIZE - at;
+        }
+        if (n > length) {
+            n = length;
+        }
+        memcpy(self->queue + at, data, n);
+        data += n;
+        length -= n;
+        pthread_mutex_lock(&self->lock);
+        self->head += n;
+        pthread_mutex_unlock(&self->lock);
+    }
+    return 0;
+}
+
+// Writes a block of the range to the queue. Blocks whose sample looks random are not tried,
+// others are only sent compressed when they save a sixteenth of their size.
+// On success 0 is returned. If the sender stopped the compressor -1 is returned.
+int write_block(Compressor *self, const uint8_t *block, size_t raw)
+{
+    RUDP *rudp = self->rudp;
+    size_t stored = 0;
+    uint32_t value;
+    int result;
+
+    if (self->compress && lz_entropy(block, raw) <= COMPRESS_MAX_ENTROPY) {
+        // Compressed data is always shorter than the block, so that it is not taken as raw.
+        stored = lz_compress(block, raw, self->packed + COMPRESS_BLOCK_HEADER, raw - raw / 16 - 1);
+    }
+    if (stored == 0) {
+        stored = raw;
+        if (self->compress) {
+            stat_add(&rudp->stats.compress_raw_blocks, 1);
+        }
+    }
+    value = htonl(raw);
+    memcpy(self->packed, &value, 4);
+    value = htonl(stored);
+    memcpy(self->packed + 4, &value, 4);
+    // Raw blocks are copied from the range.
+    if (stored == raw) {
+        result = compressor_write(self, self->packed, COMPRESS_BLOCK_HEADER);
+        if (result == 0) {
+            result = compressor_write(self, block, raw);
+        }
+    }
+    else {
+        result = compressor_write(self, self->packed, COMPRESS_BLOCK_HEADER + stored);
+    }
+    stat_add(&rudp->stats.compress_input, raw);
+    stat_add(&rudp->stats.compress_output, COMPRESS_BLOCK_HEADER + stored);
+    wake_sender(rudp);
+    return result;
+}
+
+// Writes length bytes of the range as blocks of up to COMPRESS_BLOCK_SIZE bytes.
+// On success 0 is returned. If the sender stopped the compressor -1 is returned.
+int write_literals(Compressor *self, const uint8_t *data, size_t length)
+{
+    size_t raw;
+
+    if (self->index != NULL) {
+        stat_add(&self->rudp->stats.delta_literal, length);
+    }
+    for (; length > 0; data += raw, length -= raw) {
+        raw = length < COMPRESS_BLOCK_SIZE ? length : COMPRESS_BLOCK_SIZE;
+        if (write_block(self, data, raw) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Writes a copy block of length bytes at offset in the copy of the peer.
+// On success 0 is returned. If the sender stopped the compressor -1 is returned.
+int write_copy(Compressor *self, uint64_t offset, uint32_t length)
+{
+    RUDP *rudp = self->rudp;
+    char packed[COMPRESS_BLOCK_HEADER + 8];
+    uint32_t value;
+    int result;
+
+    if (length == 0) {
+        return 0;
+    }
+    value = htonl(length);
+    memcpy(packed, &value, 4);
+    memset(packed + 4, 0, 4);
+    pack_u64(packed + COMPRESS_BLOCK_HEADER, offset);
+    result = compressor_write(self, (const uint8_t*)packed, sizeof(packed));
+    stat_add(&rudp->stats.delta_matched, length);
+    stat_add(&rudp->stats.compress_input, length);
+    stat_add(&rudp->stats.compress_output, sizeof(packed));
+    wake_sender(rudp);
+    return result;
+}
+
+// Writes the range as copies of the blocks of the index which it has and data between them.
+// Copies of blocks which follow each other in the copy of the peer are joined.
+// On success 0 is returned. If the sender stopped the compressor -1 is returned.
+int encode_delta(Compressor *self)
+{
+    const DeltaIndex *index = self->index;
+    const uint8_t *data = (const uint8_t*)self->data;
+    size_t position = 0, literal = 0, limit;
+    uint64_t copy_offset = 0, offset;
+    uint32_t copy_length = 0, block, expected = DELTA_NONE;
+
+    while (position < self->length) {
+        // Data is written as soon as a block of it is known not to hold a match.
+        limit = literal + COMPRESS_BLOCK_SIZE < self->length ? literal + COMPRESS_BLOCK_SIZE : self->length;
+        block = delta_match(index, data, self->length, &position, limit, expected);
+        if (block == DELTA_NONE || position > literal) {
+            if (write_copy(self, copy_offset, copy_length) == -1
+                || write_literals(self, data + literal, position - literal) == -1)
+            {
+                return -1;
+            }
+            copy_length = 0;
+            literal = position;
+            expected = DELTA_NONE;
+        }
+        if (block == DELTA_NONE) {
+            continue;
+        }
+        offset = (uint64_t)block * index->block_size;
+        if (copy_length == 0 || copy_offset + copy_length != offset
+            || copy_length + index->block_size > DELTA_MAX_COPY)
+        {
+            if (write_copy(self, copy_offset, copy_length) == -1) {
+                return -1;
+            }
+            copy_offset = offset;
+            copy_length = 0;
+        }
+        copy_length += index->block_size;
+        position += index->block_size;
+        literal = position;
+        expected = block + 1;
+    }
+    return write_copy(self, copy_offset, copy_length);
+}
+
+// Makes the blocks of the range in the queue, as a delta if the compressor has an index.
+void* run_compressor(void *arg)
+{
+    Compressor *self = arg;
+
+    if (self->index != NULL) {
+        encode_delta(self);
+    }
+    else {
+        write_literals(self, (const uint8_t*)self->data, self->length);
+    }
+    pthread_mutex_lock(&self->lock);
+    self->done = true;
+    pthread_mutex_unlock(&self->lock);
+    wake_sender(self->rudp);
+    return NULL;
+}
+
+// Starts making the blocks of a range which the sender then sends from the queue, compressed
+// if compress is set and as a delta of the copy of the peer if index is set.
+// On success 0 is returned. On error -1 is returned.
+int compressor_start(RUDP *rudp, const char *data, size_t length, bool compress, const DeltaIndex *index)
+{
+    Compressor *self = calloc(1, sizeof(Compressor));
+
+    if (self == NULL) {
+        return -1;
+    }
+    self->rudp = rudp;
+    self->data = data;
+    self->length = length;
+    self->compress = compress;
+    self->index = index;
+    self->queue = malloc(COMPRESS_QUEUE_SIZE);
+    self->packed = malloc(COMPRESS_BLOCK_HEADER + lz_bound(COMPRESS_BLOCK_SIZE));
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->space, NULL);
+    if (self->queue == NULL || self->packed == NULL
+        || pthread_create(&self->tid, NULL, run_compressor, self) != 0)
+    {
+        pthread_cond_destroy(&self->space);
+        pthread_mutex_destroy(&self->lock);
+        free(self->queue);
+        free(self->packed);
+        free(self);
+        return -1;
+    }
+    memory_taken(rudp, COMPRESS_QUEUE_SIZE + COMPRESS_BLOCK_HEADER + lz_bound(COMPRESS_BLOCK_SIZE));
+    rudp->compressor = self;
+    return 0;
+}
+
+// Stops the compressor, which may still be waiting for space when the send failed.
+void compressor_stop(RUDP *rudp)
+{
+    Compressor *self = rudp->compressor;
+
+    pthread_mutex_lock(&self->lock);
+    self->stop = true;
+    pthread_cond_signal(&self->space);
+    pthread_mutex_unlock(&self->lock);
+    pthread_join(self->tid, NULL);
+    pthread_cond_destroy(&self->space);
+    pthread_mutex_destroy(&self->lock);
+    free(self->queue);
+    free(self->packed);
+    free(self);
+    stat_sub(&rudp->stats.memory, COMPRESS_QUEUE_SIZE + COMPRESS_BLOCK_HEADER + lz_bound(COMPRESS_BLOCK_SIZE));
+    rudp->compressor = NULL;
+}
+
+// Returns true if the queue has a full segment of size bytes, or the rest of the range.
+bool compressor_ready(Compressor *self, uint16_t size)
+{
+    bool ready;
+
+    pthread_mutex_lock(&self->lock);
+    ready = self->head - self->tail >= size || self->done;
+    pthread_mutex_unlock(&self->lock);
+    return ready;
+}
+
+// Takes up to size bytes from the queue, last is set if they end the range. Only the
+// sender takes bytes, so they are copied without the lock.
+// Returns the number of bytes taken.
+uint16_t compressor_read(Compressor *self, char *data, uint16_t size, bool *last)
+{
+    size_t n, at, first;
+
+    pthread_mutex_lock(&self->lock);
+    n = self->head - self->tail < size ? self->head - self->tail : size;
+    pthread_mutex_unlock(&self->lock);
+    at = self->tail & (COMPRESS_QUEUE_SIZE - 1);
+    first = n < COMPRESS_QUEUE_SIZE - at ? n : COMPRESS_QUEUE_SIZE - at;
+    memcpy(data, self->queue + at, first);
+    memcpy(data + first, self->queue, n - first);
+    pthread_mutex_lock(&self->lock);
+    self->tail += n;
+    *last = self->done && self->tail == self->head;
+    pthread_cond_signal(&self->space);
+    pthread_mutex_unlock(&self->lock);
+    return n;
+}
+
+// Sets a decompressor for the next message.
+// On success 0 is returned. On error -1 is returned.
+int decompressor_init(RUDP *self)
+{
+    Decompressor *decompressor = calloc(1, sizeof(Decompressor));
+
+    if (decompressor == NULL) {
+        return -1;
+    }
+    decompressor->block = pool_alloc(COMPRESS_BLOCK_SIZE);
+    decompressor->output = pool_alloc(COMPRESS_BLOCK_SIZE);
+    if (decompressor->block == NULL || decompressor->output == NULL) {
+        pool_free(decompressor->block, COMPRESS_BLOCK_SIZE);
+        pool_free(decompressor->output, COMPRESS_BLOCK_SIZE);
+        free(decompressor);
+        return -1;
+    }
+    memory_taken(self, 2 * pool_block_size(COMPRESS_BLOCK_SIZE));
+    self->decompressor = decompressor;
+    return 0;
+}
+
+void decompressor_free(RUDP *self)
+{
+    if (self->decompressor == NULL) {
+        return;
+    }
+    pool_free(self->decompressor->block, COMPRESS_BLOCK_SIZE);
+    pool_free(self->decompressor->output, COMPRESS_BLOCK_SIZE);
+    stat_sub(&self->stats.memory, 2 * pool_block_size(COMPRESS_BLOCK_SIZE));
+    free(self->decompressor);
+    self->decompressor = NULL;
+}
+
+// Used to pass the data of a message in order to the data function, file or buffer argument.
+// On success 0 is returned. On error -1 is returned.
+int deliver_data(RUDP *self, const char *data, size_t length, bool last)
+{
+    if (self->on_data != NULL) {
+        if (!self->closed) {
+            self->on_data(self, data, length, last);
+        }
+    }
+    else if (self->file_ring != NULL) {
+        if (file_ring_write(self->file_ring, data, length) == -1) {
+            return -1;
+        }
+        self->file_crc = crc32c(self->file_crc, data, length);
+    }
+    else {
+        // Data that does not fit in the buffer argument is discarded.
+        if (length > self->buffer_arg_len) {
+            length = self->buffer_arg_len;
+        }
+        memcpy(self->buffer_arg, data, length);
+        self->buffer_arg += length;
+        self->buffer_arg_len -= length;
+    }
+    self->receiver.bytes_received += length;
+    async_progress(self, length);
+    return 0;
+}
+
+// Delivers a decompressed block. A message which goes to a file is written after the
+// blocks before it.
+// On success 0 is returned. On error -1 is returned.
+int deliver_block(RUDP *self, const uint8_t *data, uint32_t length)
+{
+    Decompressor *decompressor = self->decompressor;
+    off_t offset = self->file_offset + decompressor->produced;
+
+    decompressor->produced += length;
+    if (self->file_fd == -1) {
+        return deliver_data(self, (const char*)data, length, false);
+    }
+    allocate_file(self, offset + length);
+    if (self->file_fd == -1) {
+        return 0;
+    }
+    if (pwrite(self->file_fd, data, length, offset) != length) {
+        file_failed(self);
+        return 0;
+    }
+    self->receiver.bytes_received += length;
+    mark_manifest(self, offset, offset + length, NULL);
+    return 0;
+}
+
+// Returns the bytes of data of the block after its header.
+uint32_t block_data_length(Decompressor *self)
+{
+    return self->stored_length == 0 ? 8 : self->stored_length;
+}
+
+// Takes the block header or data of the block from the data of a segment. The data of a
+// copy block is the offset of its bytes in the copy.
+// Returns the bytes taken, -1 if the block is not valid.
+ssize_t take_block_bytes(Decompressor *self, const uint8_t *data, size_t length)
+{
+    uint32_t value;
+    size_t n;
+    bool copy;
+
+    if (self->have < COMPRESS_BLOCK_HEADER) {
+        n = COMPRESS_BLOCK_HEADER - self->have < length ? COMPRESS_BLOCK_HEADER - self->have : length;
+        memcpy(self->header + self->have, data, n);
+        self->have += n;
+        if (self->have == COMPRESS_BLOCK_HEADER) {
+            memcpy(&value, self->header, 4);
+            self->raw_length = ntohl(value);
+            memcpy(&value, self->header + 4, 4);
+            self->stored_length = ntohl(value);
+            copy = self->stored_length == 0 && self->basis != NULL;
+            if (self->raw_length == 0 || self->raw_length > (copy ? DELTA_MAX_COPY : COMPRESS_BLOCK_SIZE)
+                || (self->stored_length == 0 && !copy) || self->stored_length > self->raw_length)
+            {
+                return -1;
+            }
+        }
+        return n;
+    }
+    n = COMPRESS_BLOCK_HEADER + block_data_length(self) - self->have;
+    if (n > length) {
+        n = length;
+    }
+    memcpy(self->block + self->have - COMPRESS_BLOCK_HEADER, data, n);
+    self->have += n;
+    return n;
+}
+
+// Passes the data of an in order segment of a compressed message through the decompressor.
+// Copy blocks are taken from the copy of the file the decompressor has.
+// A message which is not valid is given up as a file which cannot be written. After the last
+// segment the decompressor is freed.
+// On success 0 is returned. On error -1 is returned.
+int decompress_segment(RUDP *self, RUDP_Segment *segment)
+{
+    Decompressor *decompressor = self->decompressor;
+    const uint8_t *data = (const uint8_t*)segment->data;
+    size_t length = segment->length;
+    const uint8_t *block;
+    uint64_t offset;
+    ssize_t n;
+
+    while (length > 0 && !self->closed && self->receiver.bytes_received != -1) {
+        n = take_block_bytes(decompressor, data, length);
+        if (n == -1) {
+            break;
+        }
+        data += n;
+        length -= n;
+        if (decompressor->have < COMPRESS_BLOCK_HEADER
+            || decompressor->have < COMPRESS_BLOCK_HEADER + block_data_length(decompressor))
+        {
+            continue;
+        }
+        decompressor->have = 0;
+        block = decompressor->block;
+        if (decompressor->stored_length == 0) {
+            offset = unpack_u64((const char*)decompressor->block);
+            if (offset > decompressor->basis_length || decompressor->raw_length > decompressor->basis_length - offset) {
+                break;
+            }
+            block = decompressor->basis + offset;
+        }
+        else if (decompressor->stored_length < decompressor->raw_length) {
+            if (lz_decompress(decompressor->block, decompressor->stored_length, decompressor->output,
+                                decompressor->raw_length) != decompressor->raw_length)
+            {
+                break;
+            }
+            block = decompressor->output;
+        }
+        if (deliver_block(self, block, decompressor->raw_length) == -1) {
+            return -1;
+        }
+    }
+    if (length > 0 || (segment->header.last && decompressor->have != 0)) {
+        file_failed(self);
+    }
+    if (!segment->header.last) {
+        return 0;
+    }
+    if (self->file_fd != -1) {
+        finish_file(self, self->file_offset + decompressor->produced);
+    }
+    else if (self->receiver.bytes_received != -1 && deliver_data(self, (const char*)decompressor->output, 0, true) == -1) {
+        return -1;
+    }
+    decompressor_free(self);
+    return 0;
+}
+
+
+
+// ==================== ReceiverThread Functions ====================
+
+void rt_init(ReceiverThread *self, RUDP *rudp, bool sending)
+{
+    self->rudp = rudp;
+    self->bytes_received = 0;
+    self->sending = sending;
+    self->done = false;
+    // The thread of async transfers clears it under its lock instead, so a close is not missed.
+    if (rudp->async == NULL) {
+        atomic_init(&self->stop, false);
+    }
+    self->sockfd = rudp->sockfd;
+    self->peer_version = rudp->peer_version;
+    self->conn_id = rudp->conn_id;
+    self->recv_seqno = rudp->recv_seqno;
+    self->pending_acks = 0;
+    self->ack_now = false;
+    self->ack_deadline = 0;
+    self->sack_end = rudp->window.base;
+}
+
+// Used to pass the data of an in order segment to the decompressor, file, data function or
+// buffer argument. Data of a message which goes to a file with file_fd has been written already.
+// On success 0 is returned. On error -1 is returned.
+int deliver_segment(RUDP *self, RUDP_Segment *segment, WriteBatch *writes)
+{
+    if (self->decompressor != NULL) {
+        return decompress_segment(self, segment);
+    }
+    if (self->file_fd != -1) {
+        deliver_to_file(self, segment, writes);
+        return 0;
+    }
+    return deliver_data(self, segment->data, segment->length, segment->header.last);
+}
+
+// Handles a hello from a version 2 peer, the sequence numbers
+// of the session start at the sequence number of the hello. data has the features of the peer.
+// On success 0 is returned. On error -1 is returned.
+int accept_hello(ReceiverThread *self, RUDP_Header *hello, const char *data, uint16_t length,
+                    struct sockaddr *addr, socklen_t addrlen)
+{
+    RUDP *rudp = self->rudp;
+    RUDP_Segment ack;
+    uint16_t reply[2] = { htons(rudp->segment_size), htons(rudp->features) };
+    uint16_t features;
+
+    // A peer which is configured for version 1 behaves like a legacy peer.
+    if (rudp->version == RUDP_VERSION_1) {
+        return 0;
+    }
+    if (rudp->peer_version != RUDP_VERSION_2) {
+        rudp->peer_version = RUDP_VERSION_2;
+        rudp->conn_id = hello->conn_id;
+        rudp->recv_seqno = hello->seqno;
+        window_init(&rudp->window, rudp, rudp->recv_seqno, rudp->window_size);
+        self->sack_end = rudp->recv_seqno;
+        // Messages back to the peer, as signatures for a delta, go to the address of its hello.
+        memcpy(&rudp->peer_addr, addr, addrlen < sizeof(rudp->peer_addr) ? addrlen : sizeof(rudp->peer_addr));
+    }
+    // Hellos of other peers are not answered during a session.
+    else if (hello->conn_id != rudp->conn_id) {
+        return 0;
+    }
+    rudp->peer_window = hello->window;
+    rudp->peer_features = 0;
+    if (length >= sizeof(features)) {
+        memcpy(&features, data, sizeof(features));
+        rudp->peer_features = ntohs(features);
+    }
+    // Segments of a peer which sends parity are kept longer, which takes more slots.
+    if ((rudp->peer_features & RUDP_FEATURE_PARITY) && rudp->buffer_size <= rudp->window_size + FEC_MAX_DATA
+        && alloc_buffer(rudp, rudp->window_size, rudp->segment_size) == -1)
+    {
+        return -1;
+    }
+
+    make_ack_segment(&ack, hello->seqno);
+    ack.header.conn_id = rudp->conn_id;
+    ack.header.hello = 1;
+    ack.header.window = rudp->window_size;
+    if (rudp->logs) {
+        rudp_log(LOG_HELLO_RECEIVED, hello->window, false);
+    }
+    // Ack tells the largest segment which can be received and the features.
+    return send_packet(rudp->sockfd, &ack.header, RUDP_VERSION_2, (char*)reply, sizeof(reply),
+                        addr, addrlen) == -1 ? -1 : 0;
+}
+
+// Acks a path MTU probe of the peer of the session with the same sequence number.
+// On success 0 is returned. On error -1 is returned.
+int accept_probe(ReceiverThread *self, RUDP_Header *probe, struct sockaddr *addr, socklen_t addrlen)
+{
+    RUDP *rudp = self->rudp;
+    RUDP_Segment ack;
+
+    if (rudp->peer_version != RUDP_VERSION_2 || probe->conn_id != rudp->conn_id) {
+        return 0;
+    }
+    make_ack_segment(&ack, probe->seqno);
+    ack.header.conn_id = rudp->conn_id;
+    ack.header.probe = 1;
+    return send_packet(rudp->sockfd, &ack.header, RUDP_VERSION_2, NULL, 0, addr, addrlen) == -1 ? -1 : 0;
+}
+
+// Marks the segment with index acked at time now and stops its timer. The latest send time of the
+// segments which were sent only once is kept in sample_time for a RTT sample (Karn's algorithm).
+// Returns true if the segment was not acked before.
+bool mark_acked(RUDP *rudp, uint32_t index, uint64_t now, uint64_t *sample_time)
+{
+    RUDP_Segment *segment = &rudp->buffer[get_slot(rudp, index)];
+    Timer *timer = &rudp->timers[get_slot(rudp, index)];
+
+    if (segment->header.ack) {
+        return false;
+    }
+    if (timer->active && timer->retransmissions == 0 && timer->sent_time > *sample_time) {
+        *sample_time = timer->sent_time;
+    }
+    if (timer->active) {
+        stat_record(rudp->stats.delivery, now - timer->first_sent_time);
+    }
+    stat_sub(&rudp->stats.bytes_in_flight, segment->length);
+    stat_add(&rudp->stats.bytes_acked, segment->length);
+    async_progress(rudp, segment->length);
+    stop_timer(timer);
+    release_data(rudp, index);
+    // Mark the segment as received using ack field.
+    segment->header.ack = 1;
+    return true;
+}
+
+// Returns the number of later segments which are acked before the segment with index is
+// taken as lost. With parity the segments after it in its block do not count, a loss is only
+// resent once the receiver could not rebuild it when the parity of the block arrived.
+// Segments of a block whose parity has not been sent wait for the end of a full block.
+uint32_t loss_threshold(RUDP *rudp, uint32_t index)
+{
+    if (!rudp->fec_encoder.active) {
+        return DUPACK_THRESHOLD;
+    }
+    return DUPACK_THRESHOLD + rudp->fec_encoder.block_ends[get_slot(rudp, index)] - 1 - index;
+}
+
+// Marks the segments acked by header and advances the window. A SACK ack acks every segment
+// before its sequence number and the segments set in its bitmap, other acks ack one segment.
+// Later segments acked while the window base is unacked are counted to find a lost segment
+// without a timeout.
+// Returns true when the last segment has been acked.
+bool process_ack(RUDP *rudp, RUDP_Header *header, const uint8_t *sack, uint16_t sack_length)
+{
+    RUDP_Window *window = &rudp->window;
+    uint32_t base = window->base;
+    uint32_t inflight = window->next - base;
+    uint32_t offset, index, high = base, i;
+    uint32_t acked = 0, acked_above_base = 0, counted, threshold;
+    uint64_t now = now_us(), rtt = 0, sample_time = 0;
+    bool done = false;
+
+    offset = get_offset(window, header->seqno);
+    if (header->sack) {
+        // Sequence number is in [sendBase, nextSeqNum].
+        if (offset > inflight) {
+            return false;
+        }
+        for (i = 0; i < offset; i++) {
+            acked += mark_acked(rudp, base + i, now, &sample_time);
+        }
+        high = base + offset;
+        for (i = 0; i < (uint32_t)sack_length * 8; i++) {
+            index = header->seqno + 1 + i;
+            if (index - base >= inflight) {
+                break;
+            }
+            if ((sack[i / 8] >> (i % 8) & 1) && mark_acked(rudp, index, now, &sample_time)) {
+                acked++;
+                acked_above_base++;
+                high = index + 1;
+            }
+        }
+    }
+    // If ack is in [sendBase, nextSeqNum - 1] and it is not a duplicate.
+    else if (offset < inflight && mark_acked(rudp, base + offset, now, &sample_time)) {
+        acked = 1;
+        acked_above_base = offset != 0;
+        high = base + offset + 1;
+    }
+    if (acked == 0) {
+        return false;
+    }
+    if (high - base > rudp->sack_high - base) {
+        rudp->sack_high = high;
+    }
+
+    // RTT is sampled from the latest segment sent once, the delay of the ack is part of it.
+    if (sample_time != 0) {
+        rtt = now - sample_time;
+        rtt_sample(&rudp->rtt, rtt);
+        stat_record(rudp->stats.rtt, rtt);
+    }
+    cc_on_ack(&rudp->cc, acked, rtt, now);
+
+    // If earliest ack is received than advance window base to the next unacked segment.
+    while (window->base != window->next && rudp->buffer[get_slot(rudp, window->base)].header.ack) {
+        if (rudp->buffer[get_slot(rudp, window->base)].header.last) {
+            done = true;
+        }
+        window->base++;
+    }
+    if (window->base != base) {
+        stat_sub(&rudp->stats.window_used, window->base - base);
+        rudp->acked_above_base = 0;
+        rudp->base_moved_time = now;
+        rtt_reset_backoff(&rudp->rtt);
+        // Recovery ends when every segment sent before the loss has been acked.
+        if (rudp->in_recovery && (int32_t)(window->base - rudp->recovery_seqno) >= 0) {
+            rudp->in_recovery = false;
+        }
+    }
+    // In recovery every ack may show more lost segments.
+    if (rudp->in_recovery) {
+        rudp->fast_retransmit = true;
+    }
+
+    // Base is taken as lost when DUPACK_THRESHOLD later segments are acked.
+    // Only the first loss of a window reduces the congestion window.
+    counted = rudp->acked_above_base;
+    rudp->acked_above_base += acked_above_base;
+    threshold = loss_threshold(rudp, window->base);
+    if (window->base != window->next && counted < threshold && rudp->acked_above_base >= threshold)
+    {
+        rudp->fast_retransmit = true;
+        if (!rudp->in_recovery) {
+            cc_on_loss(&rudp->cc, inflight, false, now);
+            rudp->in_recovery = true;
+            rudp->recovery_seqno = window->next;
+            rudp->retransmit_next = window->base;
+        }
+    }
+    return done;
+}
+
+// Queues an ack received by the receiver thread of a sender for the sender, data is the SACK
+// bitmap. An ack is dropped if the queue is full, like one lost on the way. A bitmap is cut to
+// a quarter of the queue, the segments past it are acked by later acks.
+// Returns true if the ack was queued.
+bool receive_ack(ReceiverThread *self, RUDP_Header *header, uint8_t version, const char *data, uint16_t length)
+{
+    AckQueue *queue = &self->rudp->ack_queue;
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t position = tail & (ACK_QUEUE_SIZE - 1);
+    size_t size, skip = 0;
+    AckRecord *record;
+
+    // Only acks in the negotiated version and connection belong to this transfer.
+    if (!header->ack || header->hello || header->probe || version != self->peer_version
+        || header->conn_id != self->conn_id)
+    {
+        return false;
+    }
+    if (length > ACK_QUEUE_SIZE / 4) {
+        length = ACK_QUEUE_SIZE / 4;
+    }
+    size = (sizeof(AckRecord) + length + 7) & ~(size_t)7;
+    // A record does not wrap, the end of the queue is skipped.
+    if (position + size > ACK_QUEUE_SIZE) {
+        skip = ACK_QUEUE_SIZE - position;
+    }
+    if (tail + skip + size - queue->head_seen > ACK_QUEUE_SIZE) {
+        queue->head_seen = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (tail + skip + size - queue->head_seen > ACK_QUEUE_SIZE) {
+            return false;
+        }
+    }
+    if (skip != 0) {
+        ((AckRecord*)&queue->data[position])->size = 0;
+        tail += skip;
+        position = 0;
+    }
+    record = (AckRecord*)&queue->data[position];
+    record->size = size;
+    record->sack_length = length;
+    record->header = *header;
+    memcpy(record + 1, data, length);
+    atomic_store_explicit(&queue->tail, tail + size, memory_order_release);
+    return true;
+}
+
+// Keeps the reply of the peer to the message being sent.
+void keep_reply(RUDP *self, const char *data, uint16_t length)
+{
+    if (self->reply == NULL) {
+        self->reply = malloc(RUDP_REPLY_MAX);
+        if (self->reply == NULL) {
+            return;
+        }
+    }
+    self->reply_length = length < RUDP_REPLY_MAX ? length : RUDP_REPLY_MAX;
+    memcpy(self->reply, data, self->reply_length);
+}
+
+// Handles the acks the receiver thread has queued, on the thread of the sender.
+// Returns true when the last segment has been acked.
+bool handle_acks(RUDP *self)
+{
+    AckQueue *queue = &self->ack_queue;
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    AckRecord *record;
+    bool done = false;
+
+    queue->tail_seen = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    while (head != queue->tail_seen) {
+        record = (AckRecord*)&queue->data[head & (ACK_QUEUE_SIZE - 1)];
+        if (record->size == 0) {
+            head += ACK_QUEUE_SIZE - (head & (ACK_QUEUE_SIZE - 1));
+            continue;
+        }
+        if (self->logs) {
+            rudp_log(record->header.sack ? LOG_SACK_RECEIVED : LOG_ACK_RECEIVED, record->header.seqno,
+                        record->header.last);
+        }
+        stat_add(&self->stats.acks_received, 1);
+        if (record->header.reply) {
+            keep_reply(self, (const char*)(record + 1), record->sack_length);
+        }
+        if (process_ack(self, &record->header, (const uint8_t*)(record + 1),
+                        record->header.reply ? 0 : record->sack_length))
+        {
+            done = true;
+        }
+        head += record->size;
+    }
+    atomic_store_explicit(&queue->head, head, memory_order_release);
+    return done;
+}
+
+// Queues an ack of the segments received from a version 2 peer, acks every segment
+// before the window base and has a bitmap of the segments received after it.
+// On success 0 is returned. On error -1 is returned.
+int send_sack(ReceiverThread *self, SendBatch *acks)
+{
+    RUDP *rudp = self->rudp;
+    RUDP_Window *window = &rudp->window;
+    RUDP_Segment ack;
+    const char *data = (char*)self->sack;
+    uint32_t count = 0, i;
+    uint16_t length;
+
+    // Acks up to the end of a message with a reply carry it, later messages drop it.
+    if (rudp->reply != NULL && window->base != rudp->reply_seqno) {
+        free(rudp->reply);
+        rudp->reply = NULL;
+    }
+    // Bitmap covers [rcvBase + 1, sack_end - 1].
+    if ((int32_t)(self->sack_end - window->base) > 1) {
+        count = self->sack_end - window->base - 1;
+    }
+    if (count > MAX_PAYLOAD_SIZE * 8) {
+        count = MAX_PAYLOAD_SIZE * 8;
+    }
+    length = (count + 7) / 8;
+    memset(self->sack, 0, length);
+    for (i = 0; i < count; i++) {
+        if (rudp->buffer[get_slot(rudp, window->base + 1 + i)].header.ack) {
+            self->sack[i / 8] |= 1 << (i % 8);
+        }
+    }
+
+    make_ack_segment(&ack, window->base);
+    ack.header.conn_id = rudp->conn_id;
+    ack.header.sack = 1;
+    ack.header.last = self->done;
+    ack.header.window = rudp->window_size;
+    // Nothing after the message has been sent, so the reply takes the place of the bitmap.
+    if (rudp->reply != NULL) {
+        ack.header.reply = 1;
+        data = rudp->reply;
+        length = rudp->reply_length;
+    }
+    self->pending_acks = 0;
+    self->ack_now = false;
+    self->ack_deadline = 0;
+    stat_add(&rudp->stats.acks_sent, 1);
+    if (rudp->logs) {
+        rudp_log(LOG_SACK_SENT, window->base, ack.header.last);
+    }
+    return send_batch_add(rudp, acks, &ack.header, RUDP_VERSION_2, data, length,
+                            (struct sockaddr*)&self->ack_addr, self->ack_addrlen);
+}
+
+// Stores a segment received in the window unless it is a duplicate.
+// On success 0 is returned. If no space can be taken for its data -1 is returned.
+int store_segment(ReceiverThread *self, uint32_t index, char *data, uint16_t length, bool last,
+                    uint8_t version, WriteBatch *writes)
+{
+    RUDP *rudp = self->rudp;
+    RUDP_Window *window = &rudp->window;
+    RUDP_Segment *slot_segment = &rudp->buffer[get_slot(rudp, index)];
+
+    // Every full segment of a version 2 message has the length of the first one which arrives.
+    if (version == RUDP_VERSION_2 && !last && window->message_segment_size == 0) {
+        window->message_segment_size = length;
+    }
+    if (!slot_segment->header.ack) {
+        // Data of a message which goes to a file is written at once, only its length is kept.
+        // Segments of the next message are not sent before this one is acked, so every
+        // segment in the window belongs to the file. Until a full segment has arrived only
+        // the offset of the first segment is known, others are kept until they are in order.
+        // Compressed data is only written once it has been decompressed.
+        if (rudp->file_fd != -1 && version == RUDP_VERSION_2 && rudp->decompressor == NULL
+            && (window->message_segment_size != 0 || index == window->message_start))
+        {
+            // Data is copied anyway if a lost segment of its block may be rebuilt from it.
+            if (rudp->peer_features & RUDP_FEATURE_PARITY) {
+                if (slot_data(rudp, index) == NULL) {
+                    return -1;
+                }
+                make_segment(slot_segment, data, length, index);
+                data = slot_segment->data;
+            }
+            write_segment(rudp, writes, index, data, length);
+            make_segment_ref(slot_segment, NULL, length, index);
+        }
+        else {
+            if (slot_data(rudp, index) == NULL) {
+                return -1;
+            }
+            make_segment(slot_segment, data, length, index);
+        }
+        slot_segment->header.last = last;
+
+        // Mark the segment as received using ack field.
+        slot_segment->header.ack = 1;
+    }
+    if (index + 1 - window->base > self->sack_end - window->base) {
+        self->sack_end = index + 1;
+    }
+    return 0;
+}
+
+// Counts a version 2 segment for the next ack, which is sent to addr.
+void queue_ack(ReceiverThread *self, bool now, struct sockaddr *addr, socklen_t addrlen)
+{
+    self->pending_acks++;
+    if (now) {
+        self->ack_now = true;
+    }
+    self->ack_addrlen = addrlen < sizeof(self->ack_addr) ? addrlen : sizeof(self->ack_addr);
+    memcpy(&self->ack_addr, addr, self->ack_addrlen);
+}
+
+// If in order segemnt is received then deliver it and advance window base
+// to next not yet received segment. Delivered slots are freed for reuse.
+// On success 0 is returned. On error -1 is returned.
+int deliver_in_order(ReceiverThread *self, WriteBatch *writes)
+{
+    RUDP *rudp = self->rudp;
+    RUDP_Window *window = &rudp->window;
+    RUDP_Segment *slot_segment;
+    uint32_t base = window->base;
+
+    while (!self->done && rudp->buffer[get_slot(rudp, window->base)].header.ack) {
+        slot_segment = &rudp->buffer[get_slot(rudp, window->base)];
+        if (deliver_segment(rudp, slot_segment, writes) == -1) {
+            return -1;
+        }
+        slot_segment->header.ack = 0;
+        if (slot_segment->header.last) {
+            self->done = true;
+            window->message_start = window->base + 1;
+            window->message_segment_size = 0;
+        }
+        window->base++;
+    }
+    // A segment which fills a gap is acked at once.
+    if (window->base - base > 1) {
+        self->ack_now = true;
+    }
+    return 0;
+}
+
+void fec_decoder_free(FecDecoder *self)
+{
+    if (self == NULL) {
+        return;
+    }
+    free(self->blocks);
+    free(self->parity);
+    free(self->scratch);
+    free(self);
+}
+
+// Makes the decoder of rudp ready for blocks of block_size data and parity_count parity
+// segments, parity kept for blocks of another layout is dropped.
+// On success 0 is returned. On error -1 is returned.
+int fec_decoder_init(RUDP *rudp, uint8_t block_size, uint8_t parity_count)
+{
+    FecDecoder *fec = rudp->fec_decoder;
+    uint32_t block_count = 2;
+
+    // Blocks of a window and the ones at its edges fit.
+    while (block_count < rudp->window.size / block_size + 2) {
+        block_count *= 2;
+    }
+    if (fec == NULL) {
+        fec = calloc(1, sizeof(FecDecoder));
+        if (fec == NULL) {
+            return -1;
+        }
+        rudp->fec_decoder = fec;
+    }
+    free(fec->blocks);
+    free(fec->parity);
+    free(fec->scratch);
+    fec->blocks = calloc(block_count, sizeof(FecBlock));
+    fec->parity = malloc((size_t)block_count * parity_count * rudp->segment_size);
+    fec->scratch = malloc(rudp->segment_size);
+    fec->block_size = 0;
+    fec->pending = 0;
+    if (fec->blocks == NULL || fec->parity == NULL || fec->scratch == NULL) {
+        return -1;
+    }
+    fec->block_count = block_count;
+    fec->block_size = block_size;
+    fec->parity_count = parity_count;
+    return 0;
+}
+
+// Rebuilds the lost data segments of a block once as many of its parity segments have arrived.
+// The block is released when it has been rebuilt or all of its data segments have arrived.
+// Rebuilt segments are stored as if they were received from addr.
+void rebuild_block(ReceiverThread *self, FecBlock *block, struct sockaddr *addr, socklen_t addrlen,
+                    WriteBatch *writes)
+{
+    RUDP *rudp = self->rudp;
+    RUDP_Window *window = &rudp->window;
+    FecDecoder *fec = rudp->fec_decoder;
+    RUDP_Segment *segment;
+    uint8_t matrix[FEC_MAX_PARITY * FEC_MAX_PARITY], inverse[FEC_MAX_PARITY * FEC_MAX_PARITY];
+    uint8_t rows[FEC_MAX_PARITY], lost[FEC_MAX_PARITY], head[FEC_SYMBOL_HEADER];
+    uint8_t *symbols[FEC_MAX_PARITY];
+    uint8_t *parity = fec->parity + (size_t)(block - fec->blocks) * fec->parity_count * rudp->segment_size;
+    uint64_t lost_mask = 0;
+    uint32_t index;
+    uint16_t length;
+    uint8_t c;
+    int row_count = 0, lost_count = 0, i, a, b;
+
+    for (i = 0; i < fec->parity_count; i++) {
+        if (block->rows >> i & 1) {
+            rows[row_count++] = i;
+        }
+    }
+    // Segments before the window base have been delivered, their data is still in the buffer.
+    for (i = 0; i < block->count; i++) {
+        index = block->first + i;
+        if ((int32_t)(index - window->base) >= 0 && !rudp->buffer[get_slot(rudp, index)].header.ack) {
+            // More parity or the lost segments themselves may still arrive.
+            if (lost_count == row_count) {
+                return;
+            }
+            lost[lost_count++] = i;
+            lost_mask |= (uint64_t)1 << i;
+        }
+    }
+    block->used = false;
+    fec->pending--;
+    if (lost_count == 0) {
+        return;
+    }
+
+    // The segments which arrived are taken out of the parity symbols, what is left are
+    // the lost segments times the coefficients of their columns.
+    for (a = 0; a < lost_count; a++) {
+        symbols[a] = parity + (size_t)rows[a] * rudp->segment_size;
+        for (b = 0; b < lost_count; b++) {
+            matrix[a * lost_count + b] = fec_coefficient(fec->parity_count, rows[a], lost[b]);
+        }
+    }
+    for (i = 0; i < block->count; i++) {
+        if (lost_mask >> i & 1) {
+            continue;
+        }
+        segment = &rudp->buffer[get_slot(rudp, block->first + i)];
+        length = segment->length + FEC_SYMBOL_HEADER <= block->symbol_size ? segment->length
+                                                                            : block->symbol_size - FEC_SYMBOL_HEADER;
+        head[0] = segment->header.last;
+        head[1] = segment->length >> 8;
+        head[2] = segment->length & 0xFF;
+        for (a = 0; a < lost_count; a++) {
+            c = fec_coefficient(fec->parity_count, rows[a], i);
+            fec_mul_add(symbols[a], head, c, FEC_SYMBOL_HEADER);
+            fec_mul_add(symbols[a] + FEC_SYMBOL_HEADER, (const uint8_t*)segment->data, c, length);
+        }
+    }
+    if (fec_invert(matrix, inverse, lost_count) == -1) {
+        return;
+    }
+    for (b = 0; b < lost_count; b++) {
+        memset(fec->scratch, 0, block->symbol_size);
+        for (a = 0; a < lost_count; a++) {
+            fec_mul_add(fec->scratch, symbols[a], inverse[b * lost_count + a], block->symbol_size);
+        }
+        index = block->first + lost[b];
+        length = fec->scratch[1] << 8 | fec->scratch[2];
+        if (length > block->symbol_size - FEC_SYMBOL_HEADER || index - window->base >= window->size) {
+            continue;
+        }
+        // A segment which cannot be stored is left to be resent.
+        if (store_segment(self, index, (char*)fec->scratch + FEC_SYMBOL_HEADER, length, fec->scratch[0] & 1,
+                            RUDP_VERSION_2, writes) == -1)
+        {
+            continue;
+        }
+        queue_ack(self, true, addr, addrlen);
+        stat_add(&rudp->loss_stats.segments_rebuilt, 1);
+        if (rudp->logs) {
+            rudp_log(LOG_SEGMENT_REBUILT, index, false);
+        }
+    }
+}
+
+// Keeps the symbol of a parity segment with its block and rebuilds the block if it can.
+void receive_parity(ReceiverThread *self, RUDP_Header *header, const char *data, uint16_t length,
+                        struct sockaddr *addr, socklen_t addrlen, WriteBatch *writes)
+{
+    RUDP *rudp = self->rudp;
+    RUDP_Window *window = &rudp->window;
+    FecDecoder *fec = rudp->fec_decoder;
+    FecBlock *block;
+    const uint8_t *fields = (const uint8_t*)data;
+    uint8_t row, count, parity_count, block_size;
+    uint16_t symbol_size = length - FEC_HEADER_SIZE;
+
+    stat_add(&rudp->loss_stats.parity_received, 1);
+    if (length < FEC_HEADER_SIZE + FEC_SYMBOL_HEADER) {
+        return;
+    }
+    row = fields[0];
+    count = fields[1];
+    parity_count = fields[2];
+    block_size = fields[3];
+    if (parity_count == 0 || parity_count > FEC_MAX_PARITY || row >= parity_count
+        || block_size == 0 || block_size > FEC_MAX_DATA || count == 0 || count > block_size)
+    {
+        return;
+    }
+    // Blocks which have been delivered or are past the window are not rebuilt.
+    if ((int32_t)(header->seqno + count - window->base) <= 0
+        || (int32_t)(header->seqno - window->base) >= (int32_t)window->size)
+    {
+        return;
+    }
+    if (rudp->logs) {
+        rudp_log(LOG_PARITY_RECEIVED, header->seqno, false);
+    }
+    if (fec == NULL || fec->block_size != block_size || fec->parity_count != parity_count) {
+        if (fec_decoder_init(rudp, block_size, parity_count) == -1) {
+            return;
+        }
+        fec = rudp->fec_decoder;
+    }
+
+    // Blocks follow each other and have at most block_size segments, so the blocks of a window
+    // have about consecutive numbers. A block which ended early may replace the one before it.
+    block = &fec->blocks[(header->seqno / block_size) & (fec->block_count - 1)];
+    if (!block->used || block->first != header->seqno) {
+        if (!block->used) {
+            fec->pending++;
+        }
+        block->used = true;
+        block->first = header->seqno;
+        block->count = count;
+        block->rows = 0;
+        block->symbol_size = symbol_size;
+    }
+    if ((block->rows >> row & 1) || block->count != count || block->symbol_size != symbol_size) {
+        return;
+    }
+    memcpy(fec->parity + ((size_t)(block - fec->blocks) * parity_count + row) * rudp->segment_size,
+            data + FEC_HEADER_SIZE, symbol_size);
+    block->rows |= 1 << row;
+    rebuild_block(self, block, addr, addrlen, writes);
+}
+
+// Tries again to rebuild the block of a data segment which arrived, if it is waiting for more.
+void retry_block(ReceiverThread *self, uint32_t index, struct sockaddr *addr, socklen_t addrlen,
+                    WriteBatch *writes)
+{
+    FecDecoder *fec = self->rudp->fec_decoder;
+    FecBlock *block;
+
+    // The block of a segment has the number of the segment or the one before.
+    for (uint32_t number = index / fec->block_size - 1; number != index / fec->block_size + 1; number++) {
+        block = &fec->blocks[number & (fec->block_count - 1)];
+        if (block->used && index - block->first < block->count) {
+            rebuild_block(self, block, addr, addrlen, writes);
+            return;
+        }
+    }
+}
+
+// Handles a datagram received by the receiver. Acks are added to the batch acks
+// and data which goes to a file to the batch writes.
+// On success 0 is returned. On error -1 is returned.
+int receive_data(ReceiverThread *self, RUDP_Header *header, uint8_t version, char *data, uint16_t length,
+                    struct sockaddr *addr, socklen_t addrlen, SendBatch *acks, WriteBatch *writes)
+{
+    RUDP *rudp = self->rudp;
+    RUDP_Window *window = &rudp->window;
+    RUDP_Segment ack;
+    uint32_t offset, index;
+
+    if (header->hello && !header->ack) {
+        return accept_hello(self, header, data, length, addr, addrlen);
+    }
+    if (header->probe && !header->ack && version == RUDP_VERSION_2) {
+        return accept_probe(self, header, addr, addrlen);
+    }
+    if (header->ack || length > rudp->segment_size) {
+        return 0;
+    }
+    // A version 2 peer falls back to version 1 if none of its hellos were answered.
+    if (version != rudp->peer_version) {
+        if (version == RUDP_VERSION_2) {
+            return 0;
+        }
+        rudp->peer_version = RUDP_VERSION_1;
+        rudp->conn_id = 0;
+        window_init(window, rudp, 0, WINDOW_SIZE);
+    }
+    // Segments of other peers are discarded.
+    if (header->conn_id != rudp->conn_id) {
+        return 0;
+    }
+    if (header->parity) {
+        if (self->done) {
+            return 0;
+        }
+        receive_parity(self, header, data, length, addr, addrlen, writes);
+        return deliver_in_order(self, writes);
+    }
+    if (rudp->logs) {
+        rudp_log(LOG_SEGMENT_RECEIVED, header->seqno, header->last);
+    }
+
+    offset = get_offset(window, header->seqno);
+    index = window->base + offset;
+    stat_add(&rudp->stats.segments_received, 1);
+    if (offset < window->size ? rudp->buffer[get_slot(rudp, index)].header.ack : offset > window->mask - window->size) {
+        stat_add(&rudp->stats.segments_duplicate, 1);
+    }
+
+    // If segment is in [rcvBase, rcvBase + WINDOW_SIZE - 1].
+    if (offset < window->size) {
+        if (store_segment(self, index, data, length, header->last, version, writes) == -1) {
+            return -1;
+        }
+        // A block which had too little parity may now be rebuilt.
+        if (rudp->fec_decoder != NULL && rudp->fec_decoder->pending > 0) {
+            retry_block(self, index, addr, addrlen, writes);
+        }
+    }
+    // If segment is not in [rcvBase - WINDOW_SIZE, rcvBase - 1] it is not acked.
+    else if (offset <= window->mask - window->size) {
+        return 0;
+    }
+
+    if (version == RUDP_VERSION_1) {
+        // Queue ack for received segment, acks are sent when the batch has been handled.
+        make_ack_segment(&ack, header->seqno);
+        ack.header.last = header->last;
+        if (send_batch_add(rudp, acks, &ack.header, version, NULL, 0, addr, addrlen) == -1) {
+            return -1;
+        }
+        stat_add(&rudp->stats.acks_sent, 1);
+        if (rudp->logs) {
+            rudp_log(offset < window->size ? LOG_ACK_SENT : LOG_ACK_RESENT, header->seqno, ack.header.last);
+        }
+    }
+    else {
+        // Acks of version 2 segments are delayed and cover many segments. Segments out of
+        // order, duplicates, the last segment and segments the sender waits for are acked at once.
+        queue_ack(self, offset != 0 || header->last || header->ack_now, addr, addrlen);
+    }
+    return deliver_in_order(self, writes);
+}
+
+// Queues one ack for the version 2 segments received in a batch, when ACK_EVERY of them or
+// the whole window of the sender are waiting, or an ack must not be delayed, as in message mode.
+// Otherwise the ack is sent after ACK_DELAY.
+// On success 0 is returned. On error -1 is returned.
+int ack_batch(ReceiverThread *self, SendBatch *acks)
+{
+    if (self->pending_acks == 0) {
+        return 0;
+    }
+    if (self->ack_now || self->done || self->rudp->messages || self->pending_acks >= ACK_EVERY
+        || self->pending_acks >= self->rudp->peer_window)
+    {
+        return send_sack(self, acks);
+    }
+    if (self->ack_deadline == 0) {
+        self->ack_deadline = now_us() + ACK_DELAY;
+    }
+    return 0;
+}
+
+// Waits until a datagram can be read from the socket or the time is reached.
+// Returns true if a datagram can be read.
+bool wait_readable(int sockfd, uint64_t time)
+{
+    struct pollfd pfd;
+    struct timespec timeout;
+    uint64_t now = now_us();
+    uint64_t wait = time > now ? time - now : 0;
+
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    timeout.tv_sec = wait / 1000000;
+    timeout.tv_nsec = wait % 1000000 * 1000;
+    return ppoll(&pfd, 1, &timeout, NULL) != 0;
+}
+
+// Waits until an ack can be read from the socket, the sender stops the receiver thread or
+// the time, 0 for none, is reached.
+// Returns true if a datagram can be read.
+bool wait_acks(ReceiverThread *self, uint64_t time)
+{
+    struct pollfd pfds[2];
+    struct timespec timeout;
+    uint64_t now = now_us();
+    uint64_t wait = time > now ? time - now : 0;
+
+    pfds[0].fd = self->sockfd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = self->rudp->stopfd;
+    pfds[1].events = POLLIN;
+    timeout.tv_sec = wait / 1000000;
+    timeout.tv_nsec = wait % 1000000 * 1000;
+    return ppoll(pfds, 2, time != 0 ? &timeout : NULL, NULL) > 0 && (pfds[0].revents & POLLIN);
+}
+
+// Acks again a data segment of a message the peer sent before, when the sender of a reply gets
+// it. The ack of the last segment of the message may have been lost, and the peer resends it
+// until it is acked.
+// On success 0 is returned. On error -1 is returned.
+int ack_delivered(ReceiverThread *self, RUDP_Header *header, uint8_t version, struct sockaddr *addr,
+                    socklen_t addrlen, SendBatch *acks)
+{
+    RUDP *rudp = self->rudp;
+    RUDP_Segment ack;
+
+    if (header->ack || header->hello || header->probe || header->parity || version != RUDP_VERSION_2
+        || self->peer_version != RUDP_VERSION_2 || header->conn_id != self->conn_id
+        || self->recv_seqno - header->seqno - 1 >= rudp->window_size)
+    {
+        return 0;
+    }
+    make_ack_segment(&ack, self->recv_seqno);
+    ack.header.conn_id = self->conn_id;
+    ack.header.sack = 1;
+    ack.header.last = 1;
+    ack.header.window = rudp->window_size;
+    stat_add(&rudp->stats.acks_sent, 1);
+    return send_batch_add(rudp, acks, &ack.header, RUDP_VERSION_2, NULL, 0, addr, addrlen);
+}
+
+// Keeps a data segment of the next message of the peer which the receiver thread of a sender
+// read, for the receive which follows. Segments beyond EARLY_DATAGRAMS are resent by the peer.
+void keep_early(ReceiverThread *self, RUDP_Header *header, uint8_t version, const char *datagram,
+                    uint32_t bytes, struct msghdr *msg)
+{
+    RUDP *rudp = self->rudp;
+    EarlyDatagrams *early = &rudp->early;
+    char *data;
+
+    if (header->ack || header->hello || header->probe || header->parity || version != RUDP_VERSION_2
+        || self->peer_version != RUDP_VERSION_2 || header->conn_id != self->conn_id
+        || header->seqno - self->recv_seqno >= rudp->window_size || early->count == EARLY_DATAGRAMS)
+    {
+        return;
+    }
+    data = malloc(bytes);
+    if (data == NULL) {
+        return;
+    }
+    memcpy(data, datagram, bytes);
+    early->data[early->count] = data;
+    early->length[early->count] = bytes;
+    memset(&early->addr[early->count], 0, sizeof(early->addr[early->count]));
+    memcpy(&early->addr[early->count], msg->msg_name, msg->msg_namelen < sizeof(struct sockaddr_in)
+                                                        ? msg->msg_namelen : sizeof(struct sockaddr_in));
+    early->count++;
+}
+
+// Frees the segments kept for the next receive.
+void free_early(RUDP *self)
+{
+    for (int i = 0; i < self->early.count; i++) {
+        free(self->early.data[i]);
+    }
+    self->early.count = 0;
+}
+
+// Handles one datagram received by the receiver thread.
+// Returns true if an ack was queued for the sender.
+bool receive_datagram(ReceiverThread *self, char *datagram, uint32_t bytes, struct msghdr *msg,
+                        SendBatch *acks, WriteBatch *writes)
+{
+    RUDP_Header header;
+    ssize_t header_length;
+    uint8_t version;
+
+    header_length = unpack_header(&header, datagram, bytes, &version);
+    if (header_length == -1) {
+        stat_add(&self->rudp->stats.datagrams_corrupt, 1);
+        return false;
+    }
+    // For Sender.
+    // If an ack is received.
+    if (self->sending) {
+        ack_delivered(self, &header, version, msg->msg_name, msg->msg_namelen, acks);
+        keep_early(self, &header, version, datagram, bytes, msg);
+        return receive_ack(self, &header, version, datagram + header_length, bytes - header_length);
+    }
+    // For Receiver.
+    // If a data segment is received.
+    else if (receive_data(self, &header, version, datagram + header_length, bytes - header_length,
+                            msg->msg_name, msg->msg_namelen, acks, writes) == -1)
+    {
+        self->bytes_received = -1;
+        self->done = true;
+    }
+    return false;
+}
+
+// Passes the first count messages of a batch to receive_datagram, until the last segment.
+// Returns true if acks were queued for the sender.
+bool receive_batch(ReceiverThread *self, RecvBatch *batch, int count, SendBatch *acks, WriteBatch *writes)
+{
+    uint32_t offset, size;
+    bool queued = false;
+
+    for (int i = 0; i < count && !self->done; i++) {
+        // A buffer joined by the kernel is split into its datagrams.
+        for (offset = 0; offset < batch->msgs[i].msg_len && !self->done; offset += size) {
+            size = batch->msgs[i].msg_len - offset < batch->gro_size[i] ? batch->msgs[i].msg_len - offset
+                                                                         : batch->gro_size[i];
+            queued |= receive_datagram(self, recv_batch_buffer(batch, i) + offset, size,
+                                        &batch->msgs[i].msg_hdr, acks, writes);
+        }
+    }
+    return queued;
+}
+
+// Passes the datagrams the sender kept to receive_datagram, as if they were a batch. They are
+// freed once the data of the batch has been written.
+void receive_early(ReceiverThread *self, SendBatch *acks, WriteBatch *writes)
+{
+    EarlyDatagrams *early = &self->rudp->early;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    for (int i = 0; i < early->count && !self->done; i++) {
+        msg.msg_name = &early->addr[i];
+        msg.msg_namelen = sizeof(early->addr[i]);
+        receive_datagram(self, early->data[i], early->length[i], &msg, acks, writes);
+    }
+}
+
+// Receives datagrams in batches. Acks of a batch of data segments are sent together.
+// The receiver thread of a sender passes acks to the sender and runs until it is stopped.
+// A receiver runs it on its own thread until the last segment.
+void* receive(void* arg)
+{
+    ReceiverThread *self = (ReceiverThread*)arg;
+    RUDP *rudp = self->rudp;
+    RecvBatch batch;
+    SendBatch acks;
+    WriteBatch writes;
+    bool queued;
+    int count;
+
+    if (recv_batch_init(&batch, rudp) == -1) {
+        self->bytes_received = -1;
+        self->stop = true;
+    }
+    send_batch_init(&acks);
+    write_batch_init(&writes);
+
+    while (!self->stop) {
+        // A delayed ack is sent if no segment arrives before its deadline.
+        if (self->ack_deadline != 0 && !wait_readable(rudp->sockfd, self->ack_deadline)) {
+            if (send_sack(self, &acks) == -1 || send_batch_flush(rudp, &acks) == -1) {
+                self->bytes_received = -1;
+                self->stop = true;
+                break;
+            }
+            continue;
+        }
+        if (self->sending && !wait_acks(self, 0)) {
+            continue;
+        }
+        // A receiver first takes the segments its sender kept.
+        if (!self->sending && rudp->early.count > 0) {
+            receive_early(self, &acks, &writes);
+            queued = false;
+        }
+        else {
+            count = recv_batch(rudp, &batch);
+            if (count == -1) {
+                self->bytes_received = -1;
+                self->stop = true;
+                break;
+            }
+            queued = receive_batch(self, &batch, count, &acks, &writes);
+        }
+        // Data is written before it is acked.
+        write_batch_flush(&writes);
+        if (!self->sending) {
+            free_early(rudp);
+            release_delivered(rudp);
+        }
+        if (self->bytes_received != -1 && ack_batch(self, &acks) == -1) {
+            self->bytes_received = -1;
+        }
+        if (send_batch_flush(rudp, &acks) == -1) {
+            self->bytes_received = -1;
+        }
+        // If all segments or acks received.
+        if (self->done || self->bytes_received == -1) {
+            self->stop = true;
+        }
+        // Sender is woken once per batch which had acks.
+        else if (queued) {
+            wake_sender(rudp);
+        }
+    }
+    if (self->sending) {
+        wake_sender(rudp);
+    }
+    recv_batch_free(&batch);
+    return NULL;
+}
+
+// Used by a sender in message mode, which has no receiver thread, to wait until acks arrive or
+// the time expiry_time, 0 if no timer is running, is reached, and queue them as its receiver
+// thread would. The batch they are read into is kept for the next call.
+// On success 0 is returned. On error -1 is returned.
+int read_acks(RUDP *self, uint64_t expiry_time)
+{
+    size_t buffer_size = self->gro ? GRO_BUFFER_SIZE : sizeof(RUDP_Header_v2) + self->segment_size;
+    SendBatch acks;
+    WriteBatch writes;
+    int count;
+
+    // Segment size and offload may have changed since the batch was made.
+    if (self->ack_batch != NULL && self->ack_batch->buffer_size != buffer_size) {
+        recv_batch_free(self->ack_batch);
+        free(self->ack_batch);
+        self->ack_batch = NULL;
+    }
+    if (self->ack_batch == NULL) {
+        self->ack_batch = malloc(sizeof(RecvBatch));
+        if (self->ack_batch == NULL) {
+            return -1;
+        }
+        if (recv_batch_init(self->ack_batch, self) == -1) {
+            free(self->ack_batch);
+            self->ack_batch = NULL;
+            return -1;
+        }
+    }
+    if (!wait_acks(&self->receiver, expiry_time)) {
+        return 0;
+    }
+    count = recv_batch(self, self->ack_batch);
+    if (count == -1) {
+        return -1;
+    }
+    send_batch_init(&acks);
+    write_batch_init(&writes);
+    receive_batch(&self->receiver, self->ack_batch, count, &acks, &writes);
+    return send_batch_flush(self, &acks);
+}
+
+
+
+// ==================== RUDP Functions ====================
+
+// Returns a random connection ID which is not 0.
+uint32_t new_conn_id(void)
+{
+    uint32_t id = 0;
+
+    while (id == 0) {
+        if (getrandom(&id, sizeof(id), 0) != sizeof(id)) {
+            id = (uint32_t)(now_us() * 2654435761u) ^ (uint32_t)getpid();
+        }
+    }
+    return id;
+}
+
+void rudp_init(RUDP *self)
+{
+    self->sockfd = -1;
+    self->logs = false;
+    self->file_ring = NULL;
+    self->prefetcher = NULL;
+    self->file_fd = -1;
+    self->on_data = NULL;
+    self->user = NULL;
+    self->closed = false;
+    self->hash_next = NULL;
+    self->buffer = NULL;
+    self->timers = NULL;
+    self->buffer_size = 0;
+    self->window_size = 0;
+    self->segment_size = DEFAULT_SEGMENT_SIZE;
+    self->peer_segment_size = MAX_PAYLOAD_SIZE;
+    self->path_segment_size = MAX_PAYLOAD_SIZE;
+    self->gso = false;
+    self->gro = false;
+    heap_init(&self->timer_heap);
+    rtt_init(&self->rtt);
+    cc_init(&self->cc, CC_DEFAULT);
+    self->version = RUDP_VERSION_AUTO;
+    self->features = RUDP_FEATURE_FILE_HEADER | RUDP_FEATURE_FEC | RUDP_FEATURE_COMPRESS | RUDP_FEATURE_CHECKSUM
+                        | RUDP_FEATURE_DELTA | RUDP_FEATURE_RESUME;
+    self->streams = 1;
+    self->fec_data = FEC_MAX_DATA / 4;
+    self->fec_parity = 0;
+    memset(&self->fec_encoder, 0, sizeof(self->fec_encoder));
+    self->fec_decoder = NULL;
+    self->compress = false;
+    self->checksums = false;
+    self->delta = false;
+    self->resume = false;
+    self->messages = false;
+    self->slots_clear = false;
+    self->ack_batch = NULL;
+    self->manifest = NULL;
+    self->reply = NULL;
+    self->reply_length = 0;
+    self->compressor = NULL;
+    self->decompressor = NULL;
+    self->async = NULL;
+    memset(&self->loss_stats, 0, sizeof(self->loss_stats));
+    memset(&self->stats, 0, sizeof(self->stats));
+    self->peer_version = 0;
+    self->peer_features = 0;
+    self->peer_window = WINDOW_SIZE;
+    self->conn_id = new_conn_id();
+    self->send_seqno = 0;
+    self->recv_seqno = 0;
+    self->batching = true;
+    self->recv_batching = true;
+    memset(&self->batch_stats, 0, sizeof(self->batch_stats));
+    self->ack_queue.data = NULL;
+    self->early.count = 0;
+    self->epfd = self->eventfd = self->stopfd = self->timerfd = -1;
+}
+
+int rudp_socket(RUDP *self)
+{
+    rudp_init(self);
+    self->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (self->sockfd == -1) {
+        return -1;
+    }
+    if (events_init(self) == -1 || rudp_set_window(self, DEFAULT_WINDOW_SIZE) == -1) {
+        events_free(self);
+        close(self->sockfd);
+        return -1;
+    }
+    return self->sockfd;
+}
+
+int rudp_close(RUDP *self)
+{
+    async_stop(self);
+    release_buffer_data(self);
+    free(self->buffer);
+    free(self->timers);
+    free(self->fec_encoder.parity);
+    free(self->fec_encoder.block_ends);
+    free(self->ack_queue.data);
+    free(self->reply);
+    fec_decoder_free(self->fec_decoder);
+    decompressor_free(self);
+    heap_free(&self->timer_heap);
+    free_early(self);
+    if (self->ack_batch != NULL) {
+        recv_batch_free(self->ack_batch);
+        free(self->ack_batch);
+        self->ack_batch = NULL;
+    }
+    events_free(self);
+    self->buffer = NULL;
+    self->timers = NULL;
+    self->buffer_size = 0;
+    self->fec_encoder.parity = NULL;
+    self->fec_encoder.parity_length = 0;
+    self->fec_encoder.block_ends = NULL;
+    self->fec_encoder.block_ends_size = 0;
+    self->fec_decoder = NULL;
+    self->ack_queue.data = NULL;
+    self->reply = NULL;
+    return close(self->sockfd);
+}
+
+int rudp_bind(RUDP *self, const struct sockaddr *addr, socklen_t addrlen)
+{
+    return bind(self->sockfd, addr, addrlen);
+}
+
+int rudp_set_reuseport(RUDP *self)
+{
+    int on = 1;
+
+    return setsockopt(self->sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+}
+
+int rudp_set_streams(RUDP *self, int streams)
+{
+    if (streams < 1 || streams > MAX_STREAMS) {
+        return -1;
+    }
+    self->streams = streams;
+    return 0;
+}
+
+int rudp_set_fec(RUDP *self, int data, int parity)
+{
+    if (data < 1 || data > FEC_MAX_DATA || parity < 0 || parity > FEC_MAX_PARITY) {
+        return -1;
+    }
+    self->fec_data = data;
+    self->fec_parity = parity;
+    if (parity > 0) {
+        self->features |= RUDP_FEATURE_PARITY;
+    }
+    else {
+        self->features &= ~RUDP_FEATURE_PARITY;
+    }
+    return 0;
+}
+
+void rudp_set_compression(RUDP *self, bool on)
+{
+    self->compress = on;
+}
+
+void rudp_set_checksums(RUDP *self, bool on)
+{
+    self->checksums = on;
+}
+
+void rudp_set_delta(RUDP *self, bool on)
+{
+    self->delta = on;
+}
+
+void rudp_set_resume(RUDP *self, bool on)
+{
+    self->resume = on;
+}
+
+void rudp_set_messages(RUDP *self, bool on)
+{
+    self->messages = on;
+}
+
+int rudp_set_congestion(RUDP *self, const char *name)
+{
+    return cc_init(&self->cc, name);
+}
+
+void rudp_get_stats(RUDP *self, RUDP_Stats *stats)
+{
+    stats->segments_sent = stat_get(&self->stats.segments_sent);
+    stats->segments_resent = stat_get(&self->loss_stats.segments_resent);
+    stats->timeouts = stat_get(&self->stats.timeouts);
+    stats->fast_retransmits = stat_get(&self->stats.fast_retransmits);
+    stats->acks_received = stat_get(&self->stats.acks_received);
+    stats->segments_received = stat_get(&self->stats.segments_received);
+    stats->segments_duplicate = stat_get(&self->stats.segments_duplicate);
+    stats->datagrams_corrupt = stat_get(&self->stats.datagrams_corrupt);
+    stats->acks_sent = stat_get(&self->stats.acks_sent);
+    stats->parity_sent = stat_get(&self->loss_stats.parity_sent);
+    stats->parity_received = stat_get(&self->loss_stats.parity_received);
+    stats->segments_rebuilt = stat_get(&self->loss_stats.segments_rebuilt);
+    stats->datagrams_sent = stat_get(&self->batch_stats.datagrams_sent);
+    stats->datagrams_received = stat_get(&self->batch_stats.datagrams_received);
+    stats->window_used = stat_get(&self->stats.window_used);
+    stats->window_size = self->window.size;
+    stats->bytes_in_flight = stat_get(&self->stats.bytes_in_flight);
+    stats->bytes_acked = stat_get(&self->stats.bytes_acked);
+    stats->memory = stat_get(&self->stats.memory);
+    stats->memory_peak = stat_get(&self->stats.memory_peak);
+    stats->compress_input = stat_get(&self->stats.compress_input);
+    stats->compress_output = stat_get(&self->stats.compress_output);
+    stats->compress_raw_blocks = stat_get(&self->stats.compress_raw_blocks);
+    stats->delta_matched = stat_get(&self->stats.delta_matched);
+    stats->delta_literal = stat_get(&self->stats.delta_literal);
+    stats->resumed = stat_get(&self->stats.resumed);
+    for (int i = 0; i < RUDP_HISTOGRAM_BUCKETS; i++) {
+        stats->rtt_histogram[i] = stat_get(&self->stats.rtt[i]);
+        stats->delivery_histogram[i] = stat_get(&self->stats.delivery[i]);
+    }
+}
+
+uint64_t rudp_histogram_percentile(const uint64_t *histogram, double fraction)
+{
+    uint64_t total = 0, count = 0;
+
+    for (int i = 0; i < RUDP_HISTOGRAM_BUCKETS; i++) {
+        total += histogram[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    for (int i = 0; i < RUDP_HISTOGRAM_BUCKETS; i++) {
+        count += histogram[i];
+        if (count >= fraction * total) {
+            return (uint64_t)2 << i;
+        }
+    }
+    return (uint64_t)2 << (RUDP_HISTOGRAM_BUCKETS - 1);
+}
+
+void rudp_print_batch_stats(RUDP *self)
+{
+    uint64_t send_calls = stat_get(&self->batch_stats.send_calls);
+    uint64_t recv_calls = stat_get(&self->batch_stats.recv_calls);
+    uint64_t datagrams_sent = stat_get(&self->batch_stats.datagrams_sent);
+    uint64_t datagrams_received = stat_get(&self->batch_stats.datagrams_received);
+
+    rudp_flush_logs();
+    printf("Datagrams Sent: %" PRIu64 " in %" PRIu64 " calls (%.1f per call)\n", datagrams_sent, send_calls,
+            send_calls ? (double)datagrams_sent / send_calls : 0.0);
+    printf("Datagrams Received: %" PRIu64 " in %" PRIu64 " calls (%.1f per call)\n", datagrams_received, recv_calls,
+            recv_calls ? (double)datagrams_received / recv_calls : 0.0);
+}
+
+void rudp_print_loss_stats(RUDP *self)
+{
+    RUDP_Stats stats;
+
+    rudp_get_stats(self, &stats);
+    rudp_flush_logs();
+    printf("Segments Resent: %" PRIu64 "\n", stats.segments_resent);
+    printf("Parity Segments: %" PRIu64 " sent, %" PRIu64 " received\n", stats.parity_sent, stats.parity_received);
+    printf("Segments Rebuilt by FEC: %" PRIu64 "\n", stats.segments_rebuilt);
+}
+
+void rudp_print_stats(RUDP *self)
+{
+    RUDP_Stats stats;
+
+    rudp_get_stats(self, &stats);
+    rudp_flush_logs();
+    if (stats.segments_sent > 0) {
+        printf("Segments Sent: %" PRIu64 " (%" PRIu64 " timeouts, %" PRIu64 " fast retransmits)\n",
+                stats.segments_sent, stats.timeouts, stats.fast_retransmits);
+        printf("Acks Received: %" PRIu64 "\n", stats.acks_received);
+    }
+    if (stats.segments_received > 0) {
+        printf("Segments Received: %" PRIu64 " (%" PRIu64 " duplicates)\n", stats.segments_received,
+                stats.segments_duplicate);
+        printf("Acks Sent: %" PRIu64 "\n", stats.acks_sent);
+    }
+    if (stats.datagrams_corrupt > 0) {
+        printf("Corrupt Datagrams Dropped: %" PRIu64 "\n", stats.datagrams_corrupt);
+    }
+    // Percentiles are the upper bounds of histogram buckets.
+    if (rudp_histogram_percentile(stats.rtt_histogram, 1) > 0) {
+        printf("RTT: p50 < %" PRIu64 " us, p99 < %" PRIu64 " us\n",
+                rudp_histogram_percentile(stats.rtt_histogram, 0.5),
+                rudp_histogram_percentile(stats.rtt_histogram, 0.99));
+    }
+    if (rudp_histogram_percentile(stats.delivery_histogram, 1) > 0) {
+        printf("Segment Delivery: p50 < %" PRIu64 " us, p99 < %" PRIu64 " us\n",
+                rudp_histogram_percentile(stats.delivery_histogram, 0.5),
+                rudp_histogram_percentile(stats.delivery_histogram, 0.99));
+    }
+    if (stats.compress_input > 0) {
+        printf("Compressed: %" PRIu64 " -> %" PRIu64 " bytes (%.1f%%, %" PRIu64 " blocks raw)\n",
+                stats.compress_input, stats.compress_output, 100.0 * stats.compress_output / stats.compress_input,
+                stats.compress_raw_blocks);
+    }
+    if (stats.delta_matched + stats.delta_literal > 0) {
+        printf("Delta: %" PRIu64 " bytes matched, %" PRIu64 " bytes sent as data\n", stats.delta_matched,
+                stats.delta_literal);
+    }
+    if (stats.resumed > 0) {
+        printf("Resumed: %" PRIu64 " bytes the receiver had were not sent\n", stats.resumed);
+    }
+    printf("Peak Memory: %" PRIu64 " bytes (segment pool %" PRIu64 " bytes)\n", stats.memory_peak,
+            pool_reserved());
+}
+
+// Asks for socket buffers which can hold a full window, the kernel may limit them.
+// Each datagram is charged about 4 times its size because of kernel overhead.
+void set_socket_buffers(RUDP *self)
+{
+    int socket_buffer;
+    uint64_t bytes = (uint64_t)self->window_size * 4 * (sizeof(RUDP_Header_v2) + self->segment_size);
+
+    socket_buffer = bytes > INT_MAX ? INT_MAX : (int)bytes;
+    setsockopt(self->sockfd, SOL_SOCKET, SO_SNDBUF, &socket_buffer, sizeof(socket_buffer));
+    setsockopt(self->sockfd, SOL_SOCKET, SO_RCVBUF, &socket_buffer, sizeof(socket_buffer));
+}
+
+int rudp_set_window(RUDP *self, uint32_t window_size)
+{
+    if (window_size < 1 || window_size > MAX_WINDOW_SIZE || alloc_buffer(self, window_size, self->segment_size) == -1) {
+        return -1;
+    }
+    set_socket_buffers(self);
+    return 0;
+}
+
+int rudp_set_segment_size(RUDP *self, uint32_t size)
+{
+    if (size < MAX_PAYLOAD_SIZE || size > MAX_SEGMENT_SIZE || alloc_buffer(self, self->window_size, size) == -1) {
+        return -1;
+    }
+    set_socket_buffers(self);
+    return 0;
+}
+
+int rudp_set_offload(RUDP *self, bool on)
+{
+    int off = 0, value = on;
+
+    // Setting a segment size of 0 fails if the kernel has no UDP_SEGMENT.
+    if (on && setsockopt(self->sockfd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) == -1) {
+        return -1;
+    }
+    if (setsockopt(self->sockfd, SOL_UDP, UDP_GRO, &value, sizeof(value)) == -1 && on) {
+        return -1;
+    }
+    self->gso = on;
+    self->gro = on;
+    return 0;
+}
+
+
+// Finds the largest segment size which reaches the peer. Probes padded to each candidate size
+// are sent with the DF bit set and the peer acks each one with its size as sequence number.
+// Probes too large for the path are dropped on the way, or are refused by the kernel.
+// On success 0 is returned. On error -1 is returned.
+int probe_path(RUDP *self, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    // Data sizes which fill jumbo frames, Ethernet frames and the IPv6 minimum MTU.
+    static const uint16_t common_sizes[] = { 8960, 1460, 1240 };
+    // Probes are padded with zeros.
+    static const char probe_padding[MAX_SEGMENT_SIZE];
+    uint16_t sizes[1 + sizeof(common_sizes) / sizeof(common_sizes[0])];
+    RUDP_Segment probe;
+    RUDP_Header reply;
+    char datagram[sizeof(RUDP_Header_v2) + MAX_PAYLOAD_SIZE];
+    struct pollfd pfd;
+    ssize_t bytes;
+    uint8_t version;
+    uint64_t deadline, now;
+    int count = 0, round, i;
+#ifdef IP_MTU_DISCOVER
+    int mtu_discover = IP_PMTUDISC_WANT, probe_mode = IP_PMTUDISC_PROBE;
+    socklen_t optlen = sizeof(mtu_discover);
+#endif
+
+    sizes[count++] = self->segment_size < self->peer_segment_size ? self->segment_size : self->peer_segment_size;
+    for (i = 0; i < (int)(sizeof(common_sizes) / sizeof(common_sizes[0])); i++) {
+        if (common_sizes[i] < sizes[0]) {
+            sizes[count++] = common_sizes[i];
+        }
+    }
+    self->path_segment_size = MAX_PAYLOAD_SIZE;
+    if (sizes[0] <= MAX_PAYLOAD_SIZE) {
+        return 0;
+    }
+
+#ifdef IP_MTU_DISCOVER
+    // Probes are not fragmented, whatever the kernel knows about the path.
+    getsockopt(self->sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &mtu_discover, &optlen);
+    setsockopt(self->sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &probe_mode, sizeof(probe_mode));
+#endif
+    make_ack_segment(&probe, 0);
+    probe.header.ack = 0;
+    probe.header.probe = 1;
+    probe.header.conn_id = self->conn_id;
+
+    pfd.fd = self->sockfd;
+    pfd.events = POLLIN;
+    // Probes of the sizes larger than the largest acked one are sent again each round,
+    // until the largest size is acked. Sizes are in decreasing order.
+    for (round = 0; round < PROBE_RETRIES && self->path_segment_size != sizes[0]; round++) {
+        for (i = 0; i < count && sizes[i] > self->path_segment_size; i++) {
+            probe.header.seqno = sizes[i];
+            if (send_packet(self->sockfd, &probe.header, RUDP_VERSION_2, probe_padding, sizes[i],
+                            dest_addr, addrlen) == -1 && errno != EMSGSIZE)
+            {
+                return -1;
+            }
+        }
+        deadline = now_us() + get_rto(self);
+        while ((now = now_us()) < deadline && self->path_segment_size != sizes[0]
+                && poll(&pfd, 1, (deadline - now + 999) / 1000) > 0)
+        {
+            bytes = recvfrom(self->sockfd, datagram, sizeof(datagram), 0, NULL, NULL);
+            if (bytes == -1) {
+                return -1;
+            }
+            if (unpack_header(&reply, datagram, bytes, &version) == -1) {
+                continue;
+            }
+            if (version == RUDP_VERSION_2 && reply.probe && reply.ack && reply.conn_id == self->conn_id
+                && reply.seqno > self->path_segment_size && reply.seqno <= sizes[0])
+            {
+                self->path_segment_size = reply.seqno;
+            }
+        }
+    }
+#ifdef IP_MTU_DISCOVER
+    setsockopt(self->sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &mtu_discover, sizeof(mtu_discover));
+#endif
+    return 0;
+}
+
+// Sends hellos until a version 2 peer replies, otherwise falls back to version 1.
+// A legacy peer does not reply, because it reads a hello as a stray ack.
+// On success 0 is returned. On error -1 is returned.
+int negotiate(RUDP *self, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    RUDP_Segment hello;
+    RUDP_Header reply;
+    char datagram[sizeof(RUDP_Header_v2) + MAX_PAYLOAD_SIZE];
+    struct pollfd pfds[2];
+    ssize_t bytes, header_length;
+    uint8_t version;
+    uint64_t sent_time = 0;
+    uint16_t peer_segment_size, features = htons(self->features);
+    int i;
+
+    if (self->peer_version != 0) {
+        return 0;
+    }
+    if (self->version == RUDP_VERSION_1) {
+        self->peer_version = RUDP_VERSION_1;
+        self->conn_id = 0;
+        return 0;
+    }
+
+    make_ack_segment(&hello, self->send_seqno);
+    hello.header.conn_id = self->conn_id;
+    hello.header.ack = 0;
+    hello.header.hello = 1;
+    hello.header.window = self->window_size;
+
+    // The stopfd is written when the socket is closed during an async send.
+    pfds[0].fd = self->sockfd;
+    pfds[0].events = POLLIN;
+    pfds[1].fd = self->stopfd;
+    pfds[1].events = POLLIN;
+    for (i = 0; i < HELLO_RETRIES; i++) {
+        sent_time = now_us();
+        if (send_packet(self->sockfd, &hello.header, RUDP_VERSION_2, (char*)&features, sizeof(features),
+                        dest_addr, addrlen) == -1)
+        {
+            return -1;
+        }
+        if (self->logs) {
+            rudp_log(LOG_HELLO_SENT, self->window_size, false);
+        }
+        while (poll(pfds, 2, HELLO_TIMEOUT * 1000) > 0) {
+            if (pfds[1].revents & POLLIN) {
+                return -1;
+            }
+            bytes = recvfrom(self->sockfd, datagram, sizeof(datagram), 0, NULL, NULL);
+            if (bytes == -1) {
+                return -1;
+            }
+            header_length = unpack_header(&reply, datagram, bytes, &version);
+            if (header_length == -1) {
+                continue;
+            }
+            if (version == RUDP_VERSION_2 && reply.hello && reply.ack && reply.seqno == self->send_seqno
+                && reply.conn_id == self->conn_id)
+            {
+                self->peer_version = RUDP_VERSION_2;
+                self->peer_window = reply.window;
+                // Reply to the first hello gives the first RTT sample.
+                if (i == 0) {
+                    rtt_sample(&self->rtt, now_us() - sent_time);
+                }
+                if (self->logs) {
+                    rudp_log(LOG_HELLO_ACKED, reply.window, false);
+                }
+                // Peers which send no segment size receive only MAX_PAYLOAD_SIZE bytes and know no probes.
+                self->peer_segment_size = MAX_PAYLOAD_SIZE;
+                self->peer_features = 0;
+                if (bytes - header_length >= (ssize_t)sizeof(peer_segment_size)) {
+                    memcpy(&peer_segment_size, datagram + header_length, sizeof(peer_segment_size));
+                    if (ntohs(peer_segment_size) > MAX_PAYLOAD_SIZE) {
+                        self->peer_segment_size = ntohs(peer_segment_size);
+                    }
+                }
+                if (bytes - header_length >= (ssize_t)(sizeof(peer_segment_size) + sizeof(features))) {
+                    memcpy(&features, datagram + header_length + sizeof(peer_segment_size), sizeof(features));
+                    self->peer_features = ntohs(features);
+                }
+                if (probe_path(self, dest_addr, addrlen) == -1) {
+                    return -1;
+                }
+                if (self->logs) {
+                    rudp_log(LOG_SEGMENT_SIZE, self->path_segment_size, false);
+                }
+                return 0;
+            }
+        }
+    }
+
+    if (self->version == RUDP_VERSION_2) {
+        return -1;
+    }
+    if (self->logs) {
+        rudp_log(LOG_NO_HELLO_REPLY, 0, false);
+    }
+    self->peer_version = RUDP_VERSION_1;
+    self->conn_id = 0;
+    return 0;
+}
+
+
+// Returns the number of data bytes in full segments of the session.
+uint16_t data_segment_size(RUDP *self)
+{
+    uint16_t size = self->fec_encoder.active ? self->path_segment_size - FEC_OVERHEAD : self->path_segment_size;
+
+    return sends_checksums(self) ? size - RUDP_CHECKSUM_SIZE : size;
+}
+
+// Used to make the segment with index from the compressor, file or buffer argument and insert it
+// in RUDP buffer just before it is sent. Segments are made one at a time so that any amount of data
+// can be sent through the ring buffer. Segments of the buffer argument point into it, only data
+// read from the file or compressor is copied into the ring buffer.
+// On success 0 is returned. On error -1 is returned.
+int insert_segment(RUDP *self, uint32_t index)
+{
+    RUDP_Segment *segment = &self->buffer[get_slot(self, index)];
+    uint16_t size = data_segment_size(self);
+    uint16_t length;
+    ssize_t taken;
+    char *data;
+    bool last;
+
+    if (self->compressor != NULL) {
+        data = slot_data(self, index);
+        if (data == NULL) {
+            return -1;
+        }
+        length = compressor_read(self->compressor, data, size, &last);
+        make_segment_ref(segment, data, length, index);
+    }
+    else if (self->file_ring != NULL) {
+        data = slot_data(self, index);
+        if (data == NULL) {
+            return -1;
+        }
+        taken = file_ring_read(self->file_ring, data, size, &last);
+        if (taken == -1) {
+            return -1;
+        }
+        length = taken;
+        self->file_crc = crc32c(self->file_crc, data, length);
+        make_segment_ref(segment, data, length, index);
+    }
+    else {
+        length = self->buffer_arg_len < size ? self->buffer_arg_len : size;
+        make_segment_ref(segment, self->buffer_arg, length, index);
+        self->buffer_arg += length;
+        self->buffer_arg_len -= length;
+        last = self->buffer_arg_len == 0;
+        if (self->prefetcher != NULL) {
+            prefetcher_take(self->prefetcher, self->buffer_arg - self->prefetcher->data);
+        }
+    }
+    // The last bit is set in the header of the segment which ends the data.
+    segment->header.last = last;
+    segment->header.conn_id = self->conn_id;
+    return 0;
+}
+
+// Adds the segment with index to the batch. Send errors are not reported,
+// segments which were not sent are resent when their timers expire.
+void send_segment(RUDP *self, SendBatch *batch, uint32_t index, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    RUDP_Segment *segment = &self->buffer[get_slot(self, index)];
+    send_batch_add(self, batch, &segment->header, self->peer_version, segment->payload, segment->length,
+                    dest_addr, addrlen);
+}
+
+// Makes the ring of parity spaces of the encoder, when parity segments are sent in the session.
+// On success 0 is returned. On error -1 is returned.
+int fec_encoder_init(RUDP *self)
+{
+    FecEncoder *fec = &self->fec_encoder;
+    size_t length;
+    uint8_t *parity;
+    uint32_t *block_ends;
+
+    fec->active = self->fec_parity > 0 && self->peer_version == RUDP_VERSION_2
+                    && (self->peer_features & RUDP_FEATURE_FEC);
+    fec->count = 0;
+    fec->next_space = 0;
+    if (!fec->active) {
+        return 0;
+    }
+    // Each block adds at least parity + 1 datagrams to a batch, so the batch which has the
+    // parity of a block is flushed before the space of the block is used again.
+    fec->spaces = BATCH_SIZE / (self->fec_parity + 1) + 2;
+    fec->capacity = self->path_segment_size;
+    length = fec->spaces * self->fec_parity * fec->capacity;
+    if (length > fec->parity_length) {
+        parity = realloc(fec->parity, length);
+        if (parity == NULL) {
+            return -1;
+        }
+        fec->parity = parity;
+        fec->parity_length = length;
+    }
+    if (fec->block_ends_size < self->buffer_size) {
+        block_ends = realloc(fec->block_ends, self->buffer_size * sizeof(uint32_t));
+        if (block_ends == NULL) {
+            return -1;
+        }
+        fec->block_ends = block_ends;
+        fec->block_ends_size = self->buffer_size;
+    }
+    return 0;
+}
+
+// Adds the parity segments of the block being sent to the batch, which ends the block.
+void fec_send_parity(RUDP *self, SendBatch *batch, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    FecEncoder *fec = &self->fec_encoder;
+    RUDP_Segment parity;
+    uint8_t *row;
+
+    make_segment_ref(&parity, NULL, 0, fec->first);
+    parity.header.parity = 1;
+    parity.header.conn_id = self->conn_id;
+    for (int r = 0; r < self->fec_parity; r++) {
+        row = fec->parity + ((size_t)fec->next_space * self->fec_parity + r) * fec->capacity;
+        row[0] = r;
+        row[1] = fec->count;
+        row[2] = self->fec_parity;
+        row[3] = self->fec_data;
+        send_batch_add(self, batch, &parity.header, RUDP_VERSION_2, (char*)row, FEC_HEADER_SIZE + fec->symbol_size,
+                        dest_addr, addrlen);
+    }
+    for (uint32_t i = 0; i < fec->count; i++) {
+        fec->block_ends[get_slot(self, fec->first + i)] = fec->first + fec->count;
+    }
+    if (self->logs) {
+        rudp_log(LOG_PARITY_SENT, fec->first, false);
+    }
+    stat_add(&self->loss_stats.parity_sent, self->fec_parity);
+    fec->count = 0;
+    fec->next_space = (fec->next_space + 1) % fec->spaces;
+}
+
+// Returns true if acks of later segments show a segment of the block being sent to be lost.
+bool fec_block_lost(RUDP *self)
+{
+    FecEncoder *fec = &self->fec_encoder;
+    uint32_t index = fec->first;
+
+    if (self->window.base - fec->first < fec->count) {
+        index = self->window.base;
+    }
+    for (; index != fec->first + fec->count && self->sack_high - index > DUPACK_THRESHOLD; index++) {
+        if (!self->buffer[get_slot(self, index)].header.ack) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Adds a segment sent for the first time to the parity symbols of its block. When the block is
+// full, or the segment is the last, the parity segments of the block are added to the batch.
+void fec_encode(RUDP *self, SendBatch *batch, uint32_t index, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    FecEncoder *fec = &self->fec_encoder;
+    RUDP_Segment *segment = &self->buffer[get_slot(self, index)];
+    uint8_t *space = fec->parity + (size_t)fec->next_space * self->fec_parity * fec->capacity;
+    uint8_t head[FEC_SYMBOL_HEADER], *row;
+    uint8_t c;
+
+    if (fec->count == 0) {
+        fec->first = index;
+        fec->symbol_size = 0;
+        memset(space, 0, (size_t)self->fec_parity * fec->capacity);
+    }
+    fec->block_ends[get_slot(self, index)] = fec->first + self->fec_data;
+    head[0] = segment->header.last;
+    head[1] = segment->length >> 8;
+    head[2] = segment->length & 0xFF;
+    for (int r = 0; r < self->fec_parity; r++) {
+        row = space + r * fec->capacity + FEC_HEADER_SIZE;
+        c = fec_coefficient(self->fec_parity, r, fec->count);
+        fec_mul_add(row, head, c, FEC_SYMBOL_HEADER);
+        fec_mul_add(row + FEC_SYMBOL_HEADER, (const uint8_t*)segment->payload, c, segment->length);
+    }
+    if (FEC_SYMBOL_HEADER + segment->length > fec->symbol_size) {
+        fec->symbol_size = FEC_SYMBOL_HEADER + segment->length;
+    }
+    fec->count++;
+    if (fec->count == self->fec_data || segment->header.last) {
+        fec_send_parity(self, batch, dest_addr, addrlen);
+    }
+}
+
+// Used by the sender to stop its receiver thread, when the last segment is acked or it fails.
+// A sender in message mode has none.
+void stop_receiver(RUDP *self)
+{
+    uint64_t value = 1;
+
+    if (self->messages) {
+        return;
+    }
+
+    atomic_store_explicit(&self->receiver.stop, true, memory_order_relaxed);
+    write(self->stopfd, &value, sizeof(value));
+    pthread_join(self->receiver.tid, NULL);
+    // Stopfd is cleared for the next session.
+    read(self->stopfd, &value, sizeof(value));
+}
+
+// Resends segments whose timers have expired, timers are taken from the top of
+// the heap so only expired timers are looked at.
+// On success 0 is returned. On error -1 is returned.
+int check_timeouts(RUDP *self, SendBatch *batch, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    TimerHeap *heap = &self->timer_heap;
+    TimerEntry entry;
+    FecEncoder *fec = &self->fec_encoder;
+    Timer *timer;
+    uint32_t slot, block_first = 0, block_count = 0;
+    uint64_t now = now_us();
+
+    while (heap->size > 0 && heap_top(heap)->expiry_time <= now) {
+        entry = *heap_top(heap);
+        heap_pop(heap);
+        slot = get_slot(self, entry.index);
+        timer = &self->timers[slot];
+        // Skip entries of timers which were stopped or restarted after the entry was pushed.
+        if (!timer->active || timer->expiry_time != entry.expiry_time
+            || entry.index - self->window.base >= self->window.next - self->window.base)
+        {
+            continue;
+        }
+        if (timer->retransmissions == MAX_RETRANSMISSIONS) {
+            fprintf(stderr, "Peer is unreachable\n");
+            return -1;
+        }
+
+        // A segment of the block being sent has no parity yet. The parity is sent in its place
+        // and the segment gets one more timeout to be rebuilt in.
+        if (fec->active && fec->count > 0 && entry.index - fec->first < fec->count) {
+            block_first = fec->first;
+            block_count = fec->count;
+            fec_send_parity(self, batch, dest_addr, addrlen);
+        }
+        if (timer->retransmissions == 0 && entry.index - block_first < block_count) {
+            timer->expiry_time = now + get_rto(self);
+            if (heap_push(heap, timer->expiry_time, entry.index) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        // As the single timer of TCP is restarted by every ack which moves the window base
+        // (RFC 6298 5.3), a segment sent once does not time out within a timeout of the
+        // last ack which did. Segments queued behind a burst on the path are not resent
+        // while its acks are still arriving.
+        if (timer->retransmissions == 0 && self->base_moved_time + get_rto(self) > now) {
+            timer->expiry_time = self->base_moved_time + get_rto(self);
+            if (heap_push(heap, timer->expiry_time, entry.index) == -1) {
+                return -1;
+            }
+            continue;
+        }
+
+        self->buffer[slot].header.ack_now = 1;
+        send_segment(self, batch, entry.index, dest_addr, addrlen);
+        stat_add(&self->loss_stats.segments_resent, 1);
+        stat_add(&self->stats.timeouts, 1);
+        if (self->logs) {
+            rudp_log(LOG_TIMEOUT, entry.index & self->window.mask, self->buffer[slot].header.last);
+        }
+
+        // Timeout is a loss of the whole window unless it is part of a loss which was already
+        // handled. The timeout is backed off once per timeout of the window base, as with the
+        // single timer of TCP, and again only when a resent base times out. Backing off for
+        // every segment of the window would reach MAX_RTO after one lossy window.
+        if (entry.index == self->window.base && (!self->in_recovery || timer->retransmissions > 0)) {
+            rtt_backoff(&self->rtt);
+        }
+        if (!self->in_recovery) {
+            cc_on_loss(&self->cc, self->window.next - self->window.base, true, now);
+            self->in_recovery = true;
+            self->recovery_seqno = self->window.next;
+            self->retransmit_next = self->window.base;
+        }
+        restart_timer(timer, get_rto(self));
+        if (heap_push(heap, timer->expiry_time, entry.index) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Resends the segments which acks of later segments show to be lost. A segment is taken
+// as lost when a segment more than its loss threshold places after it has been acked. Each
+// segment is resent once this way in a recovery, further losses of it are found by its timer.
+// On success 0 is returned. On error -1 is returned.
+int fast_retransmit(RUDP *self, SendBatch *batch, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    RUDP_Window *window = &self->window;
+    uint32_t index = self->retransmit_next;
+    uint32_t slot;
+    Timer *timer;
+
+    self->fast_retransmit = false;
+    if (index - window->base >= window->next - window->base) {
+        index = window->base;
+    }
+    for (; index != window->next && self->sack_high - index > loss_threshold(self, index); index++) {
+        slot = get_slot(self, index);
+        timer = &self->timers[slot];
+        if (self->buffer[slot].header.ack || !timer->active) {
+            continue;
+        }
+        self->buffer[slot].header.ack_now = 1;
+        send_segment(self, batch, index, dest_addr, addrlen);
+        stat_add(&self->loss_stats.segments_resent, 1);
+        stat_add(&self->stats.fast_retransmits, 1);
+        if (self->logs) {
+            rudp_log(LOG_FAST_RETRANSMIT, index & window->mask, false);
+        }
+        restart_timer(timer, get_rto(self));
+        if (heap_push(&self->timer_heap, timer->expiry_time, index) == -1) {
+            return -1;
+        }
+    }
+    self->retransmit_next = index;
+    return 0;
+}
+
+// Sends segments from the file or buffer argument until all of them are acked.
+// Every segment which is ready to go, new or resent, is sent in one batch per pass of the loop.
+// On succes the number of bytes sent are returned. On error -1 is returned.
+ssize_t send_all(RUDP *self, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    SendBatch batch;
+    uint32_t first, index, slot, sent;
+    uint64_t expiry_time;
+    bool inserted_last = false;
+    ssize_t bytes_sent = 0;
+
+    if (negotiate(self, dest_addr, addrlen) == -1 || fec_encoder_init(self) == -1) {
+        return -1;
+    }
+    if (self->ack_queue.data == NULL && (self->ack_queue.data = malloc(ACK_QUEUE_SIZE)) == NULL) {
+        return -1;
+    }
+
+    // Initialize RUDP_Window and ReceiverThread struct variables.
+    if (self->peer_version == RUDP_VERSION_1) {
+        window_init(&self->window, self, 0, WINDOW_SIZE);
+    }
+    else {
+        window_init(&self->window, self, self->send_seqno,
+                        self->window_size < self->peer_window ? self->window_size : self->peer_window);
+    }
+    rt_init(&self->receiver, self, true);
+    first = self->window.base;
+    // Slots are marked as they are acked, and cleared again once the message has been.
+    self->slots_clear = false;
+    atomic_init(&self->ack_queue.head, 0);
+    atomic_init(&self->ack_queue.tail, 0);
+    self->ack_queue.head_seen = self->ack_queue.tail_seen = 0;
+    self->timer_heap.size = 0;
+    self->acked_above_base = 0;
+    self->fast_retransmit = false;
+    self->in_recovery = false;
+    self->sack_high = self->window.base;
+    self->base_moved_time = 0;
+    self->retransmit_next = self->window.base;
+    atomic_store_explicit(&self->stats.window_used, 0, memory_order_relaxed);
+    atomic_store_explicit(&self->stats.bytes_in_flight, 0, memory_order_relaxed);
+    send_batch_init(&batch);
+    // Start receiver thread, unless the sender reads its acks itself in message mode.
+    // First pass of the loop does not wait.
+    if (!self->messages) {
+        wake_sender(self);
+        pthread_create(&self->receiver.tid, NULL, receive, (void*)&self->receiver);
+    }
+
+    for (;;) {
+        // Sleep until acks arrive or a timer expires. A sender in message mode reads the acks
+        // and only takes those which have arrived while no segment is in flight, as on the first pass.
+        expiry_time = self->timer_heap.size > 0 ? heap_top(&self->timer_heap)->expiry_time : 0;
+        if (self->messages ? read_acks(self, self->window.next == self->window.base ? 1 : expiry_time) == -1
+                           : wait_events(self, expiry_time) == -1)
+        {
+            stop_receiver(self);
+            return -1;
+        }
+        // Receiver thread stops on its own when it fails.
+        if (atomic_load_explicit(&self->receiver.stop, memory_order_relaxed) || handle_acks(self)) {
+            break;
+        }
+        if (self->fast_retransmit && fast_retransmit(self, &batch, dest_addr, addrlen) == -1) {
+            stop_receiver(self);
+            return -1;
+        }
+        // Send more segments while segments sent are less than window size and
+        // congestion window, and all segments are not sent. A compressor or the reader of
+        // a file wakes the sender when it has more data.
+        sent = 0;
+        while (self->window.next - self->window.base < self->window.size
+            && self->window.next - self->window.base < cc_window(&self->cc) && !inserted_last
+            && (self->compressor == NULL || compressor_ready(self->compressor, data_segment_size(self)))
+            && (self->file_ring == NULL || file_ring_ready(self->file_ring, data_segment_size(self))))
+        {
+            index = self->window.next;
+            slot = get_slot(self, index);
+            if (insert_segment(self, index) == -1) {
+                stop_receiver(self);
+                return -1;
+            }
+            inserted_last = self->buffer[slot].header.last;
+
+            // Start timer and advance next before sending so that an early ack is not discarded.
+            start_timer(&self->timers[slot], get_rto(self));
+            if (heap_push(&self->timer_heap, self->timers[slot].expiry_time, index) == -1) {
+                stop_receiver(self);
+                return -1;
+            }
+            stat_add(&self->stats.segments_sent, 1);
+            stat_add(&self->stats.window_used, 1);
+            stat_add(&self->stats.bytes_in_flight, self->buffer[slot].length);
+            self->window.next++;
+
+            // Receiver is asked not to delay the ack when the window is full, or of any segment in message mode.
+            self->buffer[slot].header.ack_now = self->messages || self->window.next - self->window.base >= self->window.size
+                || self->window.next - self->window.base >= cc_window(&self->cc);
+            send_segment(self, &batch, index, dest_addr, addrlen);
+
+            if (self->logs) {
+                rudp_log(LOG_SEGMENT_SENT, index & self->window.mask, self->buffer[slot].header.last);
+            }
+            if (self->fec_encoder.active) {
+                fec_encode(self, &batch, index, dest_addr, addrlen);
+            }
+
+            bytes_sent += self->buffer[slot].length;
+            sent++;
+        }
+        // A block which the full window keeps from being filled, or which acks show a loss in,
+        // gets its parity now, so that the loss is rebuilt instead of waiting for a timeout.
+        if (self->fec_encoder.active && self->fec_encoder.count > 0 && (sent == 0 || fec_block_lost(self))) {
+            fec_send_parity(self, &batch, dest_addr, addrlen);
+        }
+        if (check_timeouts(self, &batch, dest_addr, addrlen) == -1) {
+            stop_receiver(self);
+            return -1;
+        }
+        send_batch_flush(self, &batch);
+    }
+
+    stop_receiver(self);
+    if (self->logs) {
+        rudp_flush_logs();
+    }
+    if (self->receiver.bytes_received == -1) {
+        return -1;
+    }
+    for (index = first; index != self->window.next; index++) {
+        self->buffer[get_slot(self, index)].header.ack = 0;
+    }
+    self->slots_clear = true;
+    if (self->peer_version == RUDP_VERSION_2) {
+        self->send_seqno = self->window.next;
+    }
+    return bytes_sent;
+}
+
+ssize_t rudp_sendto(RUDP *self, const void *buffer, size_t length,
+                        const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    if (self->logs) {
+        rudp_log(LOG_SEPARATOR, 0, false);
+    }
+    if (negotiate(self, dest_addr, addrlen) == -1) {
+        return -1;
+    }
+    if (self->peer_version == RUDP_VERSION_1 && length > LEGACY_BUFFER_SIZE * MAX_PAYLOAD_SIZE) {
+        fprintf(stderr, "Cannot send more than %d bytes\n", LEGACY_BUFFER_SIZE * MAX_PAYLOAD_SIZE);
+        return -1;
+    }
+    self->file_ring = NULL;
+    self->buffer_arg = (char*)buffer;
+    self->buffer_arg_len = length;
+    return send_all(self, dest_addr, addrlen);
+}
+
+// Sends a range of a mapped file as blocks made by a thread of its own, compressed if compress
+// is set, to a peer with RUDP_FEATURE_COMPRESS, and as a delta of the copy of the peer if index is set.
+// On succes the length of the range is returned. On error -1 is returned.
+ssize_t send_blocks(RUDP *self, const char *data, size_t length, bool compress, const DeltaIndex *index,
+                        const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    ssize_t bytes_sent;
+
+    if (self->logs) {
+        rudp_log(LOG_SEPARATOR, 0, false);
+    }
+    if (compressor_start(self, data, length, compress, index) == -1) {
+        return -1;
+    }
+    self->file_ring = NULL;
+    bytes_sent = send_all(self, dest_addr, addrlen);
+    compressor_stop(self);
+    return bytes_sent == -1 ? -1 : (ssize_t)length;
+}
+
+
+// Sets acks of the whole buffer to 0 because ack 1
+// indicates that the segment has been received.
+void initialize_buffer(RUDP *self)
+{
+    for (uint32_t i = 0; i < self->buffer_size; i++) {
+        self->buffer[i].header.ack = 0;
+    }
+}
+
+// Receives segments and delivers them to the file or buffer argument until the last segment,
+// on the calling thread. Slots are only cleared if the last send or receive left some marked.
+// On succes the number of bytes received are returned. On error -1 is returned.
+ssize_t receive_all(RUDP *self)
+{
+    // Initialize RUDP_Window and ReceiverThread struct variables.
+    if (self->peer_version == RUDP_VERSION_2) {
+        window_init(&self->window, self, self->recv_seqno, self->window_size);
+    }
+    else {
+        window_init(&self->window, self, 0, WINDOW_SIZE);
+    }
+    rt_init(&self->receiver, self, false);
+    if (!self->slots_clear) {
+        initialize_buffer(self);
+    }
+
+    receive(&self->receiver);
+    // Slots are cleared as their segments are delivered, up to the last one.
+    self->slots_clear = self->receiver.done && self->receiver.bytes_received != -1;
+    release_buffer_data(self);
+    if (self->logs) {
+        rudp_flush_logs();
+    }
+
+    if (self->peer_version == RUDP_VERSION_2) {
+        self->recv_seqno = self->window.base;
+    }
+    return self->receiver.bytes_received;
+}
+
+ssize_t rudp_recvfrom(RUDP *self, void *buffer, size_t length,
+                        struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    if (self->logs) {
+        rudp_log(LOG_SEPARATOR, 0, false);
+    }
+    self->file_ring = NULL;
+    self->buffer_arg = (char*)buffer;
+    self->buffer_arg_len = length;
+    return receive_all(self);
+}
+
+// Runs the transfers submitted to the socket in the order they were, until it is closed.
+void* run_async(void *arg)
+{
+    AsyncWorker *self = arg;
+    AsyncRequest *request, **last;
+
+    for (;;) {
+        pthread_mutex_lock(&self->lock);
+        while (!self->stop && self->pending == NULL) {
+            pthread_cond_wait(&self->changed, &self->lock);
+        }
+        if (self->stop) {
+            pthread_mutex_unlock(&self->lock);
+            return NULL;
+        }
+        // Stop flag left set by the last transfer is cleared under the lock, so a close
+        // which comes after it is not lost.
+        atomic_store_explicit(&self->rudp->receiver.stop, false, memory_order_relaxed);
+        request = self->pending;
+        self->pending = request->next;
+        self->running = request;
+        pthread_mutex_unlock(&self->lock);
+
+        if (request->sending) {
+            request->result = rudp_sendto(self->rudp, request->buffer, request->length,
+                                            (struct sockaddr*)&request->dest_addr, request->addrlen);
+        }
+        else {
+            request->result = rudp_recvfrom(self->rudp, request->buffer, request->length, NULL, NULL);
+        }
+
+        pthread_mutex_lock(&self->lock);
+        request->next = NULL;
+        for (last = &self->completed; *last != NULL; last = &(*last)->next);
+        *last = request;
+        self->running = NULL;
+        atomic_store_explicit(&self->progress, 0, memory_order_relaxed);
+        pthread_cond_broadcast(&self->changed);
+        pthread_mutex_unlock(&self->lock);
+        async_notify(self);
+    }
+}
+
+// Starts the thread of async transfers of the socket if it is not running.
+// On success 0 is returned. On error -1 is returned.
+int async_start(RUDP *self)
+{
+    AsyncWorker *worker;
+
+    if (self->async != NULL) {
+        return 0;
+    }
+    worker = calloc(1, sizeof(*worker));
+    if (worker == NULL) {
+        return -1;
+    }
+    worker->rudp = self;
+    worker->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->eventfd == -1) {
+        free(worker);
+        return -1;
+    }
+    atomic_init(&worker->progress, 0);
+    atomic_init(&self->receiver.stop, false);
+    pthread_mutex_init(&worker->lock, NULL);
+    pthread_cond_init(&worker->changed, NULL);
+    // Set first because the transfers of the thread count their progress in it.
+    self->async = worker;
+    if (pthread_create(&worker->tid, NULL, run_async, worker) != 0) {
+        self->async = NULL;
+        close(worker->eventfd);
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->changed);
+        free(worker);
+        return -1;
+    }
+    return 0;
+}
+
+// Queues a transfer after those submitted before it, the request is freed on error.
+// On success 0 is returned. On error -1 is returned.
+int async_submit(RUDP *self, AsyncRequest *request)
+{
+    AsyncRequest **last;
+
+    if (async_start(self) == -1) {
+        free(request);
+        return -1;
+    }
+    request->next = NULL;
+    request->result = -1;
+    pthread_mutex_lock(&self->async->lock);
+    for (last = &self->async->pending; *last != NULL; last = &(*last)->next);
+    *last = request;
+    pthread_cond_broadcast(&self->async->changed);
+    pthread_mutex_unlock(&self->async->lock);
+    return 0;
+}
+
+int rudp_async_fd(RUDP *self)
+{
+    return async_start(self) == -1 ? -1 : self->async->eventfd;
+}
+
+int rudp_send_async(RUDP *self, const void *buffer, size_t length,
+                        const struct sockaddr *dest_addr, socklen_t addrlen, void *user)
+{
+    AsyncRequest *request;
+
+    if (addrlen > sizeof(request->dest_addr)) {
+        errno = EINVAL;
+        return -1;
+    }
+    request = malloc(sizeof(*request));
+    if (request == NULL) {
+        return -1;
+    }
+    request->sending = true;
+    request->buffer = (void*)buffer;
+    request->length = length;
+    memcpy(&request->dest_addr, dest_addr, addrlen);
+    request->addrlen = addrlen;
+    request->user = user;
+    return async_submit(self, request);
+}
+
+int rudp_recv_async(RUDP *self, void *buffer, size_t length, void *user)
+{
+    AsyncRequest *request = malloc(sizeof(*request));
+
+    if (request == NULL) {
+        return -1;
+    }
+    request->sending = false;
+    request->buffer = buffer;
+    request->length = length;
+    request->addrlen = 0;
+    request->user = user;
+    return async_submit(self, request);
+}
+
+int rudp_async_poll(RUDP *self, RUDP_Completion *completion)
+{
+    AsyncWorker *worker = self->async;
+    AsyncRequest *request;
+    uint64_t value;
+
+    if (worker == NULL) {
+        return 0;
+    }
+    // The eventfd is cleared before the list is looked at, so that a transfer which
+    // completes after that makes it readable again.
+    read(worker->eventfd, &value, sizeof(value));
+    pthread_mutex_lock(&worker->lock);
+    request = worker->completed;
+    if (request != NULL) {
+        worker->completed = request->next;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    if (request == NULL) {
+        return 0;
+    }
+    completion->user = request->user;
+    completion->sending = request->sending;
+    completion->result = request->result;
+    free(request);
+    return 1;
+}
+
+uint64_t rudp_async_progress(RUDP *self)
+{
+    return self->async == NULL ? 0 : atomic_load_explicit(&self->async->progress, memory_order_relaxed);
+}
+
+
+// Returns the version of the peer, looking at the next datagram if it is not yet known.
+// Returns -1 on error.
+// The features of a version 2 peer are taken from its hello, so that it is known whether a file header follows.
+int peek_version(RUDP *self)
+{
+    char datagram[sizeof(RUDP_Header_v2) + sizeof(uint16_t)];
+    RUDP_Header header;
+    ssize_t bytes, header_length;
+    uint8_t version;
+    uint16_t features;
+
+    while (self->peer_version == 0) {
+        bytes = recvfrom(self->sockfd, datagram, sizeof(datagram), MSG_PEEK, NULL, NULL);
+        if (bytes == -1) {
+            return -1;
+        }
+        header_length = unpack_header(&header, datagram, bytes, &version);
+        if (header_length == -1) {
+            recvfrom(self->sockfd, datagram, sizeof(datagram), 0, NULL, NULL);
+            continue;
+        }
+        if (version == RUDP_VERSION_2 && header.hello && !header.ack
+            && bytes - header_length >= (ssize_t)sizeof(features))
+        {
+            memcpy(&features, datagram + header_length, sizeof(features));
+            self->peer_features = ntohs(features);
+        }
+        return version;
+    }
+    return self->peer_version;
+}
+
+
+
+
+// ==================== File Transfer Functions ====================
+
+// Maps a regular file from its position to its end.
+// On success 0 is returned. On error, or if there is no data to map, -1 is returned.
+int map_file(FileMap *self, FILE *fp)
+{
+    struct stat st;
+    long page_size = sysconf(_SC_PAGESIZE);
+    off_t start;
+
+    self->position = ftell(fp);
+    if (self->position == -1 || fstat(fileno(fp), &st) == -1 || !S_ISREG(st.st_mode)
+        || st.st_size <= self->position)
+    {
+        return -1;
+    }
+    // Mappings start on a page boundary.
+    start = self->position - self->position % page_size;
+    self->map_length = st.st_size - start;
+    self->map = mmap(NULL, self->map_length, PROT_READ, MAP_PRIVATE, fileno(fp), start);
+    if (self->map == MAP_FAILED) {
+        return -1;
+    }
+    madvise(self->map, self->map_length, MADV_SEQUENTIAL);
+    self->data = (char*)self->map + (self->position - start);
+    self->length = st.st_size - self->position;
+    return 0;
+}
+
+// Unmaps the file and moves its position past the bytes which were sent.
+void unmap_file(FileMap *self, FILE *fp, size_t bytes_sent)
+{
+    munmap(self->map, self->map_length);
+    fseek(fp, self->position + bytes_sent, SEEK_SET);
+}
+
+// Sends the mapped file to a version 1 peer as messages of FILE_BUFFER_SIZE bytes.
+// On succes the number of bytes sent are returned. On error -1 is returned.
+ssize_t send_map_legacy(RUDP *rudp, FileMap *file_map, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    size_t offset, length;
+    ssize_t bytesSent;
+
+    for (offset = 0; offset < file_map->length; offset += length) {
+        length = file_map->length - offset < FILE_BUFFER_SIZE ? file_map->length - offset : FILE_BUFFER_SIZE;
+        bytesSent = rudp_sendto(rudp, file_map->data + offset, length, dest_addr, addrlen);
+        if (bytesSent == -1) {
+            return -1;
+        }
+    }
+    return offset;
+}
+
+// Sends the file to a version 1 peer as messages of FILE_BUFFER_SIZE bytes
+// followed by an end-of-file indicator.
+ssize_t send_file_legacy(RUDP *rudp, FILE* fp, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    char *buffer;
+    const char* eof = "EOF";
+    short unsigned int eofLen = strlen(eof);
+    ssize_t bytesRead, bytesSent, totalBytesSent = 0;
+    FileMap file_map;
+    FileRing *ring;
+    bool last;
+
+    // Messages of a regular file are sent from its mapping.
+    if (map_file(&file_map, fp) == 0) {
+        totalBytesSent = send_map_legacy(rudp, &file_map, dest_addr, addrlen);
+        unmap_file(&file_map, fp, totalBytesSent == -1 ? 0 : totalBytesSent);
+        if (totalBytesSent == -1 || rudp_sendto(rudp, eof, eofLen, dest_addr, addrlen) == -1) {
+            return -1;
+        }
+        return totalBytesSent;
+    }
+
+    // Other files are read ahead while each message is sent.
+    buffer = malloc(FILE_BUFFER_SIZE);
+    ring = buffer == NULL ? NULL : file_ring_start(rudp, fp, false);
+    if (ring == NULL) {
+        free(buffer);
+        return -1;
+    }
+    do {
+        bytesRead = file_ring_read(ring, buffer, FILE_BUFFER_SIZE, &last);
+        bytesSent = bytesRead == -1 ? -1 : rudp_sendto(rudp, buffer, bytesRead, dest_addr, addrlen);
+        if (bytesSent == -1) {
+            file_ring_stop(ring, false);
+            free(buffer);
+            return -1;
+        }
+        totalBytesSent += bytesSent;
+    } while (!last);
+    file_ring_stop(ring, false);
+    free(buffer);
+    // Sending end-of-file indicator.
+    bytesSent = rudp_sendto(rudp, eof, eofLen, dest_addr, addrlen);
+    if (bytesSent == -1) {
+        return -1;
+    }
+
+    return totalBytesSent;
+}
+
+
+// Receives a file from a version 1 peer as messages until an end-of-file indicator.
+ssize_t receive_file_legacy(RUDP *rudp, FILE* fp, struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    char *buffer = malloc(FILE_BUFFER_SIZE);
+    const char* eof = "EOF";
+    short unsigned int eofLen = strlen(eof);
+    ssize_t bytesReceived, totalBytesReceived = 0;
+    // File is written while the next message is received.
+    FileRing *ring = buffer == NULL ? NULL : file_ring_start(rudp, fp, true);
+
+    if (ring == NULL) {
+        free(buffer);
+        return -1;
+    }
+    // Continue receiving data until an end-of-file indicator is encountered.
+    while (1) {
+        bytesReceived = rudp_recvfrom(rudp, buffer, FILE_BUFFER_SIZE, src_addr, addrlen);
+        if (bytesReceived == -1) {
+            totalBytesReceived = -1;
+            break;
+        }
+        // Checking for end-of-file indicator.
+        if (bytesReceived == eofLen && strncmp(buffer, eof, eofLen) == 0) {
+            break;
+        }
+        if (file_ring_write(ring, buffer, bytesReceived) == -1) {
+            totalBytesReceived = -1;
+            break;
+        }
+        totalBytesReceived += bytesReceived;
+    }
+    if (file_ring_stop(ring, totalBytesReceived != -1) == -1) {
+        totalBytesReceived = -1;
+    }
+    free(buffer);
+
+    return totalBytesReceived;
+}
+
+
+// Returns true if files of the session are preceded by a file header.
+bool uses_file_header(RUDP *rudp)
+{
+    return rudp->peer_version == RUDP_VERSION_2 && (rudp->features & RUDP_FEATURE_FILE_HEADER)
+        && (rudp->peer_features & RUDP_FEATURE_FILE_HEADER);
+}
+
+static const char file_header_magic[4] = { 0, 'R', 'F', 'H' };
+
+void pack_file_header(const RUDP_FileHeader *header, char *packed)
+{
+    uint32_t value;
+    uint16_t short_value;
+
+    memcpy(packed, file_header_magic, sizeof(file_header_magic));
+    value = htonl(header->transfer_id);
+    memcpy(packed + 4, &value, 4);
+    short_value = htons(header->stream);
+    memcpy(packed + 8, &short_value, 2);
+    short_value = htons(header->streams);
+    memcpy(packed + 10, &short_value, 2);
+    value = htonl(header->flags);
+    memcpy(packed + 12, &value, 4);
+    pack_u64(packed + 16, header->offset);
+    pack_u64(packed + 24, header->length);
+    pack_u64(packed + 32, header->file_size);
+    value = htonl(header->checksum);
+    memcpy(packed + 40, &value, 4);
+}
+
+int rudp_unpack_file_header(RUDP_FileHeader *header, const char *data, size_t length)
+{
+    uint32_t value;
+    uint16_t short_value;
+
+    // A filename never starts with a zero byte.
+    if (length != RUDP_FILE_HEADER_SIZE || memcmp(data, file_header_magic, sizeof(file_header_magic)) != 0) {
+        return -1;
+    }
+    memcpy(&value, data + 4, 4);
+    header->transfer_id = ntohl(value);
+    memcpy(&short_value, data + 8, 2);
+    header->stream = ntohs(short_value);
+    memcpy(&short_value, data + 10, 2);
+    header->streams = ntohs(short_value);
+    memcpy(&value, data + 12, 4);
+    header->flags = ntohl(value);
+    header->offset = unpack_u64(data + 16);
+    header->length = unpack_u64(data + 24);
+    header->file_size = unpack_u64(data + 32);
+    memcpy(&value, data + 40, 4);
+    header->checksum = ntohl(value);
+    if (header->streams == 0 || header->stream >= header->streams) {
+        return -1;
+    }
+    return 0;
+}
+
+static const char file_trailer_magic[4] = { 0, 'R', 'F', 'T' };
+
+void pack_file_trailer(uint32_t checksum, char *packed)
+{
+    checksum = htonl(checksum);
+    memcpy(packed, file_trailer_magic, sizeof(file_trailer_magic));
+    memcpy(packed + 4, &checksum, 4);
+}
+
+int rudp_unpack_file_trailer(RUDP_FileHeader *header, const char *data, size_t length)
+{
+    uint32_t value;
+
+    if (length != RUDP_FILE_TRAILER_SIZE || memcmp(data, file_trailer_magic, sizeof(file_trailer_magic)) != 0) {
+        return -1;
+    }
+    memcpy(&value, data + 4, 4);
+    header->checksum = ntohl(value);
+    header->flags |= RUDP_FILE_CHECKSUM;
+    return 0;
+}
+
+// Receives the file trailer which follows data of unknown length into header.
+// On success 0 is returned. On error -1 is returned.
+int receive_file_trailer(RUDP *rudp, RUDP_FileHeader *header, struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    char packed[RUDP_FILE_TRAILER_SIZE];
+
+    if (rudp_recvfrom(rudp, packed, sizeof(packed), src_addr, addrlen) != sizeof(packed)) {
+        return -1;
+    }
+    return rudp_unpack_file_trailer(header, packed, sizeof(packed));
+}
+
+// Returns a descriptor the file fd can be read from. A file which was opened for writing only
+// is read through a descriptor of its own, which the caller closes.
+// On error -1 is returned.
+int reading_fd(int fd)
+{
+    char path[32];
+
+    if ((fcntl(fd, F_GETFL) & O_ACCMODE) != O_WRONLY) {
+        return fd;
+    }
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+int rudp_check_file_range(int fd, off_t base, const RUDP_FileHeader *header)
+{
+    char *buffer;
+    uint64_t done = 0;
+    uint32_t crc = 0;
+    ssize_t bytes;
+    int read_fd;
+
+    if (!(header->flags & RUDP_FILE_CHECKSUM)) {
+        return 0;
+    }
+    read_fd = reading_fd(fd);
+    if (read_fd == -1) {
+        return -1;
+    }
+    buffer = malloc(FILE_BUFFER_SIZE);
+    while (buffer != NULL && done < header->length) {
+        bytes = pread(read_fd, buffer, header->length - done < FILE_BUFFER_SIZE ? header->length - done : FILE_BUFFER_SIZE,
+                        base + header->offset + done);
+        if (bytes <= 0) {
+            break;
+        }
+        crc = crc32c(crc, buffer, bytes);
+        done += bytes;
+    }
+    free(buffer);
+    if (read_fd != fd) {
+        close(read_fd);
+    }
+    return done == header->length && crc == header->checksum ? 0 : -1;
+}
+
+// Copies length bytes of the file in_fd from offset to the start of out_fd, sharing their
+// blocks where the file system can.
+// On success 0 is returned. On error -1 is returned.
+int copy_range(int in_fd, off_t offset, int out_fd, uint64_t length)
+{
+    loff_t in = offset, out = 0;
+    uint64_t done = 0;
+    char *buffer;
+    ssize_t bytes;
+
+    while (done < length) {
+        bytes = copy_file_range(in_fd, &in, out_fd, &out, length - done, 0);
+        if (bytes <= 0) {
+            break;
+        }
+        done += bytes;
+    }
+    // Files which cannot be copied by the kernel are copied through a buffer.
+    buffer = done < length ? malloc(FILE_BUFFER_SIZE) : NULL;
+    while (buffer != NULL && done < length) {
+        bytes = pread(in_fd, buffer, length - done < FILE_BUFFER_SIZE ? length - done : FILE_BUFFER_SIZE,
+                        offset + done);
+        if (bytes <= 0 || pwrite(out_fd, buffer, bytes, done) != bytes) {
+            break;
+        }
+        done += bytes;
+    }
+    free(buffer);
+    return done == length ? 0 : -1;
+}
+
+// Reads the path of the file fd into path, of PATH_MAX bytes.
+// Returns the length of the path, -1 if it is not known.
+ssize_t fd_path(int fd, char *path)
+{
+    char link[32];
+    ssize_t n;
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    n = readlink(link, path, PATH_MAX - 1);
+    if (n <= 0) {
+        return -1;
+    }
+    path[n] = 0;
+    return n;
+}
+
+// Takes a copy of the file fd from position to its end, which a delta is received against
+// while the file is written. The copy is an unnamed file in the directory of the file, where
+// its blocks may be shared, otherwise in /tmp. A file which is not regular has an empty copy.
+// On success 0 is returned. On error -1 is returned.
+int take_basis(DeltaBasis *self, int fd, off_t position)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    ssize_t n;
+    char *slash;
+    void *map;
+    int read_fd, copied;
+
+    self->fd = -1;
+    self->map = NULL;
+    self->length = 0;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size <= position) {
+        return 0;
+    }
+    n = fd_path(fd, path);
+    slash = n > 0 ? memrchr(path, '/', n) : NULL;
+    if (slash != NULL) {
+        *(slash == path ? slash + 1 : slash) = 0;
+        self->fd = open(path, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    }
+    if (self->fd == -1) {
+        self->fd = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    }
+    read_fd = reading_fd(fd);
+    if (self->fd == -1 || read_fd == -1) {
+        if (self->fd != -1) {
+            close(self->fd);
+        }
+        return -1;
+    }
+    copied = copy_range(read_fd, position, self->fd, st.st_size - position);
+    if (read_fd != fd) {
+        close(read_fd);
+    }
+    map = copied == 0 ? mmap(NULL, st.st_size - position, PROT_READ, MAP_SHARED, self->fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        close(self->fd);
+        self->fd = -1;
+        return -1;
+    }
+    self->map = map;
+    self->length = st.st_size - position;
+    return 0;
+}
+
+void free_basis(DeltaBasis *self)
+{
+    if (self->map != NULL) {
+        munmap((void*)self->map, self->length);
+    }
+    if (self->fd != -1) {
+        close(self->fd);
+    }
+    self->map = NULL;
+    self->fd = -1;
+}
+
+static const char signature_magic[4] = { 0, 'R', 'F', 'S' };
+
+// Sends the signatures of the full blocks of the copy to the peer which sends the delta.
+// On success 0 is returned. On error -1 is returned.
+int send_signatures(RUDP *rudp, const DeltaBasis *basis)
+{
+    char packed[DELTA_SIGNATURE_HEADER];
+    const struct sockaddr *dest_addr = (const struct sockaddr*)&rudp->peer_addr;
+    uint32_t block_size = delta_block_size(basis->length), *table, value;
+    uint64_t length = basis->length;
+    uint32_t count;
+    int result;
+
+    // Blocks past the most an index holds are not matched.
+    if (length / block_size > DELTA_MAX_BLOCKS) {
+        length = (uint64_t)DELTA_MAX_BLOCKS * block_size;
+    }
+    count = length / block_size;
+    memcpy(packed, signature_magic, sizeof(signature_magic));
+    value = htonl(block_size);
+    memcpy(packed + 4, &value, 4);
+    pack_u64(packed + 8, length);
+    if (rudp_sendto(rudp, packed, sizeof(packed), dest_addr, sizeof(rudp->peer_addr)) == -1) {
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    table = malloc((size_t)count * sizeof(DeltaSignature));
+    if (table == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        table[2 * i] = htonl(delta_weak(basis->map + (uint64_t)i * block_size, block_size));
+        table[2 * i + 1] = htonl(crc32c(0, basis->map + (uint64_t)i * block_size, block_size));
+    }
+    result = rudp_sendto(rudp, table, (size_t)count * sizeof(DeltaSignature), dest_addr,
+                            sizeof(rudp->peer_addr)) == -1 ? -1 : 0;
+    free(table);
+    return result;
+}
+
+// Receives the signatures of the copy of the peer and makes their index, whose signatures
+// the caller frees with it.
+// On success 0 is returned. On error -1 is returned.
+int receive_signatures(RUDP *rudp, DeltaIndex *index)
+{
+    char packed[DELTA_SIGNATURE_HEADER];
+    DeltaSignature *signatures = NULL;
+    uint32_t block_size, value;
+    uint64_t count;
+
+    if (rudp_recvfrom(rudp, packed, sizeof(packed), NULL, NULL) != sizeof(packed)
+        || memcmp(packed, signature_magic, sizeof(signature_magic)) != 0)
+    {
+        return -1;
+    }
+    memcpy(&value, packed + 4, 4);
+    block_size = ntohl(value);
+    if (block_size < DELTA_MIN_BLOCK || block_size > DELTA_MAX_BLOCK) {
+        return -1;
+    }
+    count = unpack_u64(packed + 8) / block_size;
+    if (count > DELTA_MAX_BLOCKS) {
+        return -1;
+    }
+    if (count > 0) {
+        signatures = malloc(count * sizeof(DeltaSignature));
+        if (signatures == NULL || rudp_recvfrom(rudp, signatures, count * sizeof(DeltaSignature), NULL, NULL)
+                                    != (ssize_t)(count * sizeof(DeltaSignature)))
+        {
+            free(signatures);
+            return -1;
+        }
+        for (uint64_t i = 0; i < count; i++) {
+            signatures[i].weak = ntohl(signatures[i].weak);
+            signatures[i].strong = ntohl(signatures[i].strong);
+        }
+    }
+    if (delta_index_init(index, signatures, count, block_size) == -1) {
+        free(signatures);
+        return -1;
+    }
+    memory_taken(rudp, count * sizeof(DeltaSignature));
+    return 0;
+}
+
+// Sends a range of a mapped file as a delta of the copy of the peer, whose signatures come first.
+// On succes the length of the range is returned. On error -1 is returned.
+ssize_t send_delta(RUDP *rudp, const char *data, size_t length, bool compress,
+                    const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    DeltaIndex index;
+    ssize_t bytes_sent;
+
+    if (receive_signatures(rudp, &index) == -1) {
+        return -1;
+    }
+    bytes_sent = send_blocks(rudp, data, length, compress, &index, dest_addr, addrlen);
+    stat_sub(&rudp->stats.memory, (uint64_t)index.count * sizeof(DeltaSignature));
+    free((void*)index.signatures);
+    delta_index_free(&index);
+    return bytes_sent;
+}
+
+// Makes the socket of a stream other than the first, with the settings of the first.
+// On success 0 is returned. On error -1 is returned.
+int open_stream(FileStream *stream, RUDP *first)
+{
+    RUDP *rudp = &stream->own;
+
+    if (rudp_socket(rudp) == -1) {
+        return -1;
+    }
+    if (rudp_set_window(rudp, first->window_size) == -1
+        || rudp_set_segment_size(rudp, first->segment_size) == -1
+        || rudp_set_congestion(rudp, first->cc.ops->name) == -1
+        || (first->gro && rudp_set_offload(rudp, true) == -1))
+    {
+        rudp_close(rudp);
+        return -1;
+    }
+    rudp->version = RUDP_VERSION_2;
+    rudp->features = first->features;
+    rudp->fec_data = first->fec_data;
+    rudp->fec_parity = first->fec_parity;
+    rudp->checksums = first->checksums;
+    stream->rudp = rudp;
+    return 0;
+}
+
+// Sends a raw range of a mapped file while a prefetcher faults it in ahead of the sender,
+// followed by a file trailer with its checksum if trailer is set.
+// On succes the number of bytes sent are returned. On error -1 is returned.
+ssize_t send_mapped(RUDP *rudp, const char *data, size_t length, bool trailer,
+                    const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    char packed[RUDP_FILE_TRAILER_SIZE];
+    bool prefetched = prefetcher_start(rudp, data, length) == 0;
+    ssize_t bytes_sent;
+    uint32_t crc = 0;
+
+    bytes_sent = rudp_sendto(rudp, data, length, dest_addr, addrlen);
+    if (prefetched) {
+        crc = prefetcher_stop(rudp, bytes_sent != -1 && trailer);
+    }
+    if (bytes_sent == -1 || !trailer) {
+        return bytes_sent;
+    }
+    if (!prefetched) {
+        crc = crc32c(0, data, length);
+    }
+    pack_file_trailer(crc, packed);
+    return rudp_sendto(rudp, packed, sizeof(packed), dest_addr, addrlen) == -1 ? -1 : bytes_sent;
+}
+
+// Sends the header and the range of a stream.
+void* run_stream(void *arg)
+{
+    FileStream *stream = arg;
+    StreamGroup *group = stream->group;
+    char packed[RUDP_FILE_HEADER_SIZE];
+    int registered = 1;
+
+    // Checksums of all ranges which have them in their header are computed at the same time.
+    if (stream->header.flags & RUDP_FILE_CHECKSUM) {
+        stream->header.checksum = crc32c(0, stream->data, stream->header.length);
+    }
+    pack_file_header(&stream->header, packed);
+
+    if (stream->header.stream > 0) {
+        pthread_mutex_lock(&group->lock);
+        while (group->registered == 0) {
+            pthread_cond_wait(&group->changed, &group->lock);
+        }
+        registered = group->registered;
+        pthread_mutex_unlock(&group->lock);
+    }
+    if (registered == 1 && rudp_sendto(stream->rudp, packed, sizeof(packed), group->dest_addr, group->addrlen) == -1) {
+        registered = -1;
+    }
+
+    pthread_mutex_lock(&group->lock);
+    if (stream->header.stream == 0) {
+        group->registered = registered;
+        pthread_cond_broadcast(&group->changed);
+    }
+    stream->start_time = now_us();
+    stream->acked_before = stat_get(&stream->rudp->stats.bytes_acked);
+    stream->sending = registered == 1;
+    pthread_mutex_unlock(&group->lock);
+
+    stream->bytes_sent = -1;
+    if (registered == 1 && (stream->header.flags & RUDP_FILE_DELTA)) {
+        stream->bytes_sent = send_delta(stream->rudp, stream->data, stream->header.length,
+                                        stream->header.flags & RUDP_FILE_COMPRESSED, group->dest_addr, group->addrlen);
+    }
+    else if (registered == 1 && (stream->header.flags & RUDP_FILE_COMPRESSED)) {
+        stream->bytes_sent = send_blocks(stream->rudp, stream->data, stream->header.length, true, NULL,
+                                            group->dest_addr, group->addrlen);
+    }
+    else if (registered == 1) {
+        stream->bytes_sent = send_mapped(stream->rudp, stream->data, stream->header.length,
+                                            stream->header.flags & RUDP_FILE_TRAILER, group->dest_addr, group->addrlen);
+    }
+
+    pthread_mutex_lock(&group->lock);
+    stream->end_time = now_us();
+    stream->done = true;
+    group->finished++;
+    pthread_cond_broadcast(&group->changed);
+    pthread_mutex_unlock(&group->lock);
+    return NULL;
+}
+
+// Prints the bytes of each stream acked so far.
+void report_progress(StreamGroup *group)
+{
+    FileStream *stream;
+    uint64_t acked;
+
+    for (int i = 0; i < group->count; i++) {
+        stream = &group->streams[i];
+        acked = 0;
+        if (stream->done) {
+            acked = stream->bytes_sent == -1 ? 0 : stream->bytes_sent;
+        }
+        else if (stream->sending) {
+            // Counters of the session are the only state of the sender read by other threads.
+            acked = stat_get(&stream->rudp->stats.bytes_acked) - stream->acked_before;
+            if (acked > stream->header.length) {
+                acked = stream->header.length;
+            }
+        }
+        printf("Stream %d: %" PRIu64 " of %" PRIu64 " bytes (%.0f%%)%s\n", i, acked, stream->header.length,
+                stream->header.length ? 100.0 * acked / stream->header.length : 100.0,
+                stream->done && stream->bytes_sent == -1 ? " failed" : "");
+    }
+}
+
+// Returns true if a block spread over the range looks compressible. A range compressed
+// already is sent without going through the compressor, which copies it.
+bool range_compressible(const char *data, uint64_t length)
+{
+    uint64_t offset, n;
+
+    for (int i = 0; i < COMPRESS_SAMPLE_BLOCKS; i++) {
+        offset = length / COMPRESS_SAMPLE_BLOCKS * i;
+        n = length - offset < COMPRESS_BLOCK_SIZE ? length - offset : COMPRESS_BLOCK_SIZE;
+        if (n > 0 && lz_entropy((const uint8_t*)data + offset, n) <= COMPRESS_MAX_ENTROPY) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns true if a regular file is sent to the peer as a delta of its copy.
+bool sends_delta(RUDP *rudp)
+{
+    return rudp->delta && (rudp->peer_features & RUDP_FEATURE_DELTA);
+}
+
+static const char resume_magic[4] = { 0, 'R', 'F', 'M' };
+
+// Returns true if a regular file is sent to the peer without the blocks it has from an earlier
+// transfer. A delta sends little of what the peer has anyway.
+bool sends_resume(RUDP *rudp)
+{
+    return rudp->resume && (rudp->peer_features & RUDP_FEATURE_RESUME) && !sends_delta(rudp);
+}
+
+// Sends the CRC32C of each block of the mapped file to the peer, which answers with a bitmap of
+// the blocks it has, put in have. A peer which has no manifest of the file has none of them.
+// On success 0 is returned. On error -1 is returned.
+int request_resume(RUDP *rudp, const FileMap *file_map, uint32_t block_size, uint8_t *have,
+                    const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    uint32_t count = manifest_blocks(file_map->length, block_size), value;
+    size_t length = RUDP_RESUME_HEADER + (size_t)count * sizeof(uint32_t);
+    uint64_t offset;
+    char *request = malloc(length);
+    ssize_t sent;
+
+    if (request == NULL) {
+        return -1;
+    }
+    memcpy(request, resume_magic, sizeof(resume_magic));
+    value = htonl(block_size);
+    memcpy(request + 4, &value, sizeof(value));
+    pack_u64(request + 8, file_map->length);
+    for (uint32_t i = 0; i < count; i++) {
+        offset = (uint64_t)i * block_size;
+        value = htonl(crc32c(0, file_map->data + offset,
+                                file_map->length - offset < block_size ? file_map->length - offset : block_size));
+        memcpy(request + RUDP_RESUME_HEADER + (size_t)i * sizeof(value), &value, sizeof(value));
+    }
+    free(rudp->reply);
+    rudp->reply = NULL;
+    sent = rudp_sendto(rudp, request, length, dest_addr, addrlen);
+    free(request);
+    memset(have, 0, (count + 7) / 8);
+    if (rudp->reply != NULL && rudp->reply_length == (count + 7) / 8) {
+        memcpy(have, rudp->reply, rudp->reply_length);
+    }
+    free(rudp->reply);
+    rudp->reply = NULL;
+    return sent == -1 ? -1 : 0;
+}
+
+// Joins the ranges with the smallest gaps between them until there are at most count of them,
+// the data in the gaps is then sent again. Ranges are in order and do not overlap.
+// Returns the number of ranges.
+int join_ranges(FileRange *ranges, int n, int count)
+{
+    int best, j;
+
+    while (n > count) {
+        best = 1;
+        for (j = 2; j < n; j++) {
+            if (ranges[j].offset - ranges[j - 1].offset - ranges[j - 1].length
+                < ranges[best].offset - ranges[best - 1].offset - ranges[best - 1].length)
+            {
+                best = j;
+            }
+        }
+        ranges[best - 1].length = ranges[best].offset + ranges[best].length - ranges[best - 1].offset;
+        memmove(&ranges[best], &ranges[best + 1], (n - best - 1) * sizeof(*ranges));
+        n--;
+    }
+    return n;
+}
+
+// Splits the blocks of the file which the peer does not have into at most count ranges. Runs of
+// missing blocks are joined while there are more of them, and the longest are split in whole
+// blocks while there are fewer.
+// Returns the number of ranges, 0 if the peer has every block. On error -1 is returned.
+int resume_ranges(const uint8_t *have, uint64_t length, uint32_t block_size, int count, FileRange *ranges)
+{
+    uint32_t blocks = manifest_blocks(length, block_size), pieces[MAX_STREAMS], first, total;
+    FileRange *runs = malloc(((blocks + 1) / 2 + 1) * sizeof(FileRange));
+    uint64_t start, end;
+    int n = 0, best, j, k, ranges_count = 0;
+
+    if (runs == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < blocks; i++) {
+        if (have[i / 8] >> (i % 8) & 1) {
+            continue;
+        }
+        start = (uint64_t)i * block_size;
+        end = start + block_size < length ? start + block_size : length;
+        if (n > 0 && runs[n - 1].offset + runs[n - 1].length == start) {
+            runs[n - 1].length = end - runs[n - 1].offset;
+        }
+        else {
+            runs[n].offset = start;
+            runs[n].length = end - start;
+            n++;
+        }
+    }
+    n = join_ranges(runs, n, count);
+    // Extra ranges go one at a time to the run with the longest pieces.
+    for (j = 0; j < n; j++) {
+        pieces[j] = 1;
+    }
+    for (k = n; k < count && n > 0; k++) {
+        best = 0;
+        for (j = 1; j < n; j++) {
+            if (runs[j].length * pieces[best] > runs[best].length * pieces[j]) {
+                best = j;
+            }
+        }
+        if (runs[best].length <= (uint64_t)pieces[best] * block_size) {
+            break;
+        }
+        pieces[best]++;
+    }
+    for (j = 0; j < n; j++) {
+        first = runs[j].offset / block_size;
+        total = manifest_blocks(runs[j].length, block_size);
+        for (uint32_t p = 0; p < pieces[j]; p++) {
+            start = (first + (uint64_t)total * p / pieces[j]) * block_size;
+            end = (first + (uint64_t)total * (p + 1) / pieces[j]) * block_size;
+            ranges[ranges_count].offset = start;
+            ranges[ranges_count].length = (end < length ? end : length) - start;
+            ranges_count++;
+        }
+    }
+    free(runs);
+    return ranges_count;
+}
+
+ssize_t rudp_resume_file(Manifest *manifest, const char *path, off_t base, const char *request, size_t length,
+                            char *reply)
+{
+    uint32_t block_size, count, *checksums;
+    uint64_t file_length;
+    int result;
+
+    if (length < RUDP_RESUME_HEADER || memcmp(request, resume_magic, sizeof(resume_magic)) != 0) {
+        return -1;
+    }
+    memcpy(&block_size, request + 4, sizeof(block_size));
+    block_size = ntohl(block_size);
+    file_length = unpack_u64(request + 8);
+    // Blocks are as the sender makes them, so that the bitmap fits in the reply.
+    if (block_size != manifest_block_size(file_length)) {
+        return -1;
+    }
+    count = manifest_blocks(file_length, block_size);
+    if (length != RUDP_RESUME_HEADER + (size_t)count * sizeof(uint32_t)) {
+        return -1;
+    }
+    checksums = malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+    if (checksums == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(&checksums[i], request + RUDP_RESUME_HEADER + (size_t)i * sizeof(uint32_t), sizeof(uint32_t));
+        checksums[i] = ntohl(checksums[i]);
+    }
+    result = manifest_open(manifest, path, base, file_length, block_size, checksums);
+    free(checksums);
+    if (result == -1) {
+        return -1;
+    }
+    memcpy(reply, manifest->blocks, (count + 7) / 8);
+    return (count + 7) / 8;
+}
+
+// Takes the data of a message received with ReceiveFileFrom, and answers it if it is a resume
+// request for a regular file.
+void take_file_message(RUDP *rudp, const char *data, size_t length, bool last)
+{
+    FileMessage *message = rudp->user;
+    char reply[RUDP_REPLY_MAX];
+    ssize_t reply_length;
+
+    // Data past the longest request is dropped, the message is then neither a request nor a header.
+    if (length > RUDP_RESUME_MAX - message->length) {
+        length = RUDP_RESUME_MAX - message->length;
+    }
+    memcpy(message->data + message->length, data, length);
+    message->length += length;
+    if (!last || message->path == NULL || message->resumed) {
+        return;
+    }
+    reply_length = rudp_resume_file(message->manifest, message->path, message->base, message->data,
+                                    message->length, reply);
+    if (reply_length != -1) {
+        message->resumed = true;
+        rudp_conn_reply(rudp, reply, reply_length);
+    }
+}
+
+// Receives the file header of a file received with ReceiveFileFrom. A resume request before it
+// is answered from the manifest of a regular file, which is then left open in manifest.
+// On success 0 is returned. On error -1 is returned.
+int receive_file_header(RUDP *rudp, FILE *fp, RUDP_FileHeader *header, Manifest *manifest, bool *resumed)
+{
+    void (*on_data)(struct RUDP *conn, const char *data, size_t length, bool last) = rudp->on_data;
+    void *user = rudp->user;
+    FileMessage message;
+    char path[PATH_MAX];
+    struct stat st;
+    ssize_t bytes;
+
+    message.data = malloc(RUDP_RESUME_MAX);
+    if (message.data == NULL) {
+        return -1;
+    }
+    message.length = 0;
+    message.path = NULL;
+    message.manifest = manifest;
+    message.resumed = false;
+    // Blocks of a regular file are counted from its position.
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && fflush(fp) == 0
+        && (message.base = ftell(fp)) != -1 && fd_path(fileno(fp), path) != -1)
+    {
+        message.path = path;
+    }
+    rudp->on_data = take_file_message;
+    rudp->user = &message;
+    bytes = rudp_recvfrom(rudp, NULL, 0, NULL, NULL);
+    if (bytes != -1 && message.length >= sizeof(resume_magic)
+        && memcmp(message.data, resume_magic, sizeof(resume_magic)) == 0)
+    {
+        message.length = 0;
+        bytes = rudp_recvfrom(rudp, NULL, 0, NULL, NULL);
+    }
+    rudp->on_data = on_data;
+    rudp->user = user;
+    if (bytes == -1 || rudp_unpack_file_header(header, message.data, message.length) == -1) {
+        bytes = -1;
+    }
+    free(message.data);
+    *resumed = message.resumed;
+    return bytes == -1 ? -1 : 0;
+}
+
+// Splits the mapped file into ranges of at least STREAM_MIN_LENGTH bytes, one for each stream
+// the peer accepts, and sends them in parallel. The first stream uses rudp. A file which is
+// resumed is split into the ranges the peer does not have.
+// On succes the number of bytes sent, with those the peer had, are returned. On error -1 is returned.
+ssize_t send_file_streams(RUDP *rudp, FileMap *file_map, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    StreamGroup *group;
+    FileStream *stream;
+    FileRange ranges[MAX_STREAMS];
+    struct timespec deadline;
+    uint64_t range, length = file_map->length, missing = length, skipped = 0;
+    uint32_t block_size;
+    uint8_t *have = NULL;
+    ssize_t total = 0;
+    bool logs = rudp->logs, resume = sends_resume(rudp);
+    int count = 1, i;
+
+    // Blocks the peer has are known before the file is split.
+    if (resume) {
+        block_size = manifest_block_size(length);
+        have = malloc(RUDP_REPLY_MAX);
+        if (have == NULL || request_resume(rudp, file_map, block_size, have, dest_addr, addrlen) == -1) {
+            free(have);
+            return -1;
+        }
+        for (uint32_t b = 0; b < manifest_blocks(length, block_size); b++) {
+            if (have[b / 8] >> (b % 8) & 1) {
+                missing -= (uint64_t)(b + 1) * block_size < length ? block_size : length - (uint64_t)b * block_size;
+            }
+        }
+    }
+    // A delta is made against the copy of the whole file, so it is sent as one stream.
+    if ((rudp->peer_features & RUDP_FEATURE_STREAMS) && !sends_delta(rudp)) {
+        count = missing / STREAM_MIN_LENGTH < rudp->streams ? missing / STREAM_MIN_LENGTH : rudp->streams;
+        if (count < 1) {
+            count = 1;
+        }
+    }
+    if (resume) {
+        count = resume_ranges(have, length, block_size, count, ranges);
+        free(have);
+        if (count == -1) {
+            return -1;
+        }
+        // A file the peer has in full is sent as an empty range at its end.
+        if (count == 0) {
+            ranges[0].offset = length;
+            ranges[0].length = 0;
+            count = 1;
+        }
+    }
+    group = calloc(1, sizeof(StreamGroup));
+    if (group == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->changed, NULL);
+    group->dest_addr = dest_addr;
+    group->addrlen = addrlen;
+    group->streams[0].rudp = rudp;
+    // Streams whose socket cannot be made are left out.
+    for (i = 1; i < count && open_stream(&group->streams[i], rudp) == 0; i++) {
+    }
+    group->count = i;
+
+    if (resume) {
+        count = join_ranges(ranges, count, group->count);
+        // Streams beyond the ranges left are not needed.
+        for (i = count; i < group->count; i++) {
+            rudp_close(&group->streams[i].own);
+        }
+        group->count = count;
+        for (i = 0; i < count; i++) {
+            skipped += ranges[i].length;
+        }
+        skipped = length - skipped;
+        stat_add(&rudp->stats.resumed, skipped);
+    }
+    else {
+        // Ranges are multiples of 64 KB, so writes of the peer stay aligned.
+        count = group->count;
+        range = ((length + count - 1) / count + 65535) & ~(uint64_t)65535;
+        for (i = 0; i < count; i++) {
+            ranges[i].offset = i * range < length ? i * range : length;
+            ranges[i].length = (i + 1) * range < length ? range : length - ranges[i].offset;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        stream = &group->streams[i];
+        stream->group = group;
+        stream->header.transfer_id = rudp->conn_id;
+        stream->header.stream = i;
+        stream->header.streams = count;
+        stream->header.flags = RUDP_FILE_CHECKSUM;
+        stream->header.offset = ranges[i].offset;
+        stream->header.length = ranges[i].length;
+        stream->header.file_size = file_map->position + length;
+        stream->data = file_map->data + stream->header.offset;
+        // All streams go to the peer which the first one negotiated with.
+        if (rudp->compress && (rudp->peer_features & RUDP_FEATURE_COMPRESS)
+            && range_compressible(stream->data, stream->header.length))
+        {
+            stream->header.flags |= RUDP_FILE_COMPRESSED;
+        }
+        if (sends_delta(rudp)) {
+            stream->header.flags |= RUDP_FILE_DELTA;
+        }
+        // A raw range is checksummed as it is read ahead of the sender, instead of being read
+        // once for its header first, and its checksum follows it in a trailer.
+        if (stream->header.flags == RUDP_FILE_CHECKSUM && (rudp->peer_features & RUDP_FEATURE_CHECKSUM)) {
+            stream->header.flags = RUDP_FILE_TRAILER;
+        }
+    }
+
+    // A single stream is sent by the caller, with its logs.
+    if (count == 1) {
+        run_stream(&group->streams[0]);
+    }
+    else {
+        rudp->logs = false;
+        for (i = 0; i < count; i++) {
+            if (pthread_create(&group->streams[i].tid, NULL, run_stream, &group->streams[i]) != 0) {
+                break;
+            }
+        }
+        // Streams which were not started fail, and the others do not join without the first.
+        pthread_mutex_lock(&group->lock);
+        if (i == 0) {
+            group->registered = -1;
+        }
+        for (int j = i; j < count; j++) {
+            group->streams[j].bytes_sent = -1;
+            group->streams[j].done = true;
+            group->finished++;
+        }
+        pthread_cond_broadcast(&group->changed);
+        while (group->finished < count) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += PROGRESS_INTERVAL / 1000000;
+            if (pthread_cond_timedwait(&group->changed, &group->lock, &deadline) == ETIMEDOUT && logs) {
+                report_progress(group);
+            }
+        }
+        pthread_mutex_unlock(&group->lock);
+        for (int j = 0; j < i; j++) {
+            pthread_join(group->streams[j].tid, NULL);
+        }
+        rudp->logs = logs;
+        if (logs) {
+            rudp_flush_logs();
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        stream = &group->streams[i];
+        if (count > 1 && logs && stream->bytes_sent != -1) {
+            printf("Stream %d: %zd bytes in %.2f s\n", i, stream->bytes_sent,
+                    (stream->end_time - stream->start_time) / 1e6);
+        }
+        if (stream->bytes_sent == -1) {
+            total = -1;
+        }
+        else if (total != -1) {
+            total += stream->bytes_sent;
+        }
+        if (i > 0) {
+            stats_merge(rudp, &stream->own);
+            rudp_close(&stream->own);
+        }
+    }
+    pthread_cond_destroy(&group->changed);
+    pthread_mutex_destroy(&group->lock);
+    free(group);
+    return total == -1 ? -1 : total + (ssize_t)skipped;
+}
+
+ssize_t SendFileTo(RUDP *rudp, FILE* fp, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    ssize_t totalBytesSent;
+    FileMap file_map;
+    RUDP_FileHeader header;
+    char packed[RUDP_FILE_HEADER_SIZE];
+    bool prefetched;
+
+    if (negotiate(rudp, dest_addr, addrlen) == -1) {
+        return -1;
+    }
+    if (rudp->peer_version == RUDP_VERSION_1) {
+        return send_file_legacy(rudp, fp, dest_addr, addrlen);
+    }
+
+    if (rudp->logs) {
+        rudp_log(LOG_SEPARATOR, 0, false);
+    }
+    // Segments of a regular file point into its mapping, which is faulted in ahead of them.
+    // Other files are read ahead by a thread of their own and copied into the ring buffer
+    // as the window advances.
+    if (map_file(&file_map, fp) == 0) {
+        if (uses_file_header(rudp)) {
+            totalBytesSent = send_file_streams(rudp, &file_map, dest_addr, addrlen);
+            unmap_file(&file_map, fp, totalBytesSent == -1 ? 0 : totalBytesSent);
+            return totalBytesSent;
+        }
+        rudp->buffer_arg = (char*)file_map.data;
+        rudp->buffer_arg_len = file_map.length;
+        prefetched = prefetcher_start(rudp, file_map.data, file_map.length) == 0;
+        totalBytesSent = send_all(rudp, dest_addr, addrlen);
+        if (prefetched) {
+            prefetcher_stop(rudp, false);
+        }
+        unmap_file(&file_map, fp, totalBytesSent == -1 ? 0 : totalBytesSent);
+        return totalBytesSent;
+    }
+    // Header of data whose length is not known has no checksum, a peer which takes
+    // file trailers gets it after the data.
+    memset(&header, 0, sizeof(header));
+    if (uses_file_header(rudp)) {
+        header.transfer_id = rudp->conn_id;
+        header.streams = 1;
+        header.length = RUDP_LENGTH_UNKNOWN;
+        header.file_size = RUDP_LENGTH_UNKNOWN;
+        if (rudp->peer_features & RUDP_FEATURE_CHECKSUM) {
+            header.flags = RUDP_FILE_TRAILER;
+        }
+        pack_file_header(&header, packed);
+        if (rudp_sendto(rudp, packed, sizeof(packed), dest_addr, addrlen) == -1) {
+            return -1;
+        }
+    }
+    rudp->file_ring = file_ring_start(rudp, fp, false);
+    if (rudp->file_ring == NULL) {
+        return -1;
+    }
+    rudp->file_crc = 0;
+    totalBytesSent = send_all(rudp, dest_addr, addrlen);
+    file_ring_stop(rudp->file_ring, false);
+    rudp->file_ring = NULL;
+    if (totalBytesSent != -1 && (header.flags & RUDP_FILE_TRAILER)) {
+        pack_file_trailer(rudp->file_crc, packed);
+        if (rudp_sendto(rudp, packed, RUDP_FILE_TRAILER_SIZE, dest_addr, addrlen) == -1) {
+            return -1;
+        }
+    }
+
+    return totalBytesSent;
+}
+
+
+ssize_t ReceiveFileFrom(RUDP *rudp, FILE* fp, struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    ssize_t totalBytesReceived;
+    struct stat st;
+    long position;
+    RUDP_FileHeader header;
+    DeltaBasis basis = { -1, NULL, 0 };
+    Manifest manifest;
+    bool has_header, delta, resumed = false;
+    int version = peek_version(rudp);
+
+    if (version == -1) {
+        return -1;
+    }
+    if (version == RUDP_VERSION_1) {
+        return receive_file_legacy(rudp, fp, src_addr, addrlen);
+    }
+    has_header = (rudp->features & RUDP_FEATURE_FILE_HEADER) && (rudp->peer_features & RUDP_FEATURE_FILE_HEADER);
+    // Without RUDP_FEATURE_STREAMS the file comes as one stream, which is only part of it if
+    // the file is resumed.
+    if (has_header && (receive_file_header(rudp, fp, &header, &manifest, &resumed) == -1 || header.streams != 1)) {
+        if (resumed) {
+            manifest_close(&manifest);
+        }
+        return -1;
+    }
+
+    if (rudp->logs) {
+        rudp_log(LOG_SEPARATOR, 0, false);
+    }
+    delta = has_header && (header.flags & RUDP_FILE_DELTA);
+    if (has_header && (header.flags & (RUDP_FILE_COMPRESSED | RUDP_FILE_DELTA)) && decompressor_init(rudp) == -1) {
+        if (resumed) {
+            manifest_close(&manifest);
+        }
+        return -1;
+    }
+    // Segments of a regular file are written at their offsets as soon as they arrive,
+    // other files are written as soon as segments are in order. Compressed files are
+    // written as blocks are decompressed.
+    if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) && fflush(fp) == 0
+        && (position = ftell(fp)) != -1)
+    {
+        // A delta copies data of the file as it was, which it overwrites.
+        if (delta && (take_basis(&basis, fileno(fp), position) == -1 || send_signatures(rudp, &basis) == -1)) {
+            free_basis(&basis);
+            decompressor_free(rudp);
+            return -1;
+        }
+        if (delta) {
+            rudp->decompressor->basis = basis.map;
+            rudp->decompressor->basis_length = basis.length;
+        }
+        set_file(rudp, fileno(fp), position + (has_header ? header.offset : 0));
+        rudp->manifest = resumed ? &manifest : NULL;
+        totalBytesReceived = receive_all(rudp);
+        rudp->file_fd = -1;
+        rudp->manifest = NULL;
+        decompressor_free(rudp);
+        free_basis(&basis);
+        // The file ends with the delta, data of the copy past it is gone.
+        if (totalBytesReceived != -1 && delta && ftruncate(fileno(fp), position + totalBytesReceived) == -1) {
+            totalBytesReceived = -1;
+        }
+        if (totalBytesReceived != -1 && has_header && (header.flags & RUDP_FILE_TRAILER)) {
+            if (header.length == RUDP_LENGTH_UNKNOWN) {
+                header.length = totalBytesReceived;
+            }
+            if (receive_file_trailer(rudp, &header, src_addr, addrlen) == -1) {
+                totalBytesReceived = -1;
+            }
+        }
+        // Data on the disk is checked against the checksum of the sender.
+        if (totalBytesReceived != -1 && has_header && (header.length != (uint64_t)totalBytesReceived
+            || rudp_check_file_range(fileno(fp), position, &header) == -1))
+        {
+            fprintf(stderr, "File does not match its checksum\n");
+            totalBytesReceived = -1;
+        }
+        // A resumed file is whole once its range is, data of an older file past it is gone.
+        if (resumed && totalBytesReceived != -1) {
+            stat_add(&rudp->stats.resumed, manifest.length - totalBytesReceived);
+            totalBytesReceived = ftruncate(fileno(fp), position + manifest.length) == -1 ? -1 : (ssize_t)manifest.length;
+        }
+        if (resumed && totalBytesReceived != -1) {
+            manifest_remove(&manifest);
+        }
+        else if (resumed) {
+            manifest_close(&manifest);
+        }
+        fseek(fp, position + (totalBytesReceived == -1 ? 0 : totalBytesReceived), SEEK_SET);
+        return totalBytesReceived;
+    }
+    // Other files have no copy to make a delta against.
+    if (delta && send_signatures(rudp, &basis) == -1) {
+        decompressor_free(rudp);
+        return -1;
+    }
+    // File is written by a thread of its own behind the receiver.
+    rudp->file_ring = file_ring_start(rudp, fp, true);
+    if (rudp->file_ring == NULL) {
+        decompressor_free(rudp);
+        return -1;
+    }
+    rudp->file_crc = 0;
+    totalBytesReceived = receive_all(rudp);
+    if (file_ring_stop(rudp->file_ring, totalBytesReceived != -1) == -1) {
+        totalBytesReceived = -1;
+    }
+    rudp->file_ring = NULL;
+    decompressor_free(rudp);
+    // Data written to the file is checked as it goes, against the checksum of the sender.
+    if (totalBytesReceived != -1 && has_header && (header.flags & (RUDP_FILE_CHECKSUM | RUDP_FILE_TRAILER))) {
+        if ((header.flags & RUDP_FILE_TRAILER) && receive_file_trailer(rudp, &header, src_addr, addrlen) == -1) {
+            return -1;
+        }
+        if (rudp->file_crc != header.checksum) {
+            fprintf(stderr, "File does not match its checksum\n");
+            return -1;
+        }
+    }
+
+    return totalBytesReceived;
+}
+
+
+
+// ==================== RUDP_Listener Functions ====================
+
+// Returns the bucket of the hash table for the connection ID and peer address.
+uint32_t conn_bucket(RUDP_Listener *self, uint32_t conn_id, const struct sockaddr_in *addr)
+{
+    uint32_t hash = conn_id * 2654435761u;
+    hash ^= addr->sin_addr.s_addr * 2246822519u;
+    hash ^= addr->sin_port * 3266489917u;
+    return (hash ^ hash >> 16) & (self->table_size - 1);
+}
+
+// Returns the connection with the connection ID and peer address, NULL if there is none.
+RUDP *find_conn(RUDP_Listener *self, uint32_t conn_id, const struct sockaddr_in *addr)
+{
+    RUDP *conn = self->table[conn_bucket(self, conn_id, addr)];
+
+    while (conn != NULL && (conn->conn_id != conn_id || conn->peer_addr.sin_port != addr->sin_port
+                            || conn->peer_addr.sin_addr.s_addr != addr->sin_addr.s_addr))
+    {
+        conn = conn->hash_next;
+    }
+    return conn;
+}
+
+// Doubles the number of buckets of the hash table.
+// On success 0 is returned. On error -1 is returned.
+int grow_table(RUDP_Listener *self)
+{
+    RUDP **old_table = self->table;
+    uint32_t old_size = self->table_size;
+    uint32_t bucket;
+    RUDP *conn, *next;
+
+    self->table = calloc(2 * old_size, sizeof(RUDP*));
+    if (self->table == NULL) {
+        self->table = old_table;
+        return -1;
+    }
+    self->table_size = 2 * old_size;
+    for (uint32_t i = 0; i < old_size; i++) {
+        for (conn = old_table[i]; conn != NULL; conn = next) {
+            next = conn->hash_next;
+            bucket = conn_bucket(self, conn->conn_id, &conn->peer_addr);
+            conn->hash_next = self->table[bucket];
+            self->table[bucket] = conn;
+        }
+    }
+    free(old_table);
+    return 0;
+}
+
+// Makes a connection for a new peer, which gets the window, segment size, version and logs of the listener.
+// Returns the connection. On error NULL is returned.
+RUDP *add_conn(RUDP_Listener *self, uint32_t conn_id, uint8_t version, const struct sockaddr_in *addr)
+{
+    RUDP **conns;
+    RUDP *conn;
+    uint32_t slot, bucket;
+
+    if (self->count * 2 >= self->table_size && grow_table(self) == -1) {
+        return NULL;
+    }
+    if (self->count == self->capacity) {
+        conns = realloc(self->conns, 2 * self->capacity * sizeof(RUDP*));
+        if (conns == NULL) {
+            return NULL;
+        }
+        memset(conns + self->capacity, 0, self->capacity * sizeof(RUDP*));
+        self->conns = conns;
+        self->capacity *= 2;
+    }
+    for (slot = 0; self->conns[slot] != NULL; slot++) {
+    }
+
+    conn = malloc(sizeof(RUDP));
+    if (conn == NULL) {
+        return NULL;
+    }
+    rudp_init(conn);
+    if (alloc_buffer(conn, self->rudp.window_size, self->rudp.segment_size) == -1) {
+        free(conn);
+        return NULL;
+    }
+    // Connections send on the socket of the listener.
+    conn->sockfd = self->rudp.sockfd;
+    conn->version = self->rudp.version;
+    conn->features = self->rudp.features;
+    conn->checksums = self->rudp.checksums;
+    conn->logs = self->rudp.logs;
+    conn->on_data = self->on_data;
+    conn->conn_id = conn_id;
+    conn->peer_addr = *addr;
+    conn->last_active = now_us();
+    conn->conn_slot = slot;
+    // Version 2 sessions start with the hello, version 1 sessions with the first segment.
+    if (version == RUDP_VERSION_1) {
+        conn->peer_version = RUDP_VERSION_1;
+        window_init(&conn->window, conn, 0, WINDOW_SIZE);
+    }
+    else {
+        window_init(&conn->window, conn, 0, conn->window_size);
+    }
+    rt_init(&conn->receiver, conn, false);
+
+    bucket = conn_bucket(self, conn_id, addr);
+    conn->hash_next = self->table[bucket];
+    self->table[bucket] = conn;
+    self->conns[slot] = conn;
+    self->count++;
+    return conn;
+}
+
+// Removes the connection from the listener and frees it.
+void remove_conn(RUDP_Listener *self, RUDP *conn)
+{
+    RUDP **link = &self->table[conn_bucket(self, conn->conn_id, &conn->peer_addr)];
+
+    while (*link != conn) {
+        link = &(*link)->hash_next;
+    }
+    *link = conn->hash_next;
+    self->conns[conn->conn_slot] = NULL;
+    self->count--;
+
+    if (self->on_close != NULL) {
+        self->on_close(conn);
+    }
+    release_buffer_data(conn);
+    free(conn->buffer);
+    free(conn->timers);
+    fec_decoder_free(conn->fec_decoder);
+    decompressor_free(conn);
+    free(conn->reply);
+    heap_free(&conn->timer_heap);
+    stats_merge(&self->rudp, conn);
+    free(conn);
+}
+
+// Drops connections which were closed more than CONN_LINGER ago,
+// or which received nothing for CONN_IDLE_TIMEOUT.
+void sweep_conns(RUDP_Listener *self, uint64_t now)
+{
+    RUDP *conn;
+
+    for (uint32_t slot = 0; slot < self->capacity; slot++) {
+        conn = self->conns[slot];
+        if (conn != NULL && now - conn->last_active > (conn->closed ? CONN_LINGER : CONN_IDLE_TIMEOUT)) {
+            if (conn->logs) {
+                rudp_log(LOG_CONN_DROPPED, conn->conn_id, false);
+            }
+            remove_conn(self, conn);
+        }
+    }
+}
+
+// Sends the delayed acks whose time has come.
+// On success 0 is returned. On error -1 is returned.
+int send_due_acks(RUDP_Listener *self, SendBatch *acks, uint64_t now)
+{
+    TimerHeap *heap = &self->ack_timers;
+    TimerEntry entry;
+    RUDP *conn;
+
+    while (heap->size > 0 && heap_top(heap)->expiry_time <= now) {
+        entry = *heap_top(heap);
+        heap_pop(heap);
+        conn = self->conns[entry.index];
+        // Skip entries of acks which were sent before they were due.
+        if (conn == NULL || conn->receiver.ack_deadline != entry.expiry_time) {
+            continue;
+        }
+        if (send_sack(&conn->receiver, acks) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Passes a datagram to the connection of its peer. A hello of a new version 2 peer or
+// a data segment of a new version 1 peer makes a new connection. The listener only
+// receives data, so acks are discarded.
+// Sets conn to the connection, or to NULL if the datagram was discarded.
+// On success 0 is returned. On error -1 is returned.
+int dispatch(RUDP_Listener *self, char *datagram, uint32_t bytes, struct sockaddr_in *addr, socklen_t addrlen,
+                SendBatch *acks, WriteBatch *writes, RUDP **conn)
+{
+    RUDP_Header header;
+    ssize_t header_length;
+    uint8_t version;
+
+    *conn = NULL;
+    header_length = unpack_header(&header, datagram, bytes, &version);
+    if (header_length == -1) {
+        stat_add(&self->rudp.stats.datagrams_corrupt, 1);
+        return 0;
+    }
+    if (header.ack) {
+        return 0;
+    }
+    *conn = find_conn(self, header.conn_id, addr);
+    if (*conn == NULL) {
+        if (version == RUDP_VERSION_2 ? !header.hello || self->rudp.version == RUDP_VERSION_1
+                                      : self->rudp.version == RUDP_VERSION_2)
+        {
+            return 0;
+        }
+        *conn = add_conn(self, header.conn_id, version, addr);
+        if (*conn == NULL) {
+            return 0;
+        }
+        if ((*conn)->logs) {
+            rudp_log(LOG_CONN_ACCEPTED, header.conn_id, false);
+        }
+    }
+    (*conn)->last_active = now_us();
+    if (receive_data(&(*conn)->receiver, &header, version, datagram + header_length, bytes - header_length,
+                        (struct sockaddr*)addr, addrlen, acks, writes) == -1)
+    {
+        return -1;
+    }
+    // Connection stays open after the last segment of a message, the next message continues
+    // the sequence numbers of a version 2 peer and starts again at 0 for a version 1 peer.
+    if ((*conn)->receiver.done) {
+        (*conn)->receiver.done = false;
+        if ((*conn)->peer_version == RUDP_VERSION_1) {
+            window_init(&(*conn)->window, *conn, 0, WINDOW_SIZE);
+        }
+    }
+    return 0;
+}
+
+int rudp_listener_socket(RUDP_Listener *self)
+{
+    self->capacity = 64;
+    self->count = 0;
+    self->table_size = 64;
+    self->conns = calloc(self->capacity, sizeof(RUDP*));
+    self->table = calloc(self->table_size, sizeof(RUDP*));
+    heap_init(&self->ack_timers);
+    self->on_data = NULL;
+    self->on_close = NULL;
+    self->stop = false;
+    if (self->conns == NULL || self->table == NULL) {
+        free(self->conns);
+        free(self->table);
+        return -1;
+    }
+    if (rudp_socket(&self->rudp) == -1) {
+        free(self->conns);
+        free(self->table);
+        return -1;
+    }
+    self->rudp.features = 0;
+    return 0;
+}
+
+// Receives the datagrams of a batch, which are dispatched to their connections.
+// Each connection which received data is added once to touched.
+// On success 0 is returned. On error -1 is returned.
+int dispatch_batch(RUDP_Listener *self, RecvBatch *batch, int count, SendBatch *acks, WriteBatch *writes,
+                    RUDP **touched, int *touched_count)
+{
+    RUDP *conn;
+    struct msghdr *msg;
+    uint32_t offset, size;
+    int i, j;
+
+    *touched_count = 0;
+    for (i = 0; i < count; i++) {
+        msg = &batch->msgs[i].msg_hdr;
+        // A buffer joined by the kernel is split into its datagrams.
+        for (offset = 0; offset < batch->msgs[i].msg_len; offset += size) {
+            size = batch->msgs[i].msg_len - offset < batch->gro_size[i] ? batch->msgs[i].msg_len - offset
+                                                                         : batch->gro_size[i];
+            if (dispatch(self, recv_batch_buffer(batch, i) + offset, size, msg->msg_name, msg->msg_namelen,
+                            acks, writes, &conn) == -1)
+            {
+                return -1;
+            }
+            if (conn == NULL) {
+                continue;
+            }
+            for (j = 0; j < *touched_count && touched[j] != conn; j++) {
+            }
+            if (j == *touched_count) {
+                touched[(*touched_count)++] = conn;
+            }
+        }
+    }
+    return 0;
+}
+
+int rudp_listener_run(RUDP_Listener *self)
+{
+    RecvBatch batch;
+    SendBatch acks;
+    WriteBatch writes;
+    // Joined buffers hold datagrams of one peer, but may carry several connection IDs.
+    RUDP *touched[BATCH_SIZE * GSO_MAX_SEGMENTS];
+    uint64_t now, deadline, ack_deadline;
+    uint64_t next_sweep = now_us() + CONN_SWEEP_INTERVAL;
+    int count, touched_count, j;
+    int result = 0;
+
+    if (recv_batch_init(&batch, &self->rudp) == -1) {
+        return -1;
+    }
+    send_batch_init(&acks);
+    write_batch_init(&writes);
+
+    while (!self->stop && result == 0) {
+        now = now_us();
+        if (send_due_acks(self, &acks, now) == -1 || send_batch_flush(&self->rudp, &acks) == -1) {
+            result = -1;
+            break;
+        }
+        if (now >= next_sweep) {
+            sweep_conns(self, now);
+            next_sweep = now + CONN_SWEEP_INTERVAL;
+        }
+
+        // Wait for datagrams until the first delayed ack or the next sweep.
+        deadline = next_sweep;
+        if (self->ack_timers.size > 0 && heap_top(&self->ack_timers)->expiry_time < deadline) {
+            deadline = heap_top(&self->ack_timers)->expiry_time;
+        }
+        if (!wait_readable(self->rudp.sockfd, deadline)) {
+            continue;
+        }
+        count = recv_batch(&self->rudp, &batch);
+        if (count == -1
+            || dispatch_batch(self, &batch, count, &acks, &writes, touched, &touched_count) == -1)
+        {
+            result = -1;
+            break;
+        }
+
+        // Data is written before it is acked. Each connection which received segments
+        // sends one ack for them, or starts its ack delay.
+        write_batch_flush(&writes);
+        for (j = 0; j < touched_count && result == 0; j++) {
+            release_delivered(touched[j]);
+            ack_deadline = touched[j]->receiver.ack_deadline;
+            if (ack_batch(&touched[j]->receiver, &acks) == -1) {
+                result = -1;
+            }
+            else if (ack_deadline == 0 && touched[j]->receiver.ack_deadline != 0
+                && heap_push(&self->ack_timers, touched[j]->receiver.ack_deadline, touched[j]->conn_slot) == -1)
+            {
+                result = -1;
+            }
+        }
+        if (result == 0 && send_batch_flush(&self->rudp, &acks) == -1) {
+            result = -1;
+        }
+    }
+    recv_batch_free(&batch);
+    if (self->rudp.logs) {
+        rudp_flush_logs();
+    }
+    return result;
+}
+
+int rudp_listener_close(RUDP_Listener *self)
+{
+    for (uint32_t slot = 0; slot < self->capacity; slot++) {
+        if (self->conns[slot] != NULL) {
+            remove_conn(self, self->conns[slot]);
+        }
+    }
+    free(self->conns);
+    free(self->table);
+    heap_free(&self->ack_timers);
+    self->conns = NULL;
+    self->table = NULL;
+    return rudp_close(&self->rudp);
+}
+
+void rudp_conn_close(RUDP *conn)
+{
+    conn->closed = true;
+    conn->file_fd = -1;
+    conn->manifest = NULL;
+}
+
+int rudp_conn_set_file(RUDP *conn, int fd, off_t offset)
+{
+    if (conn->peer_version != RUDP_VERSION_2) {
+        return -1;
+    }
+    set_file(conn, fd, offset);
+    return 0;
+}
+
+void rudp_conn_set_manifest(RUDP *conn, Manifest *manifest)
+{
+    conn->manifest = manifest;
+}
+
+// on_data is called before the window moves past the last segment of the message.
+int rudp_conn_reply(RUDP *conn, const void *data, size_t length)
+{
+    if (conn->peer_version != RUDP_VERSION_2 || length > RUDP_REPLY_MAX) {
+        return -1;
+    }
+    if (conn->reply == NULL) {
+        conn->reply = malloc(RUDP_REPLY_MAX);
+        if (conn->reply == NULL) {
+            return -1;
+        }
+    }
+    memcpy(conn->reply, data, length);
+    conn->reply_length = length;
+    conn->reply_seqno = conn->window.base + 1;
+    return 0;
+}
+
+int rudp_conn_set_compressed(RUDP *conn)
+{
+    if (conn->peer_version != RUDP_VERSION_2) {
+        return -1;
+    }
+    decompressor_free(conn);
+    return decompressor_init(conn);
+}
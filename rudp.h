@@ -1,144 +1,1084 @@
-#ifndef RUDP_H
-#define RUDP_H
-
-#include <arpa/inet.h>
-#include <stdint.h>
-#include <pthread.h>
-#include <stdbool.h>
-
-
-#define MAX_PAYLOAD_SIZE 500  // Max number of data bytes that can be sent in a segment.
-
-// Bits for sequence number = 6.
-// sequence numbers = 2 ^ 6 = 64.
-#define SEQUENCE_NUMBERS 64   // Total number of sequence numbers.
-
-// window size <= sequence numbers / 2 = 32.
-#define WINDOW_SIZE 8         // Max number of unacknowledged segments that can be sent.
-#define TIMEOUT 3             // Time in seconds to wait before retransmission.
-#define BUFFER_SIZE 256       // Max segments that can be sent using one function call.
-
-#define FILE_BUFFER_SIZE 102400   // Max file bytes that will be read and sent using one function call.
-
-
-/*
-<--------- 8 bits --------->
-+-----------------+---+----+
-| sequence number |ack|last|
-+-----------------+---+----+
-|                          |
-|          data            |
-+--------------------------+
-*/
-
-struct RUDP_Header
-{
-    unsigned int seqno : 6;
-    unsigned int ack : 1;
-    unsigned int last : 1;
-}__attribute__((packed));
-typedef struct RUDP_Header RUDP_Header;
-
-
-
-struct RUDP_Segment
-{
-    RUDP_Header header;
-    char data[MAX_PAYLOAD_SIZE];
-}__attribute__((packed));
-typedef struct RUDP_Segment RUDP_Segment;
-
-
-
-struct RUDP;
-typedef struct RUDP_Window
-{
-    struct RUDP *rudp;
-    // For sender it is index of earliest unacked segment. 
-    // For receiver it is index of earliest expected segment.
-    uint8_t base;
-    // For sender it is index of the next segment to be sent. 
-    uint8_t next;
-} RUDP_Window;
-
-
-
-typedef struct ReceiverThread
-{
-    struct RUDP *rudp;
-    pthread_t tid;
-    ssize_t bytes_received;
-    bool stop;
-} ReceiverThread;
-
-
-typedef struct Timer
-{
-    uint8_t index; // Index of the associated segment in the buffer.
-    bool active;
-    time_t start_time;
-    time_t current_time;
-    uint8_t elapsed_time;
-} Timer;
-
-
-typedef struct RUDP
-{
-    int sockfd;
-    RUDP_Segment buffer[BUFFER_SIZE];
-    uint8_t no_of_segments; // Number of segments in buffer.
-    RUDP_Window window;
-    ReceiverThread receiver;
-    Timer timers[WINDOW_SIZE];
-    uint8_t next_timer; // Index of next timer to be used.
-    char *buffer_arg;
-    size_t buffer_arg_len;
-    bool logs;
-} RUDP;
-
-
-
-void rudp_init(RUDP *self);
-
-
-// On success 0 is returned. On error -1 is returned.
-int rudp_socket(RUDP *self);
-
-
-// On success 0 is returned. On error -1 is returned.
-int rudp_close(RUDP *self);
-
-
-// On success 0 is returned. On error -1 is returned.
-int rudp_bind(RUDP *self, const struct sockaddr *addr, socklen_t addrlen);
-
-
-// Here bytes sent or received refer to the data bytes. It does not include 
-// the bytes sent or received for acks or retransmissions.
-
-// On succes the number of bytes sent are returned. On error -1 is returned.
-ssize_t rudp_sendto(RUDP *self, const void *buffer, size_t length, 
-                        const struct sockaddr *dest_addr, socklen_t addrlen);
-
-
-// On succes the number of bytes received are returned. On error -1 is returned.
-ssize_t rudp_recvfrom(RUDP *self, void *buffer, size_t length, 
-                        struct sockaddr *src_addr, socklen_t *addrlen);
-
-
-
-// Upon successful completion, the number of bytes sent is returned.
-// Otherwise, -1 is returned.
-ssize_t SendFileTo(RUDP *rudp, FILE* fp, const struct sockaddr *dest_addr, socklen_t addrlen);
-
-
-// Upon successful completion, the number of bytes received is returned.
-// Otherwise, -1 is returned.
-ssize_t ReceiveFileFrom(RUDP *rudp, FILE* fp, struct sockaddr *src_addr, socklen_t *addrlen);
-
-
-
-
-#endif
-
-
+#ifndef RUDP_H
+#define RUDP_H
+
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "rudp_cc.h"
+#include "rudp_crc.h"
+#include "rudp_delta.h"
+#include "rudp_manifest.h"
+#include "rudp_fec.h"
+#include "rudp_log.h"
+#include "rudp_lz.h"
+#include "rudp_pool.h"
+
+
+#define MAX_PAYLOAD_SIZE 500  // Data bytes in a segment to a version 1 peer, the smallest version 2 segment size.
+
+#define RUDP_VERSION_AUTO 0   // Use version 2 if the peer supports it, otherwise version 1.
+#define RUDP_VERSION_1 1      // 1 byte header with 6 bit sequence numbers.
+#define RUDP_VERSION_2 2      // 12 byte header with 32 bit sequence numbers and connection IDs.
+
+// Version 1.
+// Bits for sequence number = 6.
+// sequence numbers = 2 ^ 6 = 64.
+#define SEQUENCE_NUMBERS 64   // Total number of version 1 sequence numbers.
+
+// window size <= sequence numbers / 2 = 32.
+#define WINDOW_SIZE 8         // Max number of unacknowledged segments that can be sent with version 1.
+#define LEGACY_BUFFER_SIZE 256    // Max segments a version 1 peer can receive using one function call.
+#define FILE_BUFFER_SIZE 102400   // Max file bytes that are sent in one message to a version 1 peer.
+
+// Version 2.
+// Bits for sequence number = 32, window size <= 2 ^ 31.
+#define DEFAULT_WINDOW_SIZE 256   // Window used until it is changed with rudp_set_window.
+#define MAX_WINDOW_SIZE 65535     // Window is advertised in 16 bits.
+#define FILE_PREALLOCATE 8388608  // Bytes of a received file which are allocated ahead of its data.
+#define FILE_RING_SIZE 4194304    // Bytes of a file which is not regular read ahead of the sender or written behind the receiver, a power of two.
+#define FILE_CHUNK_SIZE 65536     // Bytes the I/O thread of a file reads or writes at a time.
+#define FILE_READAHEAD 16777216   // Bytes of a mapped file faulted in ahead of the sender.
+#define ASYNC_PROGRESS_BYTES 1048576 // Bytes an async transfer moves between wakeups of its caller.
+#define DEFAULT_SEGMENT_SIZE 1460 // Segment size used until it is changed with rudp_set_segment_size, fills a 1500 byte MTU.
+#define MAX_SEGMENT_SIZE 65495    // Largest segment size, fills a 65507 byte UDP datagram.
+#define PROBE_RETRIES 2           // Times probes of a segment size are sent before a smaller size is used.
+#define GSO_MAX_SEGMENTS 64       // Max datagrams the kernel makes from one buffer with UDP_SEGMENT.
+#define GRO_BUFFER_SIZE 65535     // Max bytes of datagrams the kernel joins into one buffer with UDP_GRO.
+#define MAX_STREAMS 64            // Max parallel streams a file is sent over.
+#define STREAM_MIN_LENGTH 1048576 // Smallest range of a file which is sent over a stream of its own.
+#define PROGRESS_INTERVAL 1000000 // Time between progress reports of streams.
+#define FEC_HEADER_SIZE 4         // Bytes before the symbol in a parity segment.
+#define FEC_SYMBOL_HEADER 3       // Flags and length of a data segment at the start of its symbol.
+#define FEC_OVERHEAD 7            // Data bytes a segment gives up so that a parity segment fits the same size.
+#define RUDP_HISTOGRAM_BUCKETS 26 // Buckets of a time histogram, powers of two up to about a minute in microseconds.
+#define ACK_QUEUE_SIZE 65536      // Bytes of acks the receiver thread of a sender queues for it, a power of two.
+#define EARLY_DATAGRAMS 64        // Most datagrams of the next message of the peer a sender keeps.
+#define CACHE_LINE_SIZE 64        // Fields written by different threads are kept this far apart.
+#define COMPRESS_BLOCK_SIZE 65536 // Bytes of a file range compressed at a time.
+#define COMPRESS_BLOCK_HEADER 8   // Bytes before the data of a block in a compressed range.
+#define COMPRESS_QUEUE_SIZE 1048576   // Bytes of compressed blocks made ahead of the sender, a power of two.
+#define COMPRESS_MAX_ENTROPY 7.5  // Blocks whose bytes have more bits of entropy are sent raw.
+#define COMPRESS_SAMPLE_BLOCKS 8  // Blocks of a range looked at before it is compressed.
+#define DELTA_MAX_COPY 16777216   // Most bytes of a copy block, which the receiver writes at once.
+#define DELTA_SIGNATURE_HEADER 16 // Bytes of the message before the signatures of the blocks.
+#define RUDP_RESUME_HEADER 16     // Bytes of a resume request before the checksums of the blocks.
+#define RUDP_RESUME_MAX (RUDP_RESUME_HEADER + 4 * MANIFEST_MAX_BLOCKS) // Longest resume request.
+#define RUDP_REPLY_MAX (MANIFEST_MAX_BLOCKS / 8)  // Most bytes of a reply sent with an ack.
+
+// Retransmission timeout is computed from RTT samples as in RFC 6298, all times are in microseconds.
+#define INITIAL_RTO 1000000   // Retransmission timeout until the first RTT sample.
+#define MIN_RTO 10000         // Lower bound of the retransmission timeout, covers acks held up by a busy receiver.
+#define RTO_GRANULARITY 5000  // Time the timers and the threads of both sides can run late by on a busy host.
+#define MAX_RTO 60000000      // Upper bound of the retransmission timeout after backoff.
+#define LEGACY_RTO 3000000    // Fixed retransmission timeout with version 1 peers, which mishandle early duplicates.
+#define MAX_RETRANSMISSIONS 15    // Times a segment is resent before the peer is considered unreachable.
+#define DUPACK_THRESHOLD 3    // Acks of later segments after which an unacked segment is resent.
+#define ACK_EVERY 4           // Version 2 data segments received before an ack is sent.
+#define ACK_DELAY 500         // Max time an ack of a version 2 data segment is delayed.
+#define HELLO_TIMEOUT 1       // Time in seconds to wait for the reply to a hello.
+#define HELLO_RETRIES 3       // Hellos sent before falling back to version 1.
+
+// Listener.
+#define CONN_LINGER 5000000           // Time a closed connection is kept to ack resent segments.
+#define CONN_IDLE_TIMEOUT 60000000    // Time after which a connection which receives nothing is dropped.
+#define CONN_SWEEP_INTERVAL 1000000   // Time between checks for connections to drop.
+
+
+/*
+Version 1 header.
+<--------- 8 bits --------->
++-----------------+---+----+
+| sequence number |ack|last|
++-----------------+---+----+
+|                          |
+|          data            |
++--------------------------+
+
+Version 2 header. Multi byte fields are in network byte order.
+The first byte has both high bits set, so a legacy peer reads it as an ack.
+<--------------------------- 32 bits --------------------------->
++---+-----------+---------------+-------------------------------+
+|1 1|  version  |     flags     |            window             |
++---+-----------+---------------+-------------------------------+
+|                        sequence number                        |
++---------------------------------------------------------------+
+|                         connection ID                         |
++---------------------------------------------------------------+
+|                                                               |
+|                             data                              |
++---------------------------------------------------------------+
+
+A datagram with the CHECKSUM flag has the CRC32C of the header and the data in the 32 bits
+after the header, and is dropped if they do not match. It is sent to peers with
+RUDP_FEATURE_CHECKSUM after the hello, when the sender turned it on with rudp_set_checksums.
+Full segments then carry 4 fewer data bytes, so datagrams keep the size found by probing.
+
+A version 2 ack with the SACK flag acks every segment before its sequence number,
+which is the next segment the receiver expects. Its data is a bitmap of the segments
+received after that one, bit i (bit i % 8 of byte i / 8) is segment seqno + 1 + i.
+
+The connection ID is chosen by the peer which sends the hello. A listener tells
+connections from each other by their ID and address, version 1 peers by address only.
+
+A hello carries the features of the sender as 16 bits of data. The ack of a hello carries
+the largest segment size the peer can receive and its features, 16 bits each.
+The sender then probes the path with segments of smaller sizes sent with the DF bit set,
+and sends full segments of the largest size whose probe was acked.
+
+When both peers have RUDP_FEATURE_FILE_HEADER, SendFileTo sends a file header message before
+the data of a file. A file may then be split into ranges sent over parallel streams, each a
+session of its own. Every stream starts with the header of its range, the first stream after
+the filename message of the application, the others as their first message. Multi byte fields
+are in network byte order.
+<--------------------------- 32 bits --------------------------->
++---------------+---------------+---------------+---------------+
+|       0       |      'R'      |      'F'      |      'H'      |
++---------------+---------------+---------------+---------------+
+|          transfer ID (connection ID of the first stream)      |
++-------------------------------+-------------------------------+
+|        stream index           |        stream count           |
++-------------------------------+-------------------------------+
+|                             flags                             |
++---------------------------------------------------------------+
+|                    offset of the range (64)                   |
++---------------------------------------------------------------+
+|                    length of the range (64)                   |
++---------------------------------------------------------------+
+|                        file size (64)                         |
++---------------------------------------------------------------+
+|                     CRC32C of the range                       |
++---------------------------------------------------------------+
+
+A sender with forward error correction follows every block of data segments with parity
+segments, which are not acked or resent. The sequence number of a parity segment is the
+index of the first data segment of its block. Its data is the number of the parity symbol,
+the data segments in the block, the parity symbols of each block and the data segments of a
+full block, 8 bits each, followed by the parity symbol. The symbol of a data segment is its
+flags (bit 0 is the last flag), its length in 16 bits and its data, padded with zeros to the
+longest symbol of the block. A block ends early when the window of the sender is full.
+The receiver rebuilds up to as many lost data segments of a block as it received parity
+segments of it, without waiting for them to be resent.
+
+A range whose file header has RUDP_FILE_COMPRESSED is sent as blocks of at most
+COMPRESS_BLOCK_SIZE bytes of the range, each after its raw length and the length of its
+data, 32 bits each. Data as long as the raw length is the raw block, shorter data is the
+block compressed in the format of rudp_lz.h. The file header has the length and checksum
+of the raw range.
+
+Data whose length is not known when its file header is sent, read from a pipe, has no
+checksum in the header. With RUDP_FILE_TRAILER it is followed by a trailer message with
+the CRC32C of the data. A raw range sent to a peer with RUDP_FEATURE_CHECKSUM also has its
+checksum in a trailer, computed as the range is read ahead of the sender.
++---------------+---------------+---------------+---------------+
+|       0       |      'R'      |      'F'      |      'T'      |
++---------------+---------------+---------------+---------------+
+|                         CRC32C of the data                    |
++---------------------------------------------------------------+
+
+A range whose file header has RUDP_FILE_DELTA is sent as a delta of the copy the receiver
+has, from the position of its file to the end. The receiver first sends back the signatures
+of the blocks of its copy, a message with their size and the length of the copy, followed,
+if the copy has a full block, by a message with the weak checksum and the CRC32C of each full
+block, 32 bits each (see rudp_delta.h). The range is then sent as the blocks of a compressed
+range, with copy blocks for data the copy has. A copy block has no data, its length is 0 and
+it is followed by the offset in the copy of its raw length bytes, 64 bits. Other blocks are
+compressed if the header also has RUDP_FILE_COMPRESSED. The copy is replaced by the range.
++---------------+---------------+---------------+---------------+
+|       0       |      'R'      |      'F'      |      'S'      |
++---------------+---------------+---------------+---------------+
+|                          block size                           |
++---------------------------------------------------------------+
+|                    length of the copy (64)                    |
++---------------------------------------------------------------+
+
+A sender may resume a regular file to a peer with RUDP_FEATURE_RESUME. Before the first file
+header it sends a resume request with the block size of the manifest of the file (see
+rudp_manifest.h), the length of the file and the CRC32C of each block, 32 bits each.
+The receiver answers with a reply on the acks of the last segment of the request, an ack with
+the REPLY flag whose data is the reply instead of a SACK bitmap. The reply is a bitmap of the
+blocks the receiver has written with the same checksum, bit i % 8 of byte i / 8 for block i,
+and the sender only sends ranges of the blocks which are missing. A file the receiver has in
+full is sent as an empty range at its end. The receiver marks blocks in its manifest as they
+are written, so a transfer which fails is resumed from where it stopped.
++---------------+---------------+---------------+---------------+
+|       0       |      'R'      |      'F'      |      'M'      |
++---------------+---------------+---------------+---------------+
+|                          block size                           |
++---------------------------------------------------------------+
+|                    length of the file (64)                    |
++---------------------------------------------------------------+
+*/
+
+struct RUDP_Header_v1
+{
+    unsigned int seqno : 6;
+    unsigned int ack : 1;
+    unsigned int last : 1;
+}__attribute__((packed));
+typedef struct RUDP_Header_v1 RUDP_Header_v1;
+
+#define RUDP_V2_MARK 0xC0
+#define RUDP_FLAG_ACK 0x01
+#define RUDP_FLAG_LAST 0x02
+#define RUDP_FLAG_HELLO 0x04    // Sent to negotiate version 2, the window is the sender's window.
+#define RUDP_FLAG_SACK 0x08     // Cumulative ack followed by a SACK bitmap.
+#define RUDP_FLAG_ACK_NOW 0x10  // Sent on segments whose ack should not be delayed, the sender cannot send more.
+#define RUDP_FLAG_PROBE 0x20    // Path MTU probe padded to a segment size, acked with the same sequence number.
+#define RUDP_FLAG_PARITY 0x40   // Parity segment of a block of data segments.
+#define RUDP_FLAG_CHECKSUM 0x80 // CRC32C of the datagram follows the header.
+#define RUDP_FLAG_REPLY 0x40    // On an ack, a reply to the message it acks follows instead of a SACK bitmap.
+#define RUDP_CHECKSUM_SIZE 4
+
+// Features advertised in hellos and their acks.
+#define RUDP_FEATURE_FILE_HEADER 0x01   // Files are preceded by a file header.
+#define RUDP_FEATURE_STREAMS 0x02       // Ranges of a file on parallel streams are put together.
+#define RUDP_FEATURE_FEC 0x04           // Lost data segments are rebuilt from parity segments.
+#define RUDP_FEATURE_PARITY 0x08        // Parity segments are sent to peers with RUDP_FEATURE_FEC.
+#define RUDP_FEATURE_COMPRESS 0x10      // Compressed ranges of files are received.
+#define RUDP_FEATURE_CHECKSUM 0x20      // Datagrams with checksums and file trailers are received.
+#define RUDP_FEATURE_DELTA 0x40         // Signatures of the file are sent back for a delta of it.
+#define RUDP_FEATURE_RESUME 0x80        // Resume requests are answered with the blocks a manifest has.
+
+#define RUDP_FILE_HEADER_SIZE 44
+#define RUDP_FILE_CHECKSUM 0x01     // Flag of a file header with the CRC32C of its range.
+#define RUDP_FILE_COMPRESSED 0x02   // Flag of a file header whose range is sent compressed.
+#define RUDP_FILE_TRAILER 0x04      // Flag of a file header whose data is followed by a file trailer.
+#define RUDP_FILE_DELTA 0x08        // Flag of a file header whose range is sent as a delta of the copy of the peer.
+#define RUDP_FILE_TRAILER_SIZE 8
+#define RUDP_LENGTH_UNKNOWN UINT64_MAX
+
+struct RUDP_Header_v2
+{
+    uint8_t version;
+    uint8_t flags;
+    uint16_t window;
+    uint32_t seqno;
+    uint32_t conn_id;
+}__attribute__((packed));
+typedef struct RUDP_Header_v2 RUDP_Header_v2;
+
+
+// Header of a segment in memory. It is packed into the
+// version in use when the segment is sent.
+struct RUDP_Header
+{
+    uint32_t seqno;
+    uint32_t conn_id;
+    uint16_t window;
+    unsigned int ack : 1;
+    unsigned int last : 1;
+    unsigned int hello : 1;
+    unsigned int sack : 1;
+    unsigned int ack_now : 1;
+    unsigned int probe : 1;
+    unsigned int parity : 1;
+    unsigned int reply : 1;
+};
+typedef struct RUDP_Header RUDP_Header;
+
+
+// Range of a file sent over one stream.
+typedef struct RUDP_FileHeader
+{
+    uint32_t transfer_id;   // Connection ID of the first stream of the file.
+    uint16_t stream;        // Index of the stream, the first stream also carries the filename.
+    uint16_t streams;       // Number of streams of the file.
+    uint32_t flags;
+    uint64_t offset;        // Offset in the file of the first byte of the range.
+    uint64_t length;        // Bytes in the range, RUDP_LENGTH_UNKNOWN if it is not a regular file.
+    uint64_t file_size;     // Bytes in the file, RUDP_LENGTH_UNKNOWN if it is not a regular file.
+    uint32_t checksum;      // CRC32C of the range if flags has RUDP_FILE_CHECKSUM.
+} RUDP_FileHeader;
+
+
+
+struct RUDP_Segment
+{
+    RUDP_Header header;
+    uint16_t length;        // Number of data bytes.
+    const char *payload;    // Data of the segment, points into data or into memory of the caller.
+    char *data;             // Block of the pool with space for segment_size bytes of data, NULL if it has none.
+};
+typedef struct RUDP_Segment RUDP_Segment;
+
+
+
+struct RUDP;
+typedef struct RUDP_Window
+{
+    struct RUDP *rudp;
+    // Indexes are sequence numbers which are not wrapped to the version 1 range,
+    // so one window can stay open for a whole file.
+    // For sender it is index of earliest unacked segment.
+    // For receiver it is index of earliest expected segment.
+    uint32_t base;
+    // For sender it is index of the next segment to be sent.
+    uint32_t next;
+    // For receiver it is index of the first segment of the message being received.
+    uint32_t message_start;
+    // For receiver it is the length of the full segments of the message, 0 until one has arrived.
+    uint32_t message_segment_size;
+    uint32_t size;  // Max number of segments in the window.
+    uint32_t mask;  // Sequence numbers on the wire are index & mask.
+    // For receiver it is index of the first delivered segment whose data is not yet given back.
+    uint32_t released;
+} RUDP_Window;
+
+
+
+typedef struct ReceiverThread
+{
+    struct RUDP *rudp;
+    pthread_t tid;
+    ssize_t bytes_received;
+    bool sending;   // Set when acks are expected, otherwise data segments are expected.
+    bool done;      // Set when the last segment has been received.
+    atomic_bool stop;   // Set by the sender to stop its receiver thread, or by the thread when it fails or is done.
+    // Session of the sender, copied so that acks are checked without reading the cache lines it writes.
+    int sockfd;
+    uint8_t peer_version;
+    uint32_t conn_id;
+    uint32_t recv_seqno;    // Next sequence number of the peer, whose data before it was delivered.
+    // Delayed acks of the receiver with a version 2 peer.
+    uint32_t pending_acks;      // Segments received since the last ack.
+    bool ack_now;               // Set when the next ack should not be delayed.
+    uint64_t ack_deadline;      // Time when the delayed ack is sent, 0 if none is pending.
+    uint32_t sack_end;          // One past the highest segment received in the window.
+    struct sockaddr_in ack_addr;
+    socklen_t ack_addrlen;
+    uint8_t sack[MAX_PAYLOAD_SIZE];
+} ReceiverThread;
+
+
+// Ack received by the receiver thread of a sender, followed by its SACK bitmap.
+typedef struct AckRecord
+{
+    uint32_t size;          // Bytes of the record and its bitmap rounded up to 8, 0 if the queue wraps here.
+    uint16_t sack_length;   // Bytes of the bitmap.
+    RUDP_Header header;
+} AckRecord;
+
+
+// Acks passed from the receiver thread to the sender, which handles them, so the state of the
+// window is only used by the sender. Only the receiver thread moves tail and only the sender
+// moves head, each on a cache line of its own with the last value it read of the other.
+typedef struct AckQueue
+{
+    uint8_t *data;          // ACK_QUEUE_SIZE bytes, allocated by the first send.
+    char pad_head[CACHE_LINE_SIZE];
+    atomic_size_t head;     // Bytes taken by the sender.
+    size_t tail_seen;
+    char pad_tail[CACHE_LINE_SIZE];
+    atomic_size_t tail;     // Bytes added by the receiver thread.
+    size_t head_seen;
+    char pad_end[CACHE_LINE_SIZE];
+} AckQueue;
+
+
+// Data segments of the next message of the peer which a sender read with its last acks, as a
+// peer which answers a message sends its reply as soon as it has the message. The receive
+// which follows takes them before it reads the socket, instead of waiting for them to be resent.
+typedef struct EarlyDatagrams
+{
+    char *data[EARLY_DATAGRAMS];
+    uint16_t length[EARLY_DATAGRAMS];
+    struct sockaddr_in addr[EARLY_DATAGRAMS];
+    int count;
+} EarlyDatagrams;
+
+
+typedef struct Timer
+{
+    bool active;
+    uint8_t retransmissions;    // Acks of resent segments are not used as RTT samples (Karn's algorithm).
+    uint64_t sent_time;         // Time when the segment was last sent.
+    uint64_t first_sent_time;   // Time when the segment was first sent.
+    uint64_t expiry_time;       // Time when the segment is resent if it is not acked.
+} Timer;
+
+
+typedef struct TimerEntry
+{
+    uint64_t expiry_time;
+    uint32_t index;     // Index of the segment.
+} TimerEntry;
+
+
+// Min heap of timer entries ordered by expiry time, so the next timer to expire
+// is found without scanning the window. Entries of timers which were stopped or
+// restarted are not removed, they are skipped when they reach the top.
+typedef struct TimerHeap
+{
+    TimerEntry *entries;
+    uint32_t size;
+    uint32_t capacity;
+} TimerHeap;
+
+
+typedef struct RTTEstimator
+{
+    uint64_t srtt;      // Smoothed round trip time.
+    uint64_t rttvar;    // Round trip time variation.
+    uint64_t rto;       // Retransmission timeout, doubled on every timeout until new data is acked.
+    bool has_sample;
+} RTTEstimator;
+
+
+// Counts of system calls which sent or received datagrams, the average
+// batch size is the number of datagrams divided by the number of calls.
+// The sender and its receiver thread count on different cache lines.
+typedef struct BatchStats
+{
+    atomic_uint_least64_t send_calls;
+    atomic_uint_least64_t datagrams_sent;
+    char pad[CACHE_LINE_SIZE];
+    atomic_uint_least64_t recv_calls;
+    atomic_uint_least64_t datagrams_received;
+} BatchStats;
+
+
+// Losses repaired by the sender, which resends segments, and by the receiver, which
+// rebuilds them from parity segments.
+typedef struct LossStats
+{
+    atomic_uint_least64_t segments_resent;
+    atomic_uint_least64_t parity_sent;
+    atomic_uint_least64_t parity_received;
+    atomic_uint_least64_t segments_rebuilt;
+} LossStats;
+
+
+// Counters of the segments and acks of a session and histograms of its times. They are written
+// by the sender, or by the receiver thread of a receiver, and may be read by any thread with
+// rudp_get_stats.
+typedef struct SessionStats
+{
+    atomic_uint_least64_t segments_sent;        // Data segments sent for the first time.
+    atomic_uint_least64_t timeouts;
+    atomic_uint_least64_t fast_retransmits;
+    atomic_uint_least64_t acks_received;
+    atomic_uint_least64_t segments_received;    // Data segments received, duplicates included.
+    atomic_uint_least64_t segments_duplicate;   // Data segments which had been received before.
+    atomic_uint_least64_t datagrams_corrupt;    // Datagrams dropped as too short or with a wrong checksum.
+    atomic_uint_least64_t acks_sent;
+    atomic_uint_least64_t window_used;          // Segments sent from the window base on.
+    atomic_uint_least64_t bytes_in_flight;      // Data bytes sent and not acked.
+    atomic_uint_least64_t bytes_acked;          // Data bytes acked in the session.
+    atomic_uint_least64_t memory;               // Bytes of the ring buffer, timers and segment data held.
+    atomic_uint_least64_t memory_peak;
+    atomic_uint_least64_t compress_input;       // Bytes of file ranges compressed.
+    atomic_uint_least64_t compress_output;      // Bytes they were sent as, with block headers.
+    atomic_uint_least64_t compress_raw_blocks;  // Blocks which did not compress and were sent raw.
+    atomic_uint_least64_t delta_matched;        // Bytes of delta ranges sent as copies of the copy of the peer.
+    atomic_uint_least64_t delta_literal;        // Bytes of delta ranges sent as data.
+    atomic_uint_least64_t resumed;              // Bytes of files the peer had from an earlier transfer, not sent.
+    atomic_uint_least64_t rtt[RUDP_HISTOGRAM_BUCKETS];
+    atomic_uint_least64_t delivery[RUDP_HISTOGRAM_BUCKETS];   // Time from the first send of a segment to its ack.
+} SessionStats;
+
+
+// Copy of the statistics of a session, times are in microseconds. Bucket i of a histogram
+// counts times in [2 ^ i, 2 ^ (i + 1)), bucket 0 also 0 and the last bucket all longer times.
+typedef struct RUDP_Stats
+{
+    uint64_t segments_sent;
+    uint64_t segments_resent;
+    uint64_t timeouts;
+    uint64_t fast_retransmits;
+    uint64_t acks_received;
+    uint64_t segments_received;
+    uint64_t segments_duplicate;
+    uint64_t datagrams_corrupt;
+    uint64_t acks_sent;
+    uint64_t parity_sent;
+    uint64_t parity_received;
+    uint64_t segments_rebuilt;
+    uint64_t datagrams_sent;
+    uint64_t datagrams_received;
+    uint64_t window_used;
+    uint64_t window_size;
+    uint64_t bytes_in_flight;
+    uint64_t bytes_acked;
+    uint64_t memory;
+    uint64_t memory_peak;       // For a listener the largest peak of a connection.
+    uint64_t compress_input;
+    uint64_t compress_output;
+    uint64_t compress_raw_blocks;
+    uint64_t delta_matched;
+    uint64_t delta_literal;
+    uint64_t resumed;
+    uint64_t rtt_histogram[RUDP_HISTOGRAM_BUCKETS];
+    uint64_t delivery_histogram[RUDP_HISTOGRAM_BUCKETS];
+} RUDP_Stats;
+
+
+// Parity symbols of the block of data segments being sent, computed as segments are sent
+// for the first time.
+typedef struct FecEncoder
+{
+    bool active;            // Set when parity segments are sent in the session.
+    uint32_t first;         // Index of the first data segment of the block.
+    uint8_t count;          // Data segments in the block so far.
+    uint16_t symbol_size;   // Bytes of the longest symbol of the block.
+    // Parity segments are sent from a ring of spaces, one for each block, as many that a batch
+    // is flushed before a space is used again. A parity segment is FEC_HEADER_SIZE bytes
+    // followed by the symbol.
+    uint8_t *parity;
+    size_t parity_length;   // Bytes allocated for the ring.
+    size_t capacity;        // Bytes of each parity segment.
+    uint32_t spaces;        // Blocks in the ring.
+    uint32_t next_space;    // Space of the block being sent.
+    // Index after the block of each slot of the ring buffer. A block ends early when the
+    // window is full, so it is one past the last segment of a full block until its parity is sent.
+    uint32_t *block_ends;
+    uint32_t block_ends_size;
+} FecEncoder;
+
+
+// Block of data segments some of whose parity segments have been received.
+typedef struct FecBlock
+{
+    uint32_t first;         // Index of the first data segment.
+    uint8_t count;          // Data segments in the block.
+    uint16_t rows;          // Bitmap of the parity symbols received.
+    uint16_t symbol_size;
+    bool used;
+} FecBlock;
+
+
+// Parity received by a connection, kept until its block is rebuilt or complete.
+typedef struct FecDecoder
+{
+    FecBlock *blocks;       // Direct mapped by block number, a power of two of them.
+    uint32_t block_count;
+    uint8_t block_size;     // Data segments in a full block of the sender.
+    uint8_t parity_count;   // Parity segments in each block of the sender.
+    uint8_t *parity;        // parity_count symbols of segment_size bytes for each block.
+    uint8_t *scratch;       // Space for a rebuilt symbol.
+    uint32_t pending;       // Blocks in use.
+} FecDecoder;
+
+
+// Compresses a range of a file in a thread of its own ahead of the sender, which makes
+// segments from the queue of compressed blocks. The thread waits while the queue is full.
+typedef struct Compressor
+{
+    struct RUDP *rudp;
+    const char *data;       // Range being compressed.
+    size_t length;
+    bool compress;          // Cleared when blocks are only sent raw or as copies.
+    const DeltaIndex *index;    // Signatures of the copy of the peer for a delta, NULL if there are none.
+    uint8_t *queue;         // Ring of COMPRESS_QUEUE_SIZE bytes.
+    uint8_t *packed;        // Header and compressed data of the block being made.
+    pthread_mutex_t lock;   // Guards the fields below.
+    pthread_cond_t space;   // Signaled when the sender takes bytes or stops the thread.
+    uint64_t head;          // Bytes written to the queue.
+    uint64_t tail;          // Bytes taken by the sender.
+    bool done;              // Set when the whole range is in the queue.
+    bool stop;
+    pthread_t tid;
+} Compressor;
+
+
+// Compressed range being received. Blocks are put together from the data of the segments,
+// which need not end with them.
+typedef struct Decompressor
+{
+    uint8_t header[COMPRESS_BLOCK_HEADER];
+    uint32_t raw_length;    // Lengths of the block, from its header.
+    uint32_t stored_length;
+    uint32_t have;          // Bytes of the header or the data of the block received.
+    uint8_t *block;         // Data of the block as it was sent.
+    uint8_t *output;        // Decompressed block.
+    uint64_t produced;      // Bytes of the range delivered.
+    const uint8_t *basis;   // Copy of the file which copy blocks are taken from, NULL if there are none.
+    uint64_t basis_length;
+} Decompressor;
+
+
+// File which is not regular, as a pipe, read ahead of the sender or written behind the receiver
+// by a thread of its own through a ring of chunks, so that the file and the network are busy at
+// the same time. The thread waits while the ring is full, for a reader, or empty, for a writer.
+typedef struct FileRing
+{
+    struct RUDP *rudp;      // Sender woken when a chunk has been read.
+    FILE *fp;
+    bool writing;           // Set when the thread writes the ring to the file.
+    uint8_t *data;          // Ring of FILE_RING_SIZE bytes.
+    pthread_mutex_t lock;   // Guards the fields below.
+    pthread_cond_t changed; // Signaled when bytes are put in or taken out, or the ring ends.
+    uint64_t head;          // Bytes put in the ring.
+    uint64_t tail;          // Bytes taken out.
+    bool done;              // Set when no more bytes are put in.
+    bool failed;            // Set when the file could not be read or written.
+    bool stop;
+    pthread_t tid;
+} FileRing;
+
+
+// Faults the pages of a mapped range in, in a thread of its own up to FILE_READAHEAD bytes ahead
+// of the sender, so that a range which is not cached is read from the disk while the data before
+// it is sent. The CRC32C of the range is computed on the way.
+typedef struct Prefetcher
+{
+    const char *data;
+    size_t length;
+    size_t told;            // Bytes taken which the thread was last told of, only used by the sender.
+    pthread_mutex_t lock;   // Guards the fields below.
+    pthread_cond_t taken_changed;   // Signaled when the sender takes another chunk or stops the thread.
+    size_t taken;           // Bytes of the range taken by the sender.
+    bool stop;
+    uint32_t crc;           // Written by the thread, read once it has been joined.
+    pthread_t tid;
+} Prefetcher;
+
+
+// Send or receive submitted with rudp_send_async or rudp_recv_async.
+typedef struct AsyncRequest
+{
+    bool sending;
+    void *buffer;
+    size_t length;
+    struct sockaddr_in dest_addr;   // Peer a send goes to.
+    socklen_t addrlen;
+    void *user;
+    ssize_t result;         // Returned by rudp_sendto or rudp_recvfrom.
+    struct AsyncRequest *next;
+} AsyncRequest;
+
+
+// Runs the transfers submitted to a socket one after another in a thread of its own, so that the
+// caller goes on with its other work while they run. The eventfd becomes readable when a transfer
+// completes or has moved another ASYNC_PROGRESS_BYTES bytes.
+typedef struct AsyncWorker
+{
+    struct RUDP *rudp;
+    int eventfd;
+    atomic_uint_least64_t progress; // Bytes acked or delivered of the running transfer.
+    pthread_mutex_t lock;   // Guards the fields below.
+    pthread_cond_t changed; // Signaled when a transfer is submitted or completes, or the thread is stopped.
+    AsyncRequest *pending;  // Transfers not yet started, oldest first.
+    AsyncRequest *running;
+    AsyncRequest *completed;    // Transfers not yet taken by rudp_async_poll, oldest first.
+    bool stop;
+    pthread_t tid;
+} AsyncWorker;
+
+
+// Result of a transfer submitted with rudp_send_async or rudp_recv_async.
+typedef struct RUDP_Completion
+{
+    void *user;             // Given when the transfer was submitted.
+    bool sending;
+    ssize_t result;         // Bytes sent or received, -1 on error.
+} RUDP_Completion;
+
+
+typedef struct RUDP
+{
+    int sockfd;
+    RUDP_Segment *buffer;   // Ring buffer, segment with index i is kept in slot i & (buffer_size - 1).
+    Timer *timers;          // Retransmission timer of each slot in buffer.
+    TimerHeap timer_heap;   // Running timers, used by the sender only.
+    RTTEstimator rtt;       // Kept between function calls.
+    CongestionControl cc;   // Kept between function calls, set with rudp_set_congestion.
+    // Loss recovery state of the sender.
+    uint32_t acked_above_base;  // Later segments acked since the window base last moved.
+    bool fast_retransmit;       // Set when lost segments should be resent.
+    bool in_recovery;           // Set from a loss until recovery_seqno is acked.
+    uint32_t recovery_seqno;    // Value of next when the loss was found.
+    uint32_t sack_high;         // One past the highest segment acked.
+    uint64_t base_moved_time;   // Time when an ack last moved the window base.
+    uint32_t retransmit_next;   // Next segment checked for a fast retransmit in recovery.
+    uint32_t buffer_size;   // Power of two and at least 2 * window_size.
+    uint32_t window_size;   // Max number of unacknowledged segments, set with rudp_set_window.
+    uint16_t segment_size;      // Largest segment sent or received, set with rudp_set_segment_size.
+    uint16_t peer_segment_size; // Largest segment the peer receives, from the ack of its hello.
+    uint16_t path_segment_size; // Size of the segments sent in the session, found by probing the path.
+    uint8_t version;        // Version to use, one of RUDP_VERSION_*.
+    uint16_t features;      // RUDP_FEATURE_* advertised to peers.
+    uint16_t streams;       // Streams files are sent over, set with rudp_set_streams.
+    uint8_t fec_data;       // Data segments in a block, set with rudp_set_fec.
+    uint8_t fec_parity;     // Parity segments sent after each block, 0 if none are.
+    bool compress;          // Set with rudp_set_compression.
+    bool checksums;         // Set with rudp_set_checksums.
+    bool delta;             // Set with rudp_set_delta.
+    bool resume;            // Set with rudp_set_resume.
+    bool messages;          // Set with rudp_set_messages.
+    // Session state which is kept between function calls.
+    uint8_t peer_version;   // Negotiated version, 0 until it is known.
+    uint16_t peer_features; // Features of the peer from its hello or the ack of ours.
+    uint32_t conn_id;       // Connection ID of the session, 0 with version 1 peers.
+    uint32_t peer_window;   // Window advertised by the peer.
+    uint32_t send_seqno;    // Next version 2 sequence number to send.
+    uint32_t recv_seqno;    // Next version 2 sequence number expected.
+    RUDP_Window window;
+    bool slots_clear;       // Set while no slot of buffer has its ack field set, so a receive need not clear them.
+    struct RecvBatch *ack_batch;    // Datagrams a sender in message mode reads, kept between calls.
+    // The receiver thread of a sender only uses the fields from here to the end of early.
+    char pad_receiver[CACHE_LINE_SIZE];
+    ReceiverThread receiver;
+    AckQueue ack_queue;
+    EarlyDatagrams early;
+    // Segments are made from and delivered to the file through its ring if it is set,
+    // otherwise to the buffer argument.
+    FileRing *file_ring;
+    uint32_t file_crc;      // CRC32C of the data made from or delivered to the file.
+    char *buffer_arg;
+    size_t buffer_arg_len;
+    Prefetcher *prefetcher; // Faults in the mapped file which the buffer argument points into, NULL if there is none.
+    // Connections of a listener deliver data to a function instead, last is set
+    // on the data which ends a message. Segments are discarded once it is closed.
+    void (*on_data)(struct RUDP *conn, const char *data, size_t length, bool last);
+    // Data of a version 2 message can be written to a file at the offset of each segment as
+    // soon as it arrives, in any order. Every segment but the last of a message is full,
+    // so the offset follows from the sequence number.
+    int file_fd;            // File of the message being received, -1 if there is none.
+    off_t file_offset;      // Offset in the file of the first byte of the message.
+    off_t file_allocated;   // End of the space allocated for the file.
+    Manifest *manifest;     // Manifest whose blocks of the file are marked as they are written, NULL if there is none.
+    // Reply to the last message received, sent with its acks, or the reply of the peer to the
+    // last message sent. NULL if there is none.
+    char *reply;
+    uint16_t reply_length;
+    uint32_t reply_seqno;   // Sequence number after the message which the reply answers.
+    void *user;             // Set by the user of a listener for each connection.
+    bool closed;
+    // State of a connection kept by a listener.
+    struct sockaddr_in peer_addr;
+    uint64_t last_active;   // Time when the last datagram was received.
+    uint32_t conn_slot;     // Index in the connections of the listener.
+    struct RUDP *hash_next; // Next connection in the same bucket of the hash table.
+    // Sender waits for events in epoll instead of polling the window and timers.
+    int epfd;
+    int eventfd;            // Written by the receiver thread to wake the sender.
+    int stopfd;             // Written by the sender to wake its receiver thread when it stops it.
+    int timerfd;            // Expires when the first retransmission timer does.
+    uint64_t timer_armed;   // Expiry time the timerfd is set to, 0 if it is not set.
+    bool batching;          // Cleared when the kernel has no sendmmsg.
+    bool recv_batching;     // Cleared when the kernel has no recvmmsg.
+    bool gso;               // Full segments to a peer are sent as one buffer with UDP_SEGMENT.
+    bool gro;               // Datagrams of a peer may be received joined in one buffer with UDP_GRO.
+    BatchStats batch_stats;
+    // Forward error correction. Data of received segments is kept in the ring buffer while
+    // their blocks may still need it.
+    FecEncoder fec_encoder;
+    FecDecoder *fec_decoder;    // Allocated when the first parity segment arrives.
+    // Compression of file ranges. Segments are made from the queue of the compressor while a
+    // range is sent, and a message which is received goes through the decompressor if it is set.
+    Compressor *compressor;
+    Decompressor *decompressor;
+    AsyncWorker *async;     // Runs the transfers submitted with rudp_send_async and rudp_recv_async, NULL until one is.
+    LossStats loss_stats;
+    SessionStats stats;
+    bool logs;
+} RUDP;
+
+
+
+// Sets the fields of self to their defaults, without a socket.
+void rudp_init(RUDP *self);
+
+
+// On success 0 is returned. On error -1 is returned.
+int rudp_socket(RUDP *self);
+
+
+// On success 0 is returned. On error -1 is returned.
+int rudp_close(RUDP *self);
+
+
+// On success 0 is returned. On error -1 is returned.
+int rudp_bind(RUDP *self, const struct sockaddr *addr, socklen_t addrlen);
+
+
+// Lets sockets of other RUDPs bind the same port, the kernel then spreads peers over them
+// by a hash of their address, so each peer is always received by the same socket.
+// Must be called before rudp_bind on every socket which shares the port.
+// On success 0 is returned. On error -1 is returned.
+int rudp_set_reuseport(RUDP *self);
+
+
+// Sets the max number of unacknowledged segments used with version 2 peers.
+// window_size must be in [1, MAX_WINDOW_SIZE]. The window used for a transfer
+// is the smaller of the windows of both peers.
+// On success 0 is returned. On error -1 is returned.
+int rudp_set_window(RUDP *self, uint32_t window_size);
+
+
+// Sets the largest number of data bytes in a segment sent to or received from version 2 peers.
+// size must be in [MAX_PAYLOAD_SIZE, MAX_SEGMENT_SIZE]. Segments sent are no larger than the
+// size of the receiver and the size probing finds for the path.
+// On success 0 is returned. On error -1 is returned.
+int rudp_set_segment_size(RUDP *self, uint32_t size);
+
+
+// Turns on sending full segments as one buffer which the kernel splits (UDP_SEGMENT) and
+// receiving datagrams joined by the kernel (UDP_GRO), so one system call moves up to 64 KB.
+// On success 0 is returned. On error, or if the kernel does not support it, -1 is returned.
+int rudp_set_offload(RUDP *self, bool on);
+
+
+// Sets the number of parallel streams SendFileTo sends a regular file over, in [1, MAX_STREAMS].
+// Each stream has its own socket, thread and session with the peer, so a file can use more
+// than one core and more than one flow's share of the path. Only peers with
+// RUDP_FEATURE_STREAMS are sent more than one stream, and every stream gets at least
+// STREAM_MIN_LENGTH bytes.
+// On success 0 is returned. On error -1 is returned.
+int rudp_set_streams(RUDP *self, int streams);
+
+
+// Splits the data sent to peers with RUDP_FEATURE_FEC into blocks of data segments, each
+// followed by parity segments, so that up to parity losses in a block are repaired without
+// resending. data must be in [1, FEC_MAX_DATA] and parity in [0, FEC_MAX_PARITY], 0 turns it off.
+// The overhead is parity / data of the data sent, and each segment carries FEC_OVERHEAD
+// fewer data bytes.
+// On success 0 is returned. On error -1 is returned.
+int rudp_set_fec(RUDP *self, int data, int parity);
+
+
+// Adds a CRC32C to the datagrams sent to peers with RUDP_FEATURE_CHECKSUM, which drop those
+// that were corrupted on the way instead of passing them on. Data whose length is not known
+// is followed by a file trailer with its CRC32C, as a regular file has one in its file header.
+void rudp_set_checksums(RUDP *self, bool on);
+
+
+// Sends a regular file to peers with RUDP_FEATURE_DELTA as a delta of the copy they have, which
+// sends the signatures of its blocks first. Data the copy has anywhere is sent as a reference to
+// it, so a file with small changes costs about the changes and the signatures on the path.
+// The file is sent as one stream.
+void rudp_set_delta(RUDP *self, bool on);
+
+
+// Sends a regular file to peers with RUDP_FEATURE_RESUME without the blocks they have from an
+// earlier transfer which failed, as recorded in the manifest next to their file. The CRC32C of
+// every block is sent first, so blocks which changed since are sent again.
+void rudp_set_resume(RUDP *self, bool on);
+
+
+// Sets message mode, for small messages such as requests and replies. A send reads its acks on
+// the calling thread instead of starting a receiver thread for them and asks the peer to ack
+// every segment at once, and a receive acks every batch of segments at once. Larger transfers
+// are faster without it, as the acks of a sender are then read while it sends.
+void rudp_set_messages(RUDP *self, bool on);
+
+
+// Compresses the ranges SendFileTo sends to peers with RUDP_FEATURE_COMPRESS, in a thread of
+// each stream. Blocks which do not compress, as those of files compressed already, are sent raw.
+// It pays off when the path is slower than the compressor, about 300 MB/s on one core.
+void rudp_set_compression(RUDP *self, bool on);
+
+
+// Sets the congestion control algorithm of the sender, one of "reno" (default), "cubic",
+// "vegas" and "none".
+// On success 0 is returned. On error -1 is returned.
+int rudp_set_congestion(RUDP *self, const char *name);
+
+
+// Prints the number of datagrams sent and received with the number of system calls
+// used for them. More than one datagram per call means batching with sendmmsg and recvmmsg.
+void rudp_print_batch_stats(RUDP *self);
+
+
+// Prints the segments which were resent and those rebuilt from parity segments. A listener
+// counts the segments rebuilt by its connections once they have been freed.
+void rudp_print_loss_stats(RUDP *self);
+
+
+// Copies the counters of the session into stats. It may be called from any thread while
+// the session is in use. A listener counts those of its connections once they have been freed.
+void rudp_get_stats(RUDP *self, RUDP_Stats *stats);
+
+
+// Returns the upper bound in microseconds of the bucket of histogram which holds the given
+// fraction of the times, 0 if the histogram is empty.
+uint64_t rudp_histogram_percentile(const uint64_t *histogram, double fraction);
+
+
+// Prints the segments and acks sent and received, percentiles of the RTT and of the
+// time from the first send of a segment to its ack, and the peak memory of the session.
+void rudp_print_stats(RUDP *self);
+
+
+// Here bytes sent or received refer to the data bytes. It does not include
+// the bytes sent or received for acks or retransmissions.
+
+// The first call to send on a socket negotiates the version with the peer.
+
+// On succes the number of bytes sent are returned. On error -1 is returned.
+ssize_t rudp_sendto(RUDP *self, const void *buffer, size_t length,
+                        const struct sockaddr *dest_addr, socklen_t addrlen);
+
+
+// On succes the number of bytes received are returned. On error -1 is returned.
+ssize_t rudp_recvfrom(RUDP *self, void *buffer, size_t length,
+                        struct sockaddr *src_addr, socklen_t *addrlen);
+
+
+// Transfers can also be submitted without waiting for them, so that one thread drives the
+// transfers of many sockets alongside its other I/O. They run one after another in a thread
+// of the socket, which is started by the first call to rudp_async_fd or a submit. While they
+// run no other function may be called on the socket but rudp_send_async, rudp_recv_async,
+// rudp_async_poll, rudp_async_progress and rudp_close, which ends the running transfer
+// and drops those not yet started. Buffers must stay valid until their transfer completes.
+
+// Returns an eventfd which becomes readable when a transfer completes or has moved another
+// ASYNC_PROGRESS_BYTES bytes, to be waited for with poll or epoll. It is cleared by rudp_async_poll.
+// On error -1 is returned.
+int rudp_async_fd(RUDP *self);
+
+
+// Submits a send of length bytes of buffer to dest_addr. user is passed back with its completion.
+// On success 0 is returned. On error -1 is returned.
+int rudp_send_async(RUDP *self, const void *buffer, size_t length,
+                        const struct sockaddr *dest_addr, socklen_t addrlen, void *user);
+
+
+// Submits a receive of a message into the length bytes of buffer. user is passed back with its completion.
+// On success 0 is returned. On error -1 is returned.
+int rudp_recv_async(RUDP *self, void *buffer, size_t length, void *user);
+
+
+// Takes the oldest transfer which has completed into completion, after clearing the eventfd, so
+// that it is called until it returns 0 each time the eventfd is readable.
+// Returns 1 if a transfer was taken and 0 if none has completed.
+int rudp_async_poll(RUDP *self, RUDP_Completion *completion);
+
+
+// Returns the bytes acked or delivered of the transfer which is running, 0 if none is.
+uint64_t rudp_async_progress(RUDP *self);
+
+
+
+// Reads a file header from a message.
+// On success 0 is returned. If the message is not a file header -1 is returned.
+int rudp_unpack_file_header(RUDP_FileHeader *header, const char *data, size_t length);
+
+
+// Reads a file trailer from a message into the checksum of header, which is then
+// checked like that of a regular file once its length is set to the bytes received.
+// On success 0 is returned. If the message is not a file trailer -1 is returned.
+int rudp_unpack_file_trailer(RUDP_FileHeader *header, const char *data, size_t length);
+
+
+// Checks the range of a file header against the data written to fd, with the range starting
+// at base + header->offset. Ranges without a checksum always pass.
+// On success 0 is returned. On error, or if the data differs, -1 is returned.
+int rudp_check_file_range(int fd, off_t base, const RUDP_FileHeader *header);
+
+
+
+// A listener receives from many peers on one socket. Every peer which sends to it gets
+// a connection with its own window, buffers and delayed acks, all of them are served
+// by one loop. Version 1 peers can only send one connection per address.
+typedef struct RUDP_Listener
+{
+    RUDP rudp;                  // Socket of the listener, its window, version, features and logs are used for new connections.
+    RUDP **conns;               // Connections by slot, free slots are NULL.
+    uint32_t capacity;          // Number of slots.
+    uint32_t count;             // Number of connections.
+    RUDP **table;               // Hash table of connections keyed by connection ID and peer address.
+    uint32_t table_size;        // Power of two.
+    TimerHeap ack_timers;       // Delayed acks, the index of an entry is the slot of its connection.
+    // Called with the data of each connection in order.
+    void (*on_data)(RUDP *conn, const char *data, size_t length, bool last);
+    // Called before a connection is freed, when it has been closed or idle for too long.
+    void (*on_close)(RUDP *conn);
+    atomic_bool stop;           // Set to make rudp_listener_run return, also from other threads.
+} RUDP_Listener;
+
+
+// Creates the socket of the listener, which is bound with rudp_bind(&listener->rudp, ...).
+// The listener advertises no features, data of peers goes to on_data as it was sent.
+// On success 0 is returned. On error -1 is returned.
+int rudp_listener_socket(RUDP_Listener *self);
+
+
+// Receives from all peers until self->stop is set. A stop from another thread is seen
+// within CONN_SWEEP_INTERVAL. Listeners share no state, so each may run in its own thread.
+// On success 0 is returned. On error -1 is returned.
+int rudp_listener_run(RUDP_Listener *self);
+
+
+// Closes the socket of the listener and frees every connection.
+// On success 0 is returned. On error -1 is returned.
+int rudp_listener_close(RUDP_Listener *self);
+
+
+// Stops delivering the data of a connection of a listener, which keeps it for CONN_LINGER
+// to ack segments which are resent.
+void rudp_conn_close(RUDP *conn);
+
+
+// Writes the next message of a connection to the file fd from offset, instead of passing it
+// to on_data. Segments are written as soon as they arrive, also out of order, and space is
+// allocated ahead of them. When the whole message has been written on_data is called once
+// with data NULL, the length of the message and last set. It is called from on_data with the
+// last data of the message before. Messages of version 1 peers are always passed to on_data.
+// On success 0 is returned. On error -1 is returned.
+int rudp_conn_set_file(RUDP *conn, int fd, off_t offset);
+
+
+// Marks the blocks of the next message of a connection in manifest as they are written to the
+// file set with rudp_conn_set_file. A manifest may be shared by the streams of a file.
+void rudp_conn_set_manifest(RUDP *conn, Manifest *manifest);
+
+
+// Sends length bytes, at most RUDP_REPLY_MAX, back to the peer with the acks of the message
+// whose last data on_data is called with. It is called from on_data with that data, and the
+// reply is dropped once the next message arrives. A listener has no other way to answer.
+// On success 0 is returned. On error -1 is returned.
+int rudp_conn_reply(RUDP *conn, const void *data, size_t length);
+
+
+// Answers the resume request of a sender from the manifest of the file path, whose data starts
+// at base, and opens the manifest for the blocks to be marked in. reply gets a bitmap of the
+// blocks the file has with the checksums of the sender, at most RUDP_REPLY_MAX bytes.
+// On success the length of the reply is returned. If the message is not a resume request,
+// or on error, -1 is returned.
+ssize_t rudp_resume_file(Manifest *manifest, const char *path, off_t base, const char *request, size_t length,
+                            char *reply);
+
+
+// Decompresses the next message of a connection, a range whose file header has
+// RUDP_FILE_COMPRESSED, before it is written to the file or passed to on_data.
+// On success 0 is returned. On error -1 is returned.
+int rudp_conn_set_compressed(RUDP *conn);
+
+
+// The whole file is sent as one stream using a single sliding window,
+// the last segment of the file marks the end of the stream. A regular file is mapped
+// into memory and its segments are sent from the mapping without copying them.
+// Peers with RUDP_FEATURE_FILE_HEADER are first sent a file header with the CRC32C of the file,
+// and with RUDP_FEATURE_STREAMS a regular file may be split over parallel streams.
+// With rudp_set_compression peers with RUDP_FEATURE_COMPRESS are sent a regular file compressed,
+// and with rudp_set_delta peers with RUDP_FEATURE_DELTA a delta of the copy they have.
+// With rudp_set_resume peers with RUDP_FEATURE_RESUME are only sent the blocks they do not have,
+// and the whole file counts as sent.
+// Version 1 peers are sent messages of FILE_BUFFER_SIZE bytes and an end-of-file indicator.
+
+// Upon successful completion, the number of bytes sent is returned.
+// Otherwise, -1 is returned.
+ssize_t SendFileTo(RUDP *rudp, FILE* fp, const struct sockaddr *dest_addr, socklen_t addrlen);
+
+
+// A regular file is written at the offset of each segment as soon as it arrives.
+// If the peer sent a file header, the file is checked against its checksum or that of the
+// file trailer.
+// A compressed file is decompressed as it arrives. For a delta the signatures of the file
+// from its position to its end are sent to the peer, and the file is replaced by the data
+// of the peer. A regular file which is resumed keeps a manifest next to it until it has been
+// received in full, and the whole file counts as received.
+
+// Upon successful completion, the number of bytes received is returned.
+// Otherwise, -1 is returned.
+ssize_t ReceiveFileFrom(RUDP *rudp, FILE* fp, struct sockaddr *src_addr, socklen_t *addrlen);
+
+
+
+
+#endif
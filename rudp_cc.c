@@ -0,0 +1,227 @@
+
+
+#include <string.h>
+#include <math.h>
+#include "rudp_cc.h"
+
+
+
+// ==================== Reno Functions ====================
+
+void reno_init(CongestionControl *cc)
+{
+    cc->cwnd = CC_INITIAL_WINDOW;
+    cc->ssthresh = INFINITY;
+}
+
+// Window grows by one segment per ack in slow start and
+// by one segment per window of acks in congestion avoidance.
+void reno_on_ack(CongestionControl *cc, uint32_t acked, uint64_t rtt, uint64_t now)
+{
+    while (acked-- > 0) {
+        if (cc->cwnd < cc->ssthresh) {
+            cc->cwnd += 1;
+        }
+        else {
+            cc->cwnd += 1 / cc->cwnd;
+        }
+    }
+}
+
+// Window is halved on a loss found from acks, and goes back to one
+// segment on a timeout because the ack clock has been lost.
+void reno_on_loss(CongestionControl *cc, uint32_t inflight, bool timeout, uint64_t now)
+{
+    cc->ssthresh = inflight / 2.0;
+    if (cc->ssthresh < CC_MIN_WINDOW) {
+        cc->ssthresh = CC_MIN_WINDOW;
+    }
+    cc->cwnd = timeout ? 1 : cc->ssthresh;
+}
+
+const CongestionOps reno_ops = { "reno", reno_init, reno_on_ack, reno_on_loss };
+
+
+
+// ==================== Cubic Functions ====================
+
+void cubic_init(CongestionControl *cc)
+{
+    reno_init(cc);
+    cc->epoch_start = 0;
+    cc->w_max = 0;
+}
+
+// In congestion avoidance the window follows W(t) = C * (t - K)^3 + W_max,
+// where t is the time since the last loss and K is the time to reach W_max again.
+void cubic_on_ack(CongestionControl *cc, uint32_t acked, uint64_t rtt, uint64_t now)
+{
+    double t, k, target;
+
+    while (acked > 0 && cc->cwnd < cc->ssthresh) {
+        cc->cwnd += 1;
+        acked--;
+    }
+    if (acked == 0) {
+        return;
+    }
+    if (cc->epoch_start == 0) {
+        cc->epoch_start = now;
+        if (cc->w_max < cc->cwnd) {
+            cc->w_max = cc->cwnd;
+        }
+    }
+    t = (now - cc->epoch_start + cc->min_rtt) / 1e6;
+    k = cbrt(cc->w_max * (1 - CUBIC_BETA) / CUBIC_C);
+    target = CUBIC_C * (t - k) * (t - k) * (t - k) + cc->w_max;
+    if (target > cc->cwnd) {
+        cc->cwnd += acked * (target - cc->cwnd) / cc->cwnd;
+    }
+    else {
+        cc->cwnd += acked * 0.01 / cc->cwnd;
+    }
+}
+
+void cubic_on_loss(CongestionControl *cc, uint32_t inflight, bool timeout, uint64_t now)
+{
+    cc->w_max = cc->cwnd;
+    cc->epoch_start = 0;
+    cc->ssthresh = cc->cwnd * CUBIC_BETA;
+    if (cc->ssthresh < CC_MIN_WINDOW) {
+        cc->ssthresh = CC_MIN_WINDOW;
+    }
+    cc->cwnd = timeout ? 1 : cc->ssthresh;
+}
+
+const CongestionOps cubic_ops = { "cubic", cubic_init, cubic_on_ack, cubic_on_loss };
+
+
+
+// ==================== Vegas Functions ====================
+
+void vegas_init(CongestionControl *cc)
+{
+    reno_init(cc);
+    cc->round_end = 0;
+    cc->round_min_rtt = 0;
+}
+
+// Once per round trip the expected rate cwnd / min_rtt is compared with the actual
+// rate cwnd / rtt. Their difference times min_rtt is the number of segments queued
+// at the bottleneck, the window is changed to keep it between alpha and beta.
+void vegas_on_ack(CongestionControl *cc, uint32_t acked, uint64_t rtt, uint64_t now)
+{
+    double queued;
+
+    if (rtt != 0 && (cc->round_min_rtt == 0 || rtt < cc->round_min_rtt)) {
+        cc->round_min_rtt = rtt;
+    }
+    if (cc->delivered < cc->round_end) {
+        return;
+    }
+    // A round ends when the segments sent at its start have been acked.
+    cc->round_end = cc->delivered + (uint64_t)cc->cwnd;
+    if (cc->round_min_rtt == 0 || cc->min_rtt == 0) {
+        reno_on_ack(cc, acked, rtt, now);
+        return;
+    }
+    queued = cc->cwnd * (cc->round_min_rtt - cc->min_rtt) / cc->round_min_rtt;
+    cc->round_min_rtt = 0;
+
+    if (cc->cwnd < cc->ssthresh) {
+        if (queued > VEGAS_GAMMA) {
+            cc->ssthresh = cc->cwnd;
+        }
+        else {
+            // Window doubles every round trip in slow start.
+            cc->cwnd *= 2;
+        }
+    }
+    else if (queued < VEGAS_ALPHA) {
+        cc->cwnd += 1;
+    }
+    else if (queued > VEGAS_BETA && cc->cwnd > CC_MIN_WINDOW) {
+        cc->cwnd -= 1;
+    }
+}
+
+const CongestionOps vegas_ops = { "vegas", vegas_init, vegas_on_ack, reno_on_loss };
+
+
+
+// ==================== No Congestion Control Functions ====================
+
+void none_init(CongestionControl *cc)
+{
+    cc->cwnd = INFINITY;
+    cc->ssthresh = INFINITY;
+}
+
+void none_on_ack(CongestionControl *cc, uint32_t acked, uint64_t rtt, uint64_t now)
+{
+}
+
+void none_on_loss(CongestionControl *cc, uint32_t inflight, bool timeout, uint64_t now)
+{
+}
+
+const CongestionOps none_ops = { "none", none_init, none_on_ack, none_on_loss };
+
+
+
+// ==================== CongestionControl Functions ====================
+
+const CongestionOps *algorithms[] = { &reno_ops, &cubic_ops, &vegas_ops, &none_ops };
+
+int cc_init(CongestionControl *self, const char *name)
+{
+    for (size_t i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++) {
+        if (strcmp(algorithms[i]->name, name) == 0) {
+            memset(self, 0, sizeof(*self));
+            self->ops = algorithms[i];
+            self->ops->init(self);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void cc_on_ack(CongestionControl *self, uint32_t acked, uint64_t rtt, uint64_t now)
+{
+    uint64_t interval;
+
+    if (rtt != 0) {
+        self->last_rtt = rtt;
+        if (self->min_rtt == 0 || rtt < self->min_rtt) {
+            self->min_rtt = rtt;
+        }
+    }
+    self->delivered += acked;
+
+    // Measure the delivery rate once at least one RTT has passed.
+    interval = now - self->interval_start;
+    if (self->interval_start == 0) {
+        self->interval_start = now;
+        self->interval_delivered = self->delivered;
+    }
+    else if (self->last_rtt != 0 && interval >= self->last_rtt) {
+        self->delivery_rate = (self->delivered - self->interval_delivered) * 1e6 / interval;
+        self->interval_start = now;
+        self->interval_delivered = self->delivered;
+    }
+
+    self->ops->on_ack(self, acked, rtt, now);
+}
+
+void cc_on_loss(CongestionControl *self, uint32_t inflight, bool timeout, uint64_t now)
+{
+    self->ops->on_loss(self, inflight, timeout, now);
+}
+
+uint32_t cc_window(CongestionControl *self)
+{
+    if (self->cwnd >= UINT32_MAX) {
+        return UINT32_MAX;
+    }
+    return self->cwnd < 1 ? 1 : (uint32_t)self->cwnd;
+}
@@ -0,0 +1,73 @@
+#ifndef RUDP_CC_H
+#define RUDP_CC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define CC_INITIAL_WINDOW 10      // Congestion window in segments at the start of a session (RFC 6928).
+#define CC_MIN_WINDOW 2           // Congestion window never goes below this after a fast retransmit.
+#define CC_DEFAULT "reno"         // Algorithm used until it is changed with rudp_set_congestion.
+
+// Vegas keeps between VEGAS_ALPHA and VEGAS_BETA segments queued at the bottleneck.
+#define VEGAS_ALPHA 2
+#define VEGAS_BETA 4
+#define VEGAS_GAMMA 1             // Slow start ends when more than VEGAS_GAMMA segments are queued.
+
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+
+struct CongestionControl;
+
+// Functions of a congestion control algorithm. Losses are reported once per
+// window of data, further losses of the same window only cause resends.
+typedef struct CongestionOps
+{
+    const char *name;
+    void (*init)(struct CongestionControl *cc);
+    // Called for segments which are newly acked, rtt is 0 when the ack gave no RTT sample.
+    void (*on_ack)(struct CongestionControl *cc, uint32_t acked, uint64_t rtt, uint64_t now);
+    // Called when a loss is detected by a timeout or by later segments being acked.
+    void (*on_loss)(struct CongestionControl *cc, uint32_t inflight, bool timeout, uint64_t now);
+} CongestionOps;
+
+
+typedef struct CongestionControl
+{
+    const CongestionOps *ops;
+    double cwnd;            // Congestion window in segments.
+    double ssthresh;        // Slow start threshold in segments.
+    uint64_t min_rtt;       // Smallest RTT sample in microseconds, 0 until the first sample.
+    uint64_t last_rtt;      // Latest RTT sample in microseconds.
+
+    // Delivery rate is measured over intervals of about one RTT.
+    uint64_t delivered;             // Total segments acked.
+    uint64_t interval_start;        // Time when the current interval started.
+    uint64_t interval_delivered;    // Segments acked before the current interval.
+    double delivery_rate;           // Segments per second in the last interval.
+
+    // State of the algorithms.
+    uint64_t epoch_start;   // Cubic: time of the first ack after the last loss.
+    double w_max;           // Cubic: congestion window before the last loss.
+    uint64_t round_end;     // Vegas: segments delivered when the current round ends.
+    uint64_t round_min_rtt; // Vegas: smallest RTT sample in the current round.
+} CongestionControl;
+
+
+
+// Sets the algorithm by name, one of "reno", "cubic", "vegas" and "none".
+// "none" only limits the sender by the window.
+// On success 0 is returned. On error -1 is returned.
+int cc_init(CongestionControl *self, const char *name);
+
+void cc_on_ack(CongestionControl *self, uint32_t acked, uint64_t rtt, uint64_t now);
+
+void cc_on_loss(CongestionControl *self, uint32_t inflight, bool timeout, uint64_t now);
+
+// Returns the number of segments which may be unacknowledged.
+uint32_t cc_window(CongestionControl *self);
+
+
+
+#endif
@@ -0,0 +1,200 @@
+
+
+
+#include <string.h>
+#include <pthread.h>
+#include "rudp_crc.h"
+
+// The crc32 instruction of SSE4.2 is used where the CPU has it, checked at run time.
+// Build with -DRUDP_NO_SSE42 to always use the tables.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(RUDP_NO_SSE42)
+#define HAVE_SSE42
+#include <nmmintrin.h>
+#endif
+
+
+#define CRC32C_POLY 0x82F63B78    // Reversed Castagnoli polynomial.
+#define CRC32C_LONG 8192          // Bytes of each of 3 parts of a long buffer computed at the same time.
+#define CRC32C_SHORT 256          // Bytes of each part of what is left.
+
+
+// table[k][b] is the CRC of byte b followed by k zero bytes, so 8 bytes are done per step.
+static uint32_t table[8][256];
+#ifdef HAVE_SSE42
+// Tables which move a CRC past CRC32C_LONG or CRC32C_SHORT zero bytes, one byte of it at a time.
+static uint32_t long_zeros[4][256];
+static uint32_t short_zeros[4][256];
+#endif
+static uint32_t (*crc32c_update)(uint32_t crc, const uint8_t *p, size_t length);
+static const char *update_name;
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+
+
+// ==================== CRC32C Functions ====================
+
+// Continues the CRC, without the inversions at the start and end, with the tables.
+static uint32_t crc_update_table(uint32_t crc, const uint8_t *p, size_t length)
+{
+    uint32_t low, high;
+
+    while (length >= 8) {
+        memcpy(&low, p, 4);
+        memcpy(&high, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        low = __builtin_bswap32(low);
+        high = __builtin_bswap32(high);
+#endif
+        low ^= crc;
+        crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF]
+            ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24]
+            ^ table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF]
+            ^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+        p += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+#ifdef HAVE_SSE42
+// Returns the product of the 32 x 32 matrix over GF(2), one column per word, and vector.
+static uint32_t crc_gf2_times(const uint32_t *matrix, uint32_t vector)
+{
+    uint32_t sum = 0;
+
+    for (; vector != 0; vector >>= 1, matrix++) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+    }
+    return sum;
+}
+
+static void crc_gf2_square(uint32_t *square, const uint32_t *matrix)
+{
+    for (int n = 0; n < 32; n++) {
+        square[n] = crc_gf2_times(matrix, matrix[n]);
+    }
+}
+
+// Makes the tables of the operator which moves a CRC past length zero bytes, a power of two.
+static void crc_make_zeros_table(uint32_t zeros[4][256], size_t length)
+{
+    uint32_t op[32], square[32];
+
+    // Operator of one zero bit, then squared to 8 bits and on to length bytes.
+    op[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++) {
+        op[n] = (uint32_t)1 << (n - 1);
+    }
+    for (size_t bits = 1; bits < 8 * length; bits *= 2) {
+        crc_gf2_square(square, op);
+        memcpy(op, square, sizeof(op));
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 0; k < 4; k++) {
+            zeros[k][b] = crc_gf2_times(op, b << (8 * k));
+        }
+    }
+}
+
+// Returns crc moved past the zero bytes of the tables.
+static uint32_t crc_shift(uint32_t zeros[4][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF] ^ zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+static uint64_t crc_read64(const uint8_t *p)
+{
+    uint64_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Continues the CRC with the crc32 instruction. It takes 3 cycles and a new one can start
+// every cycle, so a long buffer is split in 3 parts whose CRCs are computed at the same time
+// and then put together with the zeros tables.
+__attribute__((target("sse4.2")))
+static uint32_t crc_update_sse42(uint32_t crc, const uint8_t *p, size_t length)
+{
+    uint64_t crc0 = crc, crc1, crc2;
+    const uint8_t *end;
+    size_t part;
+
+    while (length > 0 && ((uintptr_t)p & 7) != 0) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+        length--;
+    }
+    for (part = CRC32C_LONG; part >= CRC32C_SHORT; part = part == CRC32C_LONG ? CRC32C_SHORT : 0) {
+        while (length >= 3 * part) {
+            crc1 = crc2 = 0;
+            for (end = p + part; p < end; p += 8) {
+                crc0 = _mm_crc32_u64(crc0, crc_read64(p));
+                crc1 = _mm_crc32_u64(crc1, crc_read64(p + part));
+                crc2 = _mm_crc32_u64(crc2, crc_read64(p + 2 * part));
+            }
+            crc0 = crc_shift(part == CRC32C_LONG ? long_zeros : short_zeros, crc0) ^ crc1;
+            crc0 = crc_shift(part == CRC32C_LONG ? long_zeros : short_zeros, crc0) ^ crc2;
+            p += 2 * part;
+            length -= 3 * part;
+        }
+    }
+    for (; length >= 8; length -= 8, p += 8) {
+        crc0 = _mm_crc32_u64(crc0, crc_read64(p));
+    }
+    while (length-- > 0) {
+        crc0 = _mm_crc32_u8(crc0, *p++);
+    }
+    return crc0;
+}
+#endif
+
+static void crc_init_table(void)
+{
+    uint32_t crc;
+
+    for (int b = 0; b < 256; b++) {
+        crc = b;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        table[0][b] = crc;
+    }
+    for (int b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xFF];
+        }
+    }
+    crc32c_update = crc_update_table;
+    update_name = "table";
+#ifdef HAVE_SSE42
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_make_zeros_table(long_zeros, CRC32C_LONG);
+        crc_make_zeros_table(short_zeros, CRC32C_SHORT);
+        crc32c_update = crc_update_sse42;
+        update_name = "sse4.2";
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+    pthread_once(&table_once, crc_init_table);
+    return ~crc32c_update(~crc, data, length);
+}
+
+uint32_t crc32c_table(uint32_t crc, const void *data, size_t length)
+{
+    pthread_once(&table_once, crc_init_table);
+    return ~crc_update_table(~crc, data, length);
+}
+
+const char *crc32c_name(void)
+{
+    pthread_once(&table_once, crc_init_table);
+    return update_name;
+}
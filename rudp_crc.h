@@ -0,0 +1,23 @@
+#ifndef RUDP_CRC_H
+#define RUDP_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// CRC32C (Castagnoli) of data, continued from crc. The CRC of no data is 0,
+// so a CRC over many buffers starts with crc 0. The crc32 instruction of SSE4.2
+// is used if the CPU has it, otherwise tables.
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+
+// Same as crc32c, always with the tables.
+uint32_t crc32c_table(uint32_t crc, const void *data, size_t length);
+
+
+// Returns the name of the code crc32c uses, "sse4.2" or "table".
+const char *crc32c_name(void);
+
+
+
+#endif
@@ -0,0 +1,181 @@
+
+
+
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "rudp_crc.h"
+#include "rudp_delta.h"
+
+// Weak checksums of whole blocks are summed 16 bytes at a time with SSE2, which every
+// x86-64 CPU has. Build with -DRUDP_NO_SSE2 to always sum byte by byte.
+#if defined(__SSE2__) && !defined(RUDP_NO_SSE2)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+
+
+// ==================== Delta Functions ====================
+
+uint32_t delta_block_size(uint64_t length)
+{
+    uint64_t size = ((uint64_t)sqrt((double)length) + 63) & ~(uint64_t)63;
+
+    if (size < DELTA_MIN_BLOCK) {
+        return DELTA_MIN_BLOCK;
+    }
+    // A copy of more than DELTA_MAX_BLOCKS blocks of the largest size only has its start matched.
+    return size > DELTA_MAX_BLOCK ? DELTA_MAX_BLOCK : size;
+}
+
+// The sums are kept modulo 2^32, which keeps them right modulo 2^16.
+uint32_t delta_weak(const uint8_t *data, size_t length)
+{
+    uint32_t s1 = 0, s2 = 0;
+    size_t i = 0;
+
+#ifdef HAVE_SSE2
+    // Each byte of a run of 16 is weighted by 16 minus its position in it, and s2 gets 16 times
+    // the sum of the runs before, which gives each byte its weight over the whole data.
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low_weights = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i high_weights = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+    __m128i sum = zero, sums_before = zero, weighted = zero, bytes;
+    uint32_t lanes[4];
+
+    for (; i + 16 <= length; i += 16) {
+        bytes = _mm_loadu_si128((const __m128i*)(data + i));
+        sums_before = _mm_add_epi32(sums_before, sum);
+        sum = _mm_add_epi32(sum, _mm_sad_epu8(bytes, zero));
+        weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_unpacklo_epi8(bytes, zero), low_weights));
+        weighted = _mm_add_epi32(weighted, _mm_madd_epi16(_mm_unpackhi_epi8(bytes, zero), high_weights));
+    }
+    _mm_storeu_si128((__m128i*)lanes, sum);
+    s1 = lanes[0] + lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, sums_before);
+    s2 = 16 * (lanes[0] + lanes[2]);
+    _mm_storeu_si128((__m128i*)lanes, weighted);
+    s2 += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+    // Each byte adds the sum of the bytes up to it, so every byte is counted once more
+    // for each byte after it.
+    for (; i < length; i++) {
+        s1 += data[i];
+        s2 += s1;
+    }
+    return (s1 & 0xFFFF) | s2 << 16;
+}
+
+// Returns the weak checksum of the length bytes one byte further, from that of the bytes from out.
+uint32_t delta_roll(uint32_t weak, uint8_t out, uint8_t in, size_t length)
+{
+    uint32_t s1 = (weak & 0xFFFF) - out + in;
+    uint32_t s2 = (weak >> 16) - (uint32_t)length * out + s1;
+
+    return (s1 & 0xFFFF) | s2 << 16;
+}
+
+uint32_t delta_bucket(const DeltaIndex *self, uint32_t weak)
+{
+    return (weak * 2654435761u >> 8) & self->mask;
+}
+
+int delta_index_init(DeltaIndex *self, const DeltaSignature *signatures, uint32_t count, uint32_t block_size)
+{
+    uint32_t buckets = 1, bucket;
+
+    // About half of the buckets are used, so that most rolled checksums which match no block
+    // are turned away by an empty bucket.
+    while (buckets < 2 * (uint64_t)count) {
+        buckets *= 2;
+    }
+    self->signatures = signatures;
+    self->count = count;
+    self->block_size = block_size;
+    self->mask = buckets - 1;
+    self->heads = malloc(buckets * sizeof(uint32_t));
+    self->next = malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+    if (self->heads == NULL || self->next == NULL) {
+        free(self->heads);
+        free(self->next);
+        return -1;
+    }
+    memset(self->heads, 0xFF, buckets * sizeof(uint32_t));
+    // Blocks are linked in reverse, so that the first of equal blocks is found first.
+    for (uint32_t i = count; i-- > 0;) {
+        bucket = delta_bucket(self, signatures[i].weak);
+        self->next[i] = self->heads[bucket];
+        self->heads[bucket] = i;
+    }
+    return 0;
+}
+
+void delta_index_free(DeltaIndex *self)
+{
+    free(self->heads);
+    free(self->next);
+    self->heads = NULL;
+    self->next = NULL;
+}
+
+// Returns the block whose signature matches the block_size bytes of data with the weak
+// checksum weak, DELTA_NONE if there is none. The CRC32C is only computed for blocks with
+// the same weak checksum.
+uint32_t delta_find(const DeltaIndex *self, uint32_t weak, const uint8_t *data, uint32_t expected)
+{
+    uint32_t strong = 0;
+    bool have_strong = false;
+
+    if (expected < self->count && self->signatures[expected].weak == weak) {
+        strong = crc32c(0, data, self->block_size);
+        have_strong = true;
+        if (self->signatures[expected].strong == strong) {
+            return expected;
+        }
+    }
+    for (uint32_t i = self->heads[delta_bucket(self, weak)]; i != DELTA_NONE; i = self->next[i]) {
+        if (self->signatures[i].weak != weak) {
+            continue;
+        }
+        if (!have_strong) {
+            strong = crc32c(0, data, self->block_size);
+            have_strong = true;
+        }
+        if (self->signatures[i].strong == strong) {
+            return i;
+        }
+    }
+    return DELTA_NONE;
+}
+
+uint32_t delta_match(const DeltaIndex *self, const uint8_t *data, size_t length, size_t *position,
+                        size_t limit, uint32_t expected)
+{
+    size_t block = self->block_size, at = *position;
+    uint32_t weak, found;
+
+    if (self->count == 0 || at + block > length) {
+        *position = length;
+        return DELTA_NONE;
+    }
+    weak = delta_weak(data + at, block);
+    for (;;) {
+        found = delta_find(self, weak, data + at, expected);
+        if (found != DELTA_NONE) {
+            *position = at;
+            return found;
+        }
+        if (at + block == length) {
+            *position = length;
+            return DELTA_NONE;
+        }
+        weak = delta_roll(weak, data[at], data[at + block], block);
+        if (++at == limit) {
+            *position = at;
+            return DELTA_NONE;
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef RUDP_DELTA_H
+#define RUDP_DELTA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define DELTA_MIN_BLOCK 2048      // Smallest block of a signature.
+#define DELTA_MAX_BLOCK 131072    // Largest block of a signature.
+#define DELTA_MAX_BLOCKS 16777216 // Most blocks of a signature.
+#define DELTA_NONE UINT32_MAX     // No block.
+
+
+// Signature of one block of the copy of the receiver: a weak checksum which can be rolled
+// along the data of the sender byte by byte, and the CRC32C of the block.
+typedef struct DeltaSignature
+{
+    uint32_t weak;
+    uint32_t strong;
+} DeltaSignature;
+
+
+// Signatures of the blocks of a copy, found by their weak checksum.
+typedef struct DeltaIndex
+{
+    const DeltaSignature *signatures;
+    uint32_t count;
+    uint32_t block_size;
+    uint32_t *heads;        // First block of each bucket, DELTA_NONE if it has none.
+    uint32_t *next;         // Next block of the bucket of each block.
+    uint32_t mask;          // Buckets - 1.
+} DeltaIndex;
+
+
+// Returns the block size of the signature of a copy of length bytes, about its square root
+// so that the signature and the data around each change both stay small.
+uint32_t delta_block_size(uint64_t length);
+
+
+// Returns the weak checksum of length bytes of data. The low 16 bits are the sum of the bytes,
+// the high 16 bits the sum of each byte times length minus its position.
+uint32_t delta_weak(const uint8_t *data, size_t length);
+
+
+// Makes the index of count signatures of blocks of block_size bytes.
+// On success 0 is returned. On error -1 is returned.
+int delta_index_init(DeltaIndex *self, const DeltaSignature *signatures, uint32_t count, uint32_t block_size);
+
+
+void delta_index_free(DeltaIndex *self);
+
+
+// Looks for the blocks of the index in data of length bytes from position, one byte at a time,
+// up to limit. Block expected is tried first, so that runs of blocks which follow each other
+// are found as such.
+// Returns the block found at position, which is moved to it. If no block starts before limit
+// DELTA_NONE is returned and position is moved to limit, or to length once no block fits.
+uint32_t delta_match(const DeltaIndex *self, const uint8_t *data, size_t length, size_t *position,
+                        size_t limit, uint32_t expected);
+
+
+
+#endif
@@ -0,0 +1,132 @@
+
+
+
+#include <string.h>
+#include <pthread.h>
+#include "rudp_fec.h"
+
+
+#define GF_POLY 0x11D   // x^8 + x^4 + x^3 + x^2 + 1, 2 generates the field.
+
+
+static uint8_t gf_exp[510];
+static uint8_t gf_log[256];
+// mul[c][b] is c * b, the row of c is 256 bytes so it stays in the cache while a symbol is done.
+static uint8_t mul[256][256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+
+
+// ==================== GF(256) Functions ====================
+
+void gf_init_tables(void)
+{
+    int x = 1;
+
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = gf_exp[i + 255] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= GF_POLY;
+        }
+    }
+    for (int c = 1; c < 256; c++) {
+        for (int b = 1; b < 256; b++) {
+            mul[c][b] = gf_exp[gf_log[c] + gf_log[b]];
+        }
+    }
+}
+
+uint8_t gf_inverse(uint8_t x)
+{
+    pthread_once(&tables_once, gf_init_tables);
+    return gf_exp[255 - gf_log[x]];
+}
+
+
+
+// ==================== FEC Functions ====================
+
+uint8_t fec_coefficient(int parity_count, int row, int column)
+{
+    if (parity_count == 1) {
+        return 1;
+    }
+    // Rows and columns are taken from disjoint sets, so row ^ column is never 0.
+    return gf_inverse(row ^ (FEC_MAX_PARITY + column));
+}
+
+void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t length)
+{
+    const uint8_t *row;
+    uint64_t a, b;
+    size_t i = 0;
+
+    if (c == 0) {
+        return;
+    }
+    // Adding is XOR, which is done 8 bytes at a time.
+    if (c == 1) {
+        for (; i + 8 <= length; i += 8) {
+            memcpy(&a, dst + i, 8);
+            memcpy(&b, src + i, 8);
+            a ^= b;
+            memcpy(dst + i, &a, 8);
+        }
+        for (; i < length; i++) {
+            dst[i] ^= src[i];
+        }
+        return;
+    }
+    pthread_once(&tables_once, gf_init_tables);
+    row = mul[c];
+    for (; i < length; i++) {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+int fec_invert(uint8_t *matrix, uint8_t *inverse, int size)
+{
+    uint8_t factor, swap;
+    int pivot;
+
+    pthread_once(&tables_once, gf_init_tables);
+    memset(inverse, 0, (size_t)size * size);
+    for (int i = 0; i < size; i++) {
+        inverse[i * size + i] = 1;
+    }
+    // Gauss-Jordan elimination, the row operations turn matrix into the identity and inverse
+    // into the inverse of matrix.
+    for (int col = 0; col < size; col++) {
+        for (pivot = col; pivot < size && matrix[pivot * size + col] == 0; pivot++) {
+        }
+        if (pivot == size) {
+            return -1;
+        }
+        if (pivot != col) {
+            for (int j = 0; j < size; j++) {
+                swap = matrix[col * size + j];
+                matrix[col * size + j] = matrix[pivot * size + j];
+                matrix[pivot * size + j] = swap;
+                swap = inverse[col * size + j];
+                inverse[col * size + j] = inverse[pivot * size + j];
+                inverse[pivot * size + j] = swap;
+            }
+        }
+        factor = gf_inverse(matrix[col * size + col]);
+        for (int j = 0; j < size; j++) {
+            matrix[col * size + j] = mul[factor][matrix[col * size + j]];
+            inverse[col * size + j] = mul[factor][inverse[col * size + j]];
+        }
+        for (int row = 0; row < size; row++) {
+            factor = matrix[row * size + col];
+            if (row == col || factor == 0) {
+                continue;
+            }
+            fec_mul_add(matrix + row * size, matrix + col * size, factor, size);
+            fec_mul_add(inverse + row * size, inverse + col * size, factor, size);
+        }
+    }
+    return 0;
+}
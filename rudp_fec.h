@@ -0,0 +1,29 @@
+#ifndef RUDP_FEC_H
+#define RUDP_FEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define FEC_MAX_DATA 64       // Max data symbols in a block.
+#define FEC_MAX_PARITY 16     // Max parity symbols in a block.
+
+
+// Coefficient of data symbol column in parity symbol row of a block with parity_count parity
+// symbols. A single parity symbol is the XOR of the data symbols. More are the rows of a Cauchy
+// matrix over GF(256), whose square submatrices can all be inverted, so any parity_count
+// missing data symbols can be rebuilt from any parity_count parity symbols.
+uint8_t fec_coefficient(int parity_count, int row, int column);
+
+
+// Adds c times src to dst in GF(256), byte by byte.
+void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t length);
+
+
+// Inverts the size x size matrix in GF(256), both stored by rows. matrix is changed.
+// On success 0 is returned. If the matrix cannot be inverted -1 is returned.
+int fec_invert(uint8_t *matrix, uint8_t *inverse, int size);
+
+
+
+#endif
@@ -0,0 +1,157 @@
+
+
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include "rudp_log.h"
+
+
+// Slot of the ring. sequence tells whether the slot holds an event for the reader, or is
+// free for the writer of a lap of the ring, so writers only race for the write position.
+typedef struct LogSlot
+{
+    atomic_size_t sequence;
+    uint32_t value;
+    uint8_t event;
+    bool last;
+} LogSlot;
+
+
+typedef struct LogFormat
+{
+    const char *message;
+    const char *last;       // Added when the event is the last of a message.
+} LogFormat;
+
+
+static const LogFormat formats[LOG_EVENT_COUNT] = {
+    [LOG_SEPARATOR] = { "------------------------------", "" },
+    [LOG_HELLO_SENT] = { "Sent Hello. Window: %u", "" },
+    [LOG_HELLO_RECEIVED] = { "Hello Received. Window: %u", "" },
+    [LOG_HELLO_ACKED] = { "Hello Acked. Window: %u", "" },
+    [LOG_NO_HELLO_REPLY] = { "No reply to hello, using version 1", "" },
+    [LOG_SEGMENT_SIZE] = { "Segment Size: %u", "" },
+    [LOG_SEGMENT_SENT] = { "Sent Segment: %u", " --> Last Segment" },
+    [LOG_SEGMENT_RECEIVED] = { "Segment Received: %u", " --> Last Segment" },
+    [LOG_TIMEOUT] = { "Timeout. Resent Segment: %u", " --> Last Segment" },
+    [LOG_FAST_RETRANSMIT] = { "Fast Retransmit. Resent Segment: %u", "" },
+    [LOG_ACK_RECEIVED] = { "Ack Received: %u", " --> Last Ack" },
+    [LOG_SACK_RECEIVED] = { "Ack Received: below %u", " --> Last Ack" },
+    [LOG_ACK_SENT] = { "Sent ACK: %u", " --> Last ACK" },
+    [LOG_ACK_RESENT] = { "Resent ACK: %u", " --> Last ACK" },
+    [LOG_SACK_SENT] = { "Sent ACK: below %u", " --> Last ACK" },
+    [LOG_PARITY_SENT] = { "Sent Parity: %u", "" },
+    [LOG_PARITY_RECEIVED] = { "Parity Received: %u", "" },
+    [LOG_SEGMENT_REBUILT] = { "Segment Rebuilt: %u", "" },
+    [LOG_CONN_ACCEPTED] = { "Connection %u Accepted", "" },
+    [LOG_CONN_DROPPED] = { "Connection %u Dropped", "" },
+};
+
+static LogSlot ring[LOG_RING_SIZE];
+static atomic_size_t write_position;
+static size_t read_position;            // Only used with drain_lock held.
+static atomic_uint_least64_t dropped;
+static uint64_t dropped_printed;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t logger_once = PTHREAD_ONCE_INIT;
+
+
+
+// ==================== Log Functions ====================
+
+// Prints the events in the ring.
+// Returns the number of events printed.
+size_t drain_log(void)
+{
+    LogSlot *slot;
+    size_t count = 0;
+    uint64_t lost;
+
+    pthread_mutex_lock(&drain_lock);
+    for (;;) {
+        slot = &ring[read_position & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != read_position + 1) {
+            break;
+        }
+        printf(formats[slot->event].message, slot->value);
+        printf("%s\n", slot->last ? formats[slot->event].last : "");
+        // Slot is free for the writer of the next lap.
+        atomic_store_explicit(&slot->sequence, read_position + LOG_RING_SIZE, memory_order_release);
+        read_position++;
+        count++;
+    }
+    lost = atomic_load_explicit(&dropped, memory_order_relaxed);
+    if (lost != dropped_printed) {
+        printf("Log Events Dropped: %lu\n", (unsigned long)(lost - dropped_printed));
+        dropped_printed = lost;
+    }
+    pthread_mutex_unlock(&drain_lock);
+    return count;
+}
+
+void* run_logger(void *arg)
+{
+    struct timespec interval = { 0, LOG_DRAIN_INTERVAL * 1000 };
+
+    (void)arg;
+    for (;;) {
+        if (drain_log() == 0) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    return NULL;
+}
+
+void start_logger(void)
+{
+    pthread_t tid;
+
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&ring[i].sequence, i);
+    }
+    if (pthread_create(&tid, NULL, run_logger, NULL) == 0) {
+        pthread_detach(tid);
+    }
+}
+
+void rudp_log(LogEvent event, uint32_t value, bool last)
+{
+    size_t position, sequence;
+    LogSlot *slot;
+
+    pthread_once(&logger_once, start_logger);
+    position = atomic_load_explicit(&write_position, memory_order_relaxed);
+    for (;;) {
+        slot = &ring[position & (LOG_RING_SIZE - 1)];
+        sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence == position) {
+            if (atomic_compare_exchange_weak_explicit(&write_position, &position, position + 1,
+                                                        memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        // Slot still holds an event of the last lap, the ring is full.
+        else if ((ptrdiff_t)(sequence - position) < 0) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else {
+            position = atomic_load_explicit(&write_position, memory_order_relaxed);
+        }
+    }
+    slot->value = value;
+    slot->event = event;
+    slot->last = last;
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+}
+
+// Before the first event the ring is empty, slot 0 does not have the sequence of an event.
+void rudp_flush_logs(void)
+{
+    drain_log();
+    fflush(stdout);
+}
@@ -0,0 +1,50 @@
+#ifndef RUDP_LOG_H
+#define RUDP_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+#define LOG_RING_SIZE 65536       // Events the ring holds, a power of two.
+#define LOG_DRAIN_INTERVAL 1000   // Microseconds the logger thread sleeps when the ring is empty.
+
+
+// Events which are logged. Each has a fixed message with one number in it.
+typedef enum LogEvent
+{
+    LOG_SEPARATOR,
+    LOG_HELLO_SENT,
+    LOG_HELLO_RECEIVED,
+    LOG_HELLO_ACKED,
+    LOG_NO_HELLO_REPLY,
+    LOG_SEGMENT_SIZE,
+    LOG_SEGMENT_SENT,
+    LOG_SEGMENT_RECEIVED,
+    LOG_TIMEOUT,
+    LOG_FAST_RETRANSMIT,
+    LOG_ACK_RECEIVED,
+    LOG_SACK_RECEIVED,
+    LOG_ACK_SENT,
+    LOG_ACK_RESENT,
+    LOG_SACK_SENT,
+    LOG_PARITY_SENT,
+    LOG_PARITY_RECEIVED,
+    LOG_SEGMENT_REBUILT,
+    LOG_CONN_ACCEPTED,
+    LOG_CONN_DROPPED,
+    LOG_EVENT_COUNT
+} LogEvent;
+
+
+// Adds an event to the log without blocking, last marks the last segment or ack of a message.
+// The events of all threads go to one ring, which a logger thread prints to stdout. An event
+// is dropped if the ring is full, and the number dropped is printed.
+void rudp_log(LogEvent event, uint32_t value, bool last);
+
+
+// Prints the events in the ring, so that output which follows comes after them.
+void rudp_flush_logs(void);
+
+
+
+#endif
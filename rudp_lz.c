@@ -0,0 +1,195 @@
+
+
+
+#include <string.h>
+#include <math.h>
+#include "rudp_lz.h"
+
+
+#define LZ_ENTROPY_SAMPLES 4096   // Bytes looked at to estimate the entropy.
+
+
+
+// ==================== LZ Functions ====================
+
+size_t lz_bound(size_t length)
+{
+    return length + length / 255 + 16;
+}
+
+static uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t value;
+
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t sequence)
+{
+    return sequence * 2654435761u >> (32 - LZ_HASH_BITS);
+}
+
+// Writes length as the rest of a length whose first 15 are in the token.
+static uint8_t *lz_write_length(uint8_t *op, size_t length)
+{
+    for (length -= 15; length >= 255; length -= 255) {
+        *op++ = 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+// Writes a sequence of literal_length bytes of literals and a match of match_length bytes,
+// 0 for the last sequence, which starts offset bytes back.
+// Returns the end of the sequence. If it does not fit before end NULL is returned.
+static uint8_t *lz_write_sequence(uint8_t *op, uint8_t *end, const uint8_t *literals, size_t literal_length,
+                                  size_t offset, size_t match_length)
+{
+    size_t needed = 1 + literal_length + literal_length / 255 + 1 + (match_length ? 2 + match_length / 255 + 1 : 0);
+    uint8_t *token = op;
+
+    if (needed > (size_t)(end - op)) {
+        return NULL;
+    }
+    *op++ = (literal_length < 15 ? literal_length : 15) << 4;
+    if (literal_length >= 15) {
+        op = lz_write_length(op, literal_length);
+    }
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+    if (match_length == 0) {
+        return op;
+    }
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    match_length -= LZ_MIN_MATCH;
+    *token |= match_length < 15 ? match_length : 15;
+    if (match_length >= 15) {
+        op = lz_write_length(op, match_length);
+    }
+    return op;
+}
+
+// Matches are found with a table of the last position of each hash of 4 bytes. The step
+// grows while nothing matches, so data without matches is passed over quickly.
+size_t lz_compress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity)
+{
+    uint16_t table[1 << LZ_HASH_BITS];
+    uint8_t *op = dst, *end = dst + capacity;
+    size_t ip = 0, anchor = 0, candidate, match_length;
+    uint32_t sequence, hash;
+
+    if (length > LZ_MAX_INPUT) {
+        return 0;
+    }
+    memset(table, 0, sizeof(table));
+    while (ip + LZ_MIN_MATCH <= length) {
+        sequence = lz_read32(src + ip);
+        hash = lz_hash(sequence);
+        candidate = table[hash];
+        table[hash] = ip;
+        if (candidate >= ip || ip - candidate > UINT16_MAX || lz_read32(src + candidate) != sequence) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        match_length = LZ_MIN_MATCH;
+        while (ip + match_length < length && src[candidate + match_length] == src[ip + match_length]) {
+            match_length++;
+        }
+        op = lz_write_sequence(op, end, src + anchor, ip - anchor, ip - candidate, match_length);
+        if (op == NULL) {
+            return 0;
+        }
+        ip += match_length;
+        anchor = ip;
+    }
+    op = lz_write_sequence(op, end, src + anchor, length - anchor, 0, 0);
+    return op == NULL ? 0 : (size_t)(op - dst);
+}
+
+// Reads the rest of a length whose first 15 are in the token.
+// On success 0 is returned. If the data ends first -1 is returned.
+static int lz_read_length(const uint8_t **ip, const uint8_t *end, size_t *length)
+{
+    uint8_t byte;
+
+    do {
+        if (*ip == end) {
+            return -1;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+ssize_t lz_decompress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity)
+{
+    const uint8_t *ip = src, *end = src + length;
+    uint8_t *op = dst;
+    size_t literal_length, match_length, offset;
+    uint8_t token;
+
+    while (ip < end) {
+        token = *ip++;
+        literal_length = token >> 4;
+        if (literal_length == 15 && lz_read_length(&ip, end, &literal_length) == -1) {
+            return -1;
+        }
+        if (literal_length > (size_t)(end - ip) || literal_length > capacity - (size_t)(op - dst)) {
+            return -1;
+        }
+        memcpy(op, ip, literal_length);
+        ip += literal_length;
+        op += literal_length;
+        // Last sequence has no match.
+        if (ip == end) {
+            break;
+        }
+        if (end - ip < 2) {
+            return -1;
+        }
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        match_length = token & 15;
+        if (match_length == 15 && lz_read_length(&ip, end, &match_length) == -1) {
+            return -1;
+        }
+        match_length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || match_length > capacity - (size_t)(op - dst)) {
+            return -1;
+        }
+        // A match may overlap the bytes it writes, which repeats them.
+        if (offset >= match_length) {
+            memcpy(op, op - offset, match_length);
+            op += match_length;
+        }
+        else {
+            for (size_t i = 0; i < match_length; i++, op++) {
+                *op = op[-offset];
+            }
+        }
+    }
+    return op - dst;
+}
+
+double lz_entropy(const uint8_t *data, size_t length)
+{
+    uint32_t counts[256] = { 0 };
+    size_t step = length > LZ_ENTROPY_SAMPLES ? length / LZ_ENTROPY_SAMPLES : 1;
+    size_t samples = 0;
+    double entropy = 0, p;
+
+    for (size_t i = 0; i < length; i += step) {
+        counts[data[i]]++;
+        samples++;
+    }
+    for (int b = 0; b < 256; b++) {
+        if (counts[b] > 0) {
+            p = (double)counts[b] / samples;
+            entropy -= p * log2(p);
+        }
+    }
+    return entropy;
+}
@@ -0,0 +1,45 @@
+#ifndef RUDP_LZ_H
+#define RUDP_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+#define LZ_MAX_INPUT 65536    // Largest input compressed at once, matches reach back at most 65535 bytes.
+#define LZ_MIN_MATCH 4        // Shortest match which is encoded.
+#define LZ_HASH_BITS 14       // Positions kept to find matches.
+
+
+/*
+Compressed data is a series of sequences, each literal bytes followed by a match with
+earlier output. The last sequence has only literals, the data ends after them.
++---------------+---------------+-----------------+----------+-----------------+
+| literals (4)  | match - 4 (4) | literal length+ | literals | offset (16, LE) | match length+
++---------------+---------------+-----------------+----------+-----------------+
+A length of 15 in the first byte is followed by bytes which are added to it, up to the
+first byte which is not 255.
+*/
+
+
+// Returns the largest size length bytes can take compressed.
+size_t lz_bound(size_t length);
+
+
+// Compresses length bytes of src, at most LZ_MAX_INPUT, into dst of capacity bytes.
+// Returns the compressed size, 0 if it does not fit in capacity.
+size_t lz_compress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity);
+
+
+// Decompresses length bytes of src into dst of capacity bytes.
+// Returns the decompressed size. If src is not valid or does not fit -1 is returned.
+ssize_t lz_decompress(const uint8_t *src, size_t length, uint8_t *dst, size_t capacity);
+
+
+// Returns the entropy in bits per byte of a sample of the bytes of data, close to 8 for
+// data which is compressed or random already.
+double lz_entropy(const uint8_t *data, size_t length);
+
+
+
+#endif
@@ -0,0 +1,181 @@
+
+
+
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "rudp_manifest.h"
+
+
+static const char manifest_magic[8] = { 'R', 'U', 'D', 'P', 'M', 'A', 'N', '1' };
+
+// Header of a manifest file.
+typedef struct ManifestHeader
+{
+    char magic[8];
+    uint64_t base;
+    uint64_t length;
+    uint32_t block_size;
+    uint32_t count;
+} ManifestHeader;
+
+
+
+// ==================== Manifest Functions ====================
+
+uint32_t manifest_block_size(uint64_t length)
+{
+    uint64_t size = MANIFEST_MIN_BLOCK;
+
+    while (manifest_blocks(length, size) > MANIFEST_MAX_BLOCKS) {
+        size *= 2;
+    }
+    return size;
+}
+
+uint32_t manifest_blocks(uint64_t length, uint32_t block_size)
+{
+    return (length + block_size - 1) / block_size;
+}
+
+// Returns the offset from base one past the end of the block.
+uint64_t block_end(const Manifest *self, uint32_t block)
+{
+    uint64_t end = ((uint64_t)block + 1) * self->block_size;
+
+    return end < self->length ? end : self->length;
+}
+
+int manifest_open(Manifest *self, const char *path, uint64_t base, uint64_t length, uint32_t block_size,
+                    const uint32_t *checksums)
+{
+    ManifestHeader header, found;
+    size_t name_length = strlen(path);
+    uint32_t count = manifest_blocks(length, block_size);
+    struct stat st;
+    void *map;
+    bool same;
+
+    memset(self, 0, sizeof(*self));
+    self->fd = -1;
+    self->path = malloc(name_length + sizeof(MANIFEST_SUFFIX));
+    if (self->path == NULL) {
+        return -1;
+    }
+    memcpy(self->path, path, name_length);
+    memcpy(self->path + name_length, MANIFEST_SUFFIX, sizeof(MANIFEST_SUFFIX));
+    self->fd = open(self->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (self->fd == -1) {
+        free(self->path);
+        self->path = NULL;
+        return -1;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, manifest_magic, sizeof(header.magic));
+    header.base = base;
+    header.length = length;
+    header.block_size = block_size;
+    header.count = count;
+    self->map_length = MANIFEST_HEADER + count * sizeof(uint32_t) + (count + 7) / 8;
+
+    // A manifest of other data is made again from nothing.
+    same = fstat(self->fd, &st) == 0 && (size_t)st.st_size == self->map_length
+            && pread(self->fd, &found, sizeof(found), 0) == sizeof(found) && memcmp(&found, &header, sizeof(found)) == 0;
+    if ((!same && ftruncate(self->fd, 0) == -1) || ftruncate(self->fd, self->map_length) == -1) {
+        manifest_close(self);
+        return -1;
+    }
+    map = mmap(NULL, self->map_length, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+    if (map == MAP_FAILED) {
+        manifest_close(self);
+        return -1;
+    }
+    self->map = map;
+    self->base = base;
+    self->length = length;
+    self->block_size = block_size;
+    self->count = count;
+    self->checksums = (uint32_t*)(self->map + MANIFEST_HEADER);
+    self->blocks = self->map + MANIFEST_HEADER + count * sizeof(uint32_t);
+    memcpy(self->map, &header, sizeof(header));
+
+    // A block whose checksum changed is unmarked before the checksum is, so that a
+    // manifest left by a crash never has it marked with the new checksum.
+    for (uint32_t i = 0; i < count; i++) {
+        if (!manifest_has(self, i)) {
+            continue;
+        }
+        if (self->checksums[i] == checksums[i]) {
+            self->kept += block_end(self, i) - (uint64_t)i * block_size;
+        }
+        else {
+            self->blocks[i / 8] &= ~(1 << (i % 8));
+        }
+    }
+    memcpy(self->checksums, checksums, count * sizeof(uint32_t));
+    return 0;
+}
+
+bool manifest_has(const Manifest *self, uint32_t block)
+{
+    return self->blocks[block / 8] >> (block % 8) & 1;
+}
+
+bool manifest_completes(const Manifest *self, uint64_t start, uint64_t end)
+{
+    if (end <= self->base || start >= self->base + self->length) {
+        return false;
+    }
+    start = start > self->base ? start - self->base : 0;
+    end = end - self->base < self->length ? end - self->base : self->length;
+    return start < end && (end / self->block_size > start / self->block_size || end == self->length);
+}
+
+void manifest_mark(Manifest *self, uint64_t from, uint64_t start, uint64_t end)
+{
+    uint32_t block, first;
+
+    if (end <= self->base || from < self->base) {
+        return;
+    }
+    from -= self->base;
+    start = start > self->base ? start - self->base : 0;
+    end -= self->base;
+    first = (from + self->block_size - 1) / self->block_size;
+    block = start / self->block_size;
+    if (block < first) {
+        block = first;
+    }
+    // Streams of a file mark blocks from their own threads, which may share a byte of the bitmap.
+    for (; block < self->count && block_end(self, block) <= end; block++) {
+        atomic_fetch_or_explicit((atomic_uchar*)&self->blocks[block / 8], 1 << (block % 8),
+                                    memory_order_relaxed);
+    }
+}
+
+void manifest_close(Manifest *self)
+{
+    if (self->map != NULL) {
+        munmap(self->map, self->map_length);
+    }
+    if (self->fd != -1) {
+        close(self->fd);
+    }
+    free(self->path);
+    self->map = NULL;
+    self->fd = -1;
+    self->path = NULL;
+}
+
+void manifest_remove(Manifest *self)
+{
+    if (self->path != NULL) {
+        unlink(self->path);
+    }
+    manifest_close(self);
+}
@@ -0,0 +1,75 @@
+#ifndef RUDP_MANIFEST_H
+#define RUDP_MANIFEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define MANIFEST_MIN_BLOCK 1048576  // Smallest block of a manifest.
+#define MANIFEST_MAX_BLOCKS 8192    // Most blocks of a manifest, so that its bitmap fits in an ack.
+#define MANIFEST_HEADER 32          // Bytes of a manifest file before the checksums of its blocks.
+#define MANIFEST_SUFFIX ".manifest" // Added to the name of a file for the name of its manifest.
+
+
+// Blocks of a file which have been written in full, kept in a manifest file next to it so that
+// a transfer which fails is resumed from them. The manifest file is mapped: a header with the
+// offset of the data in the file, its length and the block size, in the byte order of the host,
+// then the CRC32C the sender gave each block, then a bitmap of the blocks written, bit i % 8 of
+// byte i / 8 for block i. Blocks are marked as the file is written, also by more than one thread.
+typedef struct Manifest
+{
+    int fd;                 // Manifest file, -1 if there is none.
+    uint8_t *map;
+    size_t map_length;
+    char *path;
+    uint64_t base;          // Offset in the file of the first block.
+    uint64_t length;        // Bytes of data from base.
+    uint32_t block_size;
+    uint32_t count;         // Blocks, the last one may be shorter.
+    uint32_t *checksums;    // CRC32C of each block, in the mapping.
+    uint8_t *blocks;        // Bitmap of the blocks written, in the mapping.
+    uint64_t kept;          // Bytes of the blocks which the file had when the manifest was opened.
+} Manifest;
+
+
+// Returns the block size of a manifest of length bytes, a power of two of at least
+// MANIFEST_MIN_BLOCK which makes at most MANIFEST_MAX_BLOCKS blocks.
+uint32_t manifest_block_size(uint64_t length);
+
+
+// Returns the number of blocks of block_size bytes of length bytes.
+uint32_t manifest_blocks(uint64_t length, uint32_t block_size);
+
+
+// Opens the manifest of the file path for length bytes from base, in blocks of block_size bytes
+// with the given checksums, or makes a new one. Blocks of an earlier manifest of the same data
+// stay marked if their checksum has not changed, the others are unmarked.
+// On success 0 is returned. On error -1 is returned.
+int manifest_open(Manifest *self, const char *path, uint64_t base, uint64_t length, uint32_t block_size,
+                    const uint32_t *checksums);
+
+
+// Returns true if the block is marked as written.
+bool manifest_has(const Manifest *self, uint32_t block);
+
+
+// Returns true if data written from start to end, offsets in the file, ends a block.
+bool manifest_completes(const Manifest *self, uint64_t start, uint64_t end);
+
+
+// Marks the blocks which data written from start to end ends, of a range of the file which is
+// written in order from offset from. Blocks which start before from are not known to be whole.
+void manifest_mark(Manifest *self, uint64_t from, uint64_t start, uint64_t end);
+
+
+// Unmaps the manifest and keeps its file for a later transfer.
+void manifest_close(Manifest *self);
+
+
+// Unmaps the manifest and removes its file, once the whole file has been received.
+void manifest_remove(Manifest *self);
+
+
+
+#endif
@@ -0,0 +1,192 @@
+
+
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "rudp_pool.h"
+
+
+// Free blocks are linked through their first bytes.
+typedef struct PoolBlock
+{
+    struct PoolBlock *next;
+} PoolBlock;
+
+
+// Free blocks of one size shared by all threads.
+typedef struct PoolClass
+{
+    pthread_mutex_t lock;
+    PoolBlock *free;
+} PoolClass;
+
+
+// Free blocks of the calling thread, which it takes and gives back without a lock.
+typedef struct PoolCache
+{
+    PoolBlock *free[POOL_CLASSES];
+    uint32_t count[POOL_CLASSES];
+    bool registered;    // Set when the cache is given back to the pool at thread exit.
+} PoolCache;
+
+
+static PoolClass classes[POOL_CLASSES];
+static atomic_uint_least64_t reserved;
+static __thread PoolCache cache;
+static pthread_key_t cache_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+
+
+// ==================== Pool Functions ====================
+
+// Returns the size of the blocks of class c.
+static size_t pool_class_size(int c)
+{
+    return (size_t)(c % 2 ? POOL_MIN_BLOCK * 3 / 2 : POOL_MIN_BLOCK) << c / 2;
+}
+
+// Returns the class of the smallest blocks with size bytes, -1 if size is too large.
+static int pool_size_class(size_t size)
+{
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        if (size <= pool_class_size(c)) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+size_t pool_block_size(size_t size)
+{
+    int c = pool_size_class(size);
+
+    return c == -1 ? 0 : pool_class_size(c);
+}
+
+// Gives count blocks from the list of the cache of class c back to the shared list.
+static void pool_give_back(PoolCache *self, int c, uint32_t count)
+{
+    PoolBlock *first = self->free[c], *last = first;
+
+    if (count == 0) {
+        return;
+    }
+    for (uint32_t i = 1; i < count; i++) {
+        last = last->next;
+    }
+    self->free[c] = last->next;
+    self->count[c] -= count;
+    pthread_mutex_lock(&classes[c].lock);
+    last->next = classes[c].free;
+    classes[c].free = first;
+    pthread_mutex_unlock(&classes[c].lock);
+}
+
+// Called when a thread which used the pool exits.
+static void pool_release_cache(void *arg)
+{
+    PoolCache *self = arg;
+
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        pool_give_back(self, c, self->count[c]);
+    }
+}
+
+static void pool_init(void)
+{
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        pthread_mutex_init(&classes[c].lock, NULL);
+        classes[c].free = NULL;
+    }
+    pthread_key_create(&cache_key, pool_release_cache);
+}
+
+// Registers the cache of the calling thread, so that it is given back when the thread exits.
+static void pool_register_cache(void)
+{
+    pthread_once(&pool_once, pool_init);
+    pthread_setspecific(cache_key, &cache);
+    cache.registered = true;
+}
+
+// Fills the cache of class c with half of POOL_CACHE_BLOCKS from the shared list,
+// which gets a new chunk when it is empty.
+// On success 0 is returned. On error -1 is returned.
+static int pool_refill(PoolCache *self, int c)
+{
+    size_t size = pool_class_size(c);
+    PoolBlock *block;
+    char *chunk;
+
+    pthread_mutex_lock(&classes[c].lock);
+    if (classes[c].free == NULL) {
+        chunk = malloc(POOL_CHUNK_SIZE);
+        if (chunk == NULL) {
+            pthread_mutex_unlock(&classes[c].lock);
+            return -1;
+        }
+        atomic_fetch_add_explicit(&reserved, POOL_CHUNK_SIZE, memory_order_relaxed);
+        for (size_t offset = POOL_CHUNK_SIZE / size * size; offset >= size; offset -= size) {
+            block = (PoolBlock*)(chunk + offset - size);
+            block->next = classes[c].free;
+            classes[c].free = block;
+        }
+    }
+    while (classes[c].free != NULL && self->count[c] < POOL_CACHE_BLOCKS / 2) {
+        block = classes[c].free;
+        classes[c].free = block->next;
+        block->next = self->free[c];
+        self->free[c] = block;
+        self->count[c]++;
+    }
+    pthread_mutex_unlock(&classes[c].lock);
+    return 0;
+}
+
+void *pool_alloc(size_t size)
+{
+    int c = pool_size_class(size);
+    PoolBlock *block;
+
+    if (c == -1) {
+        return NULL;
+    }
+    if (!cache.registered) {
+        pool_register_cache();
+    }
+    if (cache.free[c] == NULL && pool_refill(&cache, c) == -1) {
+        return NULL;
+    }
+    block = cache.free[c];
+    cache.free[c] = block->next;
+    cache.count[c]--;
+    return block;
+}
+
+void pool_free(void *block, size_t size)
+{
+    int c = pool_size_class(size);
+    PoolBlock *free_block = block;
+
+    if (block == NULL) {
+        return;
+    }
+    // A thread may free blocks which another thread took.
+    if (!cache.registered) {
+        pool_register_cache();
+    }
+    free_block->next = cache.free[c];
+    cache.free[c] = free_block;
+    cache.count[c]++;
+    if (cache.count[c] >= POOL_CACHE_BLOCKS) {
+        pool_give_back(&cache, c, POOL_CACHE_BLOCKS / 2);
+    }
+}
+
+uint64_t pool_reserved(void)
+{
+    return atomic_load_explicit(&reserved, memory_order_relaxed);
+}
@@ -0,0 +1,33 @@
+#ifndef RUDP_POOL_H
+#define RUDP_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define POOL_MIN_BLOCK 512        // Smallest block, a power of two.
+#define POOL_CLASSES 15           // Block sizes 512, 768, 1024, 1536, ... 49152, 65536.
+#define POOL_CHUNK_SIZE 1048576   // Bytes taken from malloc at a time and cut into blocks of one size.
+#define POOL_CACHE_BLOCKS 64      // Free blocks of each size a thread keeps before it gives half back.
+
+
+// Returns the size of the block pool_alloc gives for size bytes, 0 if size is too large.
+size_t pool_block_size(size_t size);
+
+
+// Returns a block of at least size bytes, at most 65536. Blocks freed by the thread are
+// used first, so most calls take no lock.
+// On error, or if size is too large, NULL is returned.
+void *pool_alloc(size_t size);
+
+
+// Gives back a block of pool_alloc, size is the size it was asked for. Any thread may free it.
+void pool_free(void *block, size_t size);
+
+
+// Returns the bytes the pool has taken from malloc, they are kept for later blocks.
+uint64_t pool_reserved(void);
+
+
+
+#endif
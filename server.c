@@ -1,77 +1,590 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include "rudp.h"
-
-#define MAX_FILENAME_LEN 100
-
-
-
-int main(int argc, char* argv[])
-{
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        exit(1);
-    }
-    const int port = atoi(argv[1]);
-
-    struct sockaddr_in serv_adr, clnt_adr;
-    socklen_t clnt_adr_sz;
-
-    ssize_t bytes;
-    char filename[MAX_FILENAME_LEN];
-    const char *prefix = "received - ";
-    FILE* fp;
-
-    RUDP rudp;
-
-    if (rudp_socket(&rudp) == -1) {
-        perror("Failed to create socket");
-        exit(1);
-    }
-
-    memset(&serv_adr, 0, sizeof(serv_adr));
-    serv_adr.sin_family = AF_INET;
-    serv_adr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serv_adr.sin_port = htons(port);
-
-    if (rudp_bind(&rudp, (struct sockaddr*)&serv_adr, sizeof(serv_adr)) == -1) {
-        perror("Failed to bind");
-        exit(1);
-    }
-
-    rudp.logs = true;
-
-    strcpy(filename, prefix);
-    bytes = rudp_recvfrom(&rudp, filename + strlen(prefix), MAX_FILENAME_LEN - strlen(prefix), (struct sockaddr*)&clnt_adr, &clnt_adr_sz);
-    if (bytes == -1) {
-        perror("Error in receiving filename");
-        goto END;
-    }
-
-    filename[bytes + strlen(prefix)] = '\0';
-    fp = fopen(filename, "w");
-    if (fp == NULL) {
-        perror("Error in opening file.");
-        goto END;
-    }
-    
-    bytes = ReceiveFileFrom(&rudp, fp, (struct sockaddr*)&clnt_adr, &clnt_adr_sz);
-    if (bytes == -1) {
-        perror("Error in receiving file");
-        goto END;
-    }
-
-    printf("\n\nFile Saved With Name: %s\n", filename);
-    printf("Received File Size: %ld\n", bytes);
-
-
-    END:
-
-    fclose(fp);
-    rudp_close(&rudp);
-
-    return 0;
-}
-
-
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include "rudp.h"
+
+#define MAX_FILENAME_LEN 100
+
+
+// File of a client, received over one or more streams. Each stream is an upload of its own.
+typedef struct Transfer
+{
+    uint32_t id;            // Connection ID of the first stream, 0 for version 1 clients.
+    in_addr_t addr;         // Address of the client.
+    char filename[MAX_FILENAME_LEN];
+    FILE *fp;
+    int streams;
+    int streams_done;
+    int references;         // Uploads which use the transfer.
+    uint64_t bytes;
+    bool failed;
+    bool kept_open;         // Set when the file was opened without being emptied, for a resume request.
+    bool resumed;           // Set when the blocks of an earlier upload are kept, as marked in manifest.
+    Manifest manifest;
+    struct Transfer *next;
+} Transfer;
+
+
+// Upload of one stream. The first message of a client is the filename, the file follows it,
+// after a file header if the client sends them. Other streams start with their file header.
+typedef struct Upload
+{
+    char filename[MAX_FILENAME_LEN];
+    size_t filename_len;
+    Transfer *transfer;
+    RUDP_FileHeader header;
+    bool has_header;
+    bool requested;         // Set once a resume request has come before the file header.
+    bool message_start;     // Set when the next data starts a message.
+    bool wants_trailer;     // Set when the range has been written and its file trailer comes next.
+    uint64_t received;      // Bytes of the range, once it has been written.
+    char *request;          // Resume request as it comes, allocated for clients which may send one.
+    size_t request_length;
+    bool done;
+} Upload;
+
+
+// Worker thread with its own socket on the port. Its connections are only used by its thread.
+typedef struct Worker
+{
+    RUDP_Listener listener;
+    pthread_t tid;
+    int cpu;                // CPU the thread is pinned to, -1 to not pin it.
+} Worker;
+
+
+const char *prefix = "received - ";
+Worker *workers;
+int worker_count = 1;
+int max_files = 0;          // Server stops after this many files, 0 to never stop.
+atomic_int files_received;
+// Streams of a client may be received by different workers.
+Transfer *transfers;
+pthread_mutex_t transfers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-w window] [-v version] [-n files] [-t threads] [-s segment_size] [-g] [-k] <port>\n", name);
+    exit(1);
+}
+
+
+// Called with transfers_lock held when a stream has received its range.
+void finish_stream(Transfer *transfer, uint64_t bytes, bool ok)
+{
+    transfer->bytes += bytes;
+    transfer->failed |= !ok;
+    if (++transfer->streams_done < transfer->streams || transfer->failed) {
+        return;
+    }
+    fflush(transfer->fp);
+    // Data of an older file past the end of a resumed one is gone, with the manifest.
+    if (transfer->resumed) {
+        if (ftruncate(fileno(transfer->fp), transfer->manifest.length) == -1) {
+            perror("Error in truncating file");
+            transfer->failed = true;
+            return;
+        }
+        manifest_remove(&transfer->manifest);
+    }
+    rudp_flush_logs();
+    printf("\n\nFile Saved With Name: %s\n", transfer->filename);
+    printf("Received File Size: %" PRIu64 "\n", transfer->bytes);
+    if (transfer->resumed) {
+        printf("Kept From Earlier Upload: %" PRIu64 " bytes\n", transfer->manifest.kept);
+    }
+    if (transfer->streams > 1) {
+        printf("Streams: %d\n", transfer->streams);
+    }
+    if (atomic_fetch_add(&files_received, 1) + 1 == max_files) {
+        for (int i = 0; i < worker_count; i++) {
+            workers[i].listener.stop = true;
+        }
+    }
+}
+
+
+// Called with transfers_lock held when an upload no longer uses the transfer.
+void release_transfer(Transfer *transfer)
+{
+    Transfer **link = &transfers;
+
+    if (--transfer->references > 0) {
+        return;
+    }
+    if (transfer->failed || transfer->streams_done < transfer->streams) {
+        fprintf(stderr, "Upload of %s was not completed\n", transfer->filename);
+    }
+    while (*link != NULL && *link != transfer) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        *link = transfer->next;
+    }
+    // Manifest of an upload which was not completed is kept for the client to resume it.
+    if (transfer->resumed) {
+        manifest_close(&transfer->manifest);
+    }
+    fclose(transfer->fp);
+    free(transfer);
+}
+
+
+// Starts writing the range of the file header of an upload.
+void start_range(RUDP *conn, Upload *upload)
+{
+    upload->message_start = true;
+    rudp_conn_set_file(conn, fileno(upload->transfer->fp), upload->has_header ? upload->header.offset : 0);
+    if (upload->transfer->resumed) {
+        rudp_conn_set_manifest(conn, &upload->transfer->manifest);
+    }
+    if (upload->has_header && (upload->header.flags & RUDP_FILE_COMPRESSED)) {
+        rudp_conn_set_compressed(conn);
+    }
+}
+
+
+// Opens the file of the first stream of a client. A client which may resume an upload
+// gets the file as it is, which is emptied once the file header comes if it does not.
+// On success 0 is returned. On error -1 is returned.
+int open_transfer(RUDP *conn, Upload *upload)
+{
+    Transfer *transfer = calloc(1, sizeof(Transfer));
+    int fd;
+
+    if (transfer == NULL) {
+        return -1;
+    }
+    memcpy(transfer->filename, upload->filename, sizeof(transfer->filename));
+    transfer->manifest.fd = -1;
+    if (conn->peer_features & RUDP_FEATURE_RESUME) {
+        fd = open(transfer->filename, O_RDWR | O_CREAT, 0644);
+        transfer->fp = fd == -1 ? NULL : fdopen(fd, "r+");
+        if (fd != -1 && transfer->fp == NULL) {
+            close(fd);
+        }
+        transfer->kept_open = true;
+    }
+    else {
+        transfer->fp = fopen(transfer->filename, "w");
+    }
+    if (transfer->fp == NULL) {
+        perror("Error in opening file.");
+        free(transfer);
+        return -1;
+    }
+    transfer->id = conn->conn_id;
+    transfer->addr = conn->peer_addr.sin_addr.s_addr;
+    transfer->streams = 1;
+    transfer->references = 1;
+    upload->transfer = transfer;
+
+    pthread_mutex_lock(&transfers_lock);
+    transfer->next = transfers;
+    transfers = transfer;
+    pthread_mutex_unlock(&transfers_lock);
+    return 0;
+}
+
+
+// Joins another stream of a client to the transfer of its first stream.
+// On success 0 is returned. On error -1 is returned.
+int join_transfer(RUDP *conn, Upload *upload)
+{
+    Transfer *transfer;
+
+    pthread_mutex_lock(&transfers_lock);
+    for (transfer = transfers; transfer != NULL; transfer = transfer->next) {
+        if (transfer->id == upload->header.transfer_id && transfer->addr == conn->peer_addr.sin_addr.s_addr
+            && transfer->streams == upload->header.streams)
+        {
+            break;
+        }
+    }
+    if (transfer != NULL) {
+        transfer->references++;
+        upload->transfer = transfer;
+        memcpy(upload->filename, transfer->filename, sizeof(upload->filename));
+    }
+    pthread_mutex_unlock(&transfers_lock);
+    return transfer == NULL ? -1 : 0;
+}
+
+
+// Answers a resume request of the first stream from the manifest of the file. A client whose
+// request cannot be answered gets no reply and sends the whole file.
+void resume_transfer(RUDP *conn, Upload *upload, const char *data, size_t length)
+{
+    Transfer *transfer = upload->transfer;
+    char reply[RUDP_REPLY_MAX];
+    ssize_t reply_length;
+
+    reply_length = rudp_resume_file(&transfer->manifest, transfer->filename, 0, data, length, reply);
+    if (reply_length == -1) {
+        return;
+    }
+    if (rudp_conn_reply(conn, reply, reply_length) == -1) {
+        manifest_close(&transfer->manifest);
+        return;
+    }
+    transfer->resumed = true;
+}
+
+
+// Checks the range of length bytes an upload has written against the checksum of the client,
+// which ends the upload.
+void finish_range(RUDP *conn, Upload *upload, uint64_t length)
+{
+    bool ok = !upload->has_header || upload->header.length == RUDP_LENGTH_UNKNOWN
+                || (length == upload->header.length
+                    && rudp_check_file_range(fileno(upload->transfer->fp), 0, &upload->header) == 0);
+
+    if (!ok) {
+        fprintf(stderr, "Range at %" PRIu64 " of %s does not match its checksum\n",
+                upload->header.offset, upload->filename);
+    }
+    upload->done = true;
+    pthread_mutex_lock(&transfers_lock);
+    finish_stream(upload->transfer, length, ok);
+    pthread_mutex_unlock(&transfers_lock);
+    rudp_conn_close(conn);
+}
+
+
+void on_data(RUDP *conn, const char *data, size_t length, bool last)
+{
+    Upload *upload = conn->user;
+    Transfer *transfer;
+    size_t n;
+
+    if (upload == NULL) {
+        upload = calloc(1, sizeof(Upload));
+        if (upload == NULL) {
+            rudp_conn_close(conn);
+            return;
+        }
+        strcpy(upload->filename, prefix);
+        upload->filename_len = strlen(prefix);
+        conn->user = upload;
+
+        // Streams other than the first start with their file header.
+        if (last && rudp_unpack_file_header(&upload->header, data, length) == 0) {
+            upload->has_header = true;
+            if (upload->header.stream == 0 || join_transfer(conn, upload) == -1) {
+                rudp_conn_close(conn);
+                return;
+            }
+            start_range(conn, upload);
+            return;
+        }
+    }
+
+    if (upload->transfer == NULL) {
+        n = MAX_FILENAME_LEN - 1 - upload->filename_len;
+        if (length < n) {
+            n = length;
+        }
+        memcpy(upload->filename + upload->filename_len, data, n);
+        upload->filename_len += n;
+        if (last) {
+            upload->filename[upload->filename_len] = '\0';
+            if (open_transfer(conn, upload) == -1) {
+                rudp_conn_close(conn);
+                return;
+            }
+            // Files of version 2 clients are written by the listener as segments arrive,
+            // after the file header if the client sends one.
+            upload->message_start = true;
+            if (!(conn->peer_features & RUDP_FEATURE_FILE_HEADER)) {
+                start_range(conn, upload);
+            }
+        }
+        return;
+    }
+    transfer = upload->transfer;
+
+    // File header of the first stream tells the number of streams.
+    if (conn->peer_version == RUDP_VERSION_2 && (conn->peer_features & RUDP_FEATURE_FILE_HEADER)
+        && !upload->has_header)
+    {
+        // A resume request may come before the file header, in more than one piece.
+        if (conn->peer_features & RUDP_FEATURE_RESUME) {
+            if (upload->request == NULL) {
+                upload->request = malloc(RUDP_RESUME_MAX);
+            }
+            if (upload->request == NULL || upload->request_length + length > RUDP_RESUME_MAX) {
+                rudp_conn_close(conn);
+                return;
+            }
+            memcpy(upload->request + upload->request_length, data, length);
+            upload->request_length += length;
+            if (!last) {
+                return;
+            }
+            data = upload->request;
+            length = upload->request_length;
+            upload->request_length = 0;
+        }
+        if (last && !upload->requested && rudp_unpack_file_header(&upload->header, data, length) == -1
+            && (conn->peer_features & RUDP_FEATURE_RESUME))
+        {
+            upload->requested = true;
+            resume_transfer(conn, upload, data, length);
+            return;
+        }
+        if (!last || rudp_unpack_file_header(&upload->header, data, length) == -1 || upload->header.stream != 0
+            || (transfer->kept_open && !transfer->resumed && ftruncate(fileno(transfer->fp), 0) == -1))
+        {
+            rudp_conn_close(conn);
+            return;
+        }
+        upload->has_header = true;
+        pthread_mutex_lock(&transfers_lock);
+        transfer->streams = upload->header.streams;
+        pthread_mutex_unlock(&transfers_lock);
+        start_range(conn, upload);
+        return;
+    }
+
+    // Range has been written, its checksum comes in the file trailer if it was not in the header.
+    if (data == NULL && upload->has_header && (upload->header.flags & RUDP_FILE_TRAILER)) {
+        upload->received = length;
+        upload->wants_trailer = true;
+        return;
+    }
+    if (upload->wants_trailer) {
+        if (!last || rudp_unpack_file_trailer(&upload->header, data, length) == -1) {
+            rudp_conn_close(conn);
+            return;
+        }
+        if (upload->header.length == RUDP_LENGTH_UNKNOWN) {
+            upload->header.length = upload->received;
+        }
+        finish_range(conn, upload, upload->received);
+        return;
+    }
+
+    // Range has been written, it is checked against the checksum of the client.
+    if (data == NULL) {
+        finish_range(conn, upload, length);
+        return;
+    }
+
+    // Version 1 clients send the file as messages followed by an end-of-file indicator.
+    if (conn->peer_version == RUDP_VERSION_1 && upload->message_start && last
+        && length == 3 && strncmp(data, "EOF", 3) == 0)
+    {
+        upload->done = true;
+        pthread_mutex_lock(&transfers_lock);
+        finish_stream(transfer, 0, true);
+        pthread_mutex_unlock(&transfers_lock);
+        rudp_conn_close(conn);
+        return;
+    }
+    if (fwrite(data, 1, length, transfer->fp) != length) {
+        perror("Error in writing file");
+        rudp_conn_close(conn);
+        return;
+    }
+    transfer->bytes += length;
+    upload->message_start = last;
+}
+
+
+void on_close(RUDP *conn)
+{
+    Upload *upload = conn->user;
+
+    if (upload == NULL) {
+        return;
+    }
+    if (upload->transfer != NULL) {
+        pthread_mutex_lock(&transfers_lock);
+        upload->transfer->failed |= !upload->done;
+        release_transfer(upload->transfer);
+        pthread_mutex_unlock(&transfers_lock);
+    }
+    free(upload->request);
+    free(upload);
+}
+
+
+// Returns the CPU for the worker with index i, the CPUs the server may run on are used in turn.
+int worker_cpu(int i)
+{
+    cpu_set_t cpus;
+    int count = 0;
+
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1 || CPU_COUNT(&cpus) == 0) {
+        return -1;
+    }
+    i %= CPU_COUNT(&cpus);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpus) && count++ == i) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+
+void* run_worker(void *arg)
+{
+    Worker *worker = arg;
+    cpu_set_t cpus;
+
+    if (worker->cpu != -1) {
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+    if (rudp_listener_run(&worker->listener) == -1) {
+        perror("Error in receiving");
+    }
+    return NULL;
+}
+
+
+int main(int argc, char* argv[])
+{
+    int window = DEFAULT_WINDOW_SIZE;
+    int version = RUDP_VERSION_AUTO;
+    int segment_size = DEFAULT_SEGMENT_SIZE;
+    bool offload = false;
+    bool checksums = false;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "w:v:n:t:s:gk")) != -1) {
+        switch (opt) {
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 'v':
+            version = atoi(optarg);
+            break;
+        case 's':
+            segment_size = atoi(optarg);
+            break;
+        case 'g':
+            offload = true;
+            break;
+        case 'k':
+            checksums = true;
+            break;
+        case 'n':
+            max_files = atoi(optarg);
+            break;
+        case 't':
+            worker_count = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
+    }
+    // 0 threads means one per CPU.
+    if (worker_count == 0) {
+        worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (worker_count < 1) {
+        usage(argv[0]);
+    }
+    const int port = atoi(argv[optind]);
+
+    struct sockaddr_in serv_adr;
+
+    memset(&serv_adr, 0, sizeof(serv_adr));
+    serv_adr.sin_family = AF_INET;
+    serv_adr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serv_adr.sin_port = htons(port);
+
+    workers = calloc(worker_count, sizeof(Worker));
+    if (workers == NULL) {
+        perror("Failed to allocate workers");
+        exit(1);
+    }
+
+    // Every worker binds its own socket to the port, the kernel gives each client to one of them.
+    for (i = 0; i < worker_count; i++) {
+        RUDP_Listener *listener = &workers[i].listener;
+
+        if (rudp_listener_socket(listener) == -1) {
+            perror("Failed to create socket");
+            exit(1);
+        }
+        if (rudp_set_window(&listener->rudp, window) == -1) {
+            fprintf(stderr, "Window must be in [1, %d]\n", MAX_WINDOW_SIZE);
+            exit(1);
+        }
+        if (rudp_set_segment_size(&listener->rudp, segment_size) == -1) {
+            fprintf(stderr, "Segment size must be in [%d, %d]\n", MAX_PAYLOAD_SIZE, MAX_SEGMENT_SIZE);
+            exit(1);
+        }
+        if (offload && rudp_set_offload(&listener->rudp, true) == -1) {
+            perror("Failed to turn on segmentation offload");
+            exit(1);
+        }
+        listener->rudp.version = version;
+        rudp_set_checksums(&listener->rudp, checksums);
+
+        if (worker_count > 1 && rudp_set_reuseport(&listener->rudp) == -1) {
+            perror("Failed to share port");
+            exit(1);
+        }
+        if (rudp_bind(&listener->rudp, (struct sockaddr*)&serv_adr, sizeof(serv_adr)) == -1) {
+            perror("Failed to bind");
+            exit(1);
+        }
+
+        // Files may come with a file header and over parallel streams, lost segments are
+        // rebuilt from parity if the client sends it, and corrupted ones are dropped. Uploads
+        // which fail are resumed from the blocks they wrote.
+        listener->rudp.features = RUDP_FEATURE_FILE_HEADER | RUDP_FEATURE_STREAMS | RUDP_FEATURE_FEC
+                                    | RUDP_FEATURE_COMPRESS | RUDP_FEATURE_CHECKSUM | RUDP_FEATURE_RESUME;
+        listener->rudp.logs = true;
+        listener->on_data = on_data;
+        listener->on_close = on_close;
+        workers[i].cpu = worker_count > 1 ? worker_cpu(i) : -1;
+    }
+
+    // Uploads of all clients are received until max_files of them are complete.
+    // A single worker runs in the main thread.
+    if (worker_count == 1) {
+        run_worker(&workers[0]);
+    }
+    else {
+        for (i = 0; i < worker_count; i++) {
+            if (pthread_create(&workers[i].tid, NULL, run_worker, &workers[i]) != 0) {
+                fprintf(stderr, "Failed to start worker %d\n", i);
+                exit(1);
+            }
+        }
+        for (i = 0; i < worker_count; i++) {
+            pthread_join(workers[i].tid, NULL);
+        }
+    }
+
+    for (i = 0; i < worker_count; i++) {
+        if (worker_count > 1) {
+            printf("Worker %d:\n", i);
+        }
+        // Connections add their losses to the listener when they are freed.
+        rudp_listener_close(&workers[i].listener);
+        rudp_print_batch_stats(&workers[i].listener.rudp);
+        rudp_print_loss_stats(&workers[i].listener.rudp);
+        rudp_print_stats(&workers[i].listener.rudp);
+    }
+    free(workers);
+
+    return 0;
+}